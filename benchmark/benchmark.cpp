@@ -0,0 +1,292 @@
+// Headless microbenchmarks of the terrain hot paths. A synthetic world is
+// generated for every tested chunk width, and the results are written to
+// standard output as JSON. Optional first argument is the minimum time in
+// seconds that is spent on each benchmark.
+
+#include "../chunk.hpp"
+#include "../chunkworld.hpp"
+#include "../heightpyramid.hpp"
+#include "../lodbuilder.hpp"
+#include "../types.hpp"
+#include "../undergrowthplacer.hpp"
+#include "syntheticworld.hpp"
+
+#include <Urho3D/Core/Context.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/IO/VectorBuffer.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+using namespace BigWorld;
+
+class Benchmark
+{
+
+public:
+
+	inline Benchmark(float min_seconds) :
+	min_usec(min_seconds * 1000000)
+	{
+	}
+
+	// Calls "setup" without timing it and then "func" with timing, until enough
+	// time is spent. "ops" tells how many operations one call of "func" does.
+	void run(char const* name, unsigned chunk_width, int lod, unsigned ops, std::function<void()> const& setup, std::function<void()> const& func)
+	{
+		unsigned const MIN_ITERATIONS = 5;
+
+		Result result;
+		result.name = name;
+		result.chunk_width = chunk_width;
+		result.lod = lod;
+		result.ops = ops;
+		result.iterations = 0;
+		result.total_usec = 0;
+		result.min_usec = 0;
+
+		Urho3D::HiresTimer timer;
+		while (result.iterations < MIN_ITERATIONS || result.total_usec < min_usec) {
+			setup();
+			timer.Reset();
+			func();
+			long long usec = timer.GetUSec(false);
+			if (result.iterations == 0 || usec < result.min_usec) {
+				result.min_usec = usec;
+			}
+			result.total_usec += usec;
+			++ result.iterations;
+		}
+
+		results.Push(result);
+		fprintf(stderr, "%s (chunk width %u, lod %d): %.2f usec\n", name, chunk_width, lod, double(result.total_usec) / result.iterations);
+	}
+
+	void writeJson(FILE* out) const
+	{
+		fprintf(out, "{\n\t\"benchmarks\": [\n");
+		for (unsigned i = 0; i < results.Size(); ++ i) {
+			Result const& result = results[i];
+			fprintf(out,
+				"\t\t{\"name\": \"%s\", \"chunk_width\": %u, \"lod\": %d, \"ops_per_iteration\": %u, \"iterations\": %u, \"mean_usec\": %.3f, \"min_usec\": %lld}%s\n",
+				result.name.CString(),
+				result.chunk_width,
+				result.lod,
+				result.ops,
+				result.iterations,
+				double(result.total_usec) / result.iterations,
+				result.min_usec,
+				i + 1 < results.Size() ? "," : ""
+			);
+		}
+		fprintf(out, "\t]\n}\n");
+	}
+
+private:
+
+	struct Result
+	{
+		Urho3D::String name;
+		unsigned chunk_width;
+		int lod;
+		unsigned ops;
+		unsigned iterations;
+		long long total_usec;
+		long long min_usec;
+	};
+
+	long long min_usec;
+
+	Urho3D::Vector<Result> results;
+};
+
+// Results are written here, so compiler can not optimize benchmarks away
+volatile float sink;
+
+void runBenchmarks(Benchmark& bm, Urho3D::Context* context, unsigned chunk_width)
+{
+	unsigned const TERRAINTYPES = 6;
+	unsigned const SEED = 1234;
+	float const SQR_WIDTH = 1;
+	float const HEIGHTSTEP = 0.05;
+	unsigned const TERRAIN_TEXTURE_REPEATS = 4;
+
+	srand(SEED);
+
+	// Data only world, with the tested Chunk at the center
+	Urho3D::SharedPtr<ChunkWorld> world(new ChunkWorld(context, chunk_width, SQR_WIDTH, HEIGHTSTEP, TERRAIN_TEXTURE_REPEATS, 0, 0, true, true));
+	for (unsigned ttype = 0; ttype < TERRAINTYPES; ++ ttype) {
+		world->addUndergrowthModel(ttype, "Models/Undergrowth.mdl", "Materials/Undergrowth.xml", ttype % 2 == 0, 0.8, 1.2);
+	}
+	Urho3D::IntVector2 it;
+	for (it.y_ = -1; it.y_ <= 1; ++ it.y_) {
+		for (it.x_ = -1; it.x_ <= 1; ++ it.x_) {
+			Corners corners;
+			generateChunkCorners(corners, it, chunk_width, TERRAINTYPES, SEED);
+			world->addChunk(it, new Chunk(world, it, corners));
+		}
+	}
+	Urho3D::IntVector2 const POS(0, 0);
+	Chunk* chunk = world->getChunk(POS);
+
+	Corners corners;
+	world->extractCornersData(corners, POS);
+
+	// Corners data extraction
+	bm.run("extractCornersData", chunk_width, -1, 1, [&]() {
+		corners.Clear();
+	}, [&]() {
+		world->extractCornersData(corners, POS);
+	});
+
+	// Terraintype image
+	bm.run("calculateTerraintypeImage", chunk_width, -1, 1, []() {}, [&]() {
+		TTypes used_ttypes;
+		Urho3D::SharedPtr<Urho3D::Image> img = calculateTerraintypeImage(used_ttypes, context, corners, chunk_width, false);
+		sink = img->GetWidth();
+	});
+
+	// Every LOD, without terraintype image, as uniform grids and as adaptive meshes
+	float const ADAPTIVE_MAX_ERROR = HEIGHTSTEP * 4;
+	Urho3D::SharedPtr<LodBuildingTaskData> lod_data;
+	Urho3D::WorkItem lod_item;
+	lod_item.workFunction_ = buildLod;
+	for (unsigned adaptive = 0; adaptive < 2; ++ adaptive) {
+		for (unsigned lod = 0; (1u << lod) <= chunk_width; ++ lod) {
+			bm.run(adaptive ? "buildLodAdaptive" : "buildLod", chunk_width, lod, 1, [&]() {
+				lod_data = new LodBuildingTaskData;
+				lod_data->context = context;
+				lod_data->lod = lod;
+				lod_data->corners = corners;
+				lod_data->baseheight = chunk->getBaseHeight();
+				lod_data->calculate_ttype_image = false;
+				lod_data->ttype_image_mode = TTYPE_IMAGE_WEIGHTS;
+				lod_data->data_version = 0;
+				lod_data->chunk_pos = POS;
+				lod_data->chunk_width = chunk_width;
+				lod_data->sqr_width = SQR_WIDTH;
+				lod_data->heightstep = HEIGHTSTEP;
+				lod_data->terrain_texture_repeats = TERRAIN_TEXTURE_REPEATS;
+				lod_data->max_error = adaptive ? ADAPTIVE_MAX_ERROR : 0;
+				lod_item.aux_ = lod_data;
+			}, [&]() {
+				buildLod(&lod_item, 0);
+				sink = lod_data->vrts_data.Size();
+			});
+			fprintf(stderr, "\ttriangles: %u\n", lod_data->idxs_data.Size() / 3);
+		}
+	}
+
+	// Undergrowth placing
+	Urho3D::SharedPtr<UndergrowthPlacingTaskData> ug_data;
+	Urho3D::WorkItem ug_item;
+	ug_item.workFunction_ = placeUndergrowth;
+	bm.run("placeUndergrowth", chunk_width, -1, 1, [&]() {
+		ug_data = new UndergrowthPlacingTaskData;
+		ug_data->world = world;
+		ug_data->chunk_pos = POS;
+		ug_data->corners = corners;
+		ug_data->baseheight = chunk->getBaseHeight();
+		ug_data->ugmodels = world->getUndergrowthModelsByTerraintype();
+		ug_item.aux_ = ug_data;
+	}, [&]() {
+		placeUndergrowth(&ug_item, 0);
+		sink = ug_data->places.Size();
+	});
+
+	// Height queries at random positions of the Chunk
+	unsigned const HEIGHT_QUERIES = 1000;
+	float const CHUNK_WF_HALF = chunk_width * SQR_WIDTH / 2;
+	Urho3D::PODVector<Urho3D::Vector2> query_poss;
+	for (unsigned i = 0; i < HEIGHT_QUERIES; ++ i) {
+		query_poss.Push(Urho3D::Vector2(
+			(rand() % 10000) / 10000.0 * 2 * CHUNK_WF_HALF - CHUNK_WF_HALF,
+			(rand() % 10000) / 10000.0 * 2 * CHUNK_WF_HALF - CHUNK_WF_HALF
+		));
+	}
+	bm.run("getHeightFloat", chunk_width, -1, HEIGHT_QUERIES, []() {}, [&]() {
+		float total = 0;
+		for (unsigned i = 0; i < HEIGHT_QUERIES; ++ i) {
+			total += world->getHeightFloat(POS, query_poss[i], chunk->getBaseHeight());
+		}
+		sink = total;
+	});
+
+	// Serialization round trip
+	Urho3D::VectorBuffer buf;
+	bm.run("writeAndReadCorners", chunk_width, -1, 1, [&]() {
+		buf.Clear();
+	}, [&]() {
+		if (!chunk->write(buf)) {
+			fprintf(stderr, "Writing Chunk failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		buf.Seek(0);
+		Corners read_corners;
+		read_corners.Reserve(chunk_width * chunk_width);
+		for (unsigned i = 0; i < chunk_width * chunk_width; ++ i) {
+			read_corners.Push(Corner(buf));
+		}
+		sink = read_corners.Back().height;
+	});
+
+	// Height pyramid of the whole world, and reading its tiles
+	unsigned const PYRAMID_SAMPLE_SPACING = 8;
+	unsigned const PYRAMID_TILE_WIDTH = 16;
+	Urho3D::HashMap<Urho3D::IntVector2, Corners> world_corners;
+	for (it.y_ = -1; it.y_ <= 1; ++ it.y_) {
+		for (it.x_ = -1; it.x_ <= 1; ++ it.x_) {
+			generateChunkCorners(world_corners[it], it, chunk_width, TERRAINTYPES, SEED);
+		}
+	}
+	HeightPyramid::ChunkLoader loader = [&](Corners& result, Urho3D::IntVector2 const& chunk_pos) {
+		result = world_corners[chunk_pos];
+		return true;
+	};
+	Urho3D::VectorBuffer pyramid_buf;
+	bm.run("buildHeightPyramid", chunk_width, -1, 9, [&]() {
+		pyramid_buf.Clear();
+	}, [&]() {
+		if (!HeightPyramid::build(pyramid_buf, loader, Urho3D::IntRect(-1, -1, 1, 1), chunk_width, PYRAMID_SAMPLE_SPACING, PYRAMID_TILE_WIDTH, 2)) {
+			fprintf(stderr, "Building height pyramid failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	});
+	pyramid_buf.Seek(0);
+	Urho3D::SharedPtr<HeightPyramid> pyramid(new HeightPyramid());
+	if (!pyramid->open(&pyramid_buf)) {
+		fprintf(stderr, "Opening height pyramid failed!\n");
+		exit(EXIT_FAILURE);
+	}
+	HeightPyramid::Tile tile;
+	bm.run("readHeightPyramidTile", chunk_width, -1, 1, []() {}, [&]() {
+		if (!pyramid->readTile(tile, 0, Urho3D::IntVector2(0, 0))) {
+			fprintf(stderr, "Reading tile of height pyramid failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		sink = tile.heights.Back();
+	});
+}
+
+int main(int argc, char** argv)
+{
+	float min_seconds = 0.25;
+	if (argc > 1) {
+		min_seconds = atof(argv[1]);
+	}
+
+	Urho3D::SharedPtr<Urho3D::Context> context(new Urho3D::Context());
+
+	Benchmark bm(min_seconds);
+	unsigned const CHUNK_WIDTHS[] = { 16, 32, 64, 128 };
+	for (unsigned i = 0; i < sizeof(CHUNK_WIDTHS) / sizeof(CHUNK_WIDTHS[0]); ++ i) {
+		runBenchmarks(bm, context, CHUNK_WIDTHS[i]);
+	}
+
+	bm.writeJson(stdout);
+
+	return EXIT_SUCCESS;
+}
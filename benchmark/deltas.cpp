@@ -0,0 +1,200 @@
+// Loopback test of replicating terrain edits. Server and client have the
+// same synthetic world, and random brush edits are made at the server. Edits
+// are recorded and flushed as deltas periodically, like a game server would
+// send them to its clients. Deltas go through a buffer to the client, and at
+// the end the worlds are compared. Results are written to standard output as
+// JSON, together with the bytes that sending whole Chunks would have taken.
+//
+// Optional arguments are the amount of edits and edits per flush.
+
+#include "../chunk.hpp"
+#include "../chunkdelta.hpp"
+#include "../chunkworld.hpp"
+#include "../types.hpp"
+#include "syntheticworld.hpp"
+
+#include <Urho3D/Core/Context.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace BigWorld;
+
+unsigned const TERRAINTYPES = 6;
+unsigned const SEED = 1234;
+unsigned const CHUNK_WIDTH = 32;
+float const SQR_WIDTH = 1;
+float const HEIGHTSTEP = 0.05;
+unsigned const TERRAIN_TEXTURE_REPEATS = 4;
+// Chunks from -WORLD_RADIUS to WORLD_RADIUS in both directions
+int const WORLD_RADIUS = 2;
+
+float randomFloat(float min, float max)
+{
+	return min + (rand() % 10000) / 10000.0 * (max - min);
+}
+
+Urho3D::SharedPtr<ChunkWorld> createWorld(Urho3D::Context* context)
+{
+	Urho3D::SharedPtr<ChunkWorld> world(new ChunkWorld(context, CHUNK_WIDTH, SQR_WIDTH, HEIGHTSTEP, TERRAIN_TEXTURE_REPEATS, 0, 0, true, true));
+	Urho3D::IntVector2 it;
+	for (it.y_ = -WORLD_RADIUS; it.y_ <= WORLD_RADIUS; ++ it.y_) {
+		for (it.x_ = -WORLD_RADIUS; it.x_ <= WORLD_RADIUS; ++ it.x_) {
+			Corners corners;
+			generateChunkCorners(corners, it, CHUNK_WIDTH, TERRAINTYPES, SEED);
+			world->addChunk(it, new Chunk(world, it, corners));
+		}
+	}
+	return world;
+}
+
+// Makes a round raise/lower or paint edit at random position
+void editRandomly(ChunkWorld* world)
+{
+	float const CHUNK_W_F = world->getChunkWidthFloat();
+
+	Urho3D::IntVector2 chunk_pos(rand() % (WORLD_RADIUS * 2 + 1) - WORLD_RADIUS, rand() % (WORLD_RADIUS * 2 + 1) - WORLD_RADIUS);
+	Urho3D::Vector2 center(randomFloat(-CHUNK_W_F / 2, CHUNK_W_F / 2), randomFloat(-CHUNK_W_F / 2, CHUNK_W_F / 2));
+	float radius = randomFloat(1, 6) * SQR_WIDTH;
+	Urho3D::Rect area(center - Urho3D::Vector2::ONE * radius, center + Urho3D::Vector2::ONE * radius);
+
+	if (rand() % 3 > 0) {
+		int amount = (rand() % 2 ? 1 : -1) * int(randomFloat(2, 40));
+		world->editTerrain(chunk_pos, area, [&](Urho3D::Vector2 const& pos, Corner& corner) {
+			float strength = 1 - (pos - center).Length() / radius;
+			if (strength > 0) {
+				corner.height = Urho3D::Clamp<int>(corner.height + amount * strength, 0, 0xffff);
+			}
+		});
+	} else {
+		uint8_t ttype = rand() % TERRAINTYPES;
+		world->editTerrain(chunk_pos, area, [&](Urho3D::Vector2 const& pos, Corner& corner) {
+			float strength = 1 - (pos - center).Length() / radius;
+			if (strength > 0) {
+				corner.ttypes.set(ttype, Urho3D::Min(1.0f, corner.ttypes[ttype] + strength));
+			}
+		});
+	}
+}
+
+bool isSameChunk(Chunk* chunk1, Chunk* chunk2)
+{
+	Urho3D::VectorBuffer buf1;
+	Urho3D::VectorBuffer buf2;
+	if (!chunk1->write(buf1) || !chunk2->write(buf2)) {
+		return false;
+	}
+	return chunk1->getEditVersion() == chunk2->getEditVersion() &&
+	       buf1.GetSize() == buf2.GetSize() &&
+	       memcmp(buf1.GetData(), buf2.GetData(), buf1.GetSize()) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned edits = 2000;
+	unsigned edits_per_flush = 4;
+	if (argc > 1) {
+		edits = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		edits_per_flush = Urho3D::Max(atoi(argv[2]), 1);
+	}
+
+	srand(SEED);
+
+	Urho3D::SharedPtr<Urho3D::Context> context(new Urho3D::Context());
+	Urho3D::SharedPtr<ChunkWorld> server = createWorld(context);
+	Urho3D::SharedPtr<ChunkWorld> client = createWorld(context);
+
+	ChunkDeltaRecorder recorder;
+	unsigned chunk_edits = 0;
+	server->setChunkEditListener([&](Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool heights_changed, bool ttypes_changed, unsigned base_version, unsigned version) {
+		recorder.record(chunk_pos, area, heights_changed, ttypes_changed, base_version, version);
+		++ chunk_edits;
+	});
+
+	unsigned long long delta_bytes = 0;
+	unsigned long long full_chunk_bytes = 0;
+	unsigned deltas_sent = 0;
+	unsigned deltas_failed = 0;
+	long long write_usec = 0;
+	long long apply_usec = 0;
+
+	Urho3D::VectorBuffer packet;
+	Urho3D::VectorBuffer full_chunk;
+	ChunkDeltas deltas;
+	Urho3D::HiresTimer timer;
+	for (unsigned edit = 0; edit < edits; ++ edit) {
+		editRandomly(server);
+		if ((edit + 1) % edits_per_flush != 0 && edit + 1 < edits) {
+			continue;
+		}
+
+		// Server
+		timer.Reset();
+		deltas.Clear();
+		recorder.flush(deltas, server);
+		packet.Clear();
+		for (unsigned i = 0; i < deltas.Size(); ++ i) {
+			if (!deltas[i].write(packet)) {
+				fprintf(stderr, "Writing delta failed!\n");
+				return EXIT_FAILURE;
+			}
+		}
+		write_usec += timer.GetUSec(false);
+		delta_bytes += packet.GetSize();
+		deltas_sent += deltas.Size();
+
+		for (unsigned i = 0; i < deltas.Size(); ++ i) {
+			full_chunk.Clear();
+			server->getChunk(deltas[i].chunk_pos)->write(full_chunk);
+			full_chunk_bytes += full_chunk.GetSize();
+		}
+
+		// Client
+		timer.Reset();
+		packet.Seek(0);
+		while (!packet.IsEof()) {
+			ChunkDelta delta;
+			if (!delta.read(packet)) {
+				fprintf(stderr, "Reading delta failed!\n");
+				return EXIT_FAILURE;
+			}
+			if (!client->applyChunkDelta(delta)) {
+				++ deltas_failed;
+			}
+		}
+		apply_usec += timer.GetUSec(false);
+	}
+
+	unsigned chunks_different = 0;
+	Urho3D::IntVector2 it;
+	for (it.y_ = -WORLD_RADIUS; it.y_ <= WORLD_RADIUS; ++ it.y_) {
+		for (it.x_ = -WORLD_RADIUS; it.x_ <= WORLD_RADIUS; ++ it.x_) {
+			if (!isSameChunk(server->getChunk(it), client->getChunk(it))) {
+				++ chunks_different;
+			}
+		}
+	}
+
+	printf("{\n");
+	printf("\t\"settings\": {\"edits\": %u, \"edits_per_flush\": %u, \"chunk_width\": %u},\n", edits, edits_per_flush, CHUNK_WIDTH);
+	printf("\t\"chunk_edits\": %u,\n", chunk_edits);
+	printf("\t\"deltas_sent\": %u,\n", deltas_sent);
+	printf("\t\"deltas_failed\": %u,\n", deltas_failed);
+	printf("\t\"chunks_different\": %u,\n", chunks_different);
+	printf("\t\"delta_bytes\": %llu,\n", delta_bytes);
+	printf("\t\"delta_bytes_per_edit\": %.1f,\n", edits ? double(delta_bytes) / edits : 0.0);
+	printf("\t\"delta_bytes_per_delta\": %.1f,\n", deltas_sent ? double(delta_bytes) / deltas_sent : 0.0);
+	printf("\t\"full_chunk_bytes\": %llu,\n", full_chunk_bytes);
+	printf("\t\"full_chunk_bytes_per_edit\": %.1f,\n", edits ? double(full_chunk_bytes) / edits : 0.0);
+	printf("\t\"write_usec_per_delta\": %.2f,\n", deltas_sent ? double(write_usec) / deltas_sent : 0.0);
+	printf("\t\"apply_usec_per_delta\": %.2f\n", deltas_sent ? double(apply_usec) / deltas_sent : 0.0);
+	printf("}\n");
+
+	return chunks_different == 0 && deltas_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
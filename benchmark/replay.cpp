@@ -0,0 +1,483 @@
+// Replays a camera path over a synthetic world, with Urho3D Engine running
+// headless. Chunks around the camera are generated every frame, like a game
+// would load them. Pipeline counters of ChunkWorld are sampled every frame
+// and written to standard output as JSON, together with percentiles, so
+// changes can be compared by their worst frames and not just by averages.
+//
+// Options:
+//   --path <file>            Recorded path. Every line is one frame, in form
+//                            "chunk_x chunk_y baseheight x y z yaw pitch".
+//                            Without this, a scripted path is flown.
+//   --frames <n>             Length of scripted path.
+//   --speed <m/s>            Speed of scripted path.
+//   --chunk-width <n>
+//   --viewdistance <chunks>
+//   --loads-per-frame <n>    How many Chunks can be generated per frame.
+//   --max-fps <n>            Zero means unlimited. Note, that "frame_usec"
+//                            includes the time spent waiting for frame limit.
+//   --resource-paths <paths> Needed only if real techniques are wanted.
+
+#include "../camera.hpp"
+#include "../chunk.hpp"
+#include "../chunkworld.hpp"
+#include "../types.hpp"
+#include "syntheticworld.hpp"
+
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Sort.h>
+#include <Urho3D/Core/Context.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Engine/Engine.h>
+#include <Urho3D/Engine/EngineDefs.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/IndexBuffer.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/Resource/ResourceCache.h>
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace BigWorld;
+
+unsigned const TERRAINTYPES = 6;
+unsigned const SEED = 1234;
+float const SQR_WIDTH = 1;
+float const HEIGHTSTEP = 0.05;
+unsigned const TERRAIN_TEXTURE_REPEATS = 4;
+unsigned const UNDERGROWTH_RADIUS_CHUNKS = 2;
+float const UNDERGROWTH_DRAW_DISTANCE = 60;
+float const EYE_HEIGHT = 2;
+// Time of one frame of scripted path, no matter how long frames really take
+float const SCRIPTED_FRAME_SECONDS = 1 / 60.0;
+
+struct PathFrame
+{
+	Urho3D::IntVector2 chunk_pos;
+	unsigned baseheight;
+	Urho3D::Vector3 pos;
+	float yaw;
+	float pitch;
+};
+typedef Urho3D::PODVector<PathFrame> Path;
+
+struct FrameResult
+{
+	long long frame_usec;
+	long long loading_usec;
+	unsigned chunks_missing;
+	PipelineCounters delta;
+};
+typedef Urho3D::PODVector<FrameResult> FrameResults;
+
+struct Options
+{
+	Urho3D::String path_file;
+	unsigned frames;
+	float speed;
+	unsigned chunk_width;
+	unsigned viewdistance;
+	unsigned loads_per_frame;
+	int max_fps;
+	Urho3D::String resource_paths;
+};
+
+bool readPath(Path& result, Urho3D::String const& filename)
+{
+	FILE* file = fopen(filename.CString(), "r");
+	if (!file) {
+		return false;
+	}
+	PathFrame frame;
+	while (fscanf(file, "%d %d %u %f %f %f %f %f", &frame.chunk_pos.x_, &frame.chunk_pos.y_, &frame.baseheight, &frame.pos.x_, &frame.pos.y_, &frame.pos.z_, &frame.yaw, &frame.pitch) == 8) {
+		result.Push(frame);
+	}
+	fclose(file);
+	return !result.Empty();
+}
+
+// Converts global horizontal position in meters to Chunk and position relative to its center
+void globalToChunk(Urho3D::IntVector2& chunk_pos, Urho3D::Vector3& pos, float global_x, float global_z, float chunk_w)
+{
+	chunk_pos.x_ = Urho3D::FloorToInt(global_x / chunk_w + 0.5);
+	chunk_pos.y_ = Urho3D::FloorToInt(global_z / chunk_w + 0.5);
+	pos.x_ = global_x - chunk_pos.x_ * chunk_w;
+	pos.z_ = global_z - chunk_pos.y_ * chunk_w;
+}
+
+// Scripted path is a winding walk near the ground, with
+// the view turning left and right to stress the viewarea.
+void getScriptedFrame(PathFrame& result, ChunkWorld* world, unsigned frame, float speed)
+{
+	float const WAVELENGTH = 400;
+	float const AMPLITUDE = 150;
+
+	float t = frame * SCRIPTED_FRAME_SECONDS;
+	float global_x = speed * t;
+	float global_z = AMPLITUDE * sin(global_x / WAVELENGTH * 360 * Urho3D::M_DEGTORAD);
+	float heading_dz = AMPLITUDE * cos(global_x / WAVELENGTH * 360 * Urho3D::M_DEGTORAD) * 360 * Urho3D::M_DEGTORAD / WAVELENGTH;
+
+	globalToChunk(result.chunk_pos, result.pos, global_x, global_z, world->getChunkWidthFloat());
+	result.yaw = atan2(1.0f, heading_dz) * Urho3D::M_RADTODEG + sin(t * 0.5) * 60;
+	result.pitch = 5;
+
+	// Follow ground, if it is loaded
+	Chunk const* chunk = world->getChunk(result.chunk_pos);
+	if (chunk) {
+		result.baseheight = chunk->getBaseHeight();
+		try {
+			result.pos.y_ = world->getHeightFloat(result.chunk_pos, Urho3D::Vector2(result.pos.x_, result.pos.z_), result.baseheight) + EYE_HEIGHT;
+		}
+		catch (std::runtime_error const&) {
+			result.pos.y_ = EYE_HEIGHT;
+		}
+	} else {
+		result.baseheight = 20000;
+		result.pos.y_ = EYE_HEIGHT;
+	}
+}
+
+// Generates missing Chunks near "center", nearest first, and removes far
+// away ones. Returns how many Chunks are still missing from the radius.
+unsigned streamChunks(ChunkWorld* world, Urho3D::HashSet<Urho3D::IntVector2>& loaded, Urho3D::IntVector2 const& center, int radius, unsigned max_loads)
+{
+	int const UNLOAD_MARGIN = 2;
+
+	// Unload
+	Urho3D::PODVector<Urho3D::IntVector2> unload;
+	for (Urho3D::HashSet<Urho3D::IntVector2>::Iterator i = loaded.Begin(); i != loaded.End(); ++ i) {
+		Urho3D::IntVector2 diff = *i - center;
+		if (Urho3D::Max(Urho3D::Abs(diff.x_), Urho3D::Abs(diff.y_)) > radius + UNLOAD_MARGIN) {
+			unload.Push(*i);
+		}
+	}
+	for (unsigned i = 0; i < unload.Size(); ++ i) {
+		world->removeChunk(unload[i]);
+		loaded.Erase(unload[i]);
+	}
+
+	// Load rings, from inside to outside
+	unsigned missing = 0;
+	for (int ring = 0; ring <= radius; ++ ring) {
+		Urho3D::IntVector2 it;
+		for (it.y_ = center.y_ - ring; it.y_ <= center.y_ + ring; ++ it.y_) {
+			for (it.x_ = center.x_ - ring; it.x_ <= center.x_ + ring; ++ it.x_) {
+				if (Urho3D::Max(Urho3D::Abs(it.x_ - center.x_), Urho3D::Abs(it.y_ - center.y_)) != ring || loaded.Contains(it)) {
+					continue;
+				}
+				if (max_loads == 0) {
+					++ missing;
+					continue;
+				}
+				Corners corners;
+				generateChunkCorners(corners, it, world->getChunkWidth(), TERRAINTYPES, SEED);
+				world->addChunk(it, new Chunk(world, it, corners));
+				loaded.Insert(it);
+				-- max_loads;
+			}
+		}
+	}
+	return missing;
+}
+
+// Terrain textures and undergrowth are manual resources,
+// so the replay does not need any files to run.
+void addManualResources(Urho3D::Context* context, ChunkWorld* world)
+{
+	Urho3D::ResourceCache* resources = context->GetSubsystem<Urho3D::ResourceCache>();
+
+	for (unsigned ttype = 0; ttype < TERRAINTYPES; ++ ttype) {
+		Urho3D::String name = "Textures/ReplayTerrain" + Urho3D::String(ttype) + ".png";
+		Urho3D::SharedPtr<Urho3D::Texture2D> tex(new Urho3D::Texture2D(context));
+		tex->SetName(name);
+		resources->AddManualResource(tex);
+		world->addTerrainTexture(name);
+	}
+
+	// Undergrowth is one vertical quad
+	float const VRTS[] = {
+		-0.5, 0, 0,  0, 0, -1,  0, 1,
+		 0.5, 0, 0,  0, 0, -1,  1, 1,
+		 0.5, 1, 0,  0, 0, -1,  1, 0,
+		-0.5, 1, 0,  0, 0, -1,  0, 0
+	};
+	uint16_t const IDXS[] = { 0, 2, 1, 0, 3, 2 };
+	Urho3D::PODVector<Urho3D::VertexElement> elems;
+	elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
+	elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
+	elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR2, Urho3D::SEM_TEXCOORD));
+	Urho3D::SharedPtr<Urho3D::VertexBuffer> vb(new Urho3D::VertexBuffer(context));
+	vb->SetShadowed(true);
+	if (!vb->SetSize(4, elems) || !vb->SetData((void*)VRTS)) {
+		throw std::runtime_error("Unable to set undergrowth VertexBuffer!");
+	}
+	Urho3D::SharedPtr<Urho3D::IndexBuffer> ib(new Urho3D::IndexBuffer(context));
+	ib->SetShadowed(true);
+	if (!ib->SetSize(6, false) || !ib->SetData((void*)IDXS)) {
+		throw std::runtime_error("Unable to set undergrowth IndexBuffer!");
+	}
+	Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context));
+	if (!geom->SetVertexBuffer(0, vb)) {
+		throw std::runtime_error("Unable to set undergrowth Geometry VertexBuffer!");
+	}
+	geom->SetIndexBuffer(ib);
+	if (!geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, 6, false)) {
+		throw std::runtime_error("Unable to set undergrowth Geometry draw range!");
+	}
+	Urho3D::SharedPtr<Urho3D::Model> model(new Urho3D::Model(context));
+	model->SetNumGeometries(1);
+	if (!model->SetNumGeometryLodLevels(0, 1) || !model->SetGeometry(0, 0, geom)) {
+		throw std::runtime_error("Unable to set undergrowth Model Geometry!");
+	}
+	model->SetBoundingBox(Urho3D::BoundingBox(Urho3D::Vector3(-0.5, 0, 0), Urho3D::Vector3(0.5, 1, 0)));
+	model->SetName("Models/ReplayUndergrowth.mdl");
+	resources->AddManualResource(model);
+
+	Urho3D::SharedPtr<Urho3D::Material> mat(new Urho3D::Material(context));
+	mat->SetName("Materials/ReplayUndergrowth.xml");
+	resources->AddManualResource(mat);
+
+	for (unsigned ttype = 0; ttype < TERRAINTYPES; ttype += 2) {
+		world->addUndergrowthModel(ttype, model->GetName(), mat->GetName(), true, 0.8, 1.2);
+	}
+}
+
+PipelineCounters getDelta(PipelineCounters const& a, PipelineCounters const& b)
+{
+	PipelineCounters result;
+	result.frames = b.frames - a.frames;
+	result.frame_update_usec = b.frame_update_usec - a.frame_update_usec;
+	result.frames_waiting_viewarea = b.frames_waiting_viewarea - a.frames_waiting_viewarea;
+	result.frames_waiting_origin_shift = b.frames_waiting_origin_shift - a.frames_waiting_origin_shift;
+	result.viewareas_applied = b.viewareas_applied - a.viewareas_applied;
+	result.viewarea_recalculations = b.viewarea_recalculations - a.viewarea_recalculations;
+	result.viewarea_reculls = b.viewarea_reculls - a.viewarea_reculls;
+	result.lod_prepare_usec = b.lod_prepare_usec - a.lod_prepare_usec;
+	result.lod_cache_hits = b.lod_cache_hits - a.lod_cache_hits;
+	result.lod_cache_misses = b.lod_cache_misses - a.lod_cache_misses;
+	result.lod_builds_started = b.lod_builds_started - a.lod_builds_started;
+	result.lod_builds_finished = b.lod_builds_finished - a.lod_builds_finished;
+	result.lod_builds_discarded = b.lod_builds_discarded - a.lod_builds_discarded;
+	for (unsigned i = 0; i < PipelineCounters::LOD_BUILD_LATENCY_BUCKETS; ++ i) {
+		result.lod_build_latency_histogram[i] = b.lod_build_latency_histogram[i] - a.lod_build_latency_histogram[i];
+	}
+	result.undergrowths_started = b.undergrowths_started - a.undergrowths_started;
+	result.undergrowths_finished = b.undergrowths_finished - a.undergrowths_finished;
+	result.undergrowth_latency_usec = b.undergrowth_latency_usec - a.undergrowth_latency_usec;
+	result.chunks_render_evicted = b.chunks_render_evicted - a.chunks_render_evicted;
+	result.chunks_data_evicted = b.chunks_data_evicted - a.chunks_data_evicted;
+	result.chunks_hibernated = b.chunks_hibernated - a.chunks_hibernated;
+	result.chunks_woken = b.chunks_woken - a.chunks_woken;
+	result.water_reflections_queued = b.water_reflections_queued - a.water_reflections_queued;
+	result.water_refl_chunks_culled = b.water_refl_chunks_culled - a.water_refl_chunks_culled;
+	result.super_chunks_built = b.super_chunks_built - a.super_chunks_built;
+	result.horizon_tiles_loaded = b.horizon_tiles_loaded - a.horizon_tiles_loaded;
+	return result;
+}
+
+void writePercentiles(FILE* out, char const* name, Urho3D::PODVector<double> values, bool last = false)
+{
+	if (values.Empty()) {
+		values.Push(0);
+	}
+	Urho3D::Sort(values.Begin(), values.End());
+	double const P50 = values[(values.Size() - 1) * 50 / 100];
+	double const P90 = values[(values.Size() - 1) * 90 / 100];
+	double const P99 = values[(values.Size() - 1) * 99 / 100];
+	fprintf(out, "\t\t\"%s\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s\n", name, P50, P90, P99, values.Back(), last ? "" : ",");
+}
+
+void writeJson(FILE* out, Options const& options, FrameResults const& results, PipelineCounters const& total)
+{
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"settings\": {\"path\": \"%s\", \"chunk_width\": %u, \"viewdistance\": %u, \"loads_per_frame\": %u, \"max_fps\": %d},\n",
+		options.path_file.Empty() ? "scripted" : options.path_file.CString(),
+		options.chunk_width,
+		options.viewdistance,
+		options.loads_per_frame,
+		options.max_fps
+	);
+
+	// Every frame
+	fprintf(out, "\t\"frames\": [\n");
+	for (unsigned i = 0; i < results.Size(); ++ i) {
+		FrameResult const& result = results[i];
+		PipelineCounters const& d = result.delta;
+		fprintf(out,
+			"\t\t{\"frame\": %u, \"frame_usec\": %lld, \"loading_usec\": %lld, \"chunks_missing\": %u, \"update_usec\": %llu, \"lod_prepare_usec\": %llu, "
+			"\"waiting_viewarea\": %u, \"waiting_origin_shift\": %u, \"viewareas_applied\": %u, "
+			"\"lod_cache_hits\": %u, \"lod_cache_misses\": %u, "
+			"\"lod_builds_started\": %u, \"lod_builds_finished\": %u, \"lod_builds_discarded\": %u, "
+			"\"undergrowths_started\": %u, \"undergrowths_finished\": %u, \"undergrowth_latency_usec\": %llu}%s\n",
+			i, result.frame_usec, result.loading_usec, result.chunks_missing, d.frame_update_usec, d.lod_prepare_usec,
+			d.frames_waiting_viewarea, d.frames_waiting_origin_shift, d.viewareas_applied,
+			d.lod_cache_hits, d.lod_cache_misses,
+			d.lod_builds_started, d.lod_builds_finished, d.lod_builds_discarded,
+			d.undergrowths_started, d.undergrowths_finished, d.undergrowth_latency_usec,
+			i + 1 < results.Size() ? "," : ""
+		);
+	}
+	fprintf(out, "\t],\n");
+
+	// Summary. Stall is a continuous run of frames that wait for viewarea.
+	Urho3D::PODVector<double> frame_usecs;
+	Urho3D::PODVector<double> update_usecs;
+	Urho3D::PODVector<double> stalls;
+	Urho3D::PODVector<double> undergrowth_latencies;
+	unsigned stall = 0;
+	for (unsigned i = 0; i < results.Size(); ++ i) {
+		FrameResult const& result = results[i];
+		frame_usecs.Push(result.frame_usec);
+		update_usecs.Push(result.delta.frame_update_usec);
+		if (result.delta.frames_waiting_viewarea > 0) {
+			++ stall;
+		} else if (stall > 0) {
+			stalls.Push(stall);
+			stall = 0;
+		}
+		// If multiple undergrowths finish during one frame, then only their mean is known
+		if (result.delta.undergrowths_finished > 0) {
+			undergrowth_latencies.Push(double(result.delta.undergrowth_latency_usec) / result.delta.undergrowths_finished);
+		}
+	}
+	if (stall > 0) {
+		stalls.Push(stall);
+	}
+	unsigned lod_queries = total.lod_cache_hits + total.lod_cache_misses;
+	fprintf(out, "\t\"summary\": {\n");
+	fprintf(out, "\t\t\"frames\": %u,\n", results.Size());
+	fprintf(out, "\t\t\"frames_waiting_viewarea\": %u,\n", total.frames_waiting_viewarea);
+	fprintf(out, "\t\t\"frames_waiting_origin_shift\": %u,\n", total.frames_waiting_origin_shift);
+	fprintf(out, "\t\t\"viewareas_applied\": %u,\n", total.viewareas_applied);
+	fprintf(out, "\t\t\"viewarea_recalculations\": %u,\n", total.viewarea_recalculations);
+	fprintf(out, "\t\t\"viewarea_reculls\": %u,\n", total.viewarea_reculls);
+	fprintf(out, "\t\t\"lod_cache_hit_ratio\": %.3f,\n", lod_queries ? double(total.lod_cache_hits) / lod_queries : 1.0);
+	fprintf(out, "\t\t\"lod_builds_started\": %u,\n", total.lod_builds_started);
+	fprintf(out, "\t\t\"lod_builds_finished\": %u,\n", total.lod_builds_finished);
+	fprintf(out, "\t\t\"lod_builds_discarded\": %u,\n", total.lod_builds_discarded);
+	fprintf(out, "\t\t\"lod_build_latency_histogram_ms\": [");
+	for (unsigned i = 0; i < PipelineCounters::LOD_BUILD_LATENCY_BUCKETS; ++ i) {
+		fprintf(out, "%s%u", i > 0 ? ", " : "", total.lod_build_latency_histogram[i]);
+	}
+	fprintf(out, "],\n");
+	fprintf(out, "\t\t\"undergrowths_finished\": %u,\n", total.undergrowths_finished);
+	fprintf(out, "\t\t\"chunks_render_evicted\": %u,\n", total.chunks_render_evicted);
+	fprintf(out, "\t\t\"chunks_data_evicted\": %u,\n", total.chunks_data_evicted);
+	fprintf(out, "\t\t\"chunks_hibernated\": %u,\n", total.chunks_hibernated);
+	fprintf(out, "\t\t\"chunks_woken\": %u,\n", total.chunks_woken);
+	fprintf(out, "\t\t\"water_reflections_queued\": %u,\n", total.water_reflections_queued);
+	fprintf(out, "\t\t\"water_refl_chunks_culled\": %u,\n", total.water_refl_chunks_culled);
+	fprintf(out, "\t\t\"super_chunks_built\": %u,\n", total.super_chunks_built);
+	fprintf(out, "\t\t\"horizon_tiles_loaded\": %u,\n", total.horizon_tiles_loaded);
+	writePercentiles(out, "frame_usec", frame_usecs);
+	writePercentiles(out, "update_usec", update_usecs);
+	writePercentiles(out, "stall_frames", stalls);
+	writePercentiles(out, "undergrowth_latency_usec", undergrowth_latencies, true);
+	fprintf(out, "\t}\n}\n");
+}
+
+bool parseOptions(Options& result, int argc, char** argv)
+{
+	result.frames = 3000;
+	result.speed = 20;
+	result.chunk_width = 32;
+	result.viewdistance = 8;
+	result.loads_per_frame = 4;
+	result.max_fps = 60;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		char const* key = argv[i];
+		char const* value = argv[i + 1];
+		if (strcmp(key, "--path") == 0) result.path_file = value;
+		else if (strcmp(key, "--frames") == 0) result.frames = atoi(value);
+		else if (strcmp(key, "--speed") == 0) result.speed = atof(value);
+		else if (strcmp(key, "--chunk-width") == 0) result.chunk_width = atoi(value);
+		else if (strcmp(key, "--viewdistance") == 0) result.viewdistance = atoi(value);
+		else if (strcmp(key, "--loads-per-frame") == 0) result.loads_per_frame = atoi(value);
+		else if (strcmp(key, "--max-fps") == 0) result.max_fps = atoi(value);
+		else if (strcmp(key, "--resource-paths") == 0) result.resource_paths = value;
+		else return false;
+	}
+	return argc % 2 == 1 && result.chunk_width > 0;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(options, argc, argv)) {
+		fprintf(stderr, "Invalid options! See the beginning of replay.cpp.\n");
+		return EXIT_FAILURE;
+	}
+
+	Urho3D::SharedPtr<Urho3D::Context> context(new Urho3D::Context());
+	Urho3D::SharedPtr<Urho3D::Engine> engine(new Urho3D::Engine(context));
+	Urho3D::VariantMap engine_params;
+	engine_params[Urho3D::EP_HEADLESS] = true;
+	engine_params[Urho3D::EP_LOG_QUIET] = true;
+	engine_params[Urho3D::EP_LOG_NAME] = "";
+	engine_params[Urho3D::EP_RESOURCE_PATHS] = options.resource_paths;
+	if (!engine->Initialize(engine_params)) {
+		fprintf(stderr, "Unable to initialize Engine!\n");
+		return EXIT_FAILURE;
+	}
+	engine->SetMaxFps(options.max_fps);
+
+	// World is not headless, so it updates itself at the beginning of every frame
+	Urho3D::SharedPtr<ChunkWorld> world(new ChunkWorld(context, options.chunk_width, SQR_WIDTH, HEIGHTSTEP, TERRAIN_TEXTURE_REPEATS, UNDERGROWTH_RADIUS_CHUNKS, UNDERGROWTH_DRAW_DISTANCE, false));
+	addManualResources(context, world);
+
+	Path path;
+	if (!options.path_file.Empty() && !readPath(path, options.path_file)) {
+		fprintf(stderr, "Unable to read path from \"%s\"!\n", options.path_file.CString());
+		return EXIT_FAILURE;
+	}
+	unsigned frames = path.Empty() ? options.frames : path.Size();
+
+	// Load the start area fully before the first frame
+	int const LOAD_RADIUS = options.viewdistance + 1;
+	Urho3D::HashSet<Urho3D::IntVector2> loaded;
+	PathFrame frame;
+	if (path.Empty()) {
+		getScriptedFrame(frame, world, 0, options.speed);
+		streamChunks(world, loaded, frame.chunk_pos, LOAD_RADIUS, UINT_MAX);
+		getScriptedFrame(frame, world, 0, options.speed);
+	} else {
+		frame = path[0];
+		streamChunks(world, loaded, frame.chunk_pos, LOAD_RADIUS, UINT_MAX);
+	}
+	Camera* camera = world->setUpCamera(frame.chunk_pos, frame.baseheight, frame.pos, frame.yaw, frame.pitch, 0, options.viewdistance);
+
+	FrameResults results;
+	results.Reserve(frames);
+	Urho3D::HiresTimer timer;
+	for (unsigned frame_i = 0; frame_i < frames; ++ frame_i) {
+		timer.Reset();
+
+		// Move camera and load Chunks around it
+		if (path.Empty()) {
+			getScriptedFrame(frame, world, frame_i, options.speed);
+		} else {
+			frame = path[frame_i];
+		}
+		camera->setTransform(frame.chunk_pos, frame.baseheight, frame.pos, frame.yaw, frame.pitch, 0);
+		FrameResult result;
+		result.chunks_missing = streamChunks(world, loaded, camera->getChunkPosition(), LOAD_RADIUS, options.loads_per_frame);
+		result.loading_usec = timer.GetUSec(false);
+
+		PipelineCounters before = world->getPipelineCounters();
+		engine->RunFrame();
+		result.delta = getDelta(before, world->getPipelineCounters());
+		result.frame_usec = timer.GetUSec(false);
+		results.Push(result);
+	}
+
+	writeJson(stdout, options, results, world->getPipelineCounters());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include "syntheticworld.hpp"
+
+#include <cmath>
+#include <cstdlib>
+
+namespace BigWorld
+{
+
+float latticeValue(int x, int y, unsigned seed)
+{
+	unsigned h = unsigned(x) * 374761393u + unsigned(y) * 668265263u + seed * 2246822519u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	h ^= h >> 16;
+	return (h & 0xffffff) / float(0xffffff);
+}
+
+float valueNoise(float x, float y, unsigned seed)
+{
+	int ix = int(floor(x));
+	int iy = int(floor(y));
+	float fx = x - ix;
+	float fy = y - iy;
+	fx = fx * fx * (3 - 2 * fx);
+	fy = fy * fy * (3 - 2 * fy);
+	float v_sw = latticeValue(ix, iy, seed);
+	float v_se = latticeValue(ix + 1, iy, seed);
+	float v_nw = latticeValue(ix, iy + 1, seed);
+	float v_ne = latticeValue(ix + 1, iy + 1, seed);
+	return Urho3D::Lerp(Urho3D::Lerp(v_sw, v_se, fx), Urho3D::Lerp(v_nw, v_ne, fx), fy);
+}
+
+float fractalNoise(float x, float y, unsigned seed)
+{
+	float result = 0;
+	float amplitude = 0.5;
+	for (unsigned octave = 0; octave < 5; ++ octave) {
+		result += valueNoise(x, y, seed + octave) * amplitude;
+		x *= 2;
+		y *= 2;
+		amplitude /= 2;
+	}
+	return result;
+}
+
+void generateChunkCorners(Corners& result, Urho3D::IntVector2 const& chunk_pos, unsigned chunk_width, unsigned terraintypes, unsigned seed)
+{
+	result.Reserve(chunk_width * chunk_width);
+	for (unsigned y = 0; y < chunk_width; ++ y) {
+		for (unsigned x = 0; x < chunk_width; ++ x) {
+			int global_x = chunk_pos.x_ * int(chunk_width) + int(x);
+			int global_y = chunk_pos.y_ * int(chunk_width) + int(y);
+
+			Corner corner;
+			corner.height = 20000 + fractalNoise(global_x / 96.0, global_y / 96.0, seed) * 8000;
+			for (unsigned ttype = 0; ttype < terraintypes; ++ ttype) {
+				float weight = valueNoise(global_x / 24.0, global_y / 24.0, seed + 100 + ttype);
+				weight += (rand() % 100) / 1000.0;
+				if (weight > 0.45) {
+					corner.ttypes.set(ttype, weight);
+				}
+			}
+			if (corner.ttypes.empty()) {
+				corner.ttypes.set(rand() % terraintypes, 1);
+			}
+			result.Push(corner);
+		}
+	}
+}
+
+}
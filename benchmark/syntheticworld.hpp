@@ -0,0 +1,20 @@
+#ifndef BIGWORLD_BENCHMARK_SYNTHETICWORLD_HPP
+#define BIGWORLD_BENCHMARK_SYNTHETICWORLD_HPP
+
+#include "../types.hpp"
+
+namespace BigWorld
+{
+
+// Hash based value noise, so the world is same on every run
+float latticeValue(int x, int y, unsigned seed);
+float valueNoise(float x, float y, unsigned seed);
+float fractalNoise(float x, float y, unsigned seed);
+
+// Generates corners of one Chunk. Heights are fractal noise, and every
+// corner gets a random mix of the terraintypes that are strong there.
+void generateChunkCorners(Corners& result, Urho3D::IntVector2 const& chunk_pos, unsigned chunk_width, unsigned terraintypes, unsigned seed);
+
+}
+
+#endif
@@ -2,8 +2,8 @@
 
 #include "chunkworld.hpp"
 #include "lodbuilder.hpp"
-#include "../urhoextras/random.hpp"
-#include "../urhoextras/utils.hpp"
+#include "tracer.hpp"
+#include "undergrowthplacer.hpp"
 
 #include <Urho3D/Core/Profiler.h>
 #include <Urho3D/Graphics/Geometry.h>
@@ -15,65 +15,96 @@
 #include <Urho3D/Resource/ResourceCache.h>
 #include <Urho3D/Scene/Scene.h>
 
+#include <cstring>
 #include <stdexcept>
 
 namespace BigWorld
 {
 
+namespace
+{
+
+unsigned long long getModelMemoryUse(Urho3D::Model const* model)
+{
+	unsigned long long result = 0;
+	for (unsigned geom_i = 0; geom_i < model->GetNumGeometries(); ++ geom_i) {
+		for (unsigned lod_i = 0; lod_i < model->GetNumGeometryLodLevels(geom_i); ++ lod_i) {
+			Urho3D::Geometry const* geom = model->GetGeometry(geom_i, lod_i);
+			Urho3D::VertexBuffer const* vb = geom->GetVertexBuffer(0);
+			Urho3D::IndexBuffer const* ib = geom->GetIndexBuffer();
+			if (vb) {
+				result += vb->GetVertexCount() * vb->GetVertexSize();
+			}
+			if (ib) {
+				result += ib->GetIndexCount() * ib->GetIndexSize();
+			}
+		}
+	}
+	return result;
+}
+
+}
+
 Chunk::Chunk(ChunkWorld* world, Urho3D::IntVector2 const& pos, Corners& corners) :
 Urho3D::Object(world->GetContext()),
 world(world),
 pos(pos),
-undergrowth_state(UGSTATE_NOT_INITIALIZED),
-undergrowth_node(NULL)
+data_version(0),
+edit_version(0),
+rendering(NULL)
 {
 	if (corners.Size() != world->getChunkWidth() * world->getChunkWidth()) {
 		throw std::runtime_error("Array of corners has invalid size!");
 	}
 
-	// Fast way to "copy" corners
-	this->corners.Swap(corners);
-
 	// Use average height as baseheight. Also check validity of corners
 	unsigned long average_height = 0;
-	for (Corners::ConstIterator it = this->corners.Begin(); it != this->corners.End(); ++ it) {
+	for (Corners::ConstIterator it = corners.Begin(); it != corners.End(); ++ it) {
 		average_height += it->height;
 		if (it->ttypes.empty()) {
 			throw std::runtime_error("Every corner of Chunk must have at least one terraintype!");
 		}
 	}
-	average_height /= this->corners.Size();
+	average_height /= corners.Size();
 	baseheight = average_height;
 
-	node = world->getScene()->CreateChild();
-	node->SetDeepEnabled(false);
+	// Fast way to "copy" corners
+	snapshot = new CornersSnapshot(corners, world->getChunkWidth(), 0);
+
+	// Data only Chunks do not need anything else
+	if (!world->isDataOnly()) {
+		rendering = new RenderingState;
+		rendering->node = world->getScene()->CreateChild();
+		rendering->node->SetDeepEnabled(false);
+	}
 
-	updateLowestHeight();
+	updateHeightRange();
+	updateDataMemoryUse();
 }
 
 Chunk::~Chunk()
 {
+	if (!rendering) {
+		return;
+	}
+
 	destroyUndergrowth();
 
-	// If there is a preparation task, make sure it is completed.
-	if (task_workitem.NotNull()) {
-		// Action is required only if task is not yet ready
-		if (!task_workitem->completed_) {
-			// First try to simply remove task
-			Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
-			if (!workqueue->RemoveWorkItem(task_workitem)) {
-				// Removing did not work. Let's just wait until workitem is ready
-				while (!task_workitem->completed_) {
-					// Wait, wait...
-				}
-			}
-		}
-	}
+	rendering->splat_slot.release();
+
+	stopTask();
+
+	delete rendering;
 }
 
 bool Chunk::write(Urho3D::Serializer& dest) const
 {
-	return writeWithoutObject(dest, corners);
+	if (snapshot->isCompressed()) {
+		Corners decoded;
+		snapshot->copyCorners(decoded);
+		return writeWithoutObject(dest, decoded);
+	}
+	return writeWithoutObject(dest, snapshot->getCorners());
 }
 
 bool Chunk::writeWithoutObject(Urho3D::Serializer& dest, Corners const& corners)
@@ -85,49 +116,69 @@ bool Chunk::writeWithoutObject(Urho3D::Serializer& dest, Corners const& corners)
 	return true;
 }
 
-bool Chunk::prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos)
+bool Chunk::prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos, bool background)
 {
+	TraceScope trace("PrepareForLod", pos, lod);
+
+	if (!rendering) {
+		throw std::runtime_error("Data only Chunks can not be rendered!");
+	}
+
 	// Preparation is ready when LOD can be found from loadcache
-	if (lodcache.Contains(lod)) {
+	if (hasLod(lod) && !isWaterPatchOutdated()) {
 		return true;
 	}
 
 	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
 
 	// If there is an existing task
-	if (task_workitem.NotNull()) {
+	if (rendering->task_workitem.NotNull()) {
 		// If the task is building this LOD, then check if it's ready
-		if (task_lod == lod) {
+		if (rendering->task_lod == lod) {
 			// If not ready, then keep waiting
-			if (!task_workitem->completed_) {
+			if (!rendering->task_workitem->completed_) {
 				return false;
 			}
 
+			// If data or water levels have changed after the task was
+			// started, then the results are useless. Start a new task instead.
+			if (rendering->task_data->data_version != data_version || rendering->task_data->water_version != world->getWaterVersion(pos)) {
+				++ world->getPipelineCounters().lod_builds_discarded;
+				rendering->task_workitem = NULL;
+				rendering->task_data = NULL;
+				rendering->task_mat = NULL;
+			}
 			// Try to use task results. Sometimes this needs to be called
 			// multiple times because of texture and other resource loading.
-			if (!storeTaskResultsToLodCache()) {
+			else if (!storeTaskResultsToLodCache()) {
 				return false;
 			}
-
-			task_workitem = NULL;
-			task_data = NULL;
-			task_mat = NULL;
-
-			return true;
+			else {
+				PipelineCounters& counters = world->getPipelineCounters();
+				++ counters.lod_builds_finished;
+				counters.addLodBuildLatency(rendering->task_timer.GetUSec(false));
+				rendering->task_workitem = NULL;
+				rendering->task_data = NULL;
+				rendering->task_mat = NULL;
+
+				return true;
+			}
 		}
 		// If the task is building different LOD, then try remove it.
 		else {
 			// If already complete, then removing is easy
-			if (task_workitem->completed_) {
-				task_workitem = NULL;
-				task_data = NULL;
-				task_mat = NULL;
+			if (rendering->task_workitem->completed_) {
+				++ world->getPipelineCounters().lod_builds_discarded;
+				rendering->task_workitem = NULL;
+				rendering->task_data = NULL;
+				rendering->task_mat = NULL;
 			}
 			// Try to stop task
-			else if (workqueue->RemoveWorkItem(task_workitem)) {
-				task_workitem = NULL;
-				task_data = NULL;
-				task_mat = NULL;
+			else if (workqueue->RemoveWorkItem(rendering->task_workitem)) {
+				++ world->getPipelineCounters().lod_builds_discarded;
+				rendering->task_workitem = NULL;
+				rendering->task_data = NULL;
+				rendering->task_mat = NULL;
 			}
 			// Removing old task was not possible, so try again later
 			else {
@@ -137,107 +188,518 @@ bool Chunk::prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos)
 	}
 
 	// There is no task running at background, so start one.
-	task_lod = lod;
+	// Corners are extracted from snapshots at worker thread.
+	CornersSnapshots snapshots;
+	if (!world->getCornersSnapshots(snapshots, pos)) {
+		return false;
+	}
+	rendering->task_lod = lod;
 	// Get and set data
-	task_data = new LodBuildingTaskData;
-	task_data->context = context_;
-	task_data->lod = lod;
-	task_data->chunk_width = world->getChunkWidth();
-	task_data->sqr_width = world->getSquareWidth();
-	task_data->heightstep = world->getHeightstep();
-	task_data->terrain_texture_repeats = world->getTerrainTextureRepeats();
-	task_data->baseheight = baseheight;
-	task_data->calculate_ttype_image = matcache.Null();
-	world->extractCornersData(task_data->corners, pos);
+	rendering->task_data = new LodBuildingTaskData;
+	rendering->task_data->context = context_;
+	rendering->task_data->lod = lod;
+	rendering->task_data->chunk_width = world->getChunkWidth();
+	rendering->task_data->sqr_width = world->getSquareWidth();
+	rendering->task_data->heightstep = world->getHeightstep();
+	rendering->task_data->terrain_texture_repeats = world->getTerrainTextureRepeats();
+	rendering->task_data->max_error = world->getLodMaxError();
+	rendering->task_data->baseheight = baseheight;
+	rendering->task_data->build_water_patch = world->hasWaterPatches();
+	rendering->task_data->water_y = world->hasWaterPatches() ? world->getWaterHeight(pos, baseheight) : 0;
+	rendering->task_data->water_version = world->getWaterVersion(pos);
+	rendering->task_data->calculate_ttype_image = rendering->matcache.Null() || rendering->matcache_outdated;
+	rendering->task_data->ttype_image_mode = world->getTerraintypeImageMode();
+	rendering->task_data->data_version = data_version;
+	rendering->task_data->chunk_pos = pos;
+	rendering->task_data->snapshots.Swap(snapshots);
 	// Set up workitem
-	task_workitem = new Urho3D::WorkItem();
-	task_workitem->workFunction_ = buildLod;
-	task_workitem->aux_ = task_data;
+	rendering->task_workitem = new Urho3D::WorkItem();
+	rendering->task_workitem->workFunction_ = buildLod;
+	rendering->task_workitem->aux_ = rendering->task_data;
+	// Background tasks are done when there is nothing else to do
+	rendering->task_workitem->priority_ = background ? 0 : 1;
 	// Store possible existing material, so setting
 	// matcache to NULL does not cause problems.
-	task_mat = matcache;
+	rendering->task_mat = rendering->matcache;
 
 	// Start task
-	workqueue->AddWorkItem(task_workitem);
+	workqueue->AddWorkItem(rendering->task_workitem);
+	rendering->task_timer.Reset();
+	++ world->getPipelineCounters().lod_builds_started;
 
 	return false;
 }
 
-void Chunk::show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint8_t lod)
+int Chunk::getClosestLod(uint8_t lod) const
+{
+	int closest = -1;
+	if (!rendering) {
+		return closest;
+	}
+	for (LodCache::ConstIterator it = rendering->lodcache.Begin(); it != rendering->lodcache.End(); ++ it) {
+		if (closest < 0 || abs(int(it->first_) - int(lod)) < abs(closest - int(lod))) {
+			closest = it->first_;
+		}
+	}
+	return closest;
+}
+
+void Chunk::show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint8_t lod, unsigned viewmask)
 {
-	assert(lodcache.Contains(lod));
-	assert(!matcache.Null());
+	TraceScope trace("ShowChunk", pos, lod);
+
+	assert(rendering);
+	assert(rendering->lodcache.Contains(lod));
+	assert(!rendering->matcache.Null());
 
-	node->SetPosition(Urho3D::Vector3(
+	rendering->node->SetPosition(Urho3D::Vector3(
 		rel_pos.x_ * world->getChunkWidthFloat(),
 		(int(baseheight) - int(origin_height)) * world->getHeightstep(),
 		rel_pos.y_ * world->getChunkWidthFloat()
 	));
 
+	Urho3D::SharedPtr<Urho3D::StaticModel>& active_model = rendering->active_models[viewmask];
+
 	// If there is no active static model, then one needs to be created
 	if (!active_model) {
-		active_model = node->CreateComponent<Urho3D::StaticModel>();
-		active_model->SetModel(lodcache[lod]);
-		active_model->SetMaterial(matcache);
-		active_model->SetOcclusionLodLevel(lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
+		active_model = rendering->node->CreateComponent<Urho3D::StaticModel>();
+		active_model->SetViewMask(viewmask);
+		active_model->SetModel(rendering->lodcache[lod]);
+		active_model->SetMaterial(rendering->matcache);
+		active_model->SetOcclusionLodLevel(rendering->lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
 		active_model->SetOccludee(true);
 		active_model->SetOccluder(true);
 	}
 	// If there is active static model, but it has different properties
-	else if (active_model->GetModel() != lodcache[lod] || active_model->GetMaterial() != matcache) {
-		active_model->SetModel(lodcache[lod]);
-		active_model->SetMaterial(matcache);
-		active_model->SetOcclusionLodLevel(lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
+	else if (active_model->GetModel() != rendering->lodcache[lod] || active_model->GetMaterial() != rendering->matcache) {
+		active_model->SetModel(rendering->lodcache[lod]);
+		active_model->SetMaterial(rendering->matcache);
+		active_model->SetOcclusionLodLevel(rendering->lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
 		active_model->SetOccludee(true);
 		active_model->SetOccluder(true);
 	}
 
-	node->SetDeepEnabled(true);
+	rendering->node->SetDeepEnabled(true);
 }
 
-void Chunk::hide()
+void Chunk::hide(unsigned viewmask)
 {
+	assert(rendering);
+
 	// Remove active model. If the model stays up
 	// to date, it can be still found from cache.
-	if (active_model) {
-		node->RemoveComponent(active_model);
-		active_model = NULL;
+	ActiveModels::Iterator active_models_find = rendering->active_models.Find(viewmask);
+	if (active_models_find != rendering->active_models.End()) {
+		rendering->node->RemoveComponent(active_models_find->second_);
+		rendering->active_models.Erase(active_models_find);
 	}
 
-	node->SetDeepEnabled(false);
+	// Node is visible as long as any viewer shows Chunk
+	if (rendering->active_models.Empty()) {
+		rendering->node->SetDeepEnabled(false);
+	}
+}
+
+void Chunk::setUndergrowthViewMask(unsigned viewmask)
+{
+	if (!rendering) {
+		return;
+	}
+	Urho3D::Node* nodes[2] = { rendering->undergrowth_node, rendering->undergrowth_old_node };
+	for (unsigned node_i = 0; node_i < 2; ++ node_i) {
+		if (!nodes[node_i]) {
+			continue;
+		}
+		Urho3D::PODVector<Urho3D::StaticModel*> smodels;
+		nodes[node_i]->GetComponents<Urho3D::StaticModel>(smodels);
+		for (unsigned i = 0; i < smodels.Size(); ++ i) {
+			smodels[i]->SetViewMask(viewmask);
+		}
+	}
+}
+
+void Chunk::editCorners(Urho3D::IntRect const& area, CornerBrush const& brush, bool& heights_changed, bool& ttypes_changed)
+{
+	int const CHUNK_W = world->getChunkWidth();
+	assert(area.left_ >= 0 && area.right_ < CHUNK_W);
+	assert(area.top_ >= 0 && area.bottom_ < CHUNK_W);
+
+	heights_changed = false;
+	ttypes_changed = false;
+
+	wake();
+
+	// Tasks might be reading the current snapshot, so publish a copy
+	// of it for editing. If nobody else has it, then edit it in place.
+	if (snapshot->Refs() > 1) {
+		Corners copy;
+		snapshot->copyCorners(copy);
+		snapshot = new CornersSnapshot(copy, CHUNK_W, snapshot->getEpoch());
+	}
+	Corners& corners = snapshot->getEditableCorners();
+
+	Urho3D::IntVector2 it;
+	for (it.y_ = area.top_; it.y_ <= area.bottom_; ++ it.y_) {
+		for (it.x_ = area.left_; it.x_ <= area.right_; ++ it.x_) {
+			Corner& corner = corners[it.x_ + it.y_ * CHUNK_W];
+			uint16_t old_height = corner.height;
+			TTypesByWeight old_ttypes = corner.ttypes;
+			brush(it, corner);
+			// Every corner must have at least one terraintype
+			if (corner.ttypes.empty()) {
+				corner.ttypes = old_ttypes;
+			}
+			if (corner.height != old_height) {
+				heights_changed = true;
+			}
+			if (corner.ttypes != old_ttypes) {
+				ttypes_changed = true;
+			}
+		}
+	}
+
+	if (heights_changed || ttypes_changed) {
+		snapshot->increaseEpoch();
+		++ edit_version;
+	}
+	if (heights_changed) {
+		updateHeightRange();
+	}
+	if (ttypes_changed) {
+		updateDataMemoryUse();
+	}
+}
+
+void Chunk::invalidate(bool ttypes_changed, Urho3D::IntRect const& area)
+{
+	// If only heights have changed and the up to date full detail LOD
+	// is visible, then it can be updated in place, unless it is adaptive.
+	bool patch = rendering && !ttypes_changed && world->getLodMaxError() == 0 && hasLod(0) && isModelActive(rendering->lodcache[0]);
+
+	++ data_version;
+
+	if (!rendering) {
+		return;
+	}
+
+	if (ttypes_changed) {
+		rendering->matcache_outdated = true;
+	}
+
+	// If there is a task that is not yet started, then it can be
+	// removed right away. Otherwise its results are thrown away later.
+	if (rendering->task_workitem.NotNull() && !rendering->task_workitem->completed_) {
+		Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+		if (workqueue->RemoveWorkItem(rendering->task_workitem)) {
+			++ world->getPipelineCounters().lod_builds_discarded;
+			rendering->task_workitem = NULL;
+			rendering->task_data = NULL;
+			rendering->task_mat = NULL;
+		}
+	}
+
+	// If patching works, then other LODs are the only outdated ones
+	if (patch && patchFullDetailLod(area)) {
+		Urho3D::SharedPtr<Urho3D::Model> model = rendering->lodcache[0];
+		rendering->lodcache.Clear();
+		rendering->lodcache[0] = model;
+		rendering->lodcache_version = data_version;
+	}
+
+	// Keep ready undergrowth visible until the new one is
+	// ready. Unfinished undergrowth can be simply destroyed.
+	Urho3D::Node* undergrowth_old_node = rendering->undergrowth_old_node;
+	if (rendering->undergrowth_state == UGSTATE_READY) {
+		assert(!undergrowth_old_node);
+		undergrowth_old_node = rendering->undergrowth_node;
+		rendering->undergrowth_node = NULL;
+	}
+	rendering->undergrowth_old_node = NULL;
+	destroyUndergrowth();
+	rendering->undergrowth_old_node = undergrowth_old_node;
+}
+
+bool Chunk::patchFullDetailLod(Urho3D::IntRect const& area)
+{
+	URHO3D_PROFILE(ChunkPatchFullDetailLod);
+	TraceScope trace("PatchFullDetailLod", pos, 0);
+
+	unsigned const CHUNK_W = world->getChunkWidth();
+	unsigned const CHUNK_W1 = CHUNK_W + 1;
+	unsigned const CHUNK_W3 = CHUNK_W + 3;
+	float const SQR_W = world->getSquareWidth();
+	float const CHUNK_WF_HALF = CHUNK_W * SQR_W / 2;
+	float const HEIGHTSTEP = world->getHeightstep();
+
+	// Vertices whose positions or normals have changed
+	Urho3D::IntRect vrts_area(
+		Urho3D::Max(area.left_ - 1, 0),
+		Urho3D::Max(area.top_ - 1, 0),
+		Urho3D::Min(area.right_ + 1, int(CHUNK_W)),
+		Urho3D::Min(area.bottom_ + 1, int(CHUNK_W))
+	);
+	if (vrts_area.left_ > vrts_area.right_ || vrts_area.top_ > vrts_area.bottom_) {
+		return true;
+	}
+	// Squares whose diagonal might have changed
+	Urho3D::IntRect sqrs_area(
+		Urho3D::Max(area.left_ - 1, 0),
+		Urho3D::Max(area.top_ - 1, 0),
+		Urho3D::Min(area.right_, int(CHUNK_W) - 1),
+		Urho3D::Min(area.bottom_, int(CHUNK_W) - 1)
+	);
+
+	// Big edits are better to rebuild at background
+	unsigned const PATCH_MAX_VRTS = CHUNK_W1 * CHUNK_W1 / 4;
+	if ((vrts_area.right_ - vrts_area.left_ + 1) * (vrts_area.bottom_ - vrts_area.top_ + 1) > int(PATCH_MAX_VRTS)) {
+		return false;
+	}
+
+	// Patching requires shadow data
+	Urho3D::Model* model = rendering->lodcache[0];
+	Urho3D::Geometry* geom = model->GetGeometry(0, 0);
+	Urho3D::VertexBuffer* vb = geom->GetVertexBuffer(0);
+	Urho3D::IndexBuffer* ib = geom->GetIndexBuffer();
+	if (!vb->GetShadowData() || !ib->GetShadowData() || ib->GetIndexSize() != sizeof(uint32_t)) {
+		return false;
+	}
+
+	// Get heights of corners, including the ones that are needed for normals
+	Urho3D::PODVector<uint16_t> heights;
+	world->extractHeightsData(heights, pos, Urho3D::IntRect(-1, -1, CHUNK_W + 1, CHUNK_W + 1));
+	if (heights.Empty()) {
+		return false;
+	}
+	Urho3D::PODVector<Urho3D::Vector3> poss;
+	poss.Reserve(CHUNK_W3 * CHUNK_W3);
+	unsigned ofs = 0;
+	for (unsigned y = 0; y < CHUNK_W3; ++ y) {
+		for (unsigned x = 0; x < CHUNK_W3; ++ x) {
+			poss.Push(Urho3D::Vector3(
+				(int(x) - 1) * SQR_W - CHUNK_WF_HALF,
+				(int(heights[ofs]) - int(baseheight)) * HEIGHTSTEP,
+				(int(y) - 1) * SQR_W - CHUNK_WF_HALF
+			));
+			++ ofs;
+		}
+	}
+
+	// Update positions and normals. These are the first two
+	// elements of vertex, in the same order as LOD builder uses.
+	unsigned const VRT_SIZE = vb->GetVertexSize();
+	unsigned char* vrts_data = vb->GetShadowData();
+	Urho3D::BoundingBox bbox = model->GetBoundingBox();
+	Urho3D::BoundingBox const OLD_BBOX = bbox;
+	for (int y = vrts_area.top_; y <= vrts_area.bottom_; ++ y) {
+		unsigned poss_ofs = vrts_area.left_ + 1 + (y + 1) * CHUNK_W3;
+		unsigned char* vrt = vrts_data + (vrts_area.left_ + y * CHUNK_W1) * VRT_SIZE;
+		for (int x = vrts_area.left_; x <= vrts_area.right_; ++ x) {
+			Urho3D::Vector3 const& pos = poss[poss_ofs];
+			Urho3D::Vector3 nrm = calculateCornerNormal(poss, poss_ofs, CHUNK_W3);
+			memcpy(vrt, pos.Data(), sizeof(float) * 3);
+			memcpy(vrt + sizeof(float) * 3, nrm.Data(), sizeof(float) * 3);
+			bbox.Merge(pos);
+			++ poss_ofs;
+			vrt += VRT_SIZE;
+		}
+	}
+	unsigned vrts_begin = vrts_area.left_ + vrts_area.top_ * CHUNK_W1;
+	unsigned vrts_end = vrts_area.right_ + vrts_area.bottom_ * CHUNK_W1 + 1;
+	if (!vb->SetDataRange(vrts_data + vrts_begin * VRT_SIZE, vrts_begin, vrts_end - vrts_begin)) {
+		throw std::runtime_error("Unable to set VertexBuffer data range!");
+	}
+
+	// Update triangles of squares
+	if (sqrs_area.left_ <= sqrs_area.right_ && sqrs_area.top_ <= sqrs_area.bottom_) {
+		uint32_t* idxs_data = (uint32_t*)ib->GetShadowData();
+		for (int y = sqrs_area.top_; y <= sqrs_area.bottom_; ++ y) {
+			for (int x = sqrs_area.left_; x <= sqrs_area.right_; ++ x) {
+				unsigned heights_ofs = x + 1 + (y + 1) * CHUNK_W3;
+				int h_sw = heights[heights_ofs];
+				int h_nw = heights[heights_ofs + CHUNK_W3];
+				int h_ne = heights[heights_ofs + CHUNK_W3 + 1];
+				int h_se = heights[heights_ofs + 1];
+				getSquareIndices(idxs_data + (x + y * CHUNK_W) * 6, x + y * CHUNK_W1, CHUNK_W1, h_sw, h_nw, h_ne, h_se);
+			}
+		}
+		unsigned idxs_begin = (sqrs_area.left_ + sqrs_area.top_ * CHUNK_W) * 6;
+		unsigned idxs_end = (sqrs_area.right_ + sqrs_area.bottom_ * CHUNK_W + 1) * 6;
+		if (!ib->SetDataRange(idxs_data + idxs_begin, idxs_begin, idxs_end - idxs_begin)) {
+			throw std::runtime_error("Unable to set IndexBuffer data range!");
+		}
+	}
+
+	// Occluder is small, so it is simply rebuilt
+	if (model->GetNumGeometryLodLevels(0) > 1) {
+		Urho3D::Geometry* occ_geom = model->GetGeometry(0, 1);
+		Urho3D::PODVector<char> occ_vrts_data;
+		Urho3D::PODVector<uint32_t> occ_idxs_data;
+		buildOccluder(occ_vrts_data, occ_idxs_data, poss, CHUNK_W, SQR_W);
+		if (!occ_geom->GetVertexBuffer(0)->SetData((void*)occ_vrts_data.Buffer())) {
+			throw std::runtime_error("Unable to set occluder VertexBuffer data!");
+		}
+		if (!occ_geom->GetIndexBuffer()->SetData((void*)occ_idxs_data.Buffer())) {
+			throw std::runtime_error("Unable to set occluder IndexBuffer data!");
+		}
+	}
+
+	// Water patch is small, so it is simply rebuilt too
+	if (world->hasWaterPatches()) {
+		float water_y = world->getWaterHeight(pos, baseheight);
+		Urho3D::PODVector<char> water_vrts_data;
+		Urho3D::PODVector<uint32_t> water_idxs_data;
+		buildWaterPatch(water_vrts_data, water_idxs_data, poss, CHUNK_W, SQR_W, water_y);
+		setWaterPatch(water_vrts_data, water_idxs_data, water_y);
+	}
+
+	// StaticModel copies the bounding box of Model only when Model is set. If
+	// bounding box grows, then a new Model is needed, but Geometries are shared.
+	if (bbox.min_ != OLD_BBOX.min_ || bbox.max_ != OLD_BBOX.max_) {
+		unsigned const NUM_LODS = model->GetNumGeometryLodLevels(0);
+		Urho3D::SharedPtr<Urho3D::Model> new_model(new Urho3D::Model(context_));
+		new_model->SetNumGeometries(1);
+		if (!new_model->SetNumGeometryLodLevels(0, NUM_LODS)) {
+			throw std::runtime_error("Unable to set number of lod levels of Model!");
+		}
+		for (unsigned lod_i = 0; lod_i < NUM_LODS; ++ lod_i) {
+			if (!new_model->SetGeometry(0, lod_i, model->GetGeometry(0, lod_i))) {
+				throw std::runtime_error("Unable to set Model Geometry!");
+			}
+		}
+		new_model->SetBoundingBox(bbox);
+		for (ActiveModels::Iterator it = rendering->active_models.Begin(); it != rendering->active_models.End(); ++ it) {
+			if (it->second_->GetModel() == model) {
+				it->second_->SetModel(new_model);
+				it->second_->SetMaterial(rendering->matcache);
+			}
+		}
+		rendering->lodcache[0] = new_model;
+	}
+
+	return true;
+}
+
+bool Chunk::isWaterPatchOutdated() const
+{
+	return world->hasWaterPatches() && rendering->water_version != world->getWaterVersion(pos);
+}
+
+void Chunk::setWaterPatch(Urho3D::PODVector<char> const& vrts_data, Urho3D::PODVector<uint32_t> const& idxs_data, float water_y)
+{
+	if (idxs_data.Empty()) {
+		if (rendering->water_model) {
+			rendering->node->RemoveComponent(rendering->water_model);
+			rendering->water_model = NULL;
+		}
+		return;
+	}
+
+	Urho3D::PODVector<Urho3D::VertexElement> vrts_elems;
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR2, Urho3D::SEM_TEXCOORD));
+
+	Urho3D::SharedPtr<Urho3D::VertexBuffer> vb(new Urho3D::VertexBuffer(context_));
+	if (!vb->SetSize(vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(vrts_elems), vrts_elems)) {
+		throw std::runtime_error("Unable to set water VertexBuffer size!");
+	}
+	if (!vb->SetData((void*)vrts_data.Buffer())) {
+		throw std::runtime_error("Unable to set water VertexBuffer data!");
+	}
+	Urho3D::SharedPtr<Urho3D::IndexBuffer> ib(new Urho3D::IndexBuffer(context_));
+	if (!ib->SetSize(idxs_data.Size(), true)) {
+		throw std::runtime_error("Unable to set water IndexBuffer size!");
+	}
+	if (!ib->SetData((void*)idxs_data.Buffer())) {
+		throw std::runtime_error("Unable to set water IndexBuffer data!");
+	}
+	Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context_));
+	if (!geom->SetVertexBuffer(0, vb)) {
+		throw std::runtime_error("Unable to set water Geometry VertexBuffer!");
+	}
+	geom->SetIndexBuffer(ib);
+	if (!geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, idxs_data.Size(), false)) {
+		throw std::runtime_error("Unable to set water Geometry draw range!");
+	}
+
+	Urho3D::SharedPtr<Urho3D::Model> model(new Urho3D::Model(context_));
+	model->SetNumGeometries(1);
+	if (!model->SetGeometry(0, 0, geom)) {
+		throw std::runtime_error("Unable to set water Model Geometry!");
+	}
+	float const CHUNK_WF_HALF = world->getChunkWidthFloat() / 2;
+	model->SetBoundingBox(Urho3D::BoundingBox(Urho3D::Vector3(-CHUNK_WF_HALF, water_y, -CHUNK_WF_HALF), Urho3D::Vector3(CHUNK_WF_HALF, water_y, CHUNK_WF_HALF)));
+
+	// Use viewmask to hide water from reflection camera
+	if (!rendering->water_model) {
+		rendering->water_model = rendering->node->CreateComponent<Urho3D::StaticModel>();
+		rendering->water_model->SetViewMask(world->getWaterViewMask());
+		rendering->water_model->SetCastShadows(false);
+		rendering->water_model->SetOccludee(true);
+	}
+	rendering->water_model->SetModel(model);
+	rendering->water_model->SetMaterial(world->getWaterMaterial());
 }
 
 void Chunk::removeFromWorld(void)
 {
 	URHO3D_PROFILE(ChunkRemoveFromWorld);
-	node->Remove();
 	world = NULL;
-	lodcache.Clear();
-	matcache = NULL;
-	node = NULL;
+	if (rendering) {
+		rendering->node->Remove();
+		rendering->lodcache.Clear();
+		rendering->matcache = NULL;
+		rendering->splat_slot.release();
+		rendering->node = NULL;
+	}
 }
 
 Urho3D::Node* Chunk::createChildNode()
 {
-	Urho3D::Node* child = node->CreateChild();
-	child->SetEnabled(node->IsEnabled());
+	if (!rendering) {
+		throw std::runtime_error("Data only Chunks have no scene nodes!");
+	}
+	Urho3D::Node* child = rendering->node->CreateChild();
+	child->SetEnabled(rendering->node->IsEnabled());
 	return child;
 }
 
 void Chunk::moveChildNodeFrom(Urho3D::Node* child)
 {
-	child->SetParent(node);
-	child->SetEnabled(node->IsEnabled());
+	if (!rendering) {
+		throw std::runtime_error("Data only Chunks have no scene nodes!");
+	}
+	child->SetParent(rendering->node);
+	child->SetEnabled(rendering->node->IsEnabled());
 }
 
 void Chunk::copyCornerRow(Corners& result, unsigned x, unsigned y, unsigned size) const
 {
-	unsigned chunk_w = world->getChunkWidth();
-	assert(size <= chunk_w - x);
-	assert(y < chunk_w);
-	unsigned ofs = y * chunk_w + x;
-	assert(ofs + size <= corners.Size());
-	result.Insert(result.End(), corners.Begin() + ofs, corners.Begin() + ofs + size);
+	snapshot->copyRow(result, x, y, size);
+}
+
+void Chunk::copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const
+{
+	snapshot->copyHeightRow(result, x, y, size);
+}
+
+void Chunk::hibernate()
+{
+	if (snapshot->isCompressed()) {
+		return;
+	}
+	// If tasks are reading the old snapshot, its memory is released after them
+	snapshot = snapshot->createCompressed();
+	updateDataMemoryUse();
+}
+
+void Chunk::wake()
+{
+	if (!snapshot->isCompressed()) {
+		return;
+	}
+	snapshot = snapshot->createDecompressed();
+	updateDataMemoryUse();
 }
 
 void Chunk::getTriangles(UrhoExtras::Triangle& tri1, UrhoExtras::Triangle& tri2,
@@ -292,38 +754,54 @@ void Chunk::getTriangles(UrhoExtras::Triangle& tri1, UrhoExtras::Triangle& tri2,
 bool Chunk::createUndergrowth()
 {
 	URHO3D_PROFILE(ChunkCreateUndergrowth);
+	TraceScope trace("CreateUndergrowth", pos);
+
+	if (!rendering) {
+		throw std::runtime_error("Data only Chunks have no undergrowth!");
+	}
 
-	if (undergrowth_state == UGSTATE_READY) {
+	if (rendering->undergrowth_state == UGSTATE_READY) {
 		return true;
 	}
 
-	if (undergrowth_state == UGSTATE_NOT_INITIALIZED) {
-		world->extractCornersData(undergrowth_corners, pos);
-		if (undergrowth_corners.Empty()) {
+	if (rendering->undergrowth_state == UGSTATE_NOT_INITIALIZED) {
+		Urho3D::SharedPtr<UndergrowthPlacingTaskData> task_data(new UndergrowthPlacingTaskData);
+		if (!world->getCornersSnapshots(task_data->snapshots, pos)) {
 			return false;
 		}
-		undergrowth_state = UGSTATE_PLACING;
-		undergrowth_placer_wi = new Urho3D::WorkItem();
-		undergrowth_placer_wi->aux_ = this;
-		undergrowth_placer_wi->workFunction_ = undergrowthPlacer;
+		task_data->world = world;
+		task_data->chunk_pos = pos;
+		task_data->baseheight = baseheight;
+		task_data->ugmodels = world->getUndergrowthModelsByTerraintype();
+		rendering->undergrowth_task_data = task_data;
+		rendering->undergrowth_state = UGSTATE_PLACING;
+		rendering->undergrowth_placer_wi = new Urho3D::WorkItem();
+		rendering->undergrowth_placer_wi->aux_ = task_data;
+		rendering->undergrowth_placer_wi->workFunction_ = placeUndergrowth;
 		Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
-		workqueue->AddWorkItem(undergrowth_placer_wi);
+		workqueue->AddWorkItem(rendering->undergrowth_placer_wi);
+		rendering->undergrowth_timer.Reset();
+		++ world->getPipelineCounters().undergrowths_started;
 		return false;
 	}
 
-	if (undergrowth_state == UGSTATE_PLACING) {
-	    if (!undergrowth_placer_wi->completed_) {
+	if (rendering->undergrowth_state == UGSTATE_PLACING) {
+	    if (!rendering->undergrowth_placer_wi->completed_) {
 			return false;
 		}
-		undergrowth_placer_wi = NULL;
-		undergrowth_state = UGSTATE_LOADING_RESOURCES;
+		rendering->undergrowth_placer_wi = NULL;
+		rendering->undergrowth_state = UGSTATE_LOADING_RESOURCES;
+		// Only placements are needed anymore. Releasing the
+		// snapshots saves copying them when Chunk is edited.
+		rendering->undergrowth_task_data->snapshots.Clear();
+		Corners().Swap(rendering->undergrowth_task_data->corners);
 	}
 
-	if (undergrowth_state == UGSTATE_LOADING_RESOURCES) {
+	if (rendering->undergrowth_state == UGSTATE_LOADING_RESOURCES) {
 		// Check if all models and materials are ready
 		bool resources_missing = false;
 		Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
-		for (StrNStr model_and_mat : undergrowth_places.Keys()) {
+		for (StrNStr model_and_mat : rendering->undergrowth_task_data->places.Keys()) {
 			// Check model
 			Urho3D::String const& model_path = model_and_mat.first_;
 			if (!resources->GetExistingResource<Urho3D::Model>(model_path)) {
@@ -343,36 +821,46 @@ bool Chunk::createUndergrowth()
 
 		// Resources are ready and models, positions and rotations are decided.
 		// Start combining one Model from them.
-		undergrowth_state = UGSTATE_COMBINING;
-		undergrowth_node = createChildNode();
-		undergrowth_combiner = new UrhoExtras::ModelCombiner(context_);
-		for (UndergrowthPlacements::ConstIterator i = undergrowth_places.Begin(); i != undergrowth_places.End(); ++ i) {
+		rendering->undergrowth_state = UGSTATE_COMBINING;
+		rendering->undergrowth_node = createChildNode();
+		rendering->undergrowth_combiner = new UrhoExtras::ModelCombiner(context_);
+		UndergrowthPlacements const& places = rendering->undergrowth_task_data->places;
+		for (UndergrowthPlacements::ConstIterator i = places.Begin(); i != places.End(); ++ i) {
 			Urho3D::Model* model = resources->GetResource<Urho3D::Model>(i->first_.first_);
 			Urho3D::Material* mat = resources->GetResource<Urho3D::Material>(i->first_.second_);
 			for (Urho3D::Matrix4 const& transf : i->second_) {
-				undergrowth_combiner->AddModel(model, mat, transf);
+				rendering->undergrowth_combiner->AddModel(model, mat, transf);
 			}
 		}
 
 		return false;
 	}
 
-	if (undergrowth_state == UGSTATE_COMBINING) {
-		if (undergrowth_combiner->Ready()) {
-			Urho3D::Model* model = undergrowth_combiner->GetModel();
+	if (rendering->undergrowth_state == UGSTATE_COMBINING) {
+		if (rendering->undergrowth_combiner->Ready()) {
+			Urho3D::Model* model = rendering->undergrowth_combiner->GetModel();
 			if (model) {
-				Urho3D::StaticModel* smodel = undergrowth_node->CreateComponent<Urho3D::StaticModel>();
+				Urho3D::StaticModel* smodel = rendering->undergrowth_node->CreateComponent<Urho3D::StaticModel>();
 				smodel->SetModel(model);
 				smodel->SetOccludee(true);
-				for (unsigned geom_i = 0; geom_i < undergrowth_combiner->GetModel()->GetNumGeometries(); ++ geom_i) {
-					smodel->SetMaterial(geom_i, undergrowth_combiner->GetMaterial(geom_i));
+				for (unsigned geom_i = 0; geom_i < rendering->undergrowth_combiner->GetModel()->GetNumGeometries(); ++ geom_i) {
+					smodel->SetMaterial(geom_i, rendering->undergrowth_combiner->GetMaterial(geom_i));
 				}
 				smodel->SetCastShadows(false);
 				smodel->SetDrawDistance(world->getUndergrowthDrawDistance());
+				smodel->SetViewMask(world->getUndergrowthViewMask());
+			}
+			rendering->undergrowth_combiner = NULL;
+			rendering->undergrowth_task_data = NULL;
+			rendering->undergrowth_state = UGSTATE_READY;
+			PipelineCounters& counters = world->getPipelineCounters();
+			++ counters.undergrowths_finished;
+			counters.undergrowth_latency_usec += rendering->undergrowth_timer.GetUSec(false);
+			// Outdated undergrowth is not needed anymore
+			if (rendering->undergrowth_old_node) {
+				rendering->undergrowth_old_node->Remove();
+				rendering->undergrowth_old_node = NULL;
 			}
-			undergrowth_combiner = NULL;
-			undergrowth_places.Clear();
-			undergrowth_state = UGSTATE_READY;
 			return true;
 		}
 		return false;
@@ -384,107 +872,208 @@ bool Chunk::createUndergrowth()
 bool Chunk::destroyUndergrowth()
 {
 	URHO3D_PROFILE(ChunkDestroyUndergrowth);
-	undergrowth_state = UGSTATE_STOP_PLACING;
-	if (undergrowth_placer_wi.NotNull()) {
+	if (!rendering) {
+		return true;
+	}
+	if (rendering->undergrowth_placer_wi.NotNull()) {
+		rendering->undergrowth_task_data->stop = true;
 		Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
-		if (!workqueue->RemoveWorkItem(undergrowth_placer_wi)) {
-			while (!undergrowth_placer_wi->completed_) {
+		if (!workqueue->RemoveWorkItem(rendering->undergrowth_placer_wi)) {
+			while (!rendering->undergrowth_placer_wi->completed_) {
 			}
 		}
-		undergrowth_placer_wi = NULL;
+		rendering->undergrowth_placer_wi = NULL;
 	}
-	undergrowth_corners.Clear();
-	undergrowth_combiner = NULL;
-	undergrowth_places.Clear();
-	if (undergrowth_node) {
-		undergrowth_node->Remove();
-		undergrowth_node = NULL;
+	rendering->undergrowth_task_data = NULL;
+	rendering->undergrowth_combiner = NULL;
+	if (rendering->undergrowth_node) {
+		rendering->undergrowth_node->Remove();
+		rendering->undergrowth_node = NULL;
 	}
-	undergrowth_state = UGSTATE_NOT_INITIALIZED;
+	if (rendering->undergrowth_old_node) {
+		rendering->undergrowth_old_node->Remove();
+		rendering->undergrowth_old_node = NULL;
+	}
+	rendering->undergrowth_state = UGSTATE_NOT_INITIALIZED;
 	return true;
 }
 
+void Chunk::releaseRenderingResources()
+{
+	if (!rendering) {
+		return;
+	}
+	assert(rendering->active_models.Empty());
+
+	destroyUndergrowth();
+	stopTask();
+	rendering->lodcache.Clear();
+	rendering->matcache = NULL;
+	rendering->matcache_outdated = false;
+	rendering->splat_slot.release();
+	if (rendering->water_model) {
+		rendering->node->RemoveComponent(rendering->water_model);
+		rendering->water_model = NULL;
+	}
+	rendering->water_version = 0;
+}
+
+unsigned long long Chunk::getRenderingMemoryUse() const
+{
+	if (!rendering) {
+		return 0;
+	}
+
+	unsigned long long result = 0;
+	for (LodCache::ConstIterator it = rendering->lodcache.Begin(); it != rendering->lodcache.End(); ++ it) {
+		result += getModelMemoryUse(it->second_);
+	}
+	if (rendering->water_model) {
+		result += getModelMemoryUse(rendering->water_model->GetModel());
+	}
+	return result;
+}
+
+void Chunk::collectStats(ChunkWorldStats& result, Urho3D::HashSet<Urho3D::Material const*>& materials) const
+{
+	if (!rendering) {
+		return;
+	}
+
+	result.lods_cached += rendering->lodcache.Size();
+	result.lod_bytes_cached += getRenderingMemoryUse();
+
+	if (rendering->task_workitem.NotNull()) {
+		++ result.lod_tasks_in_flight;
+		if (!rendering->task_workitem->completed_) {
+			++ result.lod_tasks_pending;
+		}
+	}
+
+	if (rendering->undergrowth_state != UGSTATE_NOT_INITIALIZED && rendering->undergrowth_state != UGSTATE_READY) {
+		++ result.undergrowth_tasks_in_flight;
+		if (rendering->undergrowth_placer_wi.NotNull() && !rendering->undergrowth_placer_wi->completed_) {
+			++ result.undergrowth_tasks_pending;
+		}
+	}
+
+	if (rendering->matcache.NotNull()) {
+		materials.Insert(rendering->matcache.Get());
+	}
+}
+
+void Chunk::stopTask()
+{
+	if (rendering->task_workitem.NotNull()) {
+		// Action is required only if task is not yet ready
+		if (!rendering->task_workitem->completed_) {
+			// First try to simply remove task
+			Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+			if (!workqueue->RemoveWorkItem(rendering->task_workitem)) {
+				// Removing did not work. Let's just wait until workitem is ready
+				while (!rendering->task_workitem->completed_) {
+					// Wait, wait...
+				}
+			}
+		}
+		rendering->task_workitem = NULL;
+		rendering->task_data = NULL;
+		rendering->task_mat = NULL;
+	}
+}
+
+bool Chunk::isModelActive(Urho3D::Model const* model) const
+{
+	for (ActiveModels::ConstIterator it = rendering->active_models.Begin(); it != rendering->active_models.End(); ++ it) {
+		if (it->second_->GetModel() == model) {
+			return true;
+		}
+	}
+	return false;
+}
+
 bool Chunk::storeTaskResultsToLodCache()
 {
-	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+	TraceScope trace("StoreLodToCache", pos, rendering->task_lod);
 
 	// Before constructing the Model, make sure material is loaded.
 	Urho3D::SharedPtr<Urho3D::Material> mat;
+	// If material uses splat atlas, then this tells the slot
+	SplatSlot const* uvs_splat_slot = NULL;
+	SplatSlot new_splat_slot;
 	// First the easiest case, where existing material can be used.
-	if (!task_data->calculate_ttype_image) {
-		assert(task_mat.NotNull());
-		mat = task_mat;
+	if (!rendering->task_data->calculate_ttype_image) {
+		assert(rendering->task_mat.NotNull());
+		mat = rendering->task_mat;
+		if (rendering->splat_slot.atlas.NotNull()) {
+			uvs_splat_slot = &rendering->splat_slot;
+		}
 	}
 	// Then second easiest case, where only one terraintype is used
-	else if (task_data->used_ttypes.Size() == 1) {
+	else if (rendering->task_data->used_ttypes.Size() == 1) {
 		// These simple materials are stored to cache in
 		// ChunkWorld. Try to get the material from there.
-		mat = world->getSingleLayerTerrainMaterial(task_data->used_ttypes[0]);
+		mat = world->getSingleLayerTerrainMaterial(rendering->task_data->used_ttypes[0]);
 		if (mat.Null()) {
 			return false;
 		}
 	}
-	// Most complex case. Material with multiple terraintypes
-	else {
-		// First make sure all textures are loaded
-		Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Texture2D> > texs;
-		for (unsigned i = 0; i < task_data->used_ttypes.Size(); ++ i) {
-			uint8_t ttype = task_data->used_ttypes[i];
-			Urho3D::String const& tex_name = world->getTerrainTextureName(ttype);
-			Urho3D::SharedPtr<Urho3D::Texture2D> tex(resources->GetExistingResource<Urho3D::Texture2D>(tex_name));
-			if (tex.Null()) {
-				// Texture was not loaded, so start loading it.
-				resources->BackgroundLoadResource<Urho3D::Texture2D>(tex_name);
-			} else {
-				texs.Push(tex);
-			}
+	// Multiple terraintypes or texture array, with a
+	// Material that is shared through splat atlas.
+	else if (world->usesSplatAtlas()) {
+		if (!world->reserveSplatSlot(new_splat_slot, rendering->task_data->used_ttypes)) {
+			return false;
 		}
-		// If some textures are missing, then give up for now
-		if (texs.Size() != task_data->used_ttypes.Size()) {
+		assert(rendering->task_data->ttype_image.NotNull());
+		new_splat_slot.atlas->setSlotData(new_splat_slot.index, rendering->task_data->ttype_image);
+		mat = new_splat_slot.atlas->getMaterial();
+		uvs_splat_slot = &new_splat_slot;
+	}
+	// Most complex case. Own Material with multiple terraintypes
+	else {
+		mat = world->createTerrainBlendMaterial(rendering->task_data->used_ttypes, NULL, world->getTerrainTextureRepeats(), world->getChunkWidth() + 1);
+		if (mat.Null()) {
 			return false;
 		}
-		// All textures are ready. Construct new material.
-		Urho3D::SharedPtr<Urho3D::Texture2D> blend_tex;
-		mat = new Urho3D::Material(context_);
-		if (texs.Size() == 4) {
-			Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend4.xml");
-			mat->SetTechnique(0, tech);
-		} else {
-			Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend3.xml");
-			mat->SetTechnique(0, tech);
-		}
-		mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * world->getTerrainTextureRepeats()));
-		mat->SetShaderParameter("WeightMapWidth", Urho3D::Variant(world->getChunkWidth() + 1));
-		blend_tex = new Urho3D::Texture2D(context_);
+		Urho3D::SharedPtr<Urho3D::Texture2D> blend_tex(new Urho3D::Texture2D(context_));
 		blend_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
 		blend_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
-		assert(task_data->ttype_image.NotNull());
-		blend_tex->SetData(task_data->ttype_image);
+		assert(rendering->task_data->ttype_image.NotNull());
+		blend_tex->SetData(rendering->task_data->ttype_image);
 		mat->SetTexture(Urho3D::TU_DIFFUSE, blend_tex);
-		for (unsigned layer = 0; layer < texs.Size(); ++ layer) {
-			mat->SetTexture((Urho3D::TextureUnit)(layer + 1), texs[layer]);
+	}
+
+	// If splat atlas is used, then UV coordinates must point to the slot
+	if (uvs_splat_slot) {
+		unsigned uv_ofs = 0;
+		for (unsigned i = 0; i < rendering->task_data->vrts_elems.Size() && rendering->task_data->vrts_elems[i].semantic_ != Urho3D::SEM_TEXCOORD; ++ i) {
+			uv_ofs += Urho3D::ELEMENT_TYPESIZES[rendering->task_data->vrts_elems[i].type_];
 		}
+		unsigned vrt_size = Urho3D::VertexBuffer::GetVertexSize(rendering->task_data->vrts_elems);
+		uvs_splat_slot->atlas->convertUvsToSlot(rendering->task_data->vrts_data, vrt_size, uv_ofs, uvs_splat_slot->index);
 	}
 
 	// Material is ready. Now construct model.
 	// Convert raw data from task to real VertexBuffer
 	Urho3D::SharedPtr<Urho3D::VertexBuffer> new_vb(new Urho3D::VertexBuffer(context_));
-	new_vb->SetShadowed(!task_data->occ_shape_available);
-	if (!new_vb->SetSize(task_data->vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(task_data->vrts_elems), task_data->vrts_elems)) {
+	// Full detail LODs keep shadow data, so they can be patched after small edits
+	bool shadowed = !rendering->task_data->occ_shape_available || rendering->task_lod == 0;
+	new_vb->SetShadowed(shadowed);
+	if (!new_vb->SetSize(rendering->task_data->vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(rendering->task_data->vrts_elems), rendering->task_data->vrts_elems)) {
 		throw std::runtime_error("Unable to set VertexBuffer size!");
 	}
-	if (!new_vb->SetData((void*)task_data->vrts_data.Buffer())) {
+	if (!new_vb->SetData((void*)rendering->task_data->vrts_data.Buffer())) {
 		throw std::runtime_error("Unable to set VertexBuffer data!");
 	}
 
 	// Convert raw data from task to real IndexBuffer
 	Urho3D::SharedPtr<Urho3D::IndexBuffer> new_ib(new Urho3D::IndexBuffer(context_));
-	new_ib->SetShadowed(!task_data->occ_shape_available);
+	new_ib->SetShadowed(shadowed);
 // TODO: Use small indices if possible!
-	if (!new_ib->SetSize(task_data->idxs_data.Size(), true)) {
+	if (!new_ib->SetSize(rendering->task_data->idxs_data.Size(), true)) {
 		throw std::runtime_error("Unable to set IndexBuffer size!");
 	}
-	if (!new_ib->SetData((void*)task_data->idxs_data.Buffer())) {
+	if (!new_ib->SetData((void*)rendering->task_data->idxs_data.Buffer())) {
 		throw std::runtime_error("Unable to set IndexBuffer data!");
 	}
 
@@ -494,30 +1083,30 @@ bool Chunk::storeTaskResultsToLodCache()
 		throw std::runtime_error("Unable to set Geometry VertexBuffer!");
 	}
 	new_geom->SetIndexBuffer(new_ib);
-	if (!new_geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, task_data->idxs_data.Size(), false)) {
+	if (!new_geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, rendering->task_data->idxs_data.Size(), false)) {
 		throw std::runtime_error("Unable to set Geometry draw range!");
 	}
 
 	// Create occluder geometry, if one is available
 	Urho3D::SharedPtr<Urho3D::Geometry> occ_geom;
-	if (task_data->occ_shape_available) {
+	if (rendering->task_data->occ_shape_available) {
 		Urho3D::SharedPtr<Urho3D::VertexBuffer> occ_vbuf(new Urho3D::VertexBuffer(context_));
 		occ_vbuf->SetShadowed(true);
 		Urho3D::PODVector<Urho3D::VertexElement> occ_vrts_elems;
 		occ_vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
-		if (!occ_vbuf->SetSize(task_data->occ_vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(occ_vrts_elems), occ_vrts_elems)) {
+		if (!occ_vbuf->SetSize(rendering->task_data->occ_vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(occ_vrts_elems), occ_vrts_elems)) {
 			throw std::runtime_error("Unable to set occluder VertexBuffer size!");
 		}
-		if (!occ_vbuf->SetData((void*)task_data->occ_vrts_data.Buffer())) {
+		if (!occ_vbuf->SetData((void*)rendering->task_data->occ_vrts_data.Buffer())) {
 			throw std::runtime_error("Unable to set occluder VertexBuffer data!");
 		}
 		Urho3D::SharedPtr<Urho3D::IndexBuffer> occ_ibuf(new Urho3D::IndexBuffer(context_));
 		occ_ibuf->SetShadowed(true);
 // TODO: Use small indices if possible!
-		if (!occ_ibuf->SetSize(task_data->occ_idxs_data.Size(), true)) {
+		if (!occ_ibuf->SetSize(rendering->task_data->occ_idxs_data.Size(), true)) {
 			throw std::runtime_error("Unable to set occluder IndexBuffer size!");
 		}
-		if (!occ_ibuf->SetData((void*)task_data->occ_idxs_data.Buffer())) {
+		if (!occ_ibuf->SetData((void*)rendering->task_data->occ_idxs_data.Buffer())) {
 			throw std::runtime_error("Unable to set occluder IndexBuffer data!");
 		}
 		occ_geom = new Urho3D::Geometry(context_);
@@ -525,7 +1114,7 @@ bool Chunk::storeTaskResultsToLodCache()
 			throw std::runtime_error("Unable to set occluder Geometry VertexBuffer!");
 		}
 		occ_geom->SetIndexBuffer(occ_ibuf);
-		if (!occ_geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, task_data->occ_idxs_data.Size(), false)) {
+		if (!occ_geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, rendering->task_data->occ_idxs_data.Size(), false)) {
 			throw std::runtime_error("Unable to set occluder Geometry draw range!");
 		}
 		occ_geom->SetLodDistance(Urho3D::M_LARGE_VALUE);
@@ -534,152 +1123,75 @@ bool Chunk::storeTaskResultsToLodCache()
 	// Create model the data from task
 	Urho3D::SharedPtr<Urho3D::Model> new_model(new Urho3D::Model(context_));
 	new_model->SetNumGeometries(1);
-	if (!new_model->SetNumGeometryLodLevels(0, task_data->occ_shape_available ? 2 : 1)) {
+	if (!new_model->SetNumGeometryLodLevels(0, rendering->task_data->occ_shape_available ? 2 : 1)) {
 		throw std::runtime_error("Unable to set number of lod levels of Model!");
 	}
 	if (!new_model->SetGeometry(0, 0, new_geom)) {
 		throw std::runtime_error("Unable to set Model Geometry!");
 	}
-	if (task_data->occ_shape_available) {
+	if (rendering->task_data->occ_shape_available) {
 		if (!new_model->SetGeometry(0, 1, occ_geom)) {
 			throw std::runtime_error("Unable to set Model occluder Geometry!");
 		}
 	}
-	new_model->SetBoundingBox(task_data->boundingbox);
-
-	// Store model and material to cache
-	lodcache[task_lod] = new_model;
-	matcache = mat;
+	new_model->SetBoundingBox(rendering->task_data->boundingbox);
+
+	// Store model and material to cache. If cached LODs were built from
+	// outdated data, then they are not needed anymore. The possible
+	// visible Model is still kept alive by the active StaticModel.
+	if (rendering->lodcache_version != rendering->task_data->data_version) {
+		rendering->lodcache.Clear();
+		rendering->lodcache_version = rendering->task_data->data_version;
+	}
+	rendering->lodcache[rendering->task_lod] = new_model;
+	rendering->matcache = mat;
+	if (rendering->task_data->build_water_patch) {
+		setWaterPatch(rendering->task_data->water_vrts_data, rendering->task_data->water_idxs_data, rendering->task_data->water_y);
+		rendering->water_version = rendering->task_data->water_version;
+	}
+	if (rendering->task_data->calculate_ttype_image) {
+		rendering->matcache_outdated = false;
+	}
+	if (new_splat_slot.atlas.NotNull()) {
+		rendering->splat_slot.release();
+		rendering->splat_slot = new_splat_slot;
+	}
 
-	// If cache grows too big, remove some elements from it.
-	unsigned const LODCACHE_MAX_SIZE = 2;
-	if (lodcache.Size() > LODCACHE_MAX_SIZE) {
-		unsigned remove = rand() % (lodcache.Size() - 1);
-		LodCache::Iterator it = lodcache.Begin();
-		while (true) {
-			// Skip current lod
-			if (it->first_ == task_lod) {
-				continue;
-			}
-			if (remove == 0) {
-				lodcache.Erase(it);
-				break;
+	// If cache grows too big, remove some elements from it. Every
+	// viewer might be showing a different LOD, so they need more room.
+	unsigned const LODCACHE_MAX_SIZE = Urho3D::Max(2u, rendering->active_models.Size() + 1);
+	if (rendering->lodcache.Size() > LODCACHE_MAX_SIZE) {
+		// Never remove the new LOD, the ones that are currently visible, or
+		// the ones that viewareas being built wait for. Otherwise viewers that
+		// want different LODs could keep evicting each other's LODs forever.
+		Urho3D::PODVector<uint8_t> removable;
+		for (LodCache::Iterator it = rendering->lodcache.Begin(); it != rendering->lodcache.End(); ++ it) {
+			if (it->first_ != rendering->task_lod && !isModelActive(it->second_) && !world->isLodNeededByNewViewarea(pos, it->first_)) {
+				removable.Push(it->first_);
 			}
-			-- remove;
+		}
+		if (!removable.Empty()) {
+			rendering->lodcache.Erase(removable[rand() % removable.Size()]);
 		}
 	}
 
 	return true;
 }
 
-void Chunk::updateLowestHeight()
+void Chunk::updateHeightRange()
 {
+	Corners const& corners = snapshot->getCorners();
 	lowest_height = corners[0].height;
+	highest_height = corners[0].height;
 	for (unsigned i = 1; i < corners.Size(); ++ i) {
 		lowest_height = Urho3D::Min(lowest_height, corners[i].height);
+		highest_height = Urho3D::Max(highest_height, corners[i].height);
 	}
 }
 
-void Chunk::undergrowthPlacer(Urho3D::WorkItem const* wi, unsigned thread_i)
+void Chunk::updateDataMemoryUse()
 {
-	(void)thread_i;
-
-	Chunk* chunk = (Chunk*)wi->aux_;
-	UndergrowthModelsByTerraintype ugmodels = chunk->world->getUndergrowthModelsByTerraintype();
-
-	unsigned const CHUNK_WIDTH = chunk->world->getChunkWidth();
-	float const HEIGHTSTEP = chunk->world->getHeightstep();
-	float const SQUARE_WIDTH = chunk->world->getSquareWidth();
-	float const CHUNK_WIDTH_F_HALF = CHUNK_WIDTH * SQUARE_WIDTH / 2.0;
-
-	for (unsigned y = 0; y < CHUNK_WIDTH; ++ y) {
-		unsigned ofs_sw = (y + 1) * (CHUNK_WIDTH + 3) + 1;
-		for (unsigned x = 0; x < CHUNK_WIDTH; ++ x) {
-			unsigned ofs_nw = ofs_sw + CHUNK_WIDTH + 3;
-			unsigned ofs_ne = ofs_nw + 1;
-			unsigned ofs_se = ofs_sw + 1;
-
-			// If cancel has been requested
-			if (chunk->undergrowth_state == UGSTATE_STOP_PLACING) {
-				chunk->undergrowth_places.Clear();
-				return;
-			}
-
-			// To generate similar results every time, use deterministic random
-// TODO: This does not work! Try something else!
-/*
-			UrhoExtras::Random rnd(ofs_sw);
-			rnd.seedMore(chunk->chunk->getPosition().x_);
-			rnd.seedMore(chunk->chunk->getPosition().y_);
-*/
-UrhoExtras::Random rnd(rand());
-
-			// Randomize rotation and position on square
-			float yaw_angle = 360 * rnd.randomFloat();
-			Urho3D::Vector2 sqr_pos(rnd.randomFloat(), rnd.randomFloat());
-
-			// Get average terraintypes in this square
-			BigWorld::TTypesByWeight const& ttypes_sw = chunk->undergrowth_corners[ofs_sw].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_nw = chunk->undergrowth_corners[ofs_nw].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_ne = chunk->undergrowth_corners[ofs_ne].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_se = chunk->undergrowth_corners[ofs_se].ttypes;
-			BigWorld::TTypesByWeight ttypes = ttypes_sw.averageOfTwo(ttypes_se).averageOfTwo(ttypes_nw.averageOfTwo(ttypes_ne));
-
-			// Select one of the terrain types randomly
-			unsigned ttypes_total_weight = ttypes.getTotalWeight();
-			unsigned ttype_selection_weight = rnd.randomUnsigned() % ttypes_total_weight;
-			unsigned ttype_selection_idx = 0;
-			while (ttype_selection_weight >= ttypes.getValueByte(ttype_selection_idx)) {
-				ttype_selection_weight -= ttypes.getValueByte(ttype_selection_idx);
-				++ ttype_selection_idx;
-				assert(ttype_selection_idx < ttypes.size());
-			}
-			uint8_t ttype_selection = ttypes.getKey(ttype_selection_idx);
-
-			// Select one of the undergrowth models, based on terraintypes
-			UndergrowthModelsByTerraintype::ConstIterator ugs_find = ugmodels.Find(ttype_selection);
-			if (ugs_find != ugmodels.End()) {
-
-				UndergrowthModels const& ttype_ugs = ugs_find->second_;
-				UndergrowthModel const& ttype_ug = ttype_ugs[rnd.randomUnsigned() % ttype_ugs.Size()];
-
-				// Decide position and rotation
-				float c_sw = (int(chunk->undergrowth_corners[ofs_sw].height) - int(chunk->baseheight)) * HEIGHTSTEP;
-				float c_nw = (int(chunk->undergrowth_corners[ofs_nw].height) - int(chunk->baseheight)) * HEIGHTSTEP;
-				float c_ne = (int(chunk->undergrowth_corners[ofs_ne].height) - int(chunk->baseheight)) * HEIGHTSTEP;
-				float c_se = (int(chunk->undergrowth_corners[ofs_se].height) - int(chunk->baseheight)) * HEIGHTSTEP;
-
-				float height = chunk->world->getHeightFromCorners(c_sw, c_nw, c_ne, c_se, sqr_pos);
-
-				Urho3D::Vector3 ug_pos = Urho3D::Vector3(
-					(x + sqr_pos.x_) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF,
-					height,
-					(y + sqr_pos.y_) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF
-				);
-				Urho3D::Quaternion ug_rot = Urho3D::Quaternion(yaw_angle, Urho3D::Vector3::UP);
-				if (ttype_ug.follow_ground_angle) {
-					Urho3D::Vector3 normal = chunk->world->getNormalFromCorners(c_sw, c_nw, c_ne, c_se, sqr_pos);
-					Urho3D::Vector2 normal_xz(normal.x_, normal.z_);
-					float follow_yaw = UrhoExtras::getAngle(normal_xz);
-					float follow_pitch = UrhoExtras::getAngle(normal_xz.Length(), normal.y_);
-					ug_rot = Urho3D::Quaternion(follow_yaw, Urho3D::Vector3::UP) * Urho3D::Quaternion(follow_pitch, Urho3D::Vector3::RIGHT) * ug_rot;
-				}
-				float ug_scale = rnd.randomFloatRange(ttype_ug.min_scale, ttype_ug.max_scale);
-
-				// Combine position, rotation and scaling
-				Urho3D::Matrix4 ug_transf_scale;
-				ug_transf_scale.SetScale(ug_scale);
-				Urho3D::Matrix4 ug_transf;
-				ug_transf.SetRotation(ug_rot.RotationMatrix());
-				ug_transf.SetTranslation(ug_pos);
-				ug_transf = ug_transf * ug_transf_scale;
-
-				chunk->undergrowth_places[StrNStr(ttype_ug.model, ttype_ug.material)].Push(ug_transf);
-			}
-			++ ofs_sw;
-		}
-	}
-
+	data_memory_use = snapshot->getMemoryUse();
 }
 
 }
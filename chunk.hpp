@@ -1,17 +1,24 @@
 #ifndef BIGWORLD_CHUNK_HPP
 #define BIGWORLD_CHUNK_HPP
 
+#include "cornerssnapshot.hpp"
+#include "splatatlas.hpp"
 #include "types.hpp"
 
 #include "../urhoextras/modelcombiner.hpp"
 #include "../urhoextras/triangle.hpp"
 
 #include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/HashSet.h>
 #include <Urho3D/Core/Object.h>
+#include <Urho3D/Core/Timer.h>
 #include <Urho3D/Graphics/Material.h>
 #include <Urho3D/Graphics/Model.h>
 #include <Urho3D/Graphics/StaticModel.h>
 #include <Urho3D/IO/Serializer.h>
+#include <Urho3D/Math/Rect.h>
+
+#include <functional>
 
 namespace BigWorld
 {
@@ -23,6 +30,9 @@ class Chunk : public Urho3D::Object
 
 public:
 
+	// Modifies one corner, that is at the given position of Chunk
+	typedef std::function<void(Urho3D::IntVector2 const& pos, Corner& corner)> CornerBrush;
+
 	// Please note, that the content of "corners" will be cleared.
 	Chunk(ChunkWorld* world, Urho3D::IntVector2 const& pos, Corners& corners);
 	virtual ~Chunk();
@@ -32,13 +42,22 @@ public:
 
 	// Starts preparing Chunk to be rendered with specific LOD. Should be called
 	// multiple times until returns true to indicate that preparations are ready.
-	bool prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos);
+	// Background preparations are done only when there is nothing else to do.
+	bool prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos, bool background = false);
 
-	inline bool hasLod(uint8_t lod) const { return lodcache.Contains(lod); }
+	// Tells if LOD is cached and up to date.
+	inline bool hasLod(uint8_t lod) const { return rendering && rendering->lodcache_version == data_version && rendering->lodcache.Contains(lod); }
+	// Returns the cached LOD that is closest to the given one, or -1 if there are none.
+	// The returned LOD might be outdated, if the data has changed after it was built.
+	int getClosestLod(uint8_t lod) const;
 
-	// Shows/hides Chunks
-	void show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint8_t lod);
-	void hide();
+	// Shows/hides Chunks. Every viewer has its own StaticModel, that is only
+	// visible to Cameras that have "viewmask" set, but they share cached LODs.
+	void show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint8_t lod, unsigned viewmask = Urho3D::DEFAULT_VIEWMASK);
+	void hide(unsigned viewmask = Urho3D::DEFAULT_VIEWMASK);
+
+	// Changes viewmask of current and outdated undergrowth
+	void setUndergrowthViewMask(unsigned viewmask);
 
 	// Removes Chunk from World
 // TODO: This feels kind of hacky...
@@ -53,26 +72,70 @@ public:
 
 	inline unsigned getBaseHeight() const { return baseheight; }
 
-	inline uint16_t getHeight(unsigned x, unsigned y, unsigned chunk_w) const { return corners[x + y * chunk_w].height; }
+	inline uint16_t getHeight(unsigned x, unsigned y, unsigned chunk_w) const { (void)chunk_w; return snapshot->getHeight(x, y); }
 	inline int getHeight(unsigned x, unsigned y, unsigned chunk_w, Chunk const* ngb_n, Chunk const* ngb_ne, Chunk const* ngb_e) const
 	{
 		assert(x <= chunk_w);
 		assert(y <= chunk_w);
-		if (x < chunk_w && y < chunk_w) return corners[x + y * chunk_w].height;
-		if (x < chunk_w) return int(ngb_n->corners[x].height);
-		if (y < chunk_w) return int(ngb_e->corners[y * chunk_w].height);
-		return int(ngb_ne->corners[0].height);
+		if (x < chunk_w && y < chunk_w) return getHeight(x, y, chunk_w);
+		if (x < chunk_w) return ngb_n->getHeight(x, 0, chunk_w);
+		if (y < chunk_w) return ngb_e->getHeight(0, y, chunk_w);
+		return ngb_ne->getHeight(0, 0, chunk_w);
 	}
 
-	inline Corners const& getCorners() const { return corners; }
+	// Corners are not available while Chunk is hibernating
+	inline Corners const& getCorners() const { return snapshot->getCorners(); }
+
+	// Current corners. Snapshot stays unchanged when Chunk is edited, so it can
+	// be read at other threads, for example when writing Chunk to disk. Epoch
+	// of snapshot tells if corners have changed. References to snapshot must
+	// only be added and released at the main thread.
+	inline CornersSnapshot* getCornersSnapshot() const { return snapshot; }
 
 	void copyCornerRow(Corners& result, unsigned x, unsigned y, unsigned size) const;
+	void copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const;
+
+	// Hibernating Chunk keeps its corners only in a compressed form. Queries
+	// and LOD building still work, but they are slower, so this is meant for
+	// Chunks that are far away. Editing wakes Chunk up automatically. Data
+	// version and epoch do not change, so cached LODs stay valid.
+	void hibernate();
+	void wake();
+	inline bool isHibernating() const { return snapshot->isCompressed(); }
 
 	void getTriangles(UrhoExtras::Triangle& tri1, UrhoExtras::Triangle& tri2,
 	                  unsigned x, unsigned y,
 	                  Chunk const* ngb_n, Chunk const* ngb_ne, Chunk const* ngb_e) const;
 
+	// Applies "brush" to every corner in "area". Area is inclusive and in the corner
+	// coordinates of this Chunk. Wakes up Chunk, if it is hibernating. Tells if heights and/or terraintypes were changed.
+	// If brush removes all terraintypes of a corner, then the old ones are kept. Edit version is increased if something changed.
+	// Corners are edited in a new snapshot, unless nobody else is using the current one, so running tasks are not disturbed.
+	// Does not invalidate anything, this should only be called from ChunkWorld.
+	void editCorners(Urho3D::IntRect const& area, CornerBrush const& brush, bool& heights_changed, bool& ttypes_changed);
+
+	// Edit version starts from zero and is increased by every edit that changes
+	// corners. Deltas of edits can only be applied to the version they were made
+	// against. If Chunk is sent as a whole, then its edit version should be sent
+	// too, and set at the receiving end, so the following deltas can be applied.
+	inline unsigned getEditVersion() const { return edit_version; }
+	inline void setEditVersion(unsigned version) { edit_version = version; }
+
+	// Marks LODs, Material and undergrowth outdated, because data of this Chunk
+	// or its neighbors has changed. Old LODs are still shown until new ones are
+	// ready. Material is rebuilt only if terraintypes have changed. "area" tells
+	// the changed corners, in the corner coordinates of this Chunk. If only
+	// heights of a small area have changed, then the visible full detail LOD is
+	// updated in place instead of rebuilding it.
+	void invalidate(bool ttypes_changed, Urho3D::IntRect const& area);
+
+	// This is increased every time Chunk is invalidated
+	inline unsigned getDataVersion() const { return data_version; }
+
+	// Height range of corners of this Chunk. Note, that the neighbor
+	// corners at north and east edges are not included.
 	inline uint16_t getLowestHeight() const { return lowest_height; }
+	inline uint16_t getHighestHeight() const { return highest_height; }
 
 	// Try to create/destroy undergrowth. Returns true if successful.
 	// Both functions can be called even when the process is ready.
@@ -80,6 +143,19 @@ public:
 	bool createUndergrowth();
 	bool destroyUndergrowth();
 
+	// Releases cached LODs, Material, water patch and undergrowth of a hidden Chunk. They
+	// are built again if Chunk is shown. This should only be called from ChunkWorld.
+	void releaseRenderingResources();
+
+	// Bytes used by the buffers of cached LODs and water patch
+	unsigned long long getRenderingMemoryUse() const;
+	// Bytes used by corners, or by their compressed form
+	inline unsigned long long getDataMemoryUse() const { return data_memory_use; }
+
+	// Adds cached LODs and running tasks of this Chunk to "result", and
+	// its Material to "materials". This should only be called from ChunkWorld.
+	void collectStats(ChunkWorldStats& result, Urho3D::HashSet<Urho3D::Material const*>& materials) const;
+
 private:
 
 	// Undergrowth states
@@ -88,48 +164,102 @@ private:
 	static unsigned char const UGSTATE_LOADING_RESOURCES = 2;
 	static unsigned char const UGSTATE_COMBINING = 3;
 	static unsigned char const UGSTATE_READY = 4;
-	static unsigned char const UGSTATE_STOP_PLACING = 5;
 
 	typedef Urho3D::HashMap<uint8_t, Urho3D::SharedPtr<Urho3D::Model> > LodCache;
+	typedef Urho3D::HashMap<unsigned, Urho3D::SharedPtr<Urho3D::StaticModel> > ActiveModels;
 
 	ChunkWorld* world;
 	Urho3D::IntVector2 pos;
 
-	Corners corners;
+	// Compressed if Chunk is hibernating
+	Urho3D::SharedPtr<CornersSnapshot> snapshot;
 
 	unsigned baseheight;
 
 	uint16_t lowest_height;
+	uint16_t highest_height;
+
+	unsigned long long data_memory_use;
+
+	unsigned data_version;
 
-	// Cache of Models and material. These can be
-	// cleared when data in corners change.
-	LodCache lodcache;
-	Urho3D::SharedPtr<Urho3D::Material> matcache;
-
-	// Scene Node, Model and LOD, if currently visible
-	Urho3D::Node* node;
-	Urho3D::SharedPtr<Urho3D::StaticModel> active_model;
-
-	// Task for building LODs at background. "task_workitem"
-	// tells if task is executed by being NULL or not NULL.
-	Urho3D::SharedPtr<Urho3D::WorkItem> task_workitem;
-	Urho3D::SharedPtr<LodBuildingTaskData> task_data;
-	uint8_t task_lod;
-	Urho3D::SharedPtr<Urho3D::Material> task_mat;
-
-	volatile unsigned char undergrowth_state;
-	BigWorld::Corners undergrowth_corners;
-	Urho3D::SharedPtr<Urho3D::WorkItem> undergrowth_placer_wi;
-	Urho3D::SharedPtr<UrhoExtras::ModelCombiner> undergrowth_combiner;
-	UndergrowthPlacements undergrowth_places;
-	Urho3D::Node* undergrowth_node;
+	unsigned edit_version;
+
+	// Everything that is needed for rendering. This is
+	// not allocated at all if ChunkWorld is data only.
+	struct RenderingState
+	{
+		// Cache of Models and material. When data changes, these are
+		// marked outdated, but can be used until new ones are built.
+		LodCache lodcache;
+		unsigned lodcache_version;
+		Urho3D::SharedPtr<Urho3D::Material> matcache;
+		bool matcache_outdated;
+		// If Material uses splat atlas, then this is the slot of this Chunk
+		SplatSlot splat_slot;
+
+		// Scene Node, and visible Models by the viewmasks of viewers
+		Urho3D::Node* node;
+		ActiveModels active_models;
+
+		// Water patch is shared by all viewers. Version tells
+		// which water levels of ChunkWorld it was built from.
+		Urho3D::SharedPtr<Urho3D::StaticModel> water_model;
+		unsigned water_version;
+
+		// Task for building LODs at background. "task_workitem"
+		// tells if task is executed by being NULL or not NULL.
+		Urho3D::SharedPtr<Urho3D::WorkItem> task_workitem;
+		Urho3D::SharedPtr<LodBuildingTaskData> task_data;
+		uint8_t task_lod;
+		Urho3D::SharedPtr<Urho3D::Material> task_mat;
+		// Measures time from starting the task to having its results in cache
+		Urho3D::HiresTimer task_timer;
+
+		unsigned char undergrowth_state;
+		Urho3D::SharedPtr<Urho3D::WorkItem> undergrowth_placer_wi;
+		Urho3D::SharedPtr<UndergrowthPlacingTaskData> undergrowth_task_data;
+		Urho3D::SharedPtr<UrhoExtras::ModelCombiner> undergrowth_combiner;
+		// Measures time from starting undergrowth to it being ready
+		Urho3D::HiresTimer undergrowth_timer;
+		Urho3D::Node* undergrowth_node;
+		// Outdated undergrowth, that is shown until the new one is ready
+		Urho3D::Node* undergrowth_old_node;
+
+		inline RenderingState() :
+		lodcache_version(0),
+		matcache_outdated(false),
+		node(NULL),
+		water_version(0),
+		task_lod(0),
+		undergrowth_state(UGSTATE_NOT_INITIALIZED),
+		undergrowth_node(NULL),
+		undergrowth_old_node(NULL)
+		{
+		}
+	};
+	RenderingState* rendering;
+
+	// Removes or waits the LOD building task, if there is one
+	void stopTask();
+
+	// Tells if any viewer is showing "model"
+	bool isModelActive(Urho3D::Model const* model) const;
 
 	// Return true if all task results were used succesfully.
 	bool storeTaskResultsToLodCache();
 
-	void updateLowestHeight();
+	bool isWaterPatchOutdated() const;
+	// Replaces water patch with the given one, or removes it if there is no water
+	void setWaterPatch(Urho3D::PODVector<char> const& vrts_data, Urho3D::PODVector<uint32_t> const& idxs_data, float water_y);
+
+	// Updates vertices, triangles, occluder and bounding box of the full detail LOD
+	// after heights in "area" have changed. Returns false if area is too big, or if
+	// something else prevents patching. Then the LOD needs to be rebuilt.
+	bool patchFullDetailLod(Urho3D::IntRect const& area);
 
-	static void undergrowthPlacer(Urho3D::WorkItem const* wi, unsigned thread_i);
+	void updateHeightRange();
+	void updateDataMemoryUse();
 };
 
 }
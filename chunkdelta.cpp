@@ -0,0 +1,261 @@
+#include "chunkdelta.hpp"
+
+#include "chunk.hpp"
+#include "chunkworld.hpp"
+#include "compactcorners.hpp"
+
+namespace BigWorld
+{
+
+namespace
+{
+
+uint8_t const FLAG_HEIGHTS = 1;
+uint8_t const FLAG_TTYPES = 2;
+
+// Protects from allocating huge buffers because of invalid data
+unsigned const MAX_AREA_WIDTH = 4096;
+
+unsigned getTTypesHash(TTypesByWeight const& ttypes)
+{
+	unsigned hash = ttypes.size();
+	for (unsigned i = 0; i < ttypes.size(); ++ i) {
+		hash = hash * 31 + ttypes.getKey(i);
+		hash = hash * 31 + ttypes.getValueByte(i);
+	}
+	return hash;
+}
+
+// Predicts height from the corners at west, south and south west. This is
+// exact for planes, so smooth slopes made by brushes cost about one byte.
+inline int predictHeight(Corners const& corners, unsigned x, unsigned y, unsigned width)
+{
+	unsigned i = x + y * width;
+	if (x > 0 && y > 0) {
+		return int(corners[i - 1].height) + int(corners[i - width].height) - int(corners[i - 1 - width].height);
+	}
+	if (x > 0) {
+		return corners[i - 1].height;
+	}
+	if (y > 0) {
+		return corners[i - width].height;
+	}
+	return 0;
+}
+
+// Reading past the end gives undefined values, so check it first
+inline bool readVLE(unsigned& result, Urho3D::Deserializer& src)
+{
+	if (src.IsEof()) {
+		return false;
+	}
+	result = src.ReadVLE();
+	return true;
+}
+
+}
+
+bool ChunkDelta::write(Urho3D::Serializer& dest) const
+{
+	unsigned const WIDTH = area.right_ - area.left_ + 1;
+	unsigned const HEIGHT = area.bottom_ - area.top_ + 1;
+	assert(area.left_ <= area.right_ && area.top_ <= area.bottom_);
+	assert(corners.Size() == WIDTH * HEIGHT);
+
+	if (!dest.WriteVLE(zigzagEncode(chunk_pos.x_))) return false;
+	if (!dest.WriteVLE(zigzagEncode(chunk_pos.y_))) return false;
+	if (!dest.WriteVLE(base_version)) return false;
+	if (!dest.WriteVLE(version - base_version)) return false;
+	if (!dest.WriteVLE(area.left_)) return false;
+	if (!dest.WriteVLE(area.top_)) return false;
+	if (!dest.WriteVLE(WIDTH - 1)) return false;
+	if (!dest.WriteVLE(HEIGHT - 1)) return false;
+	if (!dest.WriteUByte((has_heights ? FLAG_HEIGHTS : 0) | (has_ttypes ? FLAG_TTYPES : 0))) return false;
+
+	if (has_heights) {
+		for (unsigned y = 0; y < HEIGHT; ++ y) {
+			for (unsigned x = 0; x < WIDTH; ++ x) {
+				int error = int(corners[x + y * WIDTH].height) - predictHeight(corners, x, y, WIDTH);
+				if (!dest.WriteVLE(zigzagEncode(error))) return false;
+			}
+		}
+	}
+
+	if (has_ttypes) {
+		// Palette
+		Urho3D::HashMap<unsigned, Urho3D::PODVector<unsigned> > entries_by_hash;
+		Urho3D::PODVector<unsigned> palette;
+		Urho3D::PODVector<unsigned> indices;
+		indices.Reserve(corners.Size());
+		for (unsigned i = 0; i < corners.Size(); ++ i) {
+			TTypesByWeight const& ttypes = corners[i].ttypes;
+			if (i > 0 && ttypes == corners[i - 1].ttypes) {
+				indices.Push(indices.Back());
+				continue;
+			}
+			Urho3D::PODVector<unsigned>& same_hash = entries_by_hash[getTTypesHash(ttypes)];
+			unsigned index = palette.Size();
+			for (unsigned entry_i = 0; entry_i < same_hash.Size(); ++ entry_i) {
+				if (corners[palette[same_hash[entry_i]]].ttypes == ttypes) {
+					index = same_hash[entry_i];
+					break;
+				}
+			}
+			if (index == palette.Size()) {
+				palette.Push(i);
+				same_hash.Push(index);
+			}
+			indices.Push(index);
+		}
+
+		if (!dest.WriteVLE(palette.Size())) return false;
+		for (unsigned entry_i = 0; entry_i < palette.Size(); ++ entry_i) {
+			TTypesByWeight const& ttypes = corners[palette[entry_i]].ttypes;
+			if (!dest.WriteUByte(ttypes.size())) return false;
+			for (unsigned ttype_i = 0; ttype_i < ttypes.size(); ++ ttype_i) {
+				if (!dest.WriteUByte(ttypes.getKey(ttype_i))) return false;
+				if (!dest.WriteUByte(ttypes.getValueByte(ttype_i))) return false;
+			}
+		}
+
+		// Runs of same index
+		unsigned run_begin = 0;
+		while (run_begin < indices.Size()) {
+			unsigned run_end = run_begin + 1;
+			while (run_end < indices.Size() && indices[run_end] == indices[run_begin]) {
+				++ run_end;
+			}
+			if (!dest.WriteVLE(run_end - run_begin - 1)) return false;
+			if (!dest.WriteVLE(indices[run_begin])) return false;
+			run_begin = run_end;
+		}
+	}
+
+	return true;
+}
+
+bool ChunkDelta::read(Urho3D::Deserializer& src)
+{
+	unsigned pos_x, pos_y, version_diff, left, top, width, height;
+	if (!readVLE(pos_x, src) || !readVLE(pos_y, src)) return false;
+	if (!readVLE(base_version, src) || !readVLE(version_diff, src)) return false;
+	if (!readVLE(left, src) || !readVLE(top, src)) return false;
+	if (!readVLE(width, src) || !readVLE(height, src)) return false;
+	if (src.IsEof()) return false;
+	uint8_t flags = src.ReadUByte();
+
+	++ width;
+	++ height;
+	if (width > MAX_AREA_WIDTH || height > MAX_AREA_WIDTH) {
+		return false;
+	}
+
+	chunk_pos = Urho3D::IntVector2(zigzagDecode(pos_x), zigzagDecode(pos_y));
+	version = base_version + version_diff;
+	area = Urho3D::IntRect(left, top, left + width - 1, top + height - 1);
+	has_heights = flags & FLAG_HEIGHTS;
+	has_ttypes = flags & FLAG_TTYPES;
+
+	corners.Clear();
+	corners.Resize(width * height);
+
+	if (has_heights) {
+		for (unsigned y = 0; y < height; ++ y) {
+			for (unsigned x = 0; x < width; ++ x) {
+				unsigned error;
+				if (!readVLE(error, src)) return false;
+				int corner_height = predictHeight(corners, x, y, width) + zigzagDecode(error);
+				if (corner_height < 0 || corner_height > 0xffff) {
+					return false;
+				}
+				corners[x + y * width].height = corner_height;
+			}
+		}
+	}
+
+	if (has_ttypes) {
+		unsigned palette_size;
+		if (!readVLE(palette_size, src)) return false;
+		if (palette_size == 0 || palette_size > corners.Size()) {
+			return false;
+		}
+		Urho3D::Vector<TTypesByWeight> palette(palette_size);
+		for (unsigned entry_i = 0; entry_i < palette_size; ++ entry_i) {
+			if (src.IsEof()) return false;
+			uint8_t ttypes_size = src.ReadUByte();
+			// Every corner must have at least one terraintype
+			if (ttypes_size == 0 || src.GetPosition() + ttypes_size * 2 > src.GetSize()) {
+				return false;
+			}
+			palette[entry_i].rawFill(src, ttypes_size);
+		}
+
+		unsigned corner_i = 0;
+		while (corner_i < corners.Size()) {
+			unsigned run_length, index;
+			if (!readVLE(run_length, src) || !readVLE(index, src)) return false;
+			++ run_length;
+			if (run_length > corners.Size() - corner_i || index >= palette_size) {
+				return false;
+			}
+			for (unsigned i = 0; i < run_length; ++ i) {
+				corners[corner_i ++].ttypes = palette[index];
+			}
+		}
+	}
+
+	return true;
+}
+
+void ChunkDeltaRecorder::record(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool heights_changed, bool ttypes_changed, unsigned base_version, unsigned version)
+{
+	PendingDeltas::Iterator pending_find = pending.Find(chunk_pos);
+	// If edit does not continue from the previous one, for example because
+	// Chunk was reloaded in between, then the previous edits are useless.
+	if (pending_find == pending.End() || pending_find->second_.version != base_version) {
+		PendingDelta& pd = pending[chunk_pos];
+		pd.base_version = base_version;
+		pd.version = version;
+		pd.area = area;
+		pd.heights_changed = heights_changed;
+		pd.ttypes_changed = ttypes_changed;
+		return;
+	}
+
+	PendingDelta& pd = pending_find->second_;
+	pd.version = version;
+	pd.area.left_ = Urho3D::Min(pd.area.left_, area.left_);
+	pd.area.top_ = Urho3D::Min(pd.area.top_, area.top_);
+	pd.area.right_ = Urho3D::Max(pd.area.right_, area.right_);
+	pd.area.bottom_ = Urho3D::Max(pd.area.bottom_, area.bottom_);
+	pd.heights_changed = pd.heights_changed || heights_changed;
+	pd.ttypes_changed = pd.ttypes_changed || ttypes_changed;
+}
+
+void ChunkDeltaRecorder::flush(ChunkDeltas& result, ChunkWorld* world)
+{
+	for (PendingDeltas::ConstIterator i = pending.Begin(); i != pending.End(); ++ i) {
+		PendingDelta const& pd = i->second_;
+		Chunk const* chunk = world->getChunk(i->first_);
+		if (!chunk || chunk->getEditVersion() != pd.version) {
+			continue;
+		}
+
+		result.Push(ChunkDelta());
+		ChunkDelta& delta = result.Back();
+		delta.chunk_pos = i->first_;
+		delta.base_version = pd.base_version;
+		delta.version = pd.version;
+		delta.area = pd.area;
+		delta.has_heights = pd.heights_changed;
+		delta.has_ttypes = pd.ttypes_changed;
+		unsigned const WIDTH = pd.area.right_ - pd.area.left_ + 1;
+		delta.corners.Reserve(WIDTH * (pd.area.bottom_ - pd.area.top_ + 1));
+		for (int y = pd.area.top_; y <= pd.area.bottom_; ++ y) {
+			chunk->copyCornerRow(delta.corners, pd.area.left_, y, WIDTH);
+		}
+	}
+	pending.Clear();
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef BIGWORLD_CHUNKDELTA_HPP
+#define BIGWORLD_CHUNKDELTA_HPP
+
+#include "types.hpp"
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/IO/Deserializer.h>
+#include <Urho3D/IO/Serializer.h>
+#include <Urho3D/Math/Rect.h>
+#include <Urho3D/Math/Vector2.h>
+
+namespace BigWorld
+{
+class ChunkWorld;
+
+// Changed rectangle of corners of one Chunk. Delta can only be applied to the
+// Chunk that has "base_version" as its edit version, and after that Chunk has
+// "version". If only heights or only terraintypes have changed, then the other
+// one is not stored, and its values in "corners" are left empty.
+struct ChunkDelta
+{
+	Urho3D::IntVector2 chunk_pos;
+	unsigned base_version;
+	unsigned version;
+	// Inclusive, in the corner coordinates of Chunk
+	Urho3D::IntRect area;
+	bool has_heights;
+	bool has_ttypes;
+	// Corners of area, row by row
+	Corners corners;
+
+	inline ChunkDelta() :
+	base_version(0),
+	version(0),
+	has_heights(false),
+	has_ttypes(false)
+	{
+	}
+
+	// Heights are predicted from their neighbors, and only the errors are
+	// stored as variable length integers. Terraintypes are stored to a
+	// palette and corners refer to it with run length coded indices.
+	bool write(Urho3D::Serializer& dest) const;
+	// Returns false if data is invalid or ends too early
+	bool read(Urho3D::Deserializer& src);
+};
+typedef Urho3D::Vector<ChunkDelta> ChunkDeltas;
+
+// Collects edits of Chunks, so they can be sent as deltas for example once
+// per network update. Consecutive edits of the same Chunk are coalesced to
+// one delta, that covers the union of their areas.
+class ChunkDeltaRecorder
+{
+
+public:
+
+	// Parameters are same as in ChunkWorld::ChunkEditListener
+	void record(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool heights_changed, bool ttypes_changed, unsigned base_version, unsigned version);
+
+	inline bool hasDeltas() const { return !pending.Empty(); }
+
+	// Adds deltas of the recorded edits to "result", using the current corners
+	// of Chunks, and forgets the edits. Edits of Chunks that have been removed
+	// or reloaded after the edits are skipped.
+	void flush(ChunkDeltas& result, ChunkWorld* world);
+
+	// Forgets the recorded edits, for example after sending whole Chunks
+	inline void clear() { pending.Clear(); }
+
+private:
+
+	struct PendingDelta
+	{
+		unsigned base_version;
+		unsigned version;
+		Urho3D::IntRect area;
+		bool heights_changed;
+		bool ttypes_changed;
+	};
+	typedef Urho3D::HashMap<Urho3D::IntVector2, PendingDelta> PendingDeltas;
+
+	PendingDeltas pending;
+};
+
+}
+
+#endif
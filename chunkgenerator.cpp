@@ -0,0 +1,252 @@
+#include "chunkgenerator.hpp"
+
+#include "chunkworld.hpp"
+#include "tracer.hpp"
+
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace BigWorld
+{
+
+namespace
+{
+
+uint32_t const HASH_X = 374761393u;
+uint32_t const HASH_Y = 668265263u;
+uint32_t const HASH_SEED = 2246822519u;
+uint32_t const HASH_MIX = 1274126177u;
+
+inline uint32_t getHashYTerm(int y, unsigned seed)
+{
+	return uint32_t(y) * HASH_Y + seed * HASH_SEED;
+}
+
+inline float smoothStep(float t)
+{
+	return t * t * (3 - 2 * t);
+}
+
+#ifdef __SSE2__
+// SSE2 has no 32 bit multiplication that keeps the low bits, so do it in two halves
+inline __m128i multiplyLow32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+inline __m128 latticeValue4(__m128i x, __m128i y_term)
+{
+	__m128i h = _mm_add_epi32(multiplyLow32(x, _mm_set1_epi32(HASH_X)), y_term);
+	h = multiplyLow32(_mm_xor_si128(h, _mm_srli_epi32(h, 13)), _mm_set1_epi32(HASH_MIX));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+	h = _mm_and_si128(h, _mm_set1_epi32(0xffffff));
+	return _mm_div_ps(_mm_cvtepi32_ps(h), _mm_set1_ps(float(0xffffff)));
+}
+
+inline __m128 floor4(__m128 x)
+{
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	// Truncating rounds negative values up, so fix them
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x), _mm_set1_ps(1)));
+}
+
+inline __m128 smoothStep4(__m128 t)
+{
+	return _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3), _mm_mul_ps(_mm_set1_ps(2), t)));
+}
+
+// All four values are on the same row
+__m128 valueNoise4(__m128 x, float y, unsigned seed)
+{
+	__m128 floor_x = floor4(x);
+	__m128i ix = _mm_cvttps_epi32(floor_x);
+	__m128i ix_e = _mm_add_epi32(ix, _mm_set1_epi32(1));
+	__m128 fx = smoothStep4(_mm_sub_ps(x, floor_x));
+	float floor_y = floor(y);
+	int iy = int(floor_y);
+	__m128 fy = _mm_set1_ps(smoothStep(y - floor_y));
+	__m128i y_term_s = _mm_set1_epi32(getHashYTerm(iy, seed));
+	__m128i y_term_n = _mm_set1_epi32(getHashYTerm(iy + 1, seed));
+	__m128 v_sw = latticeValue4(ix, y_term_s);
+	__m128 v_se = latticeValue4(ix_e, y_term_s);
+	__m128 v_nw = latticeValue4(ix, y_term_n);
+	__m128 v_ne = latticeValue4(ix_e, y_term_n);
+	__m128 south = _mm_add_ps(v_sw, _mm_mul_ps(_mm_sub_ps(v_se, v_sw), fx));
+	__m128 north = _mm_add_ps(v_nw, _mm_mul_ps(_mm_sub_ps(v_ne, v_nw), fx));
+	return _mm_add_ps(south, _mm_mul_ps(_mm_sub_ps(north, south), fy));
+}
+#else
+// "y_term" is the part of hash that is same for the whole row
+inline float latticeValue(int x, uint32_t y_term)
+{
+	uint32_t h = uint32_t(x) * HASH_X + y_term;
+	h = (h ^ (h >> 13)) * HASH_MIX;
+	h ^= h >> 16;
+	return float(h & 0xffffff) / float(0xffffff);
+}
+
+float valueNoise(float x, float y, unsigned seed)
+{
+	float floor_x = floor(x);
+	float floor_y = floor(y);
+	int ix = int(floor_x);
+	int iy = int(floor_y);
+	float fx = smoothStep(x - floor_x);
+	float fy = smoothStep(y - floor_y);
+	uint32_t y_term_s = getHashYTerm(iy, seed);
+	uint32_t y_term_n = getHashYTerm(iy + 1, seed);
+	float v_sw = latticeValue(ix, y_term_s);
+	float v_se = latticeValue(ix + 1, y_term_s);
+	float v_nw = latticeValue(ix, y_term_n);
+	float v_ne = latticeValue(ix + 1, y_term_n);
+	float south = v_sw + (v_se - v_sw) * fx;
+	float north = v_nw + (v_ne - v_nw) * fx;
+	return south + (north - south) * fy;
+}
+#endif
+
+// Returns 1 inside range, and fades to 0 outside it
+inline float getRangeWeight(float value, float min, float max, float fade)
+{
+	if (value >= min && value <= max) {
+		return 1;
+	}
+	if (fade <= 0) {
+		return 0;
+	}
+	float distance = value < min ? min - value : value - max;
+	return Urho3D::Max(0.0f, 1 - distance / fade);
+}
+
+}
+
+NoiseChunkGenerator::NoiseChunkGenerator(unsigned seed, float base_height, float amplitude, float wavelength, unsigned octaves) :
+seed(seed),
+base_height(base_height),
+amplitude(amplitude),
+inv_wavelength(1 / wavelength),
+octaves(Urho3D::Max(octaves, 1u))
+{
+}
+
+void NoiseChunkGenerator::addTerraintypeRule(TerraintypeRule const& rule)
+{
+	rules.Push(rule);
+}
+
+void NoiseChunkGenerator::generate(Corners& result, ChunkWorld const* world, Urho3D::IntVector2 const& chunk_pos) const
+{
+	unsigned const CHUNK_W = world->getChunkWidth();
+	// Heights have one extra corner at every side, so slopes can be calculated
+	unsigned const PADDED_W = CHUNK_W + 2;
+	unsigned const ROW_STRIDE = (PADDED_W + 3) / 4 * 4;
+	float const SLOPE_SCALE = world->getHeightstep() / (2 * world->getSquareWidth());
+	uint8_t const FALLBACK_TTYPE = rules.Empty() ? 0 : rules[0].ttype;
+
+	int const X0 = chunk_pos.x_ * int(CHUNK_W) - 1;
+	int const Y0 = chunk_pos.y_ * int(CHUNK_W) - 1;
+
+	Urho3D::PODVector<float> noise(ROW_STRIDE * PADDED_W);
+	Urho3D::PODVector<uint16_t> heights(ROW_STRIDE * PADDED_W);
+	for (unsigned y = 0; y < PADDED_W; ++ y) {
+		calculateNoiseRow(&noise[y * ROW_STRIDE], X0, Y0 + int(y), PADDED_W);
+		for (unsigned x = 0; x < PADDED_W; ++ x) {
+			float height = base_height + noise[x + y * ROW_STRIDE] * amplitude;
+			heights[x + y * ROW_STRIDE] = Urho3D::Clamp<int>(height + 0.5, 0, 0xffff);
+		}
+	}
+
+	Urho3D::PODVector<float> weights(rules.Size());
+	result.Reserve(CHUNK_W * CHUNK_W);
+	for (unsigned y = 0; y < CHUNK_W; ++ y) {
+		for (unsigned x = 0; x < CHUNK_W; ++ x) {
+			unsigned ofs = (x + 1) + (y + 1) * ROW_STRIDE;
+
+			Corner corner;
+			corner.height = heights[ofs];
+
+			float dx = (int(heights[ofs + 1]) - int(heights[ofs - 1])) * SLOPE_SCALE;
+			float dz = (int(heights[ofs + ROW_STRIDE]) - int(heights[ofs - ROW_STRIDE])) * SLOPE_SCALE;
+			float slope = atan(sqrt(dx * dx + dz * dz)) * Urho3D::M_RADTODEG;
+
+			float total_weight = 0;
+			for (unsigned rule_i = 0; rule_i < rules.Size(); ++ rule_i) {
+				TerraintypeRule const& rule = rules[rule_i];
+				float weight = rule.weight;
+				weight *= getRangeWeight(corner.height, rule.min_height, rule.max_height, rule.height_fade);
+				weight *= getRangeWeight(slope, rule.min_slope, rule.max_slope, rule.slope_fade);
+				weights[rule_i] = weight;
+				total_weight += weight;
+			}
+			if (total_weight > 0) {
+				for (unsigned rule_i = 0; rule_i < rules.Size(); ++ rule_i) {
+					if (weights[rule_i] > 0) {
+						uint8_t ttype = rules[rule_i].ttype;
+						corner.ttypes.set(ttype, corner.ttypes[ttype] + weights[rule_i] / total_weight);
+					}
+				}
+			}
+			if (corner.ttypes.empty()) {
+				corner.ttypes.set(FALLBACK_TTYPE, 1);
+			}
+
+			result.Push(corner);
+		}
+	}
+}
+
+void NoiseChunkGenerator::calculateNoiseRow(float* result, int global_x, int global_y, unsigned count) const
+{
+	float const Y = global_y * inv_wavelength;
+	float total_amplitude = 0;
+	for (unsigned octave = 0; octave < octaves; ++ octave) {
+		total_amplitude += 0.5 / (1 << octave);
+	}
+
+#ifdef __SSE2__
+	for (unsigned i = 0; i < count; i += 4) {
+		__m128i ix = _mm_add_epi32(_mm_set1_epi32(global_x + int(i)), _mm_set_epi32(3, 2, 1, 0));
+		__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(ix), _mm_set1_ps(inv_wavelength));
+		float y = Y;
+		float amplitude = 0.5;
+		__m128 sum = _mm_setzero_ps();
+		for (unsigned octave = 0; octave < octaves; ++ octave) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(valueNoise4(x, y, seed + octave), _mm_set1_ps(amplitude)));
+			x = _mm_mul_ps(x, _mm_set1_ps(2));
+			y *= 2;
+			amplitude /= 2;
+		}
+		_mm_storeu_ps(result + i, _mm_div_ps(sum, _mm_set1_ps(total_amplitude)));
+	}
+#else
+	for (unsigned i = 0; i < count; ++ i) {
+		float x = (global_x + int(i)) * inv_wavelength;
+		float y = Y;
+		float amplitude = 0.5;
+		float sum = 0;
+		for (unsigned octave = 0; octave < octaves; ++ octave) {
+			sum += valueNoise(x, y, seed + octave) * amplitude;
+			x *= 2;
+			y *= 2;
+			amplitude /= 2;
+		}
+		result[i] = sum / total_amplitude;
+	}
+#endif
+}
+
+void generateChunk(Urho3D::WorkItem const* item, unsigned threadIndex)
+{
+	(void)threadIndex;
+
+	ChunkGeneratingTaskData* data = (ChunkGeneratingTaskData*)item->aux_;
+	TraceScope trace("GenerateChunk", data->chunk_pos);
+	data->generator->generate(data->corners, data->world, data->chunk_pos);
+}
+
+}
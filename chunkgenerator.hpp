@@ -0,0 +1,94 @@
+#ifndef BIGWORLD_CHUNKGENERATOR_HPP
+#define BIGWORLD_CHUNKGENERATOR_HPP
+
+#include "types.hpp"
+
+#include <Urho3D/Core/WorkQueue.h>
+
+namespace BigWorld
+{
+
+class ChunkWorld;
+
+// Generates data of Chunks procedurally. Generating is done at worker
+// threads, so implementations of "generate" must be thread safe.
+class ChunkGenerator : public Urho3D::RefCounted
+{
+
+public:
+
+	virtual ~ChunkGenerator() {}
+
+	// Fills "result" with chunk_width x chunk_width corners of Chunk at "chunk_pos",
+	// rows from south to north, just like the constructor of Chunk expects them.
+	// Every corner must have at least one terraintype.
+	virtual void generate(Corners& result, ChunkWorld const* world, Urho3D::IntVector2 const& chunk_pos) const = 0;
+};
+
+// Heights are fractal value noise, and terraintypes are decided by rules of
+// height and slope. Noise is calculated four corners at a time with SSE2, if
+// it is available. Results depend only on the seed and the position, so
+// neighbor Chunks always match.
+class NoiseChunkGenerator : public ChunkGenerator
+{
+
+public:
+
+	struct TerraintypeRule
+	{
+		uint8_t ttype;
+		// Height is in the same units as the heights of corners
+		float min_height;
+		float max_height;
+		// Slope is in degrees
+		float min_slope;
+		float max_slope;
+		// How far outside the ranges the weight fades to zero
+		float height_fade;
+		float slope_fade;
+		float weight;
+	};
+
+	// "wavelength" is the width of the largest noise features in corners.
+	// Heights go from "base_height" to "base_height + amplitude".
+	NoiseChunkGenerator(unsigned seed, float base_height, float amplitude, float wavelength, unsigned octaves = 6);
+
+	// If no rule matches a corner, then the terraintype of the first rule is
+	// used. If there are no rules at all, then terraintype zero is used.
+	void addTerraintypeRule(TerraintypeRule const& rule);
+
+	virtual void generate(Corners& result, ChunkWorld const* world, Urho3D::IntVector2 const& chunk_pos) const;
+
+	// Calculates noise of "count" corners at the row "global_y", starting from
+	// "global_x". Results are in range [0, 1]. "result" must have room for
+	// "count" rounded up to the next multiple of four.
+	void calculateNoiseRow(float* result, int global_x, int global_y, unsigned count) const;
+
+private:
+
+	typedef Urho3D::PODVector<TerraintypeRule> TerraintypeRules;
+
+	unsigned seed;
+	float base_height;
+	float amplitude;
+	float inv_wavelength;
+	unsigned octaves;
+
+	TerraintypeRules rules;
+};
+
+struct ChunkGeneratingTaskData : public Urho3D::RefCounted
+{
+	// Input
+	Urho3D::SharedPtr<ChunkGenerator> generator;
+	ChunkWorld const* world;
+	Urho3D::IntVector2 chunk_pos;
+	// Output
+	Corners corners;
+};
+
+void generateChunk(Urho3D::WorkItem const* item, unsigned threadIndex);
+
+}
+
+#endif
@@ -1,7 +1,11 @@
 #include "chunkworld.hpp"
 
+#include "horizonculling.hpp"
+#include "tracer.hpp"
+
 #include <Urho3D/Core/CoreEvents.h>
 #include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Core/Timer.h>
 #include <Urho3D/Container/HashSet.h>
 #include <Urho3D/Graphics/Graphics.h>
 #include <Urho3D/Graphics/Octree.h>
@@ -9,6 +13,8 @@
 #include <Urho3D/Graphics/Texture2D.h>
 #include <Urho3D/Resource/ResourceCache.h>
 
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
 
 namespace BigWorld
@@ -22,7 +28,8 @@ ChunkWorld::ChunkWorld(
 	unsigned terrain_texture_repeats,
 	unsigned undergrowth_radius_chunks,
 	float undergrowth_draw_distance,
-	bool headless
+	bool headless,
+	bool data_only
 ) :
 Urho3D::Object(context),
 chunk_width(chunk_width),
@@ -31,23 +38,77 @@ heightstep(heightstep),
 terrain_texture_repeats(terrain_texture_repeats),
 undergrowth_radius_chunks(undergrowth_radius_chunks),
 undergrowth_draw_distance(undergrowth_draw_distance),
-headless(headless),
+headless(headless || data_only),
+data_only(data_only),
+splat_atlas_slots_per_side(0),
+terrain_tex_array_enabled(false),
+horizon_culling(false),
+horizon_culling_eye_margin(0),
+horizon_culling_object_height(0),
+frustum_aware_va(false),
+frustum_aware_va_margin(0),
+lod_max_error(0),
+super_chunk_distance(0),
+super_chunk_max_level(0),
+eviction(false),
+eviction_render_radius(0),
+eviction_data_radius(0),
+eviction_byte_budget(0),
+eviction_frames_left(0),
+hibernation(false),
+hibernation_radius(0),
 water_refl(false),
 water_baseheight(0),
 water_height(0),
+water_viewmask(0),
 water_node(NULL),
+water_patches(false),
+water_version(0),
+water_base_version(0),
+water_refl_tex_size(1024),
+water_refl_interval(1),
+water_refl_move_threshold(0),
+water_refl_turn_threshold(0),
+water_refl_plane_valid(false),
+water_refl_origin_height(0),
+water_refl_aspect(0),
+water_refl_frames_left(0),
+water_refl_frames_since_queued(1),
+water_refl_lod_bias(0),
+water_refl_undergrowth(true),
+lod_prepare_usec_last_frame(0),
 origin(0, 0),
 origin_height(0),
-viewarea_recalculation_required(false)
+viewarea_recalculation_required(false),
+viewarea_reculling_required(false),
+va_being_built_origin_height(0)
 {
+	if (data_only) {
+		return;
+	}
+
 	scene = new Urho3D::Scene(context);
 	scene->CreateComponent<Urho3D::Octree>();
 
-	if (!headless) {
+	if (!this->headless) {
 		SubscribeToEvent(Urho3D::E_BEGINFRAME, URHO3D_HANDLER(ChunkWorld, handleBeginFrame));
 	}
 }
 
+ChunkWorld::~ChunkWorld()
+{
+	// Generating tasks use this ChunkWorld, so make sure they are not running
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	for (GeneratingChunks::Iterator i = generating_chunks.Begin(); i != generating_chunks.End(); ++ i) {
+		Urho3D::SharedPtr<Urho3D::WorkItem> const& workitem = i->second_.workitem;
+		if (!workitem->completed_ && !workqueue->RemoveWorkItem(workitem)) {
+			while (!workitem->completed_) {
+				// Wait, wait...
+			}
+		}
+	}
+}
+
 void ChunkWorld::addTerrainTexture(Urho3D::String const& name)
 {
 	texs_names.Push(name);
@@ -64,18 +125,289 @@ void ChunkWorld::addUndergrowthModel(unsigned terraintype, Urho3D::String const&
 	ugmodels[terraintype].Push(ugmodel);
 }
 
-Camera* ChunkWorld::setUpCamera(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& pos, float yaw, float pitch, float roll, unsigned viewdistance_in_chunks)
+Camera* ChunkWorld::setUpCamera(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& pos, float yaw, float pitch, float roll, unsigned viewdistance_in_chunks, unsigned viewmask)
+{
+	if (data_only) {
+		throw std::runtime_error("Data only ChunkWorld can not have Camera!");
+	}
+	if (viewmask == 0) {
+		throw std::runtime_error("Viewmask of Camera can not be zero!");
+	}
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		if (viewers[i].viewmask & viewmask) {
+			throw std::runtime_error("Every Camera needs its own bits in viewmask!");
+		}
+	}
+
+	Viewer viewer;
+	viewer.camera = new Camera(this, chunk_pos, baseheight, pos, yaw, pitch, roll, viewdistance_in_chunks);
+	viewer.viewmask = viewmask;
+	viewer.water_refl = false;
+	viewer.va_center = chunk_pos;
+	viewer.va_being_built_center = chunk_pos;
+	viewers.Insert(getNumOfCameras(), viewer);
+
+	viewer.camera->updateNodeTransform();
+	updateCameraViewMasks();
+
+	viewarea_recalculation_required = true;
+
+	return viewer.camera;
+}
+
+void ChunkWorld::removeCamera(Camera* camera)
+{
+	for (unsigned i = 0; i < getNumOfCameras(); ++ i) {
+		Viewer& viewer = viewers[i];
+		if (viewer.camera != camera) {
+			continue;
+		}
+		if (i == 0 && water_refl) {
+			throw std::runtime_error("Camera that renders water reflection can not be removed!");
+		}
+
+		for (ViewArea::Iterator va_it = viewer.va.Begin(); va_it != viewer.va.End(); ++ va_it) {
+			Chunks::Iterator chunks_find = chunks.Find(va_it->first_);
+			if (chunks_find != chunks.End()) {
+				chunks_find->second_->hide(viewer.viewmask);
+			}
+		}
+		hideSuperChunks(viewer);
+		viewer.camera->getNode()->Remove();
+		viewers.Erase(i);
+
+		updateCameraViewMasks();
+		viewarea_recalculation_required = true;
+		return;
+	}
+	throw std::runtime_error("Camera does not belong to this ChunkWorld!");
+}
+
+void ChunkWorld::setUpSplatAtlas(unsigned slots_per_side)
+{
+	if (slots_per_side == 0) {
+		throw std::runtime_error("Splat atlas must have at least one slot!");
+	}
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Splat atlas must be set up before Chunks are added!");
+	}
+	splat_atlas_slots_per_side = slots_per_side;
+}
+
+void ChunkWorld::setUpTerrainTextureArray(unsigned splat_atlas_slots_per_side)
+{
+#ifndef URHO3D_OPENGL
+	throw std::runtime_error("Terrain texture array is only supported with OpenGL!");
+#endif
+	setUpSplatAtlas(splat_atlas_slots_per_side);
+	terrain_tex_array_enabled = true;
+}
+
+void ChunkWorld::setUpAdaptiveLods(float max_error)
+{
+	if (max_error < 0) {
+		throw std::runtime_error("Maximum error of LODs must not be negative!");
+	}
+	if (chunk_width & (chunk_width - 1)) {
+		throw std::runtime_error("Adaptive LODs require Chunk width that is a power of two!");
+	}
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Adaptive LODs must be set up before Chunks are added!");
+	}
+	lod_max_error = max_error;
+}
+
+uint8_t ChunkWorld::getTerraintypeImageMode() const
 {
-	if (camera.NotNull()) {
-		throw std::runtime_error("Camera can be set up only once!");
+	if (terrain_tex_array_enabled) {
+		return TTYPE_IMAGE_INDICES;
 	}
+	if (usesSplatAtlas()) {
+		return TTYPE_IMAGE_WEIGHTS_RGBA;
+	}
+	return TTYPE_IMAGE_WEIGHTS;
+}
+
+void ChunkWorld::setUpSuperChunks(float distance, unsigned max_level)
+{
+	if (max_level > 0 && (1u << max_level) >= chunk_width) {
+		throw std::runtime_error("Blocks of super-chunks must be narrower than Chunks!");
+	}
+	super_chunk_distance = distance;
+	super_chunk_max_level = max_level;
+	viewarea_recalculation_required = true;
+}
+
+void ChunkWorld::setUpHorizonRing(HeightPyramid* pyramid, unsigned level, float radius, float sink)
+{
+	if (headless) {
+		throw std::runtime_error("Horizon ring can not be used in headless mode!");
+	}
+	if (viewers.Empty()) {
+		throw std::runtime_error("Camera must be set up before horizon ring can be created!");
+	}
+	horizon_ring = new HorizonRing(this, pyramid, level, radius, sink);
+	updateHorizonRingCoverage();
+}
 
-	camera = new Camera(this, chunk_pos, baseheight, pos, yaw, pitch, roll, viewdistance_in_chunks);
-	camera->updateNodeTransform();
+void ChunkWorld::setHorizonCulling(bool enabled, float eye_margin, float object_height)
+{
+	if (object_height < 0) {
+		throw std::runtime_error("Height of objects must not be negative!");
+	}
+	horizon_culling = enabled;
+	horizon_culling_eye_margin = eye_margin;
+	horizon_culling_object_height = object_height;
+	viewarea_recalculation_required = true;
+}
 
+void ChunkWorld::setFrustumAwareViewarea(bool enabled, float rotation_margin)
+{
+	frustum_aware_va = enabled;
+	frustum_aware_va_margin = rotation_margin;
 	viewarea_recalculation_required = true;
+}
+
+#ifdef URHO3D_PHYSICS
+void ChunkWorld::setUpPhysics(float radius, float hysteresis, unsigned collision_layer, unsigned collision_mask)
+{
+	if (data_only) {
+		throw std::runtime_error("Data only ChunkWorld can not have physics!");
+	}
+	if (physics_world.NotNull()) {
+		throw std::runtime_error("Physics can be set up only once!");
+	}
+
+	physics_world = scene->GetOrCreateComponent<Urho3D::PhysicsWorld>();
+	physics_radius = radius;
+	physics_hysteresis = hysteresis;
+	physics_collision_layer = collision_layer;
+	physics_collision_mask = collision_mask;
+
+	// Headless worlds need frame updates too when physics is used
+	if (headless) {
+		SubscribeToEvent(Urho3D::E_BEGINFRAME, URHO3D_HANDLER(ChunkWorld, handleBeginFrame));
+	}
+}
+
+void ChunkWorld::addPhysicsFocus(Urho3D::Node* node)
+{
+	physics_focuses.Push(Urho3D::WeakPtr<Urho3D::Node>(node));
+}
+
+void ChunkWorld::removePhysicsFocus(Urho3D::Node* node)
+{
+	physics_focuses.Remove(Urho3D::WeakPtr<Urho3D::Node>(node));
+}
+#endif
+
+void ChunkWorld::setUpEviction(float render_radius, float data_radius, unsigned long long byte_budget, ChunkWriteBack const& write_back)
+{
+	eviction = true;
+	eviction_render_radius = render_radius;
+	eviction_data_radius = data_radius;
+	eviction_byte_budget = byte_budget;
+	eviction_write_back = write_back;
+}
+
+void ChunkWorld::setUpHibernation(float radius)
+{
+	hibernation = true;
+	hibernation_radius = radius;
+}
+
+void ChunkWorld::evictChunks(Urho3D::IntVector2 const& center)
+{
+	URHO3D_PROFILE(EvictChunks);
+
+	if (hibernation) {
+		updateHibernation(center);
+	}
+
+	if (!eviction) {
+		return;
+	}
+
+	// Find Chunks that can be evicted, furthest first
+	Urho3D::PODVector<EvictionCandidate> candidates;
+	unsigned long long memory_use = 0;
+	for (Chunks::ConstIterator i = chunks.Begin(); i != chunks.End(); ++ i) {
+		memory_use += i->second_->getRenderingMemoryUse() + i->second_->getDataMemoryUse();
+		if (!isChunkInUse(i->first_)) {
+			EvictionCandidate candidate;
+			candidate.pos = i->first_;
+			candidate.distance = Urho3D::Min((i->first_ - center).Length(), getDistanceToViewers(i->first_));
+			candidates.Push(candidate);
+		}
+	}
+	std::sort(candidates.Begin(), candidates.End());
+
+	// Release rendering resources
+	for (unsigned i = 0; i < candidates.Size(); ++ i) {
+		EvictionCandidate const& candidate = candidates[i];
+		bool over_budget = eviction_byte_budget > 0 && memory_use > eviction_byte_budget;
+		if (candidate.distance <= eviction_render_radius && !over_budget) {
+			break;
+		}
+		Chunk* chunk = chunks[candidate.pos];
+		unsigned long long rendering_memory_use = chunk->getRenderingMemoryUse();
+		if (rendering_memory_use > 0) {
+			chunk->releaseRenderingResources();
+			memory_use -= rendering_memory_use;
+			++ counters.chunks_render_evicted;
+		}
+	}
+
+	// Removing Chunks would restart the building of new viewarea
+	if (eviction_data_radius <= 0 || isViewareaBeingBuilt()) {
+		return;
+	}
+
+	// Remove whole Chunks. Those within view distance are kept, because
+	// their neighbors are needed when new viewarea is being calculated.
+	float keep_radius = 0;
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		keep_radius = Urho3D::Max(keep_radius, viewers[i].camera->getViewDistanceInChunks() + 1.0f);
+	}
+	for (unsigned i = 0; i < candidates.Size(); ++ i) {
+		EvictionCandidate const& candidate = candidates[i];
+		bool over_budget = eviction_byte_budget > 0 && memory_use > eviction_byte_budget;
+		if (candidate.distance <= keep_radius || (candidate.distance <= eviction_data_radius && !over_budget)) {
+			break;
+		}
+#ifdef URHO3D_PHYSICS
+		// Collision shapes are still needed
+		if (colliders.Contains(candidate.pos)) {
+			continue;
+		}
+#endif
+		Chunk* chunk = chunks[candidate.pos];
+		if (eviction_write_back) {
+			eviction_write_back(candidate.pos, chunk);
+		}
+		memory_use -= chunk->getRenderingMemoryUse() + chunk->getDataMemoryUse();
+		removeChunk(candidate.pos);
+		++ counters.chunks_data_evicted;
+	}
+}
 
-	return camera;
+void ChunkWorld::updateHibernation(Urho3D::IntVector2 const& center)
+{
+	// One Chunk of hysteresis, so Chunks at the border are not
+	// compressed and decompressed again and again.
+	for (Chunks::Iterator i = chunks.Begin(); i != chunks.End(); ++ i) {
+		Chunk* chunk = i->second_;
+		float distance = Urho3D::Min((i->first_ - center).Length(), getDistanceToViewers(i->first_));
+		if (chunk->isHibernating()) {
+			if (distance <= hibernation_radius) {
+				chunk->wake();
+				++ counters.chunks_woken;
+			}
+		} else if (distance > hibernation_radius + 1) {
+			chunk->hibernate();
+			++ counters.chunks_hibernated;
+		}
+	}
 }
 
 void ChunkWorld::setUpWaterReflection(unsigned baseheight, float height, Urho3D::Material* water_material, float water_plane_width, unsigned water_viewmask)
@@ -83,34 +415,41 @@ void ChunkWorld::setUpWaterReflection(unsigned baseheight, float height, Urho3D:
 	if (water_refl) {
 		throw std::runtime_error("Water reflection can be set up only once!");
 	}
-	if (!camera) {
+	if (viewers.Empty()) {
 		throw std::runtime_error("Camera must be set up before water reflection can be created!");
 	}
 
-	unsigned const REFL_TEX_SIZE = 1024;
-
 	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
 
 	water_refl = true;
 	water_baseheight = baseheight;
 	water_height = height;
+	this->water_viewmask = water_viewmask;
+	this->water_material = water_material;
 
-	// Water plane
+	// Water plane. With patches, the node is only used for reflection.
 	water_node = scene->CreateChild("Water");
-	water_node->SetScale(Urho3D::Vector3(water_plane_width / 2.0f, 1, water_plane_width / 2.0f));
 	water_node->SetPosition(Urho3D::Vector3(0, 0, 0));
-	Urho3D::StaticModel* water = water_node->CreateComponent<Urho3D::StaticModel>();
-	water->SetModel(resources->GetResource<Urho3D::Model>("Models/Plane.mdl"));
-	water->SetMaterial(water_material);
-	// Use viewmask to hide water from reflection camera
-	water->SetViewMask(water_viewmask);
+	if (water_plane_width > 0) {
+		water_node->SetScale(Urho3D::Vector3(water_plane_width / 2.0f, 1, water_plane_width / 2.0f));
+		Urho3D::StaticModel* water = water_node->CreateComponent<Urho3D::StaticModel>();
+		water->SetModel(resources->GetResource<Urho3D::Model>("Models/Plane.mdl"));
+		water->SetMaterial(water_material);
+		// Use viewmask to hide water from reflection camera
+		water->SetViewMask(water_viewmask);
+	} else {
+		// Chunks get their patches when they are prepared next time
+		water_patches = true;
+		water_base_version = ++ water_version;
+		viewarea_recalculation_required = true;
+	}
 // TODO: What about water plane from under the water?
 
 	// Create camera for water reflection
 	// It will have the same farclip and position as the main viewport camera, but uses a reflection plane to modify
 	// its position when rendering
-	water_refl_camera = camera->createWaterReflectionCamera();
-	water_refl_camera->SetViewMask(0xffffffff ^ water_viewmask); // Use viewmask to hide water plane
+	water_refl_camera = viewers[0].camera->createWaterReflectionCamera();
+	updateCameraViewMasks(); // Use viewmask to hide water plane
 	water_refl_camera->SetAutoAspectRatio(false);
 	water_refl_camera->SetUseReflection(true);
 	water_refl_camera->SetUseClipping(true); // Enable clipping of geometry behind water plane
@@ -118,77 +457,228 @@ void ChunkWorld::setUpWaterReflection(unsigned baseheight, float height, Urho3D:
 
 	// Create a texture and setup viewport for water reflection. Assign the
 	// reflection texture to the diffuse texture unit of the water material
-	Urho3D::SharedPtr<Urho3D::Texture2D> refl_render_tex(new Urho3D::Texture2D(context_));
-	refl_render_tex->SetSize(REFL_TEX_SIZE, REFL_TEX_SIZE, Urho3D::Graphics::GetRGBFormat(), Urho3D::TEXTURE_RENDERTARGET);
-	refl_render_tex->SetFilterMode(Urho3D::FILTER_BILINEAR);
-	Urho3D::RenderSurface* surface = refl_render_tex->GetRenderSurface();
-	Urho3D::SharedPtr<Urho3D::Viewport> refl_viewport(new Urho3D::Viewport(context_, scene, water_refl_camera));
-	surface->SetViewport(0, refl_viewport);
-	water_material->SetTexture(Urho3D::TU_DIFFUSE, refl_render_tex);
+	water_refl_tex = new Urho3D::Texture2D(context_);
+	water_refl_viewport = new Urho3D::Viewport(context_, scene, water_refl_camera);
+	updateWaterReflectionTexture();
+	water_material->SetTexture(Urho3D::TU_DIFFUSE, water_refl_tex);
 
 	updateWaterReflection();
 }
 
-float ChunkWorld::getHeightFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const
+void ChunkWorld::addWaterRegion(Urho3D::IntRect const& area, unsigned baseheight, float height)
 {
-	Chunks::ConstIterator chunk_find = chunks.Find(chunk_pos);
-	Chunks::ConstIterator chunk_e_find = chunks.Find(chunk_pos + Urho3D::IntVector2(1, 0));
-	Chunks::ConstIterator chunk_ne_find = chunks.Find(chunk_pos + Urho3D::IntVector2(1, 1));
-	Chunks::ConstIterator chunk_n_find = chunks.Find(chunk_pos + Urho3D::IntVector2(0, 1));
-	if (chunk_find == chunks.End() || chunk_e_find == chunks.End() || chunk_ne_find == chunks.End() || chunk_n_find == chunks.End()) {
-		throw std::runtime_error("Unable to get height becaue some of required four chunks is missing!");
+	if (!water_patches) {
+		throw std::runtime_error("Water regions require water patches!");
 	}
 
-	Chunk const* chunk = chunk_find->second_;
-	Chunk const* chunk_e = chunk_e_find->second_;
-	Chunk const* chunk_ne = chunk_ne_find->second_;
-	Chunk const* chunk_n = chunk_n_find->second_;
+	WaterRegion region;
+	region.area = area;
+	region.baseheight = baseheight;
+	region.height = height;
+	// Only the patches of Chunks in area become outdated
+	region.version = ++ water_version;
+	water_regions.Push(region);
 
-	// Convert to squares
-	float pos_x_moved = pos.x_ + chunk_width * sqr_width * 0.5;
-	float pos_y_moved = pos.y_ + chunk_width * sqr_width * 0.5;
-	unsigned pos_i_x = Urho3D::Clamp<int>(Urho3D::FloorToInt(pos_x_moved / sqr_width), 0, chunk_width - 1);
-	unsigned pos_i_y = Urho3D::Clamp<int>(Urho3D::FloorToInt(pos_y_moved / sqr_width), 0, chunk_width - 1);
-	float pos_f_x = Urho3D::Clamp<float>(pos_x_moved / sqr_width - pos_i_x, 0, 1);
-	float pos_f_y = Urho3D::Clamp<float>(pos_y_moved / sqr_width - pos_i_y, 0, 1);
+	viewarea_recalculation_required = true;
+}
 
-	// Find heights of corners that surround the position
-	int h_sw = chunk->getHeight(pos_i_x, pos_i_y, chunk_width);
-	int h_se, h_ne, h_nw;
-	if (pos_i_x < chunk_width - 1) {
-		h_se = chunk->getHeight(pos_i_x + 1, pos_i_y, chunk_width);
-		if (pos_i_y < chunk_width - 1) {
-			h_ne = chunk->getHeight(pos_i_x + 1, pos_i_y + 1, chunk_width);
-		} else {
-			h_ne = chunk_n->getHeight(pos_i_x + 1, 0, chunk_width);
+void ChunkWorld::setWaterReflectionQuality(unsigned texture_size, unsigned interval_frames, float move_threshold, float turn_threshold)
+{
+	if (texture_size == 0) {
+		throw std::runtime_error("Water reflection texture must have size!");
+	}
+
+	water_refl_tex_size = texture_size;
+	water_refl_interval = Urho3D::Max(interval_frames, 1u);
+	water_refl_move_threshold = move_threshold;
+	water_refl_turn_threshold = turn_threshold;
+	water_refl_frames_left = 0;
+	water_refl_frames_since_queued = water_refl_interval;
+
+	if (water_refl) {
+		updateWaterReflectionTexture();
+	}
+}
+
+void ChunkWorld::setWaterReflectionDetail(unsigned viewmask, unsigned lod_bias, bool undergrowth)
+{
+	if (!water_refl) {
+		throw std::runtime_error("Water reflection must be set up before its detail can be changed!");
+	}
+	if (viewmask & water_viewmask) {
+		throw std::runtime_error("Water reflection can not use viewmask of water plane!");
+	}
+	for (unsigned i = 0; i < getNumOfCameras(); ++ i) {
+		if (viewers[i].viewmask & viewmask) {
+			throw std::runtime_error("Water reflection needs its own bits in viewmask!");
 		}
-	} else {
-		h_se = chunk_e->getHeight(0, pos_i_y, chunk_width);
-		if (pos_i_y < chunk_width - 1) {
-			h_ne = chunk_e->getHeight(0, pos_i_y + 1, chunk_width);
-		} else {
-			h_ne = chunk_ne->getHeight(0, 0, chunk_width);
+	}
+
+	// Remove the old viewer of reflection
+	if (hasWaterReflectionViewer()) {
+		Viewer& viewer = viewers.Back();
+		for (ViewArea::Iterator va_it = viewer.va.Begin(); va_it != viewer.va.End(); ++ va_it) {
+			Chunks::Iterator chunks_find = chunks.Find(va_it->first_);
+			if (chunks_find != chunks.End()) {
+				chunks_find->second_->hide(viewer.viewmask);
+			}
 		}
+		hideSuperChunks(viewer);
+		viewers.Pop();
 	}
-	if (pos_i_y < chunk_width - 1) {
-		h_nw = chunk->getHeight(pos_i_x, pos_i_y + 1, chunk_width);
-	} else {
-		h_nw = chunk_n->getHeight(pos_i_x, 0, chunk_width);
+
+	if (viewmask) {
+		Viewer viewer;
+		viewer.camera = viewers[0].camera;
+		viewer.viewmask = viewmask;
+		viewer.water_refl = true;
+		viewer.va_center = viewers[0].va_center;
+		viewer.va_being_built_center = viewers[0].va_being_built_center;
+		viewers.Push(viewer);
+	}
+	water_refl_lod_bias = lod_bias;
+	water_refl_undergrowth = undergrowth;
+
+	updateCameraViewMasks();
+	for (Chunks::Iterator i = chunks.Begin(); i != chunks.End(); ++ i) {
+		i->second_->setUndergrowthViewMask(getUndergrowthViewMask());
+	}
+
+	viewarea_recalculation_required = true;
+}
+
+float ChunkWorld::getWaterHeight(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight) const
+{
+	unsigned level_baseheight = water_baseheight;
+	float level_height = water_height;
+	// Later regions override earlier ones
+	for (unsigned i = water_regions.Size(); i > 0; -- i) {
+		WaterRegion const& region = water_regions[i - 1];
+		if (chunk_pos.x_ >= region.area.left_ && chunk_pos.x_ <= region.area.right_ && chunk_pos.y_ >= region.area.top_ && chunk_pos.y_ <= region.area.bottom_) {
+			level_baseheight = region.baseheight;
+			level_height = region.height;
+			break;
+		}
+	}
+	return level_height + (int(level_baseheight) - int(baseheight)) * heightstep;
+}
+
+unsigned ChunkWorld::getWaterVersion(Urho3D::IntVector2 const& chunk_pos) const
+{
+	// The latest region is the one that decides the water level
+	for (unsigned i = water_regions.Size(); i > 0; -- i) {
+		WaterRegion const& region = water_regions[i - 1];
+		if (chunk_pos.x_ >= region.area.left_ && chunk_pos.x_ <= region.area.right_ && chunk_pos.y_ >= region.area.top_ && chunk_pos.y_ <= region.area.bottom_) {
+			return Urho3D::Max(region.version, water_base_version);
+		}
 	}
+	return water_base_version;
+}
+
+float ChunkWorld::getHeightFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const
+{
+	float h_sw, h_nw, h_ne, h_se;
+	Urho3D::Vector2 sqr_pos;
+	getSquareHeightsFloat(h_sw, h_nw, h_ne, h_se, sqr_pos, chunk_pos, pos, baseheight);
+	return getHeightFromCorners(h_sw, h_nw, h_ne, h_se, sqr_pos);
+}
+
+Urho3D::Vector3 ChunkWorld::getNormalFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos) const
+{
+	float h_sw, h_nw, h_ne, h_se;
+	Urho3D::Vector2 sqr_pos;
+	getSquareHeightsFloat(h_sw, h_nw, h_ne, h_se, sqr_pos, chunk_pos, pos, 0);
+	return getNormalFromCorners(h_sw, h_nw, h_ne, h_se, sqr_pos);
+}
+
+bool ChunkWorld::raycast(Urho3D::Vector3& result, Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& begin, Urho3D::Vector3 const& dir, float max_distance) const
+{
+	float const CHUNK_W_F_HALF = getChunkWidthFloat() / 2;
+
+	Urho3D::Vector3 dir_n = dir.Normalized();
+
+	// Position and direction in squares, relative to the
+	// southwestern corner of the Chunk at "chunk_pos".
+	Urho3D::Vector2 sqr_begin((begin.x_ + CHUNK_W_F_HALF) / sqr_width, (begin.z_ + CHUNK_W_F_HALF) / sqr_width);
+	Urho3D::Vector2 sqr_dir(dir_n.x_ / sqr_width, dir_n.z_ / sqr_width);
+
+	// Walk squares through, in the order the ray goes through them
+	Urho3D::IntVector2 sqr(Urho3D::FloorToInt(sqr_begin.x_), Urho3D::FloorToInt(sqr_begin.y_));
+	int step_x = sqr_dir.x_ > 0 ? 1 : -1;
+	int step_y = sqr_dir.y_ > 0 ? 1 : -1;
+	float t_delta_x = sqr_dir.x_ != 0 ? Urho3D::Abs(1 / sqr_dir.x_) : Urho3D::M_INFINITY;
+	float t_delta_y = sqr_dir.y_ != 0 ? Urho3D::Abs(1 / sqr_dir.y_) : Urho3D::M_INFINITY;
+	float t_next_x = sqr_dir.x_ != 0 ? ((step_x > 0 ? sqr.x_ + 1 : sqr.x_) - sqr_begin.x_) / sqr_dir.x_ : Urho3D::M_INFINITY;
+	float t_next_y = sqr_dir.y_ != 0 ? ((step_y > 0 ? sqr.y_ + 1 : sqr.y_) - sqr_begin.y_) / sqr_dir.y_ : Urho3D::M_INFINITY;
+	float t = 0;
+	while (t <= max_distance) {
+		float t_end = Urho3D::Min(Urho3D::Min(t_next_x, t_next_y), max_distance);
+
+		// Get heights of square corners
+		uint16_t c_sw, c_nw, c_ne, c_se;
+		if (!getCornerHeight(c_sw, chunk_pos, sqr.x_, sqr.y_) ||
+		    !getCornerHeight(c_nw, chunk_pos, sqr.x_, sqr.y_ + 1) ||
+		    !getCornerHeight(c_ne, chunk_pos, sqr.x_ + 1, sqr.y_ + 1) ||
+		    !getCornerHeight(c_se, chunk_pos, sqr.x_ + 1, sqr.y_)) {
+			return false;
+		}
+		float h_sw = (int(c_sw) - int(baseheight)) * heightstep;
+		float h_nw = (int(c_nw) - int(baseheight)) * heightstep;
+		float h_ne = (int(c_ne) - int(baseheight)) * heightstep;
+		float h_se = (int(c_se) - int(baseheight)) * heightstep;
+
+		// Ray goes through at most two triangles of the square. Split
+		// the part of the ray at the diagonal, if it crosses it.
+		bool sw_ne_diagonal = fabs(h_sw - h_ne) < fabs(h_se - h_nw);
+		Urho3D::Vector2 sqr_ofs(sqr.x_, sqr.y_);
+		float ts[3] = { t, t_end, t_end };
+		unsigned ts_size = 2;
+		Urho3D::Vector2 sqr_pos_begin = sqr_begin + sqr_dir * t - sqr_ofs;
+		Urho3D::Vector2 sqr_pos_end = sqr_begin + sqr_dir * t_end - sqr_ofs;
+		float diag_begin = sw_ne_diagonal ? sqr_pos_begin.x_ - sqr_pos_begin.y_ : sqr_pos_begin.x_ + sqr_pos_begin.y_ - 1;
+		float diag_end = sw_ne_diagonal ? sqr_pos_end.x_ - sqr_pos_end.y_ : sqr_pos_end.x_ + sqr_pos_end.y_ - 1;
+		if ((diag_begin < 0) != (diag_end < 0)) {
+			ts[1] = Urho3D::Lerp(t, t_end, diag_begin / (diag_begin - diag_end));
+			ts_size = 3;
+		}
 
-	// Apply baseheight
-	h_sw -= baseheight;
-	h_se -= baseheight;
-	h_ne -= baseheight;
-	h_nw -= baseheight;
+		// Height difference between ray and ground changes linearly
+		// inside the parts, so it is enough to check their ends.
+		for (unsigned i = 0; i < ts_size - 1; ++ i) {
+			float diff[2];
+			for (unsigned end = 0; end < 2; ++ end) {
+				// Move the ends a little bit towards each others, so
+				// both of them will be inside of the same triangle.
+				float t_check = Urho3D::Lerp(ts[i + end], ts[i + 1 - end], 0.001f);
+				Urho3D::Vector2 sqr_pos = sqr_begin + sqr_dir * t_check - sqr_ofs;
+				diff[end] = begin.y_ + dir_n.y_ * t_check - getHeightFromCorners(h_sw, h_nw, h_ne, h_se, sqr_pos);
+			}
+			if (diff[0] <= 0) {
+				result = begin + dir_n * ts[i];
+				return true;
+			}
+			if (diff[1] <= 0) {
+				float t_hit = Urho3D::Lerp(ts[i], ts[i + 1], diff[0] / (diff[0] - diff[1]));
+				result = begin + dir_n * t_hit;
+				return true;
+			}
+		}
 
-	// Convert to floats
-	float h_sw_f = h_sw * heightstep;
-	float h_se_f = h_se * heightstep;
-	float h_ne_f = h_ne * heightstep;
-	float h_nw_f = h_nw * heightstep;
+		// Move to next square
+		t = t_end;
+		if (t >= max_distance) {
+			break;
+		}
+		if (t_next_x < t_next_y) {
+			sqr.x_ += step_x;
+			t_next_x += t_delta_x;
+		} else {
+			sqr.y_ += step_y;
+			t_next_y += t_delta_y;
+		}
+	}
 
-	return getHeightFromCorners(h_sw_f, h_se_f, h_ne_f, h_nw_f, Urho3D::Vector2(pos_f_x, pos_f_y));
+	return false;
 }
 
 float ChunkWorld::getHeightFromCorners(float h_sw, float h_nw, float h_ne, float h_se, Urho3D::Vector2 const& sqr_pos) const
@@ -256,6 +746,206 @@ Urho3D::Vector3 ChunkWorld::getNormalFromCorners(float h_sw, float h_nw, float h
 }
 
 
+void ChunkWorld::editTerrain(Urho3D::IntVector2 const& chunk_pos, Urho3D::Rect const& area, TerrainBrush const& brush)
+{
+	URHO3D_PROFILE(EditTerrain);
+
+	int const CHUNK_W = chunk_width;
+	float const CHUNK_W_F_HALF = getChunkWidthFloat() / 2;
+
+	// Convert area to corners, relative to the first corner of Chunk at "chunk_pos"
+	Urho3D::IntRect corners_area(
+		Urho3D::CeilToInt((area.min_.x_ + CHUNK_W_F_HALF) / sqr_width),
+		Urho3D::CeilToInt((area.min_.y_ + CHUNK_W_F_HALF) / sqr_width),
+		Urho3D::FloorToInt((area.max_.x_ + CHUNK_W_F_HALF) / sqr_width),
+		Urho3D::FloorToInt((area.max_.y_ + CHUNK_W_F_HALF) / sqr_width)
+	);
+	if (corners_area.left_ > corners_area.right_ || corners_area.top_ > corners_area.bottom_) {
+		return;
+	}
+
+	// Range of Chunks that contain the corners
+	Urho3D::IntVector2 chunks_min(floorDiv(corners_area.left_, CHUNK_W), floorDiv(corners_area.top_, CHUNK_W));
+	Urho3D::IntVector2 chunks_max(floorDiv(corners_area.right_, CHUNK_W), floorDiv(corners_area.bottom_, CHUNK_W));
+
+	// Chunks that need to be invalidated
+	ChunkInvalidations invalidated;
+
+	Urho3D::IntVector2 it;
+	for (it.y_ = chunks_min.y_; it.y_ <= chunks_max.y_; ++ it.y_) {
+		for (it.x_ = chunks_min.x_; it.x_ <= chunks_max.x_; ++ it.x_) {
+			Chunk* chunk = getChunk(chunk_pos + it);
+			if (!chunk) {
+				continue;
+			}
+
+			// Part of the area that is inside this Chunk
+			Urho3D::IntVector2 const CORNERS_OFS = it * CHUNK_W;
+			Urho3D::IntRect chunk_area(
+				Urho3D::Max(corners_area.left_ - CORNERS_OFS.x_, 0),
+				Urho3D::Max(corners_area.top_ - CORNERS_OFS.y_, 0),
+				Urho3D::Min(corners_area.right_ - CORNERS_OFS.x_, CHUNK_W - 1),
+				Urho3D::Min(corners_area.bottom_ - CORNERS_OFS.y_, CHUNK_W - 1)
+			);
+
+			unsigned const BASE_VERSION = chunk->getEditVersion();
+			bool heights_changed;
+			bool ttypes_changed;
+			chunk->editCorners(chunk_area, [&](Urho3D::IntVector2 const& pos, Corner& corner) {
+				Urho3D::IntVector2 corner_pos = CORNERS_OFS + pos;
+				brush(Urho3D::Vector2(corner_pos.x_ * sqr_width - CHUNK_W_F_HALF, corner_pos.y_ * sqr_width - CHUNK_W_F_HALF), corner);
+			}, heights_changed, ttypes_changed);
+			if (!heights_changed && !ttypes_changed) {
+				continue;
+			}
+
+			addInvalidation(invalidated, chunk_pos + it, chunk_area, ttypes_changed);
+
+			if (edit_listener) {
+				edit_listener(chunk_pos + it, chunk_area, heights_changed, ttypes_changed, BASE_VERSION, chunk->getEditVersion());
+			}
+		}
+	}
+
+	applyInvalidations(invalidated);
+}
+
+void ChunkWorld::setChunkEditListener(ChunkEditListener const& listener)
+{
+	edit_listener = listener;
+}
+
+bool ChunkWorld::applyChunkDelta(ChunkDelta const& delta)
+{
+	URHO3D_PROFILE(ApplyChunkDelta);
+
+	int const CHUNK_W = chunk_width;
+
+	Chunk* chunk = getChunk(delta.chunk_pos);
+	if (!chunk || chunk->getEditVersion() != delta.base_version) {
+		return false;
+	}
+	if (delta.area.left_ < 0 || delta.area.top_ < 0 || delta.area.right_ >= CHUNK_W || delta.area.bottom_ >= CHUNK_W) {
+		return false;
+	}
+	if (delta.area.left_ > delta.area.right_ || delta.area.top_ > delta.area.bottom_) {
+		return false;
+	}
+	int const AREA_W = delta.area.right_ - delta.area.left_ + 1;
+	int const AREA_H = delta.area.bottom_ - delta.area.top_ + 1;
+	if (delta.corners.Size() != unsigned(AREA_W * AREA_H)) {
+		return false;
+	}
+
+	bool heights_changed;
+	bool ttypes_changed;
+	chunk->editCorners(delta.area, [&](Urho3D::IntVector2 const& pos, Corner& corner) {
+		Corner const& src = delta.corners[(pos.x_ - delta.area.left_) + (pos.y_ - delta.area.top_) * AREA_W];
+		if (delta.has_heights) {
+			corner.height = src.height;
+		}
+		if (delta.has_ttypes) {
+			corner.ttypes = src.ttypes;
+		}
+	}, heights_changed, ttypes_changed);
+	chunk->setEditVersion(delta.version);
+
+	if (!heights_changed && !ttypes_changed) {
+		return true;
+	}
+
+	ChunkInvalidations invalidated;
+	addInvalidation(invalidated, delta.chunk_pos, delta.area, ttypes_changed);
+	applyInvalidations(invalidated);
+
+	if (edit_listener) {
+		edit_listener(delta.chunk_pos, delta.area, heights_changed, ttypes_changed, delta.base_version, delta.version);
+	}
+
+	return true;
+}
+
+void ChunkWorld::getStats(ChunkWorldStats& result) const
+{
+	result = ChunkWorldStats();
+	result.chunks_loaded = chunks.Size();
+	IntVector2Set visible;
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		for (ViewArea::ConstIterator va_it = viewers[i].va.Begin(); va_it != viewers[i].va.End(); ++ va_it) {
+			visible.Insert(va_it->first_);
+		}
+	}
+	result.chunks_visible = visible.Size();
+	Urho3D::HashSet<Urho3D::Material const*> materials;
+	for (Chunks::ConstIterator i = chunks.Begin(); i != chunks.End(); ++ i) {
+		if (i->second_->isHibernating()) {
+			++ result.chunks_hibernating;
+		}
+		i->second_->collectStats(result, materials);
+	}
+	for (SingleLayerMaterialsCache::ConstIterator i = mats_cache.Begin(); i != mats_cache.End(); ++ i) {
+		materials.Insert(i->second_.Get());
+	}
+	result.materials_cached = materials.Size();
+	result.lod_prepare_usec_last_frame = lod_prepare_usec_last_frame;
+	result.counters = counters;
+}
+
+void ChunkWorld::setChunkGenerator(ChunkGenerator* generator)
+{
+	this->generator = generator;
+}
+
+unsigned ChunkWorld::generateChunks(Urho3D::IntVector2 const& center, unsigned radius, unsigned max_tasks)
+{
+	URHO3D_PROFILE(GenerateChunks);
+
+	if (generator.Null()) {
+		throw std::runtime_error("There is no Chunk generator!");
+	}
+
+	// Add Chunks that are ready
+	for (GeneratingChunks::Iterator i = generating_chunks.Begin(); i != generating_chunks.End(); ) {
+		if (!i->second_.workitem->completed_) {
+			++ i;
+			continue;
+		}
+		Urho3D::IntVector2 const& pos = i->first_;
+		Urho3D::IntVector2 diff = pos - center;
+		if (!chunks.Contains(pos) && unsigned(Urho3D::Max(Urho3D::Abs(diff.x_), Urho3D::Abs(diff.y_))) <= radius) {
+			addChunk(pos, new Chunk(this, pos, i->second_.data->corners));
+		}
+		i = generating_chunks.Erase(i);
+	}
+
+	// Start generating missing Chunks, from inner rings to outer ones
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	for (int ring = 0; ring <= int(radius) && generating_chunks.Size() < max_tasks; ++ ring) {
+		Urho3D::IntVector2 it;
+		for (it.y_ = -ring; it.y_ <= ring && generating_chunks.Size() < max_tasks; ++ it.y_) {
+			// Only the edges of the ring
+			int step = (it.y_ == -ring || it.y_ == ring) ? 1 : Urho3D::Max(ring * 2, 1);
+			for (it.x_ = -ring; it.x_ <= ring && generating_chunks.Size() < max_tasks; it.x_ += step) {
+				Urho3D::IntVector2 pos = center + it;
+				if (chunks.Contains(pos) || generating_chunks.Contains(pos)) {
+					continue;
+				}
+				GeneratingChunk& generating = generating_chunks[pos];
+				generating.data = new ChunkGeneratingTaskData;
+				generating.data->generator = generator;
+				generating.data->world = this;
+				generating.data->chunk_pos = pos;
+				generating.workitem = new Urho3D::WorkItem();
+				generating.workitem->workFunction_ = generateChunk;
+				generating.workitem->aux_ = generating.data;
+				workqueue->AddWorkItem(generating.workitem);
+			}
+		}
+	}
+
+	return generating_chunks.Size();
+}
+
 void ChunkWorld::addChunk(Urho3D::IntVector2 const& chunk_pos, Chunk* chunk)
 {
 	assert(chunk);
@@ -264,6 +954,7 @@ void ChunkWorld::addChunk(Urho3D::IntVector2 const& chunk_pos, Chunk* chunk)
 	}
 
 	chunks[chunk_pos] = chunk;
+	invalidateSuperChunks(chunk_pos);
 
 	viewarea_recalculation_required = true;
 }
@@ -278,11 +969,23 @@ void ChunkWorld::removeChunk(Urho3D::IntVector2 const& chunk_pos)
 	}
 	chunks_find->second_->removeFromWorld();
 	chunks.Erase(chunks_find);
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		viewers[i].va_lazy.Erase(chunk_pos);
+	}
+	invalidateSuperChunks(chunk_pos);
+#ifdef URHO3D_PHYSICS
+	colliders.Erase(chunk_pos);
+	outdated_colliders.Erase(chunk_pos);
+#endif
 
 	viewarea_recalculation_required = true;
 
 	// It might not be possible toi build the viewarea anymore, as one chunk might be missing.
-	va_being_built.Clear();
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		viewers[i].va_being_built.Clear();
+		viewers[i].va_being_built_lazy.Clear();
+		viewers[i].sca_being_built.Clear();
+	}
 }
 
 Chunk* ChunkWorld::getChunk(Urho3D::IntVector2 const& chunk_pos)
@@ -298,74 +1001,85 @@ void ChunkWorld::extractCornersData(Corners& result, Urho3D::IntVector2 const& p
 {
 	assert(result.Empty());
 
-	// Get required chunks
-	Chunks::ConstIterator chk_find = chunks.Find(pos);
-	if (chk_find == chunks.End()) return;
-	Chunks::ConstIterator chk_s_find = chunks.Find(pos + Urho3D::IntVector2(0, -1));
-	if (chk_s_find == chunks.End()) return;
-	Chunks::ConstIterator chk_se_find = chunks.Find(pos + Urho3D::IntVector2(1, -1));
-	if (chk_se_find == chunks.End()) return;
-	Chunks::ConstIterator chk_e_find = chunks.Find(pos + Urho3D::IntVector2(1, 0));
-	if (chk_e_find == chunks.End()) return;
-	Chunks::ConstIterator chk_ne_find = chunks.Find(pos + Urho3D::IntVector2(1, 1));
-	if (chk_ne_find == chunks.End()) return;
-	Chunks::ConstIterator chk_n_find = chunks.Find(pos + Urho3D::IntVector2(0, 1));
-	if (chk_n_find == chunks.End()) return;
-	Chunks::ConstIterator chk_nw_find = chunks.Find(pos + Urho3D::IntVector2(-1, 1));
-	if (chk_nw_find == chunks.End()) return;
-	Chunks::ConstIterator chk_w_find = chunks.Find(pos + Urho3D::IntVector2(-1, 0));
-	if (chk_w_find == chunks.End()) return;
-	Chunk const* chk = chk_find->second_;
-	Chunk const* chk_s = chk_s_find->second_;
-	Chunk const* chk_se = chk_se_find->second_;
-	Chunk const* chk_e = chk_e_find->second_;
-	Chunk const* chk_ne = chk_ne_find->second_;
-	Chunk const* chk_n = chk_n_find->second_;
-	Chunk const* chk_nw = chk_nw_find->second_;
-	Chunk const* chk_w = chk_w_find->second_;
-
-	// One extra for position data, and two more
-	// to calculate neighbor positions for normal.
-	unsigned result_w = chunk_width + 3;
-
-	// Prepare result
-	result.Reserve(result_w * result_w);
-
-	// South edge
-	// Southwest corner, never used
-	result.Push(Corner());
-	// South edge
-	chk_s->copyCornerRow(result, 0, chunk_width - 1, chunk_width);
-	// Southweast corner
-	chk_se->copyCornerRow(result, 0, chunk_width - 1, 2);
-
-	// Middle row
-	for (unsigned y = 0; y < chunk_width; ++ y) {
-		// West part
-		chk_w->copyCornerRow(result, chunk_width - 1, y, 1);
-		// Middle part
-		chk->copyCornerRow(result, 0, y, chunk_width);
-		// East part
-		chk_e->copyCornerRow(result, 0, y, 2);
-	}
-
-	// Two northern rows
-	for (unsigned y = 0; y < 2; ++ y) {
-		// Northwest corner
-		chk_nw->copyCornerRow(result, chunk_width - 1, y, 1);
-		// North edge
-		chk_n->copyCornerRow(result, 0, y, chunk_width);
-		// Northeast corner
-		chk_ne->copyCornerRow(result, 0, y, 2);
-	}
-
-	assert(result.Size() == result_w * result_w);
+	CornersSnapshots snapshots;
+	if (!getCornersSnapshots(snapshots, pos)) {
+		return;
+	}
+	BigWorld::extractCornersData(result, snapshots, chunk_width);
 }
 
-Urho3D::Material* ChunkWorld::getSingleLayerTerrainMaterial(uint8_t ttype)
+bool ChunkWorld::getCornersSnapshots(CornersSnapshots& result, Urho3D::IntVector2 const& pos) const
 {
-	if (mats_cache.Contains(ttype)) {
-		return mats_cache[ttype];
+	// In the order of NGB_* indices
+	Urho3D::IntVector2 const OFFSETS[NGB_COUNT] = {
+		Urho3D::IntVector2(0, 0),
+		Urho3D::IntVector2(0, -1),
+		Urho3D::IntVector2(1, -1),
+		Urho3D::IntVector2(1, 0),
+		Urho3D::IntVector2(1, 1),
+		Urho3D::IntVector2(0, 1),
+		Urho3D::IntVector2(-1, 1),
+		Urho3D::IntVector2(-1, 0)
+	};
+
+	result.Clear();
+	result.Reserve(NGB_COUNT);
+	for (unsigned i = 0; i < NGB_COUNT; ++ i) {
+		Chunks::ConstIterator chunks_find = chunks.Find(pos + OFFSETS[i]);
+		if (chunks_find == chunks.End()) {
+			result.Clear();
+			return false;
+		}
+		result.Push(Urho3D::SharedPtr<CornersSnapshot>(chunks_find->second_->getCornersSnapshot()));
+	}
+	return true;
+}
+
+void ChunkWorld::extractHeightsData(Urho3D::PODVector<uint16_t>& result, Urho3D::IntVector2 const& pos, Urho3D::IntRect const& area) const
+{
+	assert(result.Empty());
+
+	int const CHUNK_W = chunk_width;
+	unsigned const AREA_W = area.right_ - area.left_ + 1;
+	unsigned const AREA_H = area.bottom_ - area.top_ + 1;
+
+	// Get required Chunks, so result is not touched if some are missing
+	Urho3D::IntVector2 chunks_min(floorDiv(area.left_, CHUNK_W), floorDiv(area.top_, CHUNK_W));
+	Urho3D::IntVector2 chunks_max(floorDiv(area.right_, CHUNK_W), floorDiv(area.bottom_, CHUNK_W));
+	Urho3D::PODVector<Chunk const*> area_chunks;
+	Urho3D::IntVector2 it;
+	for (it.y_ = chunks_min.y_; it.y_ <= chunks_max.y_; ++ it.y_) {
+		for (it.x_ = chunks_min.x_; it.x_ <= chunks_max.x_; ++ it.x_) {
+			Chunks::ConstIterator chunk_find = chunks.Find(pos + it);
+			if (chunk_find == chunks.End()) return;
+			area_chunks.Push(chunk_find->second_);
+		}
+	}
+
+	// Copy heights Chunk by Chunk
+	result.Resize(AREA_W * AREA_H);
+	unsigned chunk_i = 0;
+	for (it.y_ = chunks_min.y_; it.y_ <= chunks_max.y_; ++ it.y_) {
+		for (it.x_ = chunks_min.x_; it.x_ <= chunks_max.x_; ++ it.x_) {
+			Chunk const* chunk = area_chunks[chunk_i ++];
+			int const X_OFS = it.x_ * CHUNK_W;
+			int const Y_OFS = it.y_ * CHUNK_W;
+			int x_begin = Urho3D::Max(area.left_ - X_OFS, 0);
+			int x_end = Urho3D::Min(area.right_ - X_OFS, CHUNK_W - 1);
+			int y_begin = Urho3D::Max(area.top_ - Y_OFS, 0);
+			int y_end = Urho3D::Min(area.bottom_ - Y_OFS, CHUNK_W - 1);
+			for (int y = y_begin; y <= y_end; ++ y) {
+				unsigned result_ofs = (X_OFS + x_begin - area.left_) + (Y_OFS + y - area.top_) * AREA_W;
+				chunk->copyHeightRow(&result[result_ofs], x_begin, y, x_end - x_begin + 1);
+			}
+		}
+	}
+}
+
+Urho3D::Material* ChunkWorld::getSingleLayerTerrainMaterial(uint8_t ttype)
+{
+	if (mats_cache.Contains(ttype)) {
+		return mats_cache[ttype];
 	}
 
 	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
@@ -390,79 +1104,283 @@ Urho3D::Material* ChunkWorld::getSingleLayerTerrainMaterial(uint8_t ttype)
 	return mat;
 }
 
-void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData)
+Urho3D::SharedPtr<Urho3D::Material> ChunkWorld::createTerrainBlendMaterial(TTypes const& ttypes, Urho3D::Texture2D* blend_tex, float detail_tiling, unsigned weight_map_width)
 {
-	URHO3D_PROFILE(ManageChunkWorldBuilding);
+	assert(ttypes.Size() >= 2 && ttypes.Size() <= 4);
+
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+
+	// First make sure all textures are loaded
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Texture2D> > texs;
+	for (unsigned i = 0; i < ttypes.Size(); ++ i) {
+		Urho3D::String const& tex_name = texs_names[ttypes[i]];
+		Urho3D::SharedPtr<Urho3D::Texture2D> tex(resources->GetExistingResource<Urho3D::Texture2D>(tex_name));
+		if (tex.Null()) {
+			// Texture was not loaded, so start loading it.
+			resources->BackgroundLoadResource<Urho3D::Texture2D>(tex_name);
+		} else {
+			texs.Push(tex);
+		}
+	}
+	// If some textures are missing, then give up for now
+	if (texs.Size() != ttypes.Size()) {
+		return Urho3D::SharedPtr<Urho3D::Material>();
+	}
+
+	// All textures are ready. Construct new material.
+	Urho3D::SharedPtr<Urho3D::Material> mat(new Urho3D::Material(context_));
+	if (texs.Size() == 4) {
+		Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend4.xml");
+		mat->SetTechnique(0, tech);
+	} else {
+		Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend3.xml");
+		mat->SetTechnique(0, tech);
+	}
+	mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * detail_tiling));
+	mat->SetShaderParameter("WeightMapWidth", Urho3D::Variant(weight_map_width));
+	mat->SetTexture(Urho3D::TU_DIFFUSE, blend_tex);
+	for (unsigned layer = 0; layer < texs.Size(); ++ layer) {
+		mat->SetTexture((Urho3D::TextureUnit)(layer + 1), texs[layer]);
+	}
+
+	return mat;
+}
+
+bool ChunkWorld::reserveSplatSlot(SplatSlot& result, TTypes const& ttypes)
+{
+	assert(usesSplatAtlas());
+
+	// Terraintypes are in ascending order, so pack them to a key. Missing
+	// terraintypes become zero, which is not ambiguous, because only the
+	// first terraintype can be zero. This also means that the key of texture
+	// array can never collide with any real combination of terraintypes.
+	unsigned const TEXTURE_ARRAY_KEY = 0xffffffff;
+	unsigned key = 0;
+	if (terrain_tex_array_enabled) {
+		key = TEXTURE_ARRAY_KEY;
+	} else {
+		assert(ttypes.Size() >= 2 && ttypes.Size() <= 4);
+		for (unsigned i = 0; i < ttypes.Size(); ++ i) {
+			assert(i == 0 || ttypes[i] > ttypes[i - 1]);
+			key |= unsigned(ttypes[i]) << (i * 8);
+		}
+	}
+
+	// Try to find an atlas that has free slots. If
+	// there is none, then create new empty atlas.
+	SplatAtlases& atlases = splat_atlases[key];
+	SplatAtlas* atlas = NULL;
+	for (unsigned i = 0; i < atlases.Size(); ++ i) {
+		if (!atlases[i]->isFull()) {
+			atlas = atlases[i];
+			break;
+		}
+	}
+	if (!atlas) {
+		atlas = new SplatAtlas(context_, chunk_width, terrain_texture_repeats, splat_atlas_slots_per_side);
+		// Shader of texture array does the filtering by itself
+		if (terrain_tex_array_enabled) {
+			atlas->getTexture()->SetFilterMode(Urho3D::FILTER_NEAREST);
+		}
+		atlases.Push(Urho3D::SharedPtr<SplatAtlas>(atlas));
+	}
 
+	// New atlases are still missing their Material
+	if (!atlas->getMaterial()) {
+		Urho3D::SharedPtr<Urho3D::Material> mat;
+		if (terrain_tex_array_enabled) {
+			Urho3D::Texture2DArray* tex_array = getTerrainTextureArray();
+			if (!tex_array) {
+				return false;
+			}
+			Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+			mat = new Urho3D::Material(context_);
+			mat->SetTechnique(0, resources->GetResource<Urho3D::Technique>("Techniques/BigWorldTerrainArray.xml"));
+			mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * atlas->getDetailTiling()));
+			mat->SetShaderParameter("SplatAtlasWidth", Urho3D::Variant(float(atlas->getWidth())));
+			mat->SetTexture(Urho3D::TU_DIFFUSE, atlas->getTexture());
+			mat->SetTexture(Urho3D::TU_NORMAL, tex_array);
+		} else {
+			mat = createTerrainBlendMaterial(ttypes, atlas->getTexture(), atlas->getDetailTiling(), atlas->getWidth());
+			if (mat.Null()) {
+				return false;
+			}
+		}
+		atlas->setMaterial(mat);
+	}
+
+	result.atlas = atlas;
+	result.index = atlas->reserveSlot();
+	return true;
+}
+
+void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData)
+{
 	(void)eventType;
 	(void)eventData;
 
-	// If there is new viewarea being applied, then check if everything is ready
-	if (!va_being_built.Empty()) {
+	Urho3D::HiresTimer timer;
+
+	updateFrame();
+
+	++ counters.frames;
+	counters.frame_update_usec += timer.GetUSec(false);
+	if (isViewareaBeingBuilt()) {
+		++ counters.frames_waiting_viewarea;
+		if (va_being_built_origin != origin) {
+			++ counters.frames_waiting_origin_shift;
+		}
+	}
+}
+
+void ChunkWorld::updateFrame()
+{
+	URHO3D_PROFILE(ManageChunkWorldBuilding);
+	TraceScope trace("UpdateChunkWorld");
+
+	lod_prepare_usec_last_frame = 0;
+
+	// If there are new viewareas being applied, then check if everything is ready
+	if (isViewareaBeingBuilt()) {
 		URHO3D_PROFILE(CheckIfViewareaIsReady);
 
+		Urho3D::HiresTimer prepare_timer;
 		// Sometimes preparing takes lots of time. Use timer to
 		// stop preparations if too much time is being spent.
 		Urho3D::Time timer(context_);
 		float preparation_started = timer.GetElapsedTime();
 
+		// Chunk can build only one LOD at a time. If viewers want different
+		// LODs of the same Chunk, then they are prepared one after another.
+		IntVector2Set chunks_preparing;
+
+		// Preparations of all viewers are started in the same pass
 		bool everything_ready = true;
-		for (ViewArea::Iterator i = va_being_built.Begin(); i != va_being_built.End(); ++ i) {
-			Urho3D::IntVector2 pos = i->first_;
-			uint8_t lod = i->second_;
-			assert(chunks.Contains(pos));
-			Chunk* chunk = chunks[pos];
+		bool out_of_time = false;
+		for (unsigned viewer_i = 0; viewer_i < viewers.Size() && !out_of_time; ++ viewer_i) {
+			Viewer& viewer = viewers[viewer_i];
+			for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ++ i) {
+				Urho3D::IntVector2 pos = i->first_;
+				uint8_t lod = i->second_;
+				assert(chunks.Contains(pos));
+				Chunk* chunk = chunks[pos];
 
-			if (!chunk->prepareForLod(lod, pos)) {
-				everything_ready = false;
-			}
+				if (chunks_preparing.Contains(pos) && !chunk->hasLod(lod)) {
+					everything_ready = false;
+				} else if (!chunk->prepareForLod(lod, pos)) {
+					everything_ready = false;
+					chunks_preparing.Insert(pos);
+				}
 
-			if (timer.GetElapsedTime() - preparation_started > 1.0 / 120) {
-				everything_ready = false;
-				break;
+				if (timer.GetElapsedTime() - preparation_started > 1.0 / 120) {
+					everything_ready = false;
+					out_of_time = true;
+					break;
+				}
+			}
+			for (SuperChunkArea::Iterator i = viewer.sca_being_built.Begin(); i != viewer.sca_being_built.End(); ++ i) {
+				if (!getOrCreateSuperChunk(*i)->prepare()) {
+					everything_ready = false;
+				}
 			}
 		}
+		unsigned long long prepare_usec = prepare_timer.GetUSec(false);
+		lod_prepare_usec_last_frame += prepare_usec;
+		counters.lod_prepare_usec += prepare_usec;
 
-		// If everything is ready, then ask all Chunks to switch to
-		// new lod and then mark the viewarea update as complete.
+		// If everything is ready, then ask all Chunks to switch to new
+		// lod and then mark the viewarea updates as complete. All viewers
+		// are switched at the same time, because they share the origin.
 		if (everything_ready) {
-			// Some chunks might disappear from view. Because of
-			// this, keep track of all that are currently visible.
-			Urho3D::HashSet<Urho3D::IntVector2> old_chunks;
-			for (ViewArea::Iterator i = va.Begin(); i != va.End(); ++ i) {
-				old_chunks.Insert(i->first_);
-			}
+			for (unsigned viewer_i = 0; viewer_i < viewers.Size(); ++ viewer_i) {
+				Viewer& viewer = viewers[viewer_i];
+
+				// Some chunks might disappear from view. Because of
+				// this, keep track of all that are currently visible.
+				Urho3D::HashSet<Urho3D::IntVector2> old_chunks;
+				for (ViewArea::Iterator i = viewer.va.Begin(); i != viewer.va.End(); ++ i) {
+					old_chunks.Insert(i->first_);
+				}
 
-			// Reveal chunks
-			for (ViewArea::Iterator i = va_being_built.Begin(); i != va_being_built.End(); ++ i) {
-				Urho3D::IntVector2 const& pos = i->first_;
-				uint8_t lod = i->second_;
-				Chunk* chunk = chunks[pos];
+				// Reveal chunks
+				for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ++ i) {
+					Urho3D::IntVector2 const& pos = i->first_;
+					uint8_t lod = i->second_;
+					Chunk* chunk = chunks[pos];
+
+					chunk->show(pos - va_being_built_origin, va_being_built_origin_height, lod, viewer.viewmask);
+
+					old_chunks.Erase(pos);
+				}
 
-				chunk->show(pos - va_being_built_origin, va_being_built_origin_height, lod);
+				// Hide old chunks
+				for (Urho3D::HashSet<Urho3D::IntVector2>::Iterator i = old_chunks.Begin(); i != old_chunks.End(); ++ i) {
+					Urho3D::IntVector2 const& pos = *i;
+					Chunks::Iterator chunks_find = chunks.Find(pos);
+					if (chunks_find != chunks.End()) {
+						chunks_find->second_->hide(viewer.viewmask);
+					}
+				}
 
-				old_chunks.Erase(pos);
+				// Reveal super-chunks and hide old ones
+				for (SuperChunkArea::Iterator i = viewer.sca_being_built.Begin(); i != viewer.sca_being_built.End(); ++ i) {
+					super_chunks[*i]->show(Urho3D::IntVector2(i->x_, i->y_) - va_being_built_origin, va_being_built_origin_height, viewer.viewmask);
+				}
+				for (SuperChunkArea::Iterator i = viewer.sca.Begin(); i != viewer.sca.End(); ++ i) {
+					SuperChunks::Iterator super_chunks_find = super_chunks.Find(*i);
+					if (!viewer.sca_being_built.Contains(*i) && super_chunks_find != super_chunks.End()) {
+						super_chunks_find->second_->hide(viewer.viewmask);
+					}
+				}
+
+				viewer.va = viewer.va_being_built;
+				viewer.va_center = viewer.va_being_built_center;
+				viewer.va_lazy = viewer.va_being_built_lazy;
+				viewer.sca = viewer.sca_being_built;
+				viewer.va_being_built.Clear();
+				viewer.va_being_built_lazy.Clear();
+				viewer.sca_being_built.Clear();
+			}
+
+			if (horizon_ring) {
+				updateHorizonRingCoverage();
 			}
 
-			// Hide old chunks
-			for (Urho3D::HashSet<Urho3D::IntVector2>::Iterator i = old_chunks.Begin(); i != old_chunks.End(); ++ i) {
-				Urho3D::IntVector2 const& pos = *i;
-				Chunks::Iterator chunks_find = chunks.Find(pos);
-				if (chunks_find != chunks.End()) {
-					chunks_find->second_->hide();
+			// Keep some of the hidden super-chunks, in case they are needed again
+			unsigned shown_super_chunks = 0;
+			Urho3D::PODVector<HiddenSuperChunk> hidden_super_chunks;
+			for (SuperChunks::Iterator i = super_chunks.Begin(); i != super_chunks.End(); ++ i) {
+				if (i->second_->isShown()) {
+					i->second_->setLastShown(counters.viewareas_applied);
+					++ shown_super_chunks;
+				} else {
+					HiddenSuperChunk hidden;
+					hidden.key = i->first_;
+					hidden.last_shown = i->second_->getLastShown();
+					hidden_super_chunks.Push(hidden);
+				}
+			}
+			if (hidden_super_chunks.Size() > shown_super_chunks) {
+				std::sort(hidden_super_chunks.Begin(), hidden_super_chunks.End());
+				for (unsigned i = 0; i < hidden_super_chunks.Size() - shown_super_chunks; ++ i) {
+					super_chunks.Erase(hidden_super_chunks[i].key);
 				}
 			}
 
 			// Mark process complete
-			va = va_being_built;
+			++ counters.viewareas_applied;
 			bool origin_changed = origin != va_being_built_origin;
 			origin = va_being_built_origin;
 			origin_height = va_being_built_origin_height;
-			va_being_built.Clear();
 
-			camera->updateNodeTransform();
+			for (unsigned viewer_i = 0; viewer_i < viewers.Size(); ++ viewer_i) {
+				viewers[viewer_i].camera->updateNodeTransform();
+			}
 
 			if (origin_changed) {
+#ifdef URHO3D_PHYSICS
+				updatePhysicsPositions();
+#endif
 				SendEvent(E_VIEWAREA_ORIGIN_CHANGED);
 			}
 
@@ -472,109 +1390,925 @@ void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantM
 		}
 	}
 
-	// If there is no camera, then do nothing
-	if (camera.Null()) {
+#ifdef URHO3D_PHYSICS
+	if (physics_world.NotNull()) {
+		updatePhysics();
+	}
+#endif
+
+	// If there are no cameras, then do nothing
+	if (viewers.Empty()) {
 		return;
 	}
 
 	if (water_refl) {
-// TODO: Update is not required on every frame! However aspect is good to update in case size has changed!
 		updateWaterReflection();
 	}
 
-	// Check if camera has moved away from origin
-	if (camera->fixIfOutsideOrigin()) {
-		viewarea_recalculation_required = true;
+	if (horizon_ring) {
+		horizon_ring->update(viewers[0].va_center, origin, origin_height, viewers[0].viewmask);
+	}
+
+	// Check if cameras have moved away from their Chunks. The first
+	// one also moves the origin. Hidden Chunks are only valid near
+	// the position they were calculated from, but the rest of the
+	// viewarea stays the same, so it is enough to cull it again.
+	for (unsigned viewer_i = 0; viewer_i < getNumOfCameras(); ++ viewer_i) {
+		Viewer const& viewer = viewers[viewer_i];
+		if (viewer.camera->fixIfOutsideOrigin()) {
+			viewarea_recalculation_required = true;
+		} else if (horizon_culling && (getEye(viewer.camera, va_being_built_origin, va_being_built_origin_height) - viewer.va_being_built_eye).Length() > horizon_culling_eye_margin) {
+			viewarea_reculling_required = true;
+		}
 	}
 
 	updateUndergrowth();
 
-	if (!viewarea_recalculation_required) {
+	// Eviction does not need to be checked every frame
+	if (eviction || hibernation) {
+		if (eviction_frames_left == 0) {
+			unsigned const EVICTION_INTERVAL_FRAMES = 30;
+			evictChunks(viewers[0].camera->getChunkPosition());
+			eviction_frames_left = EVICTION_INTERVAL_FRAMES;
+		} else {
+			-- eviction_frames_left;
+		}
+	}
+
+	// Lazy Chunks are upgraded only when there is no new viewarea being built
+	if (!isViewareaBeingBuilt()) {
+		Urho3D::HiresTimer prepare_timer;
+		upgradeLazyChunks();
+		unsigned long long prepare_usec = prepare_timer.GetUSec(false);
+		lod_prepare_usec_last_frame += prepare_usec;
+		counters.lod_prepare_usec += prepare_usec;
+	}
+
+	if (!viewarea_recalculation_required && !viewarea_reculling_required) {
 		return;
 	}
 
 	{
 		URHO3D_PROFILE(FinishViewareaRebuilding);
+		TraceScope trace_recalculation("RecalculateViewarea");
+
+		// Viewarea requires recalculation. Form new Viewarea objects. If only
+		// culling is needed, then origin and LODs stay the same as before.
+		bool const RECULL_ONLY = !viewarea_recalculation_required;
+		if (RECULL_ONLY) {
+			++ counters.viewarea_reculls;
+		} else {
+			++ counters.viewarea_recalculations;
+			va_being_built_origin = viewers[0].camera->getChunkPosition();
+			va_being_built_origin_height = viewers[0].camera->getBaseHeight();
+		}
+
+		// LODs coarser than this would have the same geometry
+		unsigned max_lod = 0;
+		while ((1u << max_lod) < chunk_width) {
+			++ max_lod;
+		}
+
+		for (unsigned viewer_i = 0; viewer_i < viewers.Size(); ++ viewer_i) {
+			Viewer& viewer = viewers[viewer_i];
+			Camera const* camera = viewer.camera;
+			viewer.va_being_built.Clear();
+			viewer.va_being_built_lazy.Clear();
+			viewer.sca_being_built.Clear();
+			viewer.va_being_built_eye = getEye(camera, va_being_built_origin, va_being_built_origin_height);
+
+			if (RECULL_ONLY) {
+				viewer.va_being_built = viewer.va_unculled;
+			} else {
+				viewer.va_being_built_center = camera->getChunkPosition();
+				int const VIEW_DISTANCE_IN_CHUNKS = camera->getViewDistanceInChunks();
+
+				// Go viewarea through
+				Urho3D::IntVector2 it;
+				for (it.y_ = -VIEW_DISTANCE_IN_CHUNKS; it.y_ <= VIEW_DISTANCE_IN_CHUNKS; ++ it.y_) {
+					for (it.x_ = -VIEW_DISTANCE_IN_CHUNKS; it.x_ <= VIEW_DISTANCE_IN_CHUNKS; ++ it.x_) {
+						// If too far away
+						float distance = it.Length();
+						if (distance > VIEW_DISTANCE_IN_CHUNKS) {
+							continue;
+						}
+
+						Urho3D::IntVector2 pos = viewer.va_being_built_center + it;
+
+						// If Chunk or any of it's neighbors (except southwestern) is missing, then skip this
+						if (!chunks.Contains(pos) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(-1, 0)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(-1, 1)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(0, 1)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(1, 1)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(1, 0)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(1, -1)) ||
+							!chunks.Contains(pos + Urho3D::IntVector2(0, -1))) {
+							continue;
+						}
+
+						// Add to future ViewArea object
+						unsigned lod_detail = distance / 12;
+						if (viewer.water_refl) {
+							lod_detail = Urho3D::Min(lod_detail + water_refl_lod_bias, max_lod);
+						}
+
+						viewer.va_being_built[pos] = lod_detail;
+					}
+				}
+
+				viewer.va_unculled = viewer.va_being_built;
+			}
+
+			// Reflection sees what is hidden from Camera
+			if (viewer.water_refl) {
+				applyWaterReflectionCulling(viewer);
+			} else if (horizon_culling) {
+				applyHorizonCulling(viewer);
+			}
+
+			if (super_chunk_distance > 0 && super_chunk_max_level > 0) {
+				applySuperChunks(viewer);
+			}
+
+			if (frustum_aware_va) {
+				applyFrustumAwareness(viewer, max_lod);
+			}
+
+			for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ++ i) {
+				if (chunks[i->first_]->hasLod(i->second_)) {
+					++ counters.lod_cache_hits;
+				} else {
+					++ counters.lod_cache_misses;
+				}
+			}
+		}
+
+		viewarea_recalculation_required = false;
+		viewarea_reculling_required = false;
+	}
+}
+
+void ChunkWorld::updateWaterReflection()
+{
+	Urho3D::Graphics* graphics = GetSubsystem<Urho3D::Graphics>();
+	float aspect = float(graphics->GetWidth()) / float(graphics->GetHeight());
+
+	// Plane only changes when origin does
+	bool plane_changed = !water_refl_plane_valid || origin != water_refl_origin || origin_height != water_refl_origin_height || aspect != water_refl_aspect;
+	if (plane_changed) {
+		// Update water node position
+		int baseheight = int(water_baseheight) - int(origin_height);
+		float height = water_height + baseheight * heightstep;
+		water_node->SetPosition(Urho3D::Vector3(0, height, 0));
+
+		// Create a mathematical plane to represent the water in calculations
+		Urho3D::Plane water_refl_plane = Urho3D::Plane(water_node->GetWorldRotation() * Urho3D::Vector3::UP, water_node->GetWorldPosition());
+		// Create a downward biased plane for reflection view clipping. Biasing is necessary to avoid too aggressive clipping
+		Urho3D::Plane water_clip_plane = Urho3D::Plane(water_node->GetWorldRotation() * Urho3D::Vector3::UP, water_node->GetWorldPosition() + Urho3D::Vector3::DOWN * 0.1);
+
+		water_refl_camera->SetReflectionPlane(water_refl_plane);
+		water_refl_camera->SetClipPlane(water_clip_plane);
+
+		// The water reflection texture is rectangular. Set reflection camera aspect ratio to match
+		water_refl_camera->SetAspectRatio(aspect);
+
+		water_refl_plane_valid = true;
+		water_refl_origin = origin;
+		water_refl_origin_height = origin_height;
+		water_refl_aspect = aspect;
+	}
 
-		// Viewarea requires recalculation. Form new Viewarea object.
-		va_being_built.Clear();
-		va_being_built_origin = camera->getChunkPosition();
-		va_being_built_origin_height = camera->getBaseHeight();
-		va_being_built_view_distance_in_chunks = camera->getViewDistanceInChunks();
+	// Without throttling, Urho3D renders reflection whenever water is visible
+	if (water_refl_tex->GetRenderSurface()->GetUpdateMode() != Urho3D::SURFACE_MANUALUPDATE) {
+		return;
+	}
+
+	if (water_refl_frames_since_queued < water_refl_interval) {
+		++ water_refl_frames_since_queued;
+	}
+
+	Urho3D::Node* camera_node = viewers[0].camera->getNode();
+	Urho3D::Vector3 pos = camera_node->GetWorldPosition();
+	Urho3D::Vector3 dir = camera_node->GetWorldDirection();
 
-		// Go viewarea through
+	bool render = plane_changed;
+	if (!render && water_refl_frames_left == 0) {
+		if (water_refl_move_threshold <= 0 && water_refl_turn_threshold <= 0) {
+			render = true;
+		} else {
+			render = (water_refl_move_threshold > 0 && (pos - water_refl_rendered_pos).Length() > water_refl_move_threshold) ||
+			         (water_refl_turn_threshold > 0 && dir.Angle(water_refl_rendered_dir) > water_refl_turn_threshold);
+		}
+	}
+	if (!render) {
+		if (water_refl_frames_left > 0) {
+			-- water_refl_frames_left;
+		}
+		return;
+	}
+
+	// Only changes of the plane may render sooner than the interval allows
+	assert(plane_changed || water_refl_frames_since_queued >= water_refl_interval);
+
+	water_refl_tex->GetRenderSurface()->QueueUpdate();
+	water_refl_frames_left = water_refl_interval - 1;
+	water_refl_frames_since_queued = 0;
+	water_refl_rendered_pos = pos;
+	water_refl_rendered_dir = dir;
+	++ counters.water_reflections_queued;
+}
+
+void ChunkWorld::updateWaterReflectionTexture()
+{
+	// Resizing creates new render surface, so viewport is always set again
+	if (water_refl_tex->GetWidth() != int(water_refl_tex_size)) {
+		water_refl_tex->SetSize(water_refl_tex_size, water_refl_tex_size, Urho3D::Graphics::GetRGBFormat(), Urho3D::TEXTURE_RENDERTARGET);
+		water_refl_tex->SetFilterMode(Urho3D::FILTER_BILINEAR);
+		// New texture has no reflection yet
+		water_refl_plane_valid = false;
+	}
+	Urho3D::RenderSurface* surface = water_refl_tex->GetRenderSurface();
+	surface->SetViewport(0, water_refl_viewport);
+
+	bool throttled = water_refl_interval > 1 || water_refl_move_threshold > 0 || water_refl_turn_threshold > 0;
+	surface->SetUpdateMode(throttled ? Urho3D::SURFACE_MANUALUPDATE : Urho3D::SURFACE_UPDATEVISIBLE);
+}
+
+#ifdef URHO3D_PHYSICS
+void ChunkWorld::updatePhysics()
+{
+	URHO3D_PROFILE(UpdateChunkWorldPhysics);
+
+	float const CHUNK_W_F = getChunkWidthFloat();
+	float const CHUNK_W_F_HALF = CHUNK_W_F / 2;
+
+	// Get positions of all focuses, relative to origin
+	Urho3D::PODVector<Urho3D::Vector3> focuses;
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		focuses.Push(viewers[i].camera->getNode()->GetPosition());
+	}
+	for (unsigned i = 0; i < physics_focuses.Size(); ) {
+		if (physics_focuses[i].Expired()) {
+			physics_focuses.Erase(i);
+		} else {
+			focuses.Push(physics_focuses[i]->GetWorldPosition());
+			++ i;
+		}
+	}
+
+	// Start building colliders for Chunks that are near focuses
+	int const RADIUS_CHUNKS = Urho3D::CeilToInt(physics_radius / CHUNK_W_F) + 1;
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	for (unsigned focus_i = 0; focus_i < focuses.Size(); ++ focus_i) {
+		Urho3D::Vector2 focus(focuses[focus_i].x_, focuses[focus_i].z_);
+		Urho3D::IntVector2 focus_chunk(Urho3D::RoundToInt(focus.x_ / CHUNK_W_F), Urho3D::RoundToInt(focus.y_ / CHUNK_W_F));
 		Urho3D::IntVector2 it;
-		for (it.y_ = -va_being_built_view_distance_in_chunks; it.y_ <= int(va_being_built_view_distance_in_chunks); ++ it.y_) {
-			for (it.x_ = -va_being_built_view_distance_in_chunks; it.x_ <= int(va_being_built_view_distance_in_chunks); ++ it.x_) {
-				// If too far away
-				float distance = it.Length();
-				if (distance > va_being_built_view_distance_in_chunks) {
+		for (it.y_ = focus_chunk.y_ - RADIUS_CHUNKS; it.y_ <= focus_chunk.y_ + RADIUS_CHUNKS; ++ it.y_) {
+			for (it.x_ = focus_chunk.x_ - RADIUS_CHUNKS; it.x_ <= focus_chunk.x_ + RADIUS_CHUNKS; ++ it.x_) {
+				Urho3D::IntVector2 pos = origin + it;
+				if (colliders.Contains(pos)) {
+					continue;
+				}
+				// Distance from focus to the nearest point of Chunk
+				Urho3D::Vector2 center(it.x_ * CHUNK_W_F, it.y_ * CHUNK_W_F);
+				Urho3D::Vector2 diff(
+					Urho3D::Max(0.0f, Urho3D::Abs(focus.x_ - center.x_) - CHUNK_W_F_HALF),
+					Urho3D::Max(0.0f, Urho3D::Abs(focus.y_ - center.y_) - CHUNK_W_F_HALF)
+				);
+				if (diff.Length() > physics_radius) {
 					continue;
 				}
 
-				Urho3D::IntVector2 pos = va_being_built_origin + it;
-
-				// If Chunk or any of it's neighbors (except southwestern) is missing, then skip this
-				if (!chunks.Contains(pos) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(-1, 0)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(-1, 1)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(0, 1)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(1, 1)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(1, 0)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(1, -1)) ||
-					!chunks.Contains(pos + Urho3D::IntVector2(0, -1))) {
+				// Shape reads heights from the snapshots of the Chunk and the
+				// neighbors that cover its eastern and northern edges.
+				CornersSnapshots snapshots;
+				if (!getHeightfieldSnapshots(snapshots, pos)) {
 					continue;
 				}
+				unsigned baseheight = chunks[pos]->getBaseHeight();
+				Urho3D::SharedPtr<HeightfieldCollider> collider(new HeightfieldCollider(
+					workqueue, physics_world, snapshots, baseheight,
+					chunk_width, sqr_width, heightstep,
+					physics_collision_layer, physics_collision_mask
+				));
+				collider->setPosition(Urho3D::Vector3(it.x_ * CHUNK_W_F, (int(baseheight) - int(origin_height)) * heightstep, it.y_ * CHUNK_W_F));
+				colliders[pos] = collider;
+			}
+		}
+	}
+
+	// Update colliders and remove those that are too far away from all focuses
+	for (HeightfieldColliders::Iterator i = colliders.Begin(); i != colliders.End(); ) {
+		Urho3D::IntVector2 rel_pos = i->first_ - origin;
+		Urho3D::Vector2 center(rel_pos.x_ * CHUNK_W_F, rel_pos.y_ * CHUNK_W_F);
+		bool near = false;
+		for (unsigned focus_i = 0; focus_i < focuses.Size() && !near; ++ focus_i) {
+			Urho3D::Vector2 diff(
+				Urho3D::Max(0.0f, Urho3D::Abs(focuses[focus_i].x_ - center.x_) - CHUNK_W_F_HALF),
+				Urho3D::Max(0.0f, Urho3D::Abs(focuses[focus_i].z_ - center.y_) - CHUNK_W_F_HALF)
+			);
+			near = diff.Length() <= physics_radius + physics_hysteresis;
+		}
+		if (near) {
+			i->second_->update();
+			++ i;
+		} else {
+			i = colliders.Erase(i);
+		}
+	}
+
+	// Remove outdated colliders when their replacements are ready. If
+	// Chunk is not near enough to get a replacement, then remove anyway.
+	for (HeightfieldColliders::Iterator i = outdated_colliders.Begin(); i != outdated_colliders.End(); ) {
+		HeightfieldColliders::Iterator colliders_find = colliders.Find(i->first_);
+		if (colliders_find == colliders.End() || colliders_find->second_->isAdded()) {
+			i = outdated_colliders.Erase(i);
+		} else {
+			++ i;
+		}
+	}
+}
+
+void ChunkWorld::updatePhysicsPositions()
+{
+	float const CHUNK_W_F = getChunkWidthFloat();
+	for (HeightfieldColliders::Iterator i = colliders.Begin(); i != colliders.End(); ++ i) {
+		Urho3D::IntVector2 rel_pos = i->first_ - origin;
+		int baseheight = i->second_->getBaseHeight();
+		i->second_->setPosition(Urho3D::Vector3(rel_pos.x_ * CHUNK_W_F, (baseheight - int(origin_height)) * heightstep, rel_pos.y_ * CHUNK_W_F));
+	}
+	for (HeightfieldColliders::Iterator i = outdated_colliders.Begin(); i != outdated_colliders.End(); ++ i) {
+		Urho3D::IntVector2 rel_pos = i->first_ - origin;
+		int baseheight = i->second_->getBaseHeight();
+		i->second_->setPosition(Urho3D::Vector3(rel_pos.x_ * CHUNK_W_F, (baseheight - int(origin_height)) * heightstep, rel_pos.y_ * CHUNK_W_F));
+	}
+}
+
+bool ChunkWorld::getHeightfieldSnapshots(CornersSnapshots& result, Urho3D::IntVector2 const& pos) const
+{
+	unsigned const NGBS[4] = { NGB_CENTER, NGB_E, NGB_NE, NGB_N };
+	Urho3D::IntVector2 const OFFSETS[4] = {
+		Urho3D::IntVector2(0, 0),
+		Urho3D::IntVector2(1, 0),
+		Urho3D::IntVector2(1, 1),
+		Urho3D::IntVector2(0, 1)
+	};
+
+	result.Clear();
+	result.Resize(NGB_COUNT);
+	for (unsigned i = 0; i < 4; ++ i) {
+		Chunks::ConstIterator chunks_find = chunks.Find(pos + OFFSETS[i]);
+		if (chunks_find == chunks.End()) {
+			result.Clear();
+			return false;
+		}
+		result[NGBS[i]] = chunks_find->second_->getCornersSnapshot();
+	}
+	return true;
+}
+#endif
+
+void ChunkWorld::applyHorizonCulling(Viewer& viewer)
+{
+	URHO3D_PROFILE(ApplyHorizonCulling);
+
+	float const CHUNK_W_F = getChunkWidthFloat();
+	Urho3D::Vector3 const& EYE = viewer.va_being_built_eye;
+
+	HorizonCullingChunks hc_chunks;
+	hc_chunks.Reserve(viewer.va_being_built.Size());
+	for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ++ i) {
+		Urho3D::IntVector2 const& pos = i->first_;
+
+		// Rendered area of Chunk also contains the
+		// edges of northern and eastern neighbors.
+		Chunk const* chunk = chunks[pos];
+		Chunk const* chunk_n = chunks[pos + Urho3D::IntVector2(0, 1)];
+		Chunk const* chunk_ne = chunks[pos + Urho3D::IntVector2(1, 1)];
+		Chunk const* chunk_e = chunks[pos + Urho3D::IntVector2(1, 0)];
+		int lowest = Urho3D::Min(Urho3D::Min(chunk->getLowestHeight(), chunk_n->getLowestHeight()), Urho3D::Min(chunk_ne->getLowestHeight(), chunk_e->getLowestHeight()));
+		int highest = Urho3D::Max(Urho3D::Max(chunk->getHighestHeight(), chunk_n->getHighestHeight()), Urho3D::Max(chunk_ne->getHighestHeight(), chunk_e->getHighestHeight()));
+
+		Urho3D::IntVector2 rel_pos = pos - va_being_built_origin;
+		HorizonCullingChunk hc_chunk;
+		hc_chunk.pos = pos;
+		hc_chunk.center = Urho3D::Vector2(rel_pos.x_ * CHUNK_W_F - EYE.x_, rel_pos.y_ * CHUNK_W_F - EYE.z_);
+		hc_chunk.lowest = (lowest - int(va_being_built_origin_height)) * heightstep - EYE.y_;
+		hc_chunk.highest = (highest - int(va_being_built_origin_height)) * heightstep + horizon_culling_object_height - EYE.y_;
+		hc_chunks.Push(hc_chunk);
+	}
+
+	Urho3D::PODVector<Urho3D::IntVector2> hidden;
+	findHiddenChunks(hidden, hc_chunks, CHUNK_W_F, horizon_culling_eye_margin);
+	for (unsigned i = 0; i < hidden.Size(); ++ i) {
+		viewer.va_being_built.Erase(hidden[i]);
+	}
+}
+
+void ChunkWorld::applyWaterReflectionCulling(Viewer& viewer)
+{
+	URHO3D_PROFILE(ApplyWaterReflectionCulling);
+
+	for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ) {
+		Urho3D::IntVector2 const& pos = i->first_;
+
+		// Rendered area of Chunk also contains the
+		// edges of northern and eastern neighbors.
+		Chunk const* chunk = chunks[pos];
+		Chunk const* chunk_n = chunks[pos + Urho3D::IntVector2(0, 1)];
+		Chunk const* chunk_ne = chunks[pos + Urho3D::IntVector2(1, 1)];
+		Chunk const* chunk_e = chunks[pos + Urho3D::IntVector2(1, 0)];
+		int highest = Urho3D::Max(Urho3D::Max(chunk->getHighestHeight(), chunk_n->getHighestHeight()), Urho3D::Max(chunk_ne->getHighestHeight(), chunk_e->getHighestHeight()));
+
+		if ((highest - int(water_baseheight)) * heightstep < water_height) {
+			i = viewer.va_being_built.Erase(i);
+			++ counters.water_refl_chunks_culled;
+		} else {
+			++ i;
+		}
+	}
+}
+
+void ChunkWorld::applySuperChunks(Viewer& viewer)
+{
+	URHO3D_PROFILE(ApplySuperChunks);
+
+	Urho3D::IntVector2 const& CENTER = viewer.va_being_built_center;
+
+	// Biggest blocks first, so smaller ones can fill the gaps
+	for (unsigned level = super_chunk_max_level; level > 0; -- level) {
+		int const SIZE = 1 << level;
+		float const MIN_DISTANCE = super_chunk_distance * (1 << (level - 1));
+
+		// Find blocks that are far enough, and whose every Chunk is still in the viewarea
+		IntVector2Set checked;
+		Urho3D::PODVector<Urho3D::IntVector2> merged;
+		for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ++ i) {
+			Urho3D::IntVector2 block(floorDiv(i->first_.x_, SIZE) * SIZE, floorDiv(i->first_.y_, SIZE) * SIZE);
+			if (checked.Contains(block)) {
+				continue;
+			}
+			checked.Insert(block);
+
+			Urho3D::IntVector2 nearest(
+				Urho3D::Clamp(CENTER.x_, block.x_, block.x_ + SIZE - 1),
+				Urho3D::Clamp(CENTER.y_, block.y_, block.y_ + SIZE - 1)
+			);
+			if ((nearest - CENTER).Length() < MIN_DISTANCE) {
+				continue;
+			}
+
+			bool mergeable = true;
+			Urho3D::IntVector2 it;
+			for (it.y_ = 0; it.y_ < SIZE && mergeable; ++ it.y_) {
+				for (it.x_ = 0; it.x_ < SIZE && mergeable; ++ it.x_) {
+					Urho3D::IntVector2 pos = block + it;
+					if (!viewer.va_being_built.Contains(pos)) {
+						mergeable = false;
+					} else if (water_patches && chunks[pos]->getLowestHeight() * heightstep < getWaterHeight(pos, 0)) {
+						mergeable = false;
+					}
+				}
+			}
+			if (mergeable) {
+				merged.Push(block);
+			}
+		}
 
-				// Add to future ViewArea object
-				unsigned lod_detail = distance / 12;
-				va_being_built[pos] = lod_detail;
+		for (unsigned i = 0; i < merged.Size(); ++ i) {
+			Urho3D::IntVector2 const& block = merged[i];
+			Urho3D::IntVector2 it;
+			for (it.y_ = 0; it.y_ < SIZE; ++ it.y_) {
+				for (it.x_ = 0; it.x_ < SIZE; ++ it.x_) {
+					viewer.va_being_built.Erase(block + it);
+					viewer.va_being_built_lazy.Erase(block + it);
+				}
 			}
+			viewer.sca_being_built.Insert(Urho3D::IntVector3(block.x_, block.y_, level));
 		}
+	}
+}
 
-		viewarea_recalculation_required = false;
+SuperChunk* ChunkWorld::getOrCreateSuperChunk(Urho3D::IntVector3 const& key)
+{
+	SuperChunks::Iterator super_chunks_find = super_chunks.Find(key);
+	if (super_chunks_find != super_chunks.End()) {
+		return super_chunks_find->second_;
 	}
+	SuperChunk* super_chunk = new SuperChunk(this, Urho3D::IntVector2(key.x_, key.y_), key.z_);
+	super_chunks[key] = super_chunk;
+	return super_chunk;
 }
 
-void ChunkWorld::updateWaterReflection()
+void ChunkWorld::hideSuperChunks(Viewer const& viewer)
+{
+	for (SuperChunkArea::ConstIterator i = viewer.sca.Begin(); i != viewer.sca.End(); ++ i) {
+		SuperChunks::Iterator super_chunks_find = super_chunks.Find(*i);
+		if (super_chunks_find != super_chunks.End()) {
+			super_chunks_find->second_->hide(viewer.viewmask);
+		}
+	}
+}
+
+void ChunkWorld::invalidateSuperChunks(Urho3D::IntVector2 const& chunk_pos)
+{
+	if (super_chunks.Empty()) {
+		return;
+	}
+	// Blocks use corners of their neighbors too
+	for (unsigned level = 1; level <= super_chunk_max_level; ++ level) {
+		int const SIZE = 1 << level;
+		IntVector2Set blocks;
+		Urho3D::IntVector2 it;
+		for (it.y_ = -1; it.y_ <= 1; ++ it.y_) {
+			for (it.x_ = -1; it.x_ <= 1; ++ it.x_) {
+				Urho3D::IntVector2 pos = chunk_pos + it;
+				blocks.Insert(Urho3D::IntVector2(floorDiv(pos.x_, SIZE) * SIZE, floorDiv(pos.y_, SIZE) * SIZE));
+			}
+		}
+		for (IntVector2Set::Iterator i = blocks.Begin(); i != blocks.End(); ++ i) {
+			SuperChunks::Iterator super_chunks_find = super_chunks.Find(Urho3D::IntVector3(i->x_, i->y_, level));
+			if (super_chunks_find != super_chunks.End()) {
+				super_chunks_find->second_->invalidate();
+			}
+		}
+	}
+}
+
+void ChunkWorld::updateHorizonRingCoverage()
+{
+	Viewer const& viewer = viewers[0];
+	IntVector2Set covered;
+	for (ViewArea::ConstIterator i = viewer.va.Begin(); i != viewer.va.End(); ++ i) {
+		covered.Insert(i->first_);
+	}
+	for (SuperChunkArea::ConstIterator i = viewer.sca.Begin(); i != viewer.sca.End(); ++ i) {
+		int const SIZE = 1 << i->z_;
+		Urho3D::IntVector2 it;
+		for (it.y_ = 0; it.y_ < SIZE; ++ it.y_) {
+			for (it.x_ = 0; it.x_ < SIZE; ++ it.x_) {
+				covered.Insert(Urho3D::IntVector2(i->x_, i->y_) + it);
+			}
+		}
+	}
+	horizon_ring->setCoveredChunks(covered);
+}
+
+void ChunkWorld::applyFrustumAwareness(Viewer& viewer, uint8_t coarsest_lod)
+{
+	URHO3D_PROFILE(ApplyFrustumAwareness);
+
+	// If Chunk is not in the view, then use any LOD it already has
+	// and prepare the real LOD later. If there are no LODs at all,
+	// then the coarsest LOD is used, as it is the fastest to build.
+	// Leaving the Chunk out would show a hole when Camera turns.
+	for (ViewArea::Iterator i = viewer.va_being_built.Begin(); i != viewer.va_being_built.End(); ) {
+		Urho3D::IntVector2 const& pos = i->first_;
+		uint8_t lod = i->second_;
+		Chunk const* chunk = chunks[pos];
+		if (chunk->hasLod(lod) || getChunkAngleFromView(viewer.camera, pos - va_being_built_origin, viewer.va_being_built_eye) <= frustum_aware_va_margin) {
+			++ i;
+			continue;
+		}
+
+		viewer.va_being_built_lazy[pos] = lod;
+		int closest_lod = chunk->getClosestLod(lod);
+		i->second_ = closest_lod < 0 ? coarsest_lod : closest_lod;
+		++ i;
+	}
+}
+
+float ChunkWorld::getChunkAngleFromView(Camera const* camera, Urho3D::IntVector2 const& rel_pos, Urho3D::Vector3 const& eye) const
+{
+	float const CHUNK_W_F = getChunkWidthFloat();
+
+	// If Camera is looking too much up or down, then it sees every direction
+	Urho3D::Camera* camera_raw = camera->getRawCamera();
+	float half_vfov = camera_raw->GetFov() / 2;
+	if (Urho3D::Abs(camera->getPitch()) + half_vfov >= 80) {
+		return 0;
+	}
+	float half_hfov = atan(tan(half_vfov * Urho3D::M_DEGTORAD) * camera_raw->GetAspectRatio()) * Urho3D::M_RADTODEG;
+
+	// Chunks that are very near are always in the view
+	Urho3D::Vector2 to_chunk(rel_pos.x_ * CHUNK_W_F - eye.x_, rel_pos.y_ * CHUNK_W_F - eye.z_);
+	float distance = to_chunk.Length();
+	float chunk_radius = CHUNK_W_F * 0.7072;
+	if (distance <= chunk_radius) {
+		return 0;
+	}
+	float chunk_half_angle = asin(chunk_radius / distance) * Urho3D::M_RADTODEG;
+
+	// Yaw of zero is looking towards positive Z axis
+	float chunk_yaw = atan2(to_chunk.x_, to_chunk.y_) * Urho3D::M_RADTODEG;
+	float yaw_diff = fmod(chunk_yaw - camera->getYaw(), 360.0f);
+	if (yaw_diff > 180) yaw_diff -= 360;
+	else if (yaw_diff < -180) yaw_diff += 360;
+
+	return Urho3D::Max(0.0f, Urho3D::Abs(yaw_diff) - chunk_half_angle - half_hfov);
+}
+
+bool ChunkWorld::isChunkInUse(Urho3D::IntVector2 const& pos) const
+{
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		Viewer const& viewer = viewers[i];
+		if (viewer.va.Contains(pos) || viewer.va_being_built.Contains(pos) || viewer.va_lazy.Contains(pos)) {
+			return true;
+		}
+	}
+	return chunks_having_undergrowth.Contains(pos) ||
+	       chunks_missing_undergrowth.Contains(pos);
+}
+
+bool ChunkWorld::isLodNeededByNewViewarea(Urho3D::IntVector2 const& chunk_pos, uint8_t lod) const
 {
-	// Update water node position
-	int baseheight = int(water_baseheight) - int(origin_height);
-	float height = water_height + baseheight * heightstep;
-	water_node->SetPosition(Urho3D::Vector3(0, height, 0));
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		ViewArea::ConstIterator va_find = viewers[i].va_being_built.Find(chunk_pos);
+		if (va_find != viewers[i].va_being_built.End() && va_find->second_ == lod) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ChunkWorld::isViewareaBeingBuilt() const
+{
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		if (!viewers[i].va_being_built.Empty() || !viewers[i].sca_being_built.Empty()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+Urho3D::Vector3 ChunkWorld::getEye(Camera const* camera, Urho3D::IntVector2 const& origin, unsigned origin_height) const
+{
+	Urho3D::IntVector2 diff = camera->getChunkPosition() - origin;
+	Urho3D::Vector3 eye = camera->getPosition();
+	eye.x_ += diff.x_ * getChunkWidthFloat();
+	eye.y_ += (int(camera->getBaseHeight()) - int(origin_height)) * heightstep;
+	eye.z_ += diff.y_ * getChunkWidthFloat();
+	return eye;
+}
+
+float ChunkWorld::getDistanceToViewers(Urho3D::IntVector2 const& pos) const
+{
+	float result = Urho3D::M_INFINITY;
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		result = Urho3D::Min(result, (pos - viewers[i].va_center).Length());
+	}
+	return result;
+}
+
+void ChunkWorld::updateCameraViewMasks()
+{
+	unsigned all_viewmasks = 0;
+	for (unsigned i = 0; i < viewers.Size(); ++ i) {
+		all_viewmasks |= viewers[i].viewmask;
+	}
+	for (unsigned i = 0; i < getNumOfCameras(); ++ i) {
+		viewers[i].camera->getRawCamera()->SetViewMask((Urho3D::DEFAULT_VIEWMASK & ~all_viewmasks) | viewers[i].viewmask);
+	}
+	// Reflection sees the same as the first Camera, except water plane,
+	// unless it has its own viewer
+	if (hasWaterReflectionViewer()) {
+		water_refl_camera->SetViewMask(((Urho3D::DEFAULT_VIEWMASK & ~all_viewmasks) | viewers.Back().viewmask) & ~water_viewmask);
+	} else if (water_refl) {
+		water_refl_camera->SetViewMask(viewers[0].camera->getRawCamera()->GetViewMask() & ~water_viewmask);
+	}
+}
+
+void ChunkWorld::upgradeLazyChunks()
+{
+	URHO3D_PROFILE(UpgradeLazyChunks);
+
+	Urho3D::Time timer(context_);
+	float upgrading_started = timer.GetElapsedTime();
+
+	// Chunks that are in the view are upgraded first, nearest first.
+	// After them come the rest of Chunks, in the order of their angles.
+	Urho3D::PODVector<LazyChunk> lazy_chunks;
+	for (unsigned viewer_i = 0; viewer_i < viewers.Size(); ++ viewer_i) {
+		Viewer const& viewer = viewers[viewer_i];
+		Urho3D::Vector3 eye = viewer.camera->getNode()->GetPosition();
+		for (ViewArea::ConstIterator i = viewer.va_lazy.Begin(); i != viewer.va_lazy.End(); ++ i) {
+			Urho3D::IntVector2 rel_pos = i->first_ - origin;
+			Urho3D::IntVector2 rel_to_center = i->first_ - viewer.va_center;
+			LazyChunk lazy_chunk;
+			lazy_chunk.pos = i->first_;
+			lazy_chunk.viewer = viewer_i;
+			lazy_chunk.lod = i->second_;
+			lazy_chunk.angle = getChunkAngleFromView(viewer.camera, rel_pos, eye);
+			lazy_chunk.distance = Urho3D::Vector2(rel_to_center.x_, rel_to_center.y_).Length();
+			lazy_chunks.Push(lazy_chunk);
+		}
+	}
+	if (lazy_chunks.Empty()) {
+		return;
+	}
+	std::sort(lazy_chunks.Begin(), lazy_chunks.End());
+
+	// If viewers want different LODs of the same Chunk, then
+	// only the most important one is prepared at a time.
+	IntVector2Set chunks_preparing;
+
+	for (unsigned i = 0; i < lazy_chunks.Size(); ++ i) {
+		LazyChunk const& lazy_chunk = lazy_chunks[i];
+		Viewer& viewer = viewers[lazy_chunk.viewer];
+		Chunk* chunk = getChunk(lazy_chunk.pos);
+		if (!chunk) {
+			viewer.va_lazy.Erase(lazy_chunk.pos);
+		} else if (chunks_preparing.Contains(lazy_chunk.pos) && !chunk->hasLod(lazy_chunk.lod)) {
+			continue;
+		} else if (chunk->prepareForLod(lazy_chunk.lod, lazy_chunk.pos, true)) {
+			chunk->show(lazy_chunk.pos - origin, origin_height, lazy_chunk.lod, viewer.viewmask);
+			viewer.va[lazy_chunk.pos] = lazy_chunk.lod;
+			viewer.va_lazy.Erase(lazy_chunk.pos);
+		} else {
+			chunks_preparing.Insert(lazy_chunk.pos);
+		}
+
+		if (timer.GetElapsedTime() - upgrading_started > 1.0 / 240) {
+			break;
+		}
+	}
+}
+
+void ChunkWorld::addInvalidation(ChunkInvalidations& invalidations, Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool ttypes_changed)
+{
+	int const CHUNK_W = chunk_width;
+
+	Urho3D::IntVector2 ngb;
+	for (ngb.y_ = area.top_ <= 1 ? -1 : 0; ngb.y_ <= (area.bottom_ >= CHUNK_W - 1 ? 1 : 0); ++ ngb.y_) {
+		for (ngb.x_ = area.left_ <= 1 ? -1 : 0; ngb.x_ <= (area.right_ >= CHUNK_W - 1 ? 1 : 0); ++ ngb.x_) {
+			// Changed area in the corner coordinates of neighbor
+			Urho3D::IntRect ngb_area(
+				area.left_ - ngb.x_ * CHUNK_W,
+				area.top_ - ngb.y_ * CHUNK_W,
+				area.right_ - ngb.x_ * CHUNK_W,
+				area.bottom_ - ngb.y_ * CHUNK_W
+			);
+			ChunkInvalidations::Iterator invalidations_find = invalidations.Find(chunk_pos + ngb);
+			if (invalidations_find == invalidations.End()) {
+				ChunkInvalidation& inv = invalidations[chunk_pos + ngb];
+				inv.area = ngb_area;
+				inv.ttypes_changed = ttypes_changed;
+			} else {
+				ChunkInvalidation& inv = invalidations_find->second_;
+				inv.area.left_ = Urho3D::Min(inv.area.left_, ngb_area.left_);
+				inv.area.top_ = Urho3D::Min(inv.area.top_, ngb_area.top_);
+				inv.area.right_ = Urho3D::Max(inv.area.right_, ngb_area.right_);
+				inv.area.bottom_ = Urho3D::Max(inv.area.bottom_, ngb_area.bottom_);
+				inv.ttypes_changed = inv.ttypes_changed || ttypes_changed;
+			}
+		}
+	}
+}
+
+void ChunkWorld::applyInvalidations(ChunkInvalidations const& invalidations)
+{
+	for (ChunkInvalidations::ConstIterator i = invalidations.Begin(); i != invalidations.End(); ++ i) {
+		Urho3D::IntVector2 const& pos = i->first_;
+		Chunk* chunk = getChunk(pos);
+		if (!chunk) {
+			continue;
+		}
+
+		chunk->invalidate(i->second_.ttypes_changed, i->second_.area);
+		invalidateSuperChunks(pos);
+
+		// Chunk has lost its undergrowth, so it needs to be created again
+		if (chunks_having_undergrowth.Contains(pos)) {
+			chunks_missing_undergrowth.Insert(pos);
+		}
 
-	// Create a mathematical plane to represent the water in calculations
-	Urho3D::Plane water_refl_plane = Urho3D::Plane(water_node->GetWorldRotation() * Urho3D::Vector3::UP, water_node->GetWorldPosition());
-	// Create a downward biased plane for reflection view clipping. Biasing is necessary to avoid too aggressive clipping
-	Urho3D::Plane water_clip_plane = Urho3D::Plane(water_node->GetWorldRotation() * Urho3D::Vector3::UP, water_node->GetWorldPosition() + Urho3D::Vector3::DOWN * 0.1);
+#ifdef URHO3D_PHYSICS
+		// Use old collider until the new one is ready. If there
+		// already is an outdated one, then keep using that.
+		HeightfieldColliders::Iterator colliders_find = colliders.Find(pos);
+		if (colliders_find != colliders.End()) {
+			if (!outdated_colliders.Contains(pos)) {
+				outdated_colliders[pos] = colliders_find->second_;
+			}
+			colliders.Erase(colliders_find);
+		}
+#endif
+	}
 
-	water_refl_camera->SetReflectionPlane(water_refl_plane);
-	water_refl_camera->SetClipPlane(water_clip_plane);
+	if (!invalidations.Empty()) {
+		viewarea_recalculation_required = true;
+	}
+}
 
-	// The water reflection texture is rectangular. Set reflection camera aspect ratio to match
-	water_refl_camera->SetAspectRatio(float(GetSubsystem<Urho3D::Graphics>()->GetWidth()) / float(GetSubsystem<Urho3D::Graphics>()->GetHeight()));
+bool ChunkWorld::getCornerHeight(uint16_t& result, Urho3D::IntVector2 const& chunk_pos, int x, int y) const
+{
+	int const CHUNK_W = chunk_width;
+	int chunk_x = floorDiv(x, CHUNK_W);
+	int chunk_y = floorDiv(y, CHUNK_W);
+	Chunks::ConstIterator chunk_find = chunks.Find(chunk_pos + Urho3D::IntVector2(chunk_x, chunk_y));
+	if (chunk_find == chunks.End()) {
+		return false;
+	}
+	result = chunk_find->second_->getHeight(x - chunk_x * CHUNK_W, y - chunk_y * CHUNK_W, chunk_width);
+	return true;
+}
+
+void ChunkWorld::getSquareHeightsFloat(float& h_sw, float& h_nw, float& h_ne, float& h_se, Urho3D::Vector2& sqr_pos, Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const
+{
+	// Convert to squares
+	float pos_x_moved = pos.x_ + chunk_width * sqr_width * 0.5;
+	float pos_y_moved = pos.y_ + chunk_width * sqr_width * 0.5;
+	unsigned pos_i_x = Urho3D::Clamp<int>(Urho3D::FloorToInt(pos_x_moved / sqr_width), 0, chunk_width - 1);
+	unsigned pos_i_y = Urho3D::Clamp<int>(Urho3D::FloorToInt(pos_y_moved / sqr_width), 0, chunk_width - 1);
+	sqr_pos.x_ = Urho3D::Clamp<float>(pos_x_moved / sqr_width - pos_i_x, 0, 1);
+	sqr_pos.y_ = Urho3D::Clamp<float>(pos_y_moved / sqr_width - pos_i_y, 0, 1);
+
+	// Find heights of corners that surround the position
+	uint16_t c_sw, c_nw, c_ne, c_se;
+	if (!getCornerHeight(c_sw, chunk_pos, pos_i_x, pos_i_y) ||
+	    !getCornerHeight(c_nw, chunk_pos, pos_i_x, pos_i_y + 1) ||
+	    !getCornerHeight(c_ne, chunk_pos, pos_i_x + 1, pos_i_y + 1) ||
+	    !getCornerHeight(c_se, chunk_pos, pos_i_x + 1, pos_i_y)) {
+		throw std::runtime_error("Unable to get height becaue some of required four chunks is missing!");
+	}
+
+	// Apply baseheight and convert to floats
+	h_sw = (int(c_sw) - int(baseheight)) * heightstep;
+	h_nw = (int(c_nw) - int(baseheight)) * heightstep;
+	h_ne = (int(c_ne) - int(baseheight)) * heightstep;
+	h_se = (int(c_se) - int(baseheight)) * heightstep;
+}
+
+Urho3D::Texture2DArray* ChunkWorld::getTerrainTextureArray()
+{
+	if (terrain_tex_array) {
+		return terrain_tex_array;
+	}
+
+	if (texs_names.Empty()) {
+		throw std::runtime_error("Texture array requires at least one terrain texture!");
+	}
+
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+
+	// Texture array is constructed from Images, so make sure they are loaded
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Image> > imgs;
+	for (unsigned i = 0; i < texs_names.Size(); ++ i) {
+		Urho3D::SharedPtr<Urho3D::Image> img(resources->GetExistingResource<Urho3D::Image>(texs_names[i]));
+		if (img.Null()) {
+			resources->BackgroundLoadResource<Urho3D::Image>(texs_names[i]);
+		} else {
+			imgs.Push(img);
+		}
+	}
+	if (imgs.Size() != texs_names.Size()) {
+		return NULL;
+	}
+
+	// Layers are indexed by terraintypes
+	terrain_tex_array = new Urho3D::Texture2DArray(context_);
+	terrain_tex_array->SetLayers(imgs.Size());
+	for (unsigned layer = 0; layer < imgs.Size(); ++ layer) {
+		if (imgs[layer]->GetWidth() != imgs[0]->GetWidth() || imgs[layer]->GetHeight() != imgs[0]->GetHeight()) {
+			throw std::runtime_error("All terrain textures must have same size when using texture array!");
+		}
+		if (!terrain_tex_array->SetData(layer, imgs[layer])) {
+			throw std::runtime_error("Unable to set terrain texture array data!");
+		}
+	}
+
+	// Images are not needed anymore
+	for (unsigned i = 0; i < texs_names.Size(); ++ i) {
+		resources->ReleaseResource(Urho3D::Image::GetTypeStatic(), texs_names[i]);
+	}
+
+	return terrain_tex_array;
 }
 
 void ChunkWorld::startCreatingUndergrowth()
 {
 	{
 		URHO3D_PROFILE(StartCreatingUndergrowth);
-		// Ask nearby Chunks to set up undergrowth
-		Urho3D::IntVector2 i;
-		for (i.y_ = -undergrowth_radius_chunks; i.y_ <= int(undergrowth_radius_chunks); ++ i.y_) {
-			for (i.x_ = -undergrowth_radius_chunks; i.x_ <= int(undergrowth_radius_chunks); ++ i.x_) {
-				if (i.Length() <= undergrowth_radius_chunks) {
-					Urho3D::IntVector2 chunk_pos = origin + i;
-					Chunk* chunk = getChunk(chunk_pos);
-					// Try to create undergrowth. If Chunk is not yet loaded,
-					// or creating fails, then add position to waiting queue.
-					if (!chunk) {
-						chunks_missing_undergrowth.Insert(chunk_pos);
-					} else {
-						if (!chunk->createUndergrowth()) {
+		// Ask Chunks near any viewer to set up undergrowth
+		for (unsigned viewer_i = 0; viewer_i < viewers.Size(); ++ viewer_i) {
+			Urho3D::IntVector2 const& center = viewers[viewer_i].va_center;
+			Urho3D::IntVector2 i;
+			for (i.y_ = -undergrowth_radius_chunks; i.y_ <= int(undergrowth_radius_chunks); ++ i.y_) {
+				for (i.x_ = -undergrowth_radius_chunks; i.x_ <= int(undergrowth_radius_chunks); ++ i.x_) {
+					if (i.Length() <= undergrowth_radius_chunks) {
+						Urho3D::IntVector2 chunk_pos = center + i;
+						Chunk* chunk = getChunk(chunk_pos);
+						// Try to create undergrowth. If Chunk is not yet loaded,
+						// or creating fails, then add position to waiting queue.
+						if (!chunk) {
 							chunks_missing_undergrowth.Insert(chunk_pos);
+						} else {
+							if (!chunk->createUndergrowth()) {
+								chunks_missing_undergrowth.Insert(chunk_pos);
+							}
+							chunks_having_undergrowth.Insert(chunk_pos);
 						}
-						chunks_having_undergrowth.Insert(chunk_pos);
 					}
 				}
 			}
@@ -585,8 +2319,7 @@ void ChunkWorld::startCreatingUndergrowth()
 		URHO3D_PROFILE(CleanIncompleteUndergrowth);
 		// Go missing undergrowth chunks through and remove those that are too far away
 		for (IntVector2Set::Iterator i = chunks_missing_undergrowth.Begin(); i != chunks_missing_undergrowth.End(); ) {
-			Urho3D::IntVector2 chunk_pos_rel = *i - origin;
-			if (chunk_pos_rel.Length() > undergrowth_radius_chunks) {
+			if (getDistanceToViewers(*i) > undergrowth_radius_chunks) {
 				Chunk* chunk = getChunk(*i);
 				if (chunk) {
 					if (chunk->destroyUndergrowth()) {
@@ -609,7 +2342,7 @@ void ChunkWorld::startCreatingUndergrowth()
 		// Go through chunks that might have undergrowth and remove those that are too far away
 		for (IntVector2Set::Iterator i = chunks_having_undergrowth.Begin(); i != chunks_having_undergrowth.End(); ) {
 			Urho3D::IntVector2 const& chunk_pos = *i;
-			if ((chunk_pos - origin).Length() > undergrowth_radius_chunks + 1) {
+			if (getDistanceToViewers(chunk_pos) > undergrowth_radius_chunks + 1) {
 				// This chunk is too far away
 				Chunk* chunk = getChunk(chunk_pos);
 				// Check if chunk isn't even loaded
@@ -629,8 +2362,6 @@ void ChunkWorld::startCreatingUndergrowth()
 			}
 		}
 	}
-
-// TODO: Update undergrowth when ground height changes!
 }
 
 void ChunkWorld::updateUndergrowth()
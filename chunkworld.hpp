@@ -2,14 +2,27 @@
 #define BIGWORLD_CHUNKWORLD_HPP
 
 #include "chunk.hpp"
+#include "chunkdelta.hpp"
+#include "chunkgenerator.hpp"
 #include "types.hpp"
 #include "camera.hpp"
+#include "heightfieldshape.hpp"
+#include "horizonring.hpp"
+#include "splatatlas.hpp"
+#include "superchunk.hpp"
 
 #include <Urho3D/Container/HashMap.h>
 #include <Urho3D/Container/Ptr.h>
 #include <Urho3D/Container/Vector.h>
 #include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Graphics/Texture2DArray.h>
+#include <Urho3D/Graphics/Viewport.h>
+#include <Urho3D/Math/Rect.h>
 #include <Urho3D/Math/Vector2.h>
+#include <Urho3D/Math/Vector3.h>
+
+#include <functional>
 
 namespace BigWorld
 {
@@ -24,6 +37,21 @@ class ChunkWorld : public Urho3D::Object
 
 public:
 
+	// Called before Chunk is evicted, so it can be stored if it has been modified
+	typedef std::function<void(Urho3D::IntVector2 const& chunk_pos, Chunk const* chunk)> ChunkWriteBack;
+
+	// Modifies one corner. Position of the corner is relative
+	// to the center of the Chunk that was given to editTerrain().
+	typedef std::function<void(Urho3D::Vector2 const& pos, Corner& corner)> TerrainBrush;
+
+	// Called when corners of Chunk have changed. "area" is inclusive and in the
+	// corner coordinates of Chunk. Versions are the edit versions of Chunk before
+	// and after the change. This can be given to ChunkDeltaRecorder::record().
+	typedef std::function<void(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool heights_changed, bool ttypes_changed, unsigned base_version, unsigned version)> ChunkEditListener;
+
+	// If "data_only" is true, then ChunkWorld only stores heights and terraintypes.
+	// It has no Scene, and its Chunks have no Nodes, Materials or LODs. This is
+	// meant for servers. Height, normal and raycast queries are still available.
 	ChunkWorld(
 		Urho3D::Context* context,
 		unsigned chunk_width,
@@ -31,8 +59,10 @@ public:
 		float heightstep,
 		unsigned terrain_texture_repeats,
 		unsigned undergrowth_radius_chunks,
-		float undergrowth_draw_distance, bool headless
+		float undergrowth_draw_distance, bool headless,
+		bool data_only = false
 	);
+	virtual ~ChunkWorld();
 
 	void addTerrainTexture(Urho3D::String const& name);
 	inline unsigned getNumOfTerrainTextures() const { return texs_names.Size(); }
@@ -42,10 +72,120 @@ public:
 
 	inline Urho3D::Scene* getScene() const { return scene; }
 
-	// This can be called only once.
-	Camera* setUpCamera(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& pos, float yaw = 0, float pitch = 0, float roll = 0, unsigned viewdistance_in_chunks = 8);
+	// Adds a viewer. Every Camera has its own viewarea and LODs, but Chunks share
+	// cached LODs and their building. If there are multiple Cameras, then each of
+	// them needs its own bits in "viewmask". Terrain of Camera is only visible to
+	// it, and view masks of Urho3D Cameras are set so they do not see the bits of
+	// the others. Origin follows the first Camera, so the others should not go
+	// too far away from it. Water reflection is only rendered for the first one.
+	Camera* setUpCamera(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& pos, float yaw = 0, float pitch = 0, float roll = 0, unsigned viewdistance_in_chunks = 8, unsigned viewmask = Urho3D::DEFAULT_VIEWMASK);
+	void removeCamera(Camera* camera);
+	inline unsigned getNumOfCameras() const { return viewers.Size() - (hasWaterReflectionViewer() ? 1 : 0); }
+	inline Camera* getCamera(unsigned index = 0) const { return viewers[index].camera; }
+
+	// Makes Chunks with multiple terraintypes to store their blend maps to shared
+	// atlas textures. Chunks that use the same set of terraintypes will also share
+	// one Material. This should be called before Chunks are added.
+	void setUpSplatAtlas(unsigned slots_per_side = 16);
+	inline bool usesSplatAtlas() const { return splat_atlas_slots_per_side > 0; }
+
+	// Makes all Chunks to use one Material, where terrain textures are stored to
+	// a texture array. This way any amount of terraintypes can be rendered in one
+	// pass. Every corner blends its two strongest terraintypes. Splat atlas is set
+	// up automatically. All terrain textures must have same size and format, and
+	// "BigWorldTerrainArray" technique and shaders from "Data" must be available.
+	// There are only GLSL shaders, so this throws with Direct3D backends.
+	void setUpTerrainTextureArray(unsigned splat_atlas_slots_per_side = 32);
+	inline bool usesTerrainTextureArray() const { return terrain_tex_array_enabled; }
+
+	// Builds LODs as right-triangulated irregular networks instead of uniform
+	// grids, so flat areas get less triangles than steep ones. LOD "n" differs
+	// from the real heights at most "max_error" times 2^n. Borders are built
+	// with the accuracy of LOD zero, so neighbors of any LODs match without
+	// gaps. Full detail LODs can not be updated in place then. Width of Chunk
+	// must be a power of two. This must be called before Chunks are added.
+	void setUpAdaptiveLods(float max_error);
+	inline float getLodMaxError() const { return lod_max_error; }
+
+	// Tells how Chunks should store their terraintypes to images
+	uint8_t getTerraintypeImageMode() const;
+
+	// Enables skipping of Chunks that are hidden behind the terrain of nearer
+	// Chunks. Viewarea is culled again when camera moves more than "eye_margin"
+	// away from the position that was used to cull the previous viewarea. Hidden
+	// Chunks are hidden with everything on them, so "object_height" should be
+	// the height of the tallest undergrowth or objects above the terrain.
+	void setHorizonCulling(bool enabled, float eye_margin = 4, float object_height = 0);
+
+	// Makes viewarea to prefer Chunks that are in the view of Camera. Chunks
+	// outside the view, extended by "rotation_margin" degrees, are shown with
+	// any LOD they already have, or with the coarsest one. They are upgraded to
+	// their real LODs at background, when there is nothing more important to do.
+	void setFrustumAwareViewarea(bool enabled, float rotation_margin = 30);
+
+	// Draws distant Chunks as merged meshes of blocks, that have the same
+	// amount of squares and one Material like a single Chunk. Beyond "distance"
+	// Chunks, blocks of 2x2 Chunks are merged, beyond twice the distance blocks
+	// of 4x4 Chunks, and so on, up to blocks of 2^max_level x 2^max_level.
+	// Blocks must be narrower than Chunk is in squares. Blocks that have water
+	// patches are not merged. Zero distance disables merging.
+	void setUpSuperChunks(float distance, unsigned max_level = 3);
+
+	// Renders terrain from "level" of HeightPyramid beyond the viewarea of the
+	// first Camera, up to "radius" Chunks. Tiles are read one per frame as
+	// the Camera moves. Ring is sunk by "sink" below the real Chunks, so it
+	// does not show through them. Far clip of Camera needs to be set too.
+	void setUpHorizonRing(HeightPyramid* pyramid, unsigned level, float radius, float sink = 2);
+
+#ifdef URHO3D_PHYSICS
+	// Adds static collision shapes of Chunks to the PhysicsWorld of Scene. Shapes
+	// are built at background for Chunks that are within "radius" from Camera or
+	// from any physics focus Node. They are removed when they are further than
+	// "radius + hysteresis" from all of them.
+	void setUpPhysics(float radius, float hysteresis, unsigned collision_layer = 1, unsigned collision_mask = 0xffff);
+	void addPhysicsFocus(Urho3D::Node* node);
+	void removePhysicsFocus(Urho3D::Node* node);
+#endif
 
+	// Evicts far away Chunks automatically. Rendering resources of hidden Chunks
+	// that are further than "render_radius" Chunks are released, and if memory use
+	// is over "byte_budget", then the furthest hidden ones are released too. If
+	// "data_radius" is not zero, then Chunks further than it are removed, and so
+	// are the furthest ones outside view distance, if memory use is still over
+	// budget. "write_back" is called before removing. Zero budget means no limit.
+	void setUpEviction(float render_radius, float data_radius = 0, unsigned long long byte_budget = 0, ChunkWriteBack const& write_back = ChunkWriteBack());
+	// Makes Chunks that are further than "radius" Chunks to hibernate, so
+	// they keep their corners only in a compressed form. They can still be
+	// queried and shown, and they are woken up when they come within radius.
+	void setUpHibernation(float radius);
+	// Does both hibernation and eviction. This is called automatically, if there
+	// is Camera. Otherwise it should be called manually, for example by servers.
+	void evictChunks(Urho3D::IntVector2 const& center);
+
+	// If "water_plane_width" is zero, then instead of one big plane, every
+	// Chunk gets its own water patch over the squares that are below water.
+	// Patches are built together with LODs.
 	void setUpWaterReflection(unsigned baseheight, float height, Urho3D::Material* water_material, float water_plane_width, unsigned water_viewmask = 0x80000000);
+	// Gives different water level to Chunks in "area", for example to make lakes
+	// at different altitudes. Area is inclusive, and later regions override
+	// earlier ones. This requires water patches. Reflection is still calculated
+	// from the water level that was given to setUpWaterReflection().
+	void addWaterRegion(Urho3D::IntRect const& area, unsigned baseheight, float height);
+	// Lowers the cost of water reflection. Reflection texture is "texture_size"
+	// pixels wide and high, and it is rendered at most every "interval_frames"
+	// frame. If thresholds are given, then it is rendered only after Camera has
+	// moved more than "move_threshold" units or turned more than "turn_threshold"
+	// degrees since the previous rendering. Changes of origin, water height and
+	// aspect ratio always render it. Throttled reflection is rendered even if
+	// water is not visible, so without throttling it is better to use interval 1.
+	void setWaterReflectionQuality(unsigned texture_size, unsigned interval_frames = 1, float move_threshold = 0, float turn_threshold = 0);
+	// Lowers the amount of geometry in water reflection. If "viewmask" is given,
+	// then reflection gets its own viewarea, where LODs are "lod_bias" levels
+	// coarser than the first Camera uses, and Chunks that are completely below
+	// water are left out. Reflection needs its own bits in viewmask for this,
+	// and without them it shows the same Chunks as the first Camera. Undergrowth
+	// is left out from reflection, unless "undergrowth" is true.
+	void setWaterReflectionDetail(unsigned viewmask, unsigned lod_bias = 1, bool undergrowth = false);
 
 	inline unsigned getChunkWidth() const { return chunk_width; }
 	inline float getChunkWidthFloat() const { return chunk_width * sqr_width; }
@@ -53,11 +193,35 @@ public:
 	inline float getHeightstep() const { return heightstep; }
 	inline unsigned getTerrainTextureRepeats() const { return terrain_texture_repeats; }
 	inline float getUndergrowthDrawDistance() const { return undergrowth_draw_distance; }
+
+	inline bool hasWaterPatches() const { return water_patches; }
+	// Changes when water level of Chunk changes, so outdated water patches can be detected
+	unsigned getWaterVersion(Urho3D::IntVector2 const& chunk_pos) const;
+	inline Urho3D::Material* getWaterMaterial() const { return water_material; }
+	inline unsigned getWaterViewMask() const { return water_viewmask; }
+	// Returns water level at Chunk, relative to "baseheight"
+	float getWaterHeight(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight) const;
+	// Undergrowth uses viewmask of water plane, if it is hidden from reflection
+	inline unsigned getUndergrowthViewMask() const { return water_refl && !water_refl_undergrowth ? water_viewmask : Urho3D::DEFAULT_VIEWMASK; }
 	inline Urho3D::String getTerrainTextureName(uint8_t ttype) const { return texs_names[ttype]; }
 
 	inline bool isHeadless() const { return headless; }
+	inline bool isDataOnly() const { return data_only; }
+
+	// Statistics of streaming and rendering. Chunks update these too.
+	inline PipelineCounters const& getPipelineCounters() const { return counters; }
+	inline PipelineCounters& getPipelineCounters() { return counters; }
+	// Counters are always collected. Rest of the stats are gathered
+	// from Chunks when this is called, so avoid calling it every frame.
+	void getStats(ChunkWorldStats& result) const;
 
 	float getHeightFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const;
+	Urho3D::Vector3 getNormalFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos) const;
+
+	// Casts a ray against the terrain. Ray and result are relative to the center
+	// of Chunk at "chunk_pos" and to "baseheight". Returns false if nothing is hit
+	// within "max_distance", or if the ray reaches an area that is not loaded.
+	bool raycast(Urho3D::Vector3& result, Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& begin, Urho3D::Vector3 const& dir, float max_distance) const;
 
 	float getHeightFromCorners(float h_sw, float h_nw, float h_ne, float h_se, Urho3D::Vector2 const& sqr_pos) const;
 	Urho3D::Vector3 getNormalFromCorners(float h_sw, float h_nw, float h_ne, float h_se, Urho3D::Vector2 const& sqr_pos) const;
@@ -65,6 +229,31 @@ public:
 	inline Urho3D::IntVector2 getOrigin() const { return origin; }
 	inline unsigned getOriginHeight() const { return origin_height; }
 
+	// Applies "brush" to every corner inside "area". Area is relative to the center of
+	// Chunk at "chunk_pos". Corners of Chunks that are not loaded are skipped. Only the
+	// LODs, Materials, undergrowth and collision shapes of the affected Chunks are
+	// rebuilt at background. Old ones are shown until the new ones are ready.
+	void editTerrain(Urho3D::IntVector2 const& chunk_pos, Urho3D::Rect const& area, TerrainBrush const& brush);
+
+	// Listener is called by editTerrain() and applyChunkDelta()
+	void setChunkEditListener(ChunkEditListener const& listener);
+
+	// Applies an edit that was made to another copy of the world, for example
+	// at server. Returns false if Chunk is not loaded, if its edit version is
+	// not the base version of delta, or if delta is invalid. Then the whole
+	// Chunk should be requested again. Only the affected Chunks are invalidated.
+	bool applyChunkDelta(ChunkDelta const& delta);
+
+	// Chunks can be generated procedurally at worker threads, instead of
+	// giving their corners to addChunk(). Call generateChunks() repeatedly,
+	// for example every frame. It adds the Chunks that have been generated
+	// since the previous call, and starts generating missing ones within
+	// "radius" from "center", nearest first, keeping at most "max_tasks"
+	// running. Results that are outside the radius are thrown away.
+	// Returns how many Chunks are still being generated.
+	void setChunkGenerator(ChunkGenerator* generator);
+	unsigned generateChunks(Urho3D::IntVector2 const& center, unsigned radius, unsigned max_tasks = 16);
+
 	void addChunk(Urho3D::IntVector2 const& chunk_pos, Chunk* chunk);
 	void removeChunk(Urho3D::IntVector2 const& chunk_pos);
 	Chunk* getChunk(Urho3D::IntVector2 const& chunk_pos);
@@ -75,14 +264,136 @@ public:
 	// is not enough Chunks loaded, then "result" is not touched.
 	void extractCornersData(Corners& result, Urho3D::IntVector2 const& pos) const;
 
+	// Gets the current snapshots of corners of Chunk at "pos" and its neighbors,
+	// so the same corners can be extracted later, even at worker threads. Returns
+	// false and leaves "result" empty if there is not enough Chunks loaded.
+	bool getCornersSnapshots(CornersSnapshots& result, Urho3D::IntVector2 const& pos) const;
+
+	// Returns heights of corners in "area", that is inclusive and relative to the
+	// first corner of Chunk at "pos". Area can extend to other Chunks. Rows are
+	// stored from south to north. If some of the Chunks are not loaded, then
+	// "result" is not touched.
+	void extractHeightsData(Urho3D::PODVector<uint16_t>& result, Urho3D::IntVector2 const& pos, Urho3D::IntRect const& area) const;
+
 	// This is used by Chunks. Returns NULL if Material is not yet ready.
 	Urho3D::Material* getSingleLayerTerrainMaterial(uint8_t ttype);
 
+	// This is used by Chunks. Returns NULL if textures are not yet loaded.
+	Urho3D::SharedPtr<Urho3D::Material> createTerrainBlendMaterial(TTypes const& ttypes, Urho3D::Texture2D* blend_tex, float detail_tiling, unsigned weight_map_width);
+
+	// This is used by Chunks. Reserves a slot from splat atlas that is meant for
+	// specific terraintypes. Returns false if Material of atlas is not yet ready.
+	// If texture array is used, then terraintypes are ignored.
+	bool reserveSplatSlot(SplatSlot& result, TTypes const& ttypes);
+
+	// This is used by Chunks. Tells if a viewarea being built uses given LOD of Chunk.
+	bool isLodNeededByNewViewarea(Urho3D::IntVector2 const& chunk_pos, uint8_t lod) const;
+
 private:
 
 	typedef Urho3D::HashMap<uint8_t, Urho3D::SharedPtr<Urho3D::Material> > SingleLayerMaterialsCache;
+	typedef Urho3D::Vector<Urho3D::SharedPtr<SplatAtlas> > SplatAtlases;
+	typedef Urho3D::HashMap<unsigned, SplatAtlases> SplatAtlasesByTerraintypes;
 	typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::SharedPtr<Chunk> > Chunks;
 	typedef Urho3D::HashSet<Urho3D::IntVector2> IntVector2Set;
+	// Super-chunks by the position of their southwestern Chunk and level
+	typedef Urho3D::HashMap<Urho3D::IntVector3, Urho3D::SharedPtr<SuperChunk> > SuperChunks;
+	typedef Urho3D::HashSet<Urho3D::IntVector3> SuperChunkArea;
+
+	struct GeneratingChunk
+	{
+		Urho3D::SharedPtr<Urho3D::WorkItem> workitem;
+		Urho3D::SharedPtr<ChunkGeneratingTaskData> data;
+	};
+	typedef Urho3D::HashMap<Urho3D::IntVector2, GeneratingChunk> GeneratingChunks;
+
+	// Changed area of Chunk, in its own corner coordinates
+	struct ChunkInvalidation
+	{
+		Urho3D::IntRect area;
+		bool ttypes_changed;
+	};
+	typedef Urho3D::HashMap<Urho3D::IntVector2, ChunkInvalidation> ChunkInvalidations;
+
+	// Camera and its own viewareas
+	struct Viewer
+	{
+		Urho3D::SharedPtr<Camera> camera;
+		unsigned viewmask;
+		// Viewer of water reflection uses the Camera of the first viewer
+		bool water_refl;
+
+		ViewArea va;
+		// Chunk position that "va" was calculated around
+		Urho3D::IntVector2 va_center;
+		// Chunks of viewarea that are still waiting for their real LODs
+		ViewArea va_lazy;
+
+		// Viewarea before culling. When only the eye moves,
+		// culling is applied to this again.
+		ViewArea va_unculled;
+
+		// These are used when building new viewarea. Eye is
+		// relative to the origin of the viewarea being built.
+		ViewArea va_being_built;
+		Urho3D::IntVector2 va_being_built_center;
+		Urho3D::Vector3 va_being_built_eye;
+		ViewArea va_being_built_lazy;
+
+		// Super-chunks that replace their Chunks in the viewareas
+		SuperChunkArea sca;
+		SuperChunkArea sca_being_built;
+	};
+	typedef Urho3D::Vector<Viewer> Viewers;
+
+	struct LazyChunk
+	{
+		Urho3D::IntVector2 pos;
+		unsigned viewer;
+		uint8_t lod;
+		float angle;
+		float distance;
+
+		inline bool operator<(LazyChunk const& other) const
+		{
+			if (angle != other.angle) return angle < other.angle;
+			return distance < other.distance;
+		}
+	};
+
+	struct WaterRegion
+	{
+		Urho3D::IntRect area;
+		unsigned baseheight;
+		float height;
+		// Water version of the Chunks in area
+		unsigned version;
+	};
+	typedef Urho3D::PODVector<WaterRegion> WaterRegions;
+
+	// Furthest Chunks are evicted first
+	struct EvictionCandidate
+	{
+		Urho3D::IntVector2 pos;
+		float distance;
+
+		inline bool operator<(EvictionCandidate const& other) const
+		{
+			return distance > other.distance;
+		}
+	};
+
+	// Super-chunks that have been hidden for the longest time are removed first
+	struct HiddenSuperChunk
+	{
+		Urho3D::IntVector3 key;
+		unsigned last_shown;
+
+		inline bool operator<(HiddenSuperChunk const& other) const
+		{
+			return last_shown < other.last_shown;
+		}
+	};
 
 	Urho3D::SharedPtr<Urho3D::Scene> scene;
 
@@ -97,42 +408,219 @@ private:
 	UndergrowthModelsByTerraintype ugmodels;
 
 	bool headless;
+	bool data_only;
 
 	SingleLayerMaterialsCache mats_cache;
 
-	Urho3D::SharedPtr<Camera> camera;
+	// Splat atlases, mapped by the used terraintypes
+	unsigned splat_atlas_slots_per_side;
+	SplatAtlasesByTerraintypes splat_atlases;
+
+	// Texture array of all terrain textures
+	bool terrain_tex_array_enabled;
+	Urho3D::SharedPtr<Urho3D::Texture2DArray> terrain_tex_array;
+
+	Viewers viewers;
+
+	// Horizon culling
+	bool horizon_culling;
+	float horizon_culling_eye_margin;
+	// Added to the highest terrain of Chunks that might be hidden, so
+	// undergrowth and other children of their Nodes do not pop up.
+	float horizon_culling_object_height;
+
+	// Frustum aware viewarea
+	bool frustum_aware_va;
+	float frustum_aware_va_margin;
+
+	// If positive, LODs are adaptive
+	float lod_max_error;
+
+	// Super-chunks. Besides the shown ones, and the ones that are being prepared,
+	// at most as many hidden ones are kept, so moving back and forth over the
+	// distance of a level does not build them again.
+	float super_chunk_distance;
+	unsigned super_chunk_max_level;
+	SuperChunks super_chunks;
+
+	Urho3D::SharedPtr<HorizonRing> horizon_ring;
+
+	// Eviction
+	bool eviction;
+	float eviction_render_radius;
+	float eviction_data_radius;
+	unsigned long long eviction_byte_budget;
+	ChunkWriteBack eviction_write_back;
+	unsigned eviction_frames_left;
+
+	// Hibernation
+	bool hibernation;
+	float hibernation_radius;
+
+#ifdef URHO3D_PHYSICS
+	typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::SharedPtr<HeightfieldCollider> > HeightfieldColliders;
+
+	// Physics
+	Urho3D::WeakPtr<Urho3D::PhysicsWorld> physics_world;
+	float physics_radius;
+	float physics_hysteresis;
+	unsigned physics_collision_layer;
+	unsigned physics_collision_mask;
+	Urho3D::Vector<Urho3D::WeakPtr<Urho3D::Node> > physics_focuses;
+	HeightfieldColliders colliders;
+	// Colliders of edited Chunks, that are used until new ones are ready
+	HeightfieldColliders outdated_colliders;
+#endif
 
 	// Water reflection
 	bool water_refl;
 	unsigned water_baseheight;
 	float water_height;
+	unsigned water_viewmask;
 	Urho3D::Node* water_node;
+	Urho3D::SharedPtr<Urho3D::Material> water_material;
+	bool water_patches;
+	WaterRegions water_regions;
+	// Latest water version, and the one of Chunks outside regions
+	unsigned water_version;
+	unsigned water_base_version;
 	Urho3D::Camera* water_refl_camera;
+	Urho3D::SharedPtr<Urho3D::Texture2D> water_refl_tex;
+	Urho3D::SharedPtr<Urho3D::Viewport> water_refl_viewport;
+	unsigned water_refl_tex_size;
+	unsigned water_refl_interval;
+	float water_refl_move_threshold;
+	float water_refl_turn_threshold;
+	// State that reflection plane and the previous rendering were done with
+	bool water_refl_plane_valid;
+	Urho3D::IntVector2 water_refl_origin;
+	unsigned water_refl_origin_height;
+	float water_refl_aspect;
+	unsigned water_refl_frames_left;
+	// Used to check that the interval holds
+	unsigned water_refl_frames_since_queued;
+	Urho3D::Vector3 water_refl_rendered_pos;
+	Urho3D::Vector3 water_refl_rendered_dir;
+	unsigned water_refl_lod_bias;
+	bool water_refl_undergrowth;
 
 	Chunks chunks;
 
+	ChunkEditListener edit_listener;
+
+	// Procedural generation of Chunks
+	Urho3D::SharedPtr<ChunkGenerator> generator;
+	GeneratingChunks generating_chunks;
+
+	PipelineCounters counters;
+	unsigned long long lod_prepare_usec_last_frame;
+
 	// Chunks that are waiting for undergrowth to
 	// load and Chunks that have undergrowth in them
 	IntVector2Set chunks_missing_undergrowth;
 	IntVector2Set chunks_having_undergrowth;
 
-	// View details
-	ViewArea va;
+	// View details. Viewareas of all viewers share the same origin.
 	Urho3D::IntVector2 origin;
 	unsigned origin_height;
 
 	// This is enabled if viewarea changes
 	bool viewarea_recalculation_required;
+	// This is enabled if only the hidden Chunks of viewarea change
+	bool viewarea_reculling_required;
 
-	// These are used when building new viewarea
-	ViewArea va_being_built;
+	// These are used when building new viewareas
 	Urho3D::IntVector2 va_being_built_origin;
 	unsigned va_being_built_origin_height;
-	unsigned va_being_built_view_distance_in_chunks;
+
+	// Returns height of a corner. Coordinates can go outside the Chunk,
+	// in which case neighbor Chunks are used. Returns false if the
+	// Chunk that contains the corner is not loaded.
+	bool getCornerHeight(uint16_t& result, Urho3D::IntVector2 const& chunk_pos, int x, int y) const;
+
+	// Finds heights of corners of the square at "pos" and the position inside that square.
+	// Heights are relative to "baseheight". Throws an exception if some Chunks are missing.
+	void getSquareHeightsFloat(float& h_sw, float& h_nw, float& h_ne, float& h_se, Urho3D::Vector2& sqr_pos, Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const;
 
 	void handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData);
 
+	void updateFrame();
+
+	// Updates reflection plane if it has changed, and decides if reflection is rendered this frame
 	void updateWaterReflection();
+	// Sets up reflection texture, and how often it is rendered
+	void updateWaterReflectionTexture();
+
+#ifdef URHO3D_PHYSICS
+	// Creates and removes collision shapes near focuses
+	void updatePhysics();
+	// Moves collision shapes to match the current origin
+	void updatePhysicsPositions();
+	// Gets snapshots of Chunk and its eastern, northeastern and northern
+	// neighbors to NGB_* indices of "result". Other indices are left NULL.
+	// Returns false if some of the Chunks are not loaded.
+	bool getHeightfieldSnapshots(CornersSnapshots& result, Urho3D::IntVector2 const& pos) const;
+#endif
+
+	// Tells if any viewer has new viewarea being built
+	bool isViewareaBeingBuilt() const;
+
+	// Returns position of Camera relative to the given origin
+	Urho3D::Vector3 getEye(Camera const* camera, Urho3D::IntVector2 const& origin, unsigned origin_height) const;
+
+	// Distance in Chunks from "pos" to the nearest viewer, or
+	// infinity if there are no viewers with viewareas.
+	float getDistanceToViewers(Urho3D::IntVector2 const& pos) const;
+
+	// Sets view masks of Urho3D Cameras, so they only see their own terrain
+	void updateCameraViewMasks();
+
+	// Viewer of water reflection is always the last one, after Cameras
+	inline bool hasWaterReflectionViewer() const { return !viewers.Empty() && viewers.Back().water_refl; }
+
+	// Removes Chunks from the viewarea that is being built, if they are hidden
+	void applyHorizonCulling(Viewer& viewer);
+
+	// Removes Chunks from the viewarea that is being built, if they are below water
+	void applyWaterReflectionCulling(Viewer& viewer);
+
+	// Replaces distant blocks of Chunks in the viewarea that is being built with super-chunks
+	void applySuperChunks(Viewer& viewer);
+	SuperChunk* getOrCreateSuperChunk(Urho3D::IntVector3 const& key);
+	void hideSuperChunks(Viewer const& viewer);
+	// Marks super-chunks outdated, if they contain the Chunk or use its corners
+	void invalidateSuperChunks(Urho3D::IntVector2 const& chunk_pos);
+
+	// Tells horizon ring which Chunks the first Camera sees for real
+	void updateHorizonRingCoverage();
+
+	// Uses cached LODs for Chunks that are not in the view of viewarea that is
+	// being built, and marks them to be upgraded later. Chunks without any
+	// cached LODs use "coarsest_lod".
+	void applyFrustumAwareness(Viewer& viewer, uint8_t coarsest_lod);
+
+	// Returns how many degrees Chunk is outside the view of Camera
+	// horizontally. Zero means that Chunk is at least partly in the view.
+	float getChunkAngleFromView(Camera const* camera, Urho3D::IntVector2 const& rel_pos, Urho3D::Vector3 const& eye) const;
+
+	// Upgrades lazy Chunks to their real LODs
+	void upgradeLazyChunks();
+
+	// Adds invalidation of edited "area" of Chunk at "chunk_pos". Rendered data of
+	// Chunk uses corners from -1 to chunk_width + 1, so if the area is near the
+	// edges, then the neighbors are invalidated too.
+	void addInvalidation(ChunkInvalidations& invalidations, Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& area, bool ttypes_changed);
+	// Invalidates Chunks, their undergrowth and collision shapes
+	void applyInvalidations(ChunkInvalidations const& invalidations);
+
+	// Hibernates far Chunks and wakes up near ones
+	void updateHibernation(Urho3D::IntVector2 const& center);
+
+	// Tells if Chunk is visible, is going to be visible, or has undergrowth
+	bool isChunkInUse(Urho3D::IntVector2 const& pos) const;
+
+	// Returns NULL if textures are not yet loaded
+	Urho3D::Texture2DArray* getTerrainTextureArray();
 
 	void startCreatingUndergrowth();
 	void updateUndergrowth();
@@ -0,0 +1,152 @@
+#include "compactcorners.hpp"
+
+#include <Urho3D/Container/HashMap.h>
+
+namespace BigWorld
+{
+
+CompactCorners::CompactCorners(Corners const& corners, unsigned chunk_w) :
+chunk_w(chunk_w),
+wide_indices(false)
+{
+	assert(corners.Size() == chunk_w * chunk_w);
+
+	// Heights. First corner of row is stored as it is, and the
+	// rest as differences to the corner before them.
+	row_offsets.Reserve(chunk_w);
+	for (unsigned y = 0; y < chunk_w; ++ y) {
+		row_offsets.Push(heights.Size());
+		Corner const* row = &corners[y * chunk_w];
+		writeVarint(heights, row[0].height);
+		for (unsigned x = 1; x < chunk_w; ++ x) {
+			writeVarint(heights, zigzagEncode(int32_t(row[x].height) - int32_t(row[x - 1].height)));
+		}
+	}
+
+	// Palette of terraintypes. Entries are found by a simple hash of their bytes.
+	Urho3D::HashMap<unsigned, Urho3D::PODVector<unsigned> > entries_by_hash;
+	Urho3D::PODVector<unsigned> indices;
+	indices.Reserve(corners.Size());
+	for (unsigned i = 0; i < corners.Size(); ++ i) {
+		TTypesByWeight const& ttypes = corners[i].ttypes;
+		unsigned hash = ttypes.size();
+		for (unsigned ttype_i = 0; ttype_i < ttypes.size(); ++ ttype_i) {
+			hash = hash * 31 + ttypes.getKey(ttype_i);
+			hash = hash * 31 + ttypes.getValueByte(ttype_i);
+		}
+
+		Urho3D::PODVector<unsigned>& same_hash = entries_by_hash[hash];
+		unsigned index = palette_offsets.Size();
+		for (unsigned entry_i = 0; entry_i < same_hash.Size(); ++ entry_i) {
+			uint8_t const* entry = &palette[palette_offsets[same_hash[entry_i]]];
+			bool match = entry[0] == ttypes.size();
+			for (unsigned ttype_i = 0; match && ttype_i < ttypes.size(); ++ ttype_i) {
+				match = entry[1 + ttype_i * 2] == ttypes.getKey(ttype_i) && entry[2 + ttype_i * 2] == ttypes.getValueByte(ttype_i);
+			}
+			if (match) {
+				index = same_hash[entry_i];
+				break;
+			}
+		}
+
+		// New entry
+		if (index == palette_offsets.Size()) {
+			palette_offsets.Push(palette.Size());
+			palette.Push(ttypes.size());
+			for (unsigned ttype_i = 0; ttype_i < ttypes.size(); ++ ttype_i) {
+				palette.Push(ttypes.getKey(ttype_i));
+				palette.Push(ttypes.getValueByte(ttype_i));
+			}
+			same_hash.Push(index);
+		}
+
+		indices.Push(index);
+	}
+
+	wide_indices = palette_offsets.Size() > 256;
+	ttype_indices.Reserve(indices.Size() * (wide_indices ? 2 : 1));
+	for (unsigned i = 0; i < indices.Size(); ++ i) {
+		ttype_indices.Push(indices[i] & 0xff);
+		if (wide_indices) {
+			ttype_indices.Push(indices[i] >> 8);
+		}
+	}
+
+	heights.Compact();
+	palette.Compact();
+	palette_offsets.Compact();
+}
+
+void CompactCorners::decode(Corners& result) const
+{
+	assert(result.Empty());
+	result.Reserve(chunk_w * chunk_w);
+	for (unsigned y = 0; y < chunk_w; ++ y) {
+		copyRow(result, 0, y, chunk_w);
+	}
+}
+
+uint16_t CompactCorners::getHeight(unsigned x, unsigned y) const
+{
+	uint16_t result;
+	copyHeightRow(&result, x, y, 1);
+	return result;
+}
+
+void CompactCorners::copyRow(Corners& result, unsigned x, unsigned y, unsigned size) const
+{
+	assert(x + size <= chunk_w);
+	assert(y < chunk_w);
+
+	Urho3D::PODVector<uint16_t> row_heights(size);
+	copyHeightRow(row_heights.Buffer(), x, y, size);
+
+	for (unsigned i = 0; i < size; ++ i) {
+		// Fill in place, so terraintypes are not copied
+		result.Push(Corner());
+		Corner& corner = result.Back();
+		corner.height = row_heights[i];
+		uint8_t const* entry = &palette[palette_offsets[getPaletteIndex(x + i + y * chunk_w)]];
+		corner.ttypes.initRawFill(entry[0]);
+		for (unsigned ttype_i = 0; ttype_i < entry[0]; ++ ttype_i) {
+			corner.ttypes.rawFillByte(entry[1 + ttype_i * 2], entry[2 + ttype_i * 2]);
+		}
+	}
+}
+
+void CompactCorners::copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const
+{
+	assert(x + size <= chunk_w);
+	assert(y < chunk_w);
+
+	uint8_t const* src = &heights[row_offsets[y]];
+	int32_t height = readVarint(src);
+	for (unsigned i = 0; i < x + size; ++ i) {
+		if (i > 0) {
+			height += zigzagDecode(readVarint(src));
+		}
+		if (i >= x) {
+			result[i - x] = height;
+		}
+	}
+}
+
+unsigned long long CompactCorners::getMemoryUse() const
+{
+	return sizeof(CompactCorners) +
+	       heights.Capacity() +
+	       row_offsets.Capacity() * sizeof(unsigned) +
+	       palette.Capacity() +
+	       palette_offsets.Capacity() * sizeof(unsigned) +
+	       ttype_indices.Capacity();
+}
+
+unsigned CompactCorners::getPaletteIndex(unsigned corner_i) const
+{
+	if (wide_indices) {
+		return ttype_indices[corner_i * 2] | (ttype_indices[corner_i * 2 + 1] << 8);
+	}
+	return ttype_indices[corner_i];
+}
+
+}
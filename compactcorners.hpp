@@ -0,0 +1,86 @@
+#ifndef BIGWORLD_COMPACTCORNERS_HPP
+#define BIGWORLD_COMPACTCORNERS_HPP
+
+#include "types.hpp"
+
+#include <Urho3D/Container/Vector.h>
+
+namespace BigWorld
+{
+
+// Zigzag coding maps small negative and positive numbers to small unsigned ones
+inline uint32_t zigzagEncode(int32_t value)
+{
+	return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+inline int32_t zigzagDecode(uint32_t value)
+{
+	return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+// Seven bits per byte, highest bit tells if more bytes follow
+inline void writeVarint(Urho3D::PODVector<uint8_t>& dest, uint32_t value)
+{
+	while (value >= 0x80) {
+		dest.Push(uint8_t(value | 0x80));
+		value >>= 7;
+	}
+	dest.Push(uint8_t(value));
+}
+
+inline uint32_t readVarint(uint8_t const*& src)
+{
+	uint32_t result = 0;
+	unsigned shift = 0;
+	while (*src & 0x80) {
+		result |= uint32_t(*src ++ & 0x7f) << shift;
+		shift += 7;
+	}
+	result |= uint32_t(*src ++) << shift;
+	return result;
+}
+
+// Compressed, read only copy of corners of a Chunk. Every row of heights is
+// delta coded with zigzag varints, so single rows can be decoded without the
+// rest. Terraintypes are stored to a palette, and corners refer to it with
+// one or two byte indices.
+class CompactCorners
+{
+
+public:
+
+	CompactCorners(Corners const& corners, unsigned chunk_w);
+
+	// Decodes all corners to "result", that must be empty
+	void decode(Corners& result) const;
+
+	// Has to decode the beginning of the row, so this is slower than reading Corners
+	uint16_t getHeight(unsigned x, unsigned y) const;
+
+	// Appends "size" corners, or just their heights, from row "y" starting at "x"
+	void copyRow(Corners& result, unsigned x, unsigned y, unsigned size) const;
+	void copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const;
+
+	unsigned long long getMemoryUse() const;
+
+private:
+
+	unsigned chunk_w;
+
+	Urho3D::PODVector<uint8_t> heights;
+	Urho3D::PODVector<unsigned> row_offsets;
+
+	// Every entry is the amount of terraintypes and then their (key, weight) pairs
+	Urho3D::PODVector<uint8_t> palette;
+	Urho3D::PODVector<unsigned> palette_offsets;
+	// Indices are two bytes, if palette does not fit one byte
+	Urho3D::PODVector<uint8_t> ttype_indices;
+	bool wide_indices;
+
+	unsigned getPaletteIndex(unsigned corner_i) const;
+};
+
+}
+
+#endif
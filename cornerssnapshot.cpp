@@ -0,0 +1,138 @@
+#include "cornerssnapshot.hpp"
+
+namespace BigWorld
+{
+
+CornersSnapshot::CornersSnapshot(Corners& corners, unsigned chunk_w, unsigned epoch) :
+chunk_w(chunk_w),
+epoch(epoch),
+compact(NULL)
+{
+	assert(corners.Size() == chunk_w * chunk_w);
+	this->corners.Swap(corners);
+}
+
+CornersSnapshot::~CornersSnapshot()
+{
+	delete compact;
+}
+
+CornersSnapshot* CornersSnapshot::createCompressed() const
+{
+	assert(!compact);
+	return new CornersSnapshot(new CompactCorners(corners, chunk_w), chunk_w, epoch);
+}
+
+CornersSnapshot* CornersSnapshot::createDecompressed() const
+{
+	Corners copy;
+	copyCorners(copy);
+	return new CornersSnapshot(copy, chunk_w, epoch);
+}
+
+void CornersSnapshot::copyRow(Corners& result, unsigned x, unsigned y, unsigned size) const
+{
+	assert(size <= chunk_w - x);
+	assert(y < chunk_w);
+	if (compact) {
+		compact->copyRow(result, x, y, size);
+		return;
+	}
+	unsigned ofs = y * chunk_w + x;
+	result.Insert(result.End(), corners.Begin() + ofs, corners.Begin() + ofs + size);
+}
+
+void CornersSnapshot::copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const
+{
+	assert(size <= chunk_w - x);
+	assert(y < chunk_w);
+	if (compact) {
+		compact->copyHeightRow(result, x, y, size);
+		return;
+	}
+	Corner const* row = &corners[y * chunk_w + x];
+	for (unsigned i = 0; i < size; ++ i) {
+		result[i] = row[i].height;
+	}
+}
+
+void CornersSnapshot::copyCorners(Corners& result) const
+{
+	assert(result.Empty());
+	if (compact) {
+		compact->decode(result);
+	} else {
+		result = corners;
+	}
+}
+
+Corners& CornersSnapshot::getEditableCorners()
+{
+	assert(!compact);
+	assert(Refs() <= 1);
+	return corners;
+}
+
+unsigned long long CornersSnapshot::getMemoryUse() const
+{
+	if (compact) {
+		return compact->getMemoryUse();
+	}
+	unsigned long long result = corners.Capacity() * sizeof(Corner);
+	for (unsigned i = 0; i < corners.Size(); ++ i) {
+		result += corners[i].ttypes.size() * 2;
+	}
+	return result;
+}
+
+CornersSnapshot::CornersSnapshot(CompactCorners* compact, unsigned chunk_w, unsigned epoch) :
+chunk_w(chunk_w),
+epoch(epoch),
+compact(compact)
+{
+}
+
+void extractCornersData(Corners& result, CornersSnapshots const& snapshots, unsigned chunk_w)
+{
+	assert(result.Empty());
+	assert(snapshots.Size() == NGB_COUNT);
+
+	// One extra for position data, and two more
+	// to calculate neighbor positions for normal.
+	unsigned result_w = chunk_w + 3;
+
+	// Prepare result
+	result.Reserve(result_w * result_w);
+
+	// South edge
+	// Southwest corner, never used
+	result.Push(Corner());
+	// South edge
+	snapshots[NGB_S]->copyRow(result, 0, chunk_w - 1, chunk_w);
+	// Southeast corner
+	snapshots[NGB_SE]->copyRow(result, 0, chunk_w - 1, 2);
+
+	// Middle row
+	for (unsigned y = 0; y < chunk_w; ++ y) {
+		// West part
+		snapshots[NGB_W]->copyRow(result, chunk_w - 1, y, 1);
+		// Middle part
+		snapshots[NGB_CENTER]->copyRow(result, 0, y, chunk_w);
+		// East part
+		snapshots[NGB_E]->copyRow(result, 0, y, 2);
+	}
+
+	// Two northern rows
+	for (unsigned y = 0; y < 2; ++ y) {
+		// Northwest corner
+		snapshots[NGB_NW]->copyRow(result, chunk_w - 1, y, 1);
+		// North edge
+		snapshots[NGB_N]->copyRow(result, 0, y, chunk_w);
+		// Northeast corner
+		snapshots[NGB_NE]->copyRow(result, 0, y, 2);
+	}
+
+	assert(result.Size() == result_w * result_w);
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef BIGWORLD_CORNERSSNAPSHOT_HPP
+#define BIGWORLD_CORNERSSNAPSHOT_HPP
+
+#include "compactcorners.hpp"
+#include "types.hpp"
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/RefCounted.h>
+
+namespace BigWorld
+{
+
+// Indices of CornersSnapshots of a Chunk and its neighbors. Southwest
+// neighbor is not needed.
+unsigned const NGB_CENTER = 0;
+unsigned const NGB_S = 1;
+unsigned const NGB_SE = 2;
+unsigned const NGB_E = 3;
+unsigned const NGB_NE = 4;
+unsigned const NGB_N = 5;
+unsigned const NGB_NW = 6;
+unsigned const NGB_W = 7;
+unsigned const NGB_COUNT = 8;
+
+// Immutable corners of a Chunk. When corners are edited, Chunk publishes a
+// new snapshot with a bigger epoch, and background tasks keep reading the
+// ones they were given, so readers never need to lock. Corners are stored
+// either as they are, or compressed, if Chunk is hibernating. References
+// must only be added and released at the main thread.
+class CornersSnapshot : public Urho3D::RefCounted
+{
+
+public:
+
+	// Content of "corners" is swapped to the snapshot
+	CornersSnapshot(Corners& corners, unsigned chunk_w, unsigned epoch);
+	virtual ~CornersSnapshot();
+
+	// Returns a compressed or uncompressed copy with the same epoch.
+	// Compressed copy can only be created from an uncompressed snapshot.
+	CornersSnapshot* createCompressed() const;
+	CornersSnapshot* createDecompressed() const;
+
+	inline unsigned getEpoch() const { return epoch; }
+	inline bool isCompressed() const { return compact != NULL; }
+
+	inline Corners const& getCorners() const { assert(!compact); return corners; }
+	inline uint16_t getHeight(unsigned x, unsigned y) const { return compact ? compact->getHeight(x, y) : corners[x + y * chunk_w].height; }
+
+	// Appends "size" corners, or just their heights, from row "y" starting at "x"
+	void copyRow(Corners& result, unsigned x, unsigned y, unsigned size) const;
+	void copyHeightRow(uint16_t* result, unsigned x, unsigned y, unsigned size) const;
+
+	// Copies all corners to "result", that must be empty
+	void copyCorners(Corners& result) const;
+
+	// Snapshot can be modified only if it is uncompressed, and if nobody
+	// else has a reference to it. This should only be used by Chunk.
+	Corners& getEditableCorners();
+	inline void increaseEpoch() { ++ epoch; }
+
+	unsigned long long getMemoryUse() const;
+
+private:
+
+	unsigned chunk_w;
+	unsigned epoch;
+
+	// Only one of these is used
+	Corners corners;
+	CompactCorners* compact;
+
+	// Takes ownership of "compact"
+	CornersSnapshot(CompactCorners* compact, unsigned chunk_w, unsigned epoch);
+};
+
+// Extracts the same corners from snapshots of a Chunk and its neighbors,
+// that ChunkWorld::extractCornersData() extracts from the Chunks. This
+// can be called at worker threads. "result" must be empty.
+void extractCornersData(Corners& result, CornersSnapshots const& snapshots, unsigned chunk_w);
+
+}
+
+#endif
@@ -0,0 +1,278 @@
+#include "heightfieldshape.hpp"
+
+#ifdef URHO3D_PHYSICS
+
+#include "tracer.hpp"
+
+#include <Bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorld.h>
+#include <Bullet/LinearMath/btAabbUtil2.h>
+
+#include <Urho3D/Math/MathDefs.h>
+
+#include <cassert>
+#include <cstdlib>
+
+namespace BigWorld
+{
+
+HeightfieldShape::HeightfieldShape(CornersSnapshots const& snapshots, unsigned width, float sqr_width, float heightstep, unsigned baseheight) :
+snapshot(snapshots[NGB_CENTER]),
+snapshot_e(snapshots[NGB_E]),
+snapshot_ne(snapshots[NGB_NE]),
+snapshot_n(snapshots[NGB_N]),
+width(width),
+sqr_width(sqr_width),
+heightstep(heightstep),
+baseheight(baseheight),
+scaling(1, 1, 1)
+{
+	assert(snapshot && snapshot_e && snapshot_ne && snapshot_n);
+
+	m_shapeType = CUSTOM_CONCAVE_SHAPE_TYPE;
+
+	// Calculate lowest and highest heights of blocks
+	blocks_width = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blocks_lowest.Resize(blocks_width * blocks_width);
+	blocks_highest.Resize(blocks_width * blocks_width);
+	uint16_t lowest = getHeight(0, 0);
+	uint16_t highest = lowest;
+	for (unsigned block_y = 0; block_y < blocks_width; ++ block_y) {
+		for (unsigned block_x = 0; block_x < blocks_width; ++ block_x) {
+			unsigned block_i = block_x + block_y * blocks_width;
+			blocks_lowest[block_i] = getHeight(block_x * BLOCK_SIZE, block_y * BLOCK_SIZE);
+			blocks_highest[block_i] = blocks_lowest[block_i];
+			// Blocks share their edges with each others
+			for (unsigned y = block_y * BLOCK_SIZE; y <= Urho3D::Min(width, (block_y + 1) * BLOCK_SIZE); ++ y) {
+				for (unsigned x = block_x * BLOCK_SIZE; x <= Urho3D::Min(width, (block_x + 1) * BLOCK_SIZE); ++ x) {
+					uint16_t height = getHeight(x, y);
+					blocks_lowest[block_i] = Urho3D::Min(blocks_lowest[block_i], height);
+					blocks_highest[block_i] = Urho3D::Max(blocks_highest[block_i], height);
+				}
+			}
+			lowest = Urho3D::Min(lowest, blocks_lowest[block_i]);
+			highest = Urho3D::Max(highest, blocks_highest[block_i]);
+		}
+	}
+
+	float const WIDTH_F_HALF = width * sqr_width / 2;
+	local_aabb_min.setValue(-WIDTH_F_HALF, (int(lowest) - int(baseheight)) * heightstep, -WIDTH_F_HALF);
+	local_aabb_max.setValue(WIDTH_F_HALF, (int(highest) - int(baseheight)) * heightstep, WIDTH_F_HALF);
+}
+
+void HeightfieldShape::getAabb(btTransform const& t, btVector3& aabb_min, btVector3& aabb_max) const
+{
+	btVector3 scaled_min = local_aabb_min * scaling;
+	btVector3 scaled_max = local_aabb_max * scaling;
+	// Negative scaling might swap the limits
+	btVector3 real_min = scaled_min;
+	btVector3 real_max = scaled_max;
+	real_min.setMin(scaled_max);
+	real_max.setMax(scaled_min);
+	btTransformAabb(real_min, real_max, getMargin(), t, aabb_min, aabb_max);
+}
+
+void HeightfieldShape::processAllTriangles(btTriangleCallback* callback, btVector3 const& aabb_min, btVector3 const& aabb_max) const
+{
+	// Convert AABB to unscaled space of corners
+	btVector3 query_min = aabb_min / scaling;
+	btVector3 query_max = aabb_max / scaling;
+	btVector3 temp = query_min;
+	query_min.setMin(query_max);
+	query_max.setMax(temp);
+
+	float const WIDTH_F_HALF = width * sqr_width / 2;
+	int sqr_x_begin = Urho3D::Max(0, Urho3D::FloorToInt((query_min.x() + WIDTH_F_HALF) / sqr_width));
+	int sqr_y_begin = Urho3D::Max(0, Urho3D::FloorToInt((query_min.z() + WIDTH_F_HALF) / sqr_width));
+	int sqr_x_end = Urho3D::Min(int(width), Urho3D::CeilToInt((query_max.x() + WIDTH_F_HALF) / sqr_width));
+	int sqr_y_end = Urho3D::Min(int(width), Urho3D::CeilToInt((query_max.z() + WIDTH_F_HALF) / sqr_width));
+	if (sqr_x_begin >= sqr_x_end || sqr_y_begin >= sqr_y_end) {
+		return;
+	}
+	int query_lowest = Urho3D::FloorToInt(query_min.y() / heightstep) + int(baseheight);
+	int query_highest = Urho3D::CeilToInt(query_max.y() / heightstep) + int(baseheight);
+
+	for (unsigned block_y = sqr_y_begin / BLOCK_SIZE; block_y * BLOCK_SIZE < unsigned(sqr_y_end); ++ block_y) {
+		for (unsigned block_x = sqr_x_begin / BLOCK_SIZE; block_x * BLOCK_SIZE < unsigned(sqr_x_end); ++ block_x) {
+			// Skip blocks that are completely above or below the AABB
+			unsigned block_i = block_x + block_y * blocks_width;
+			if (int(blocks_lowest[block_i]) > query_highest || int(blocks_highest[block_i]) < query_lowest) {
+				continue;
+			}
+
+			unsigned y_end = Urho3D::Min<unsigned>(sqr_y_end, (block_y + 1) * BLOCK_SIZE);
+			unsigned x_end = Urho3D::Min<unsigned>(sqr_x_end, (block_x + 1) * BLOCK_SIZE);
+			for (unsigned y = Urho3D::Max<unsigned>(sqr_y_begin, block_y * BLOCK_SIZE); y < y_end; ++ y) {
+				for (unsigned x = Urho3D::Max<unsigned>(sqr_x_begin, block_x * BLOCK_SIZE); x < x_end; ++ x) {
+					int h_sw = getHeight(x, y);
+					int h_se = getHeight(x + 1, y);
+					int h_nw = getHeight(x, y + 1);
+					int h_ne = getHeight(x + 1, y + 1);
+
+					// Skip squares that are completely above or below the AABB
+					if (Urho3D::Min(Urho3D::Min(h_sw, h_se), Urho3D::Min(h_nw, h_ne)) > query_highest ||
+					    Urho3D::Max(Urho3D::Max(h_sw, h_se), Urho3D::Max(h_nw, h_ne)) < query_lowest) {
+						continue;
+					}
+
+					btVector3 pos_sw = getCornerPosition(x, y);
+					btVector3 pos_se = getCornerPosition(x + 1, y);
+					btVector3 pos_nw = getCornerPosition(x, y + 1);
+					btVector3 pos_ne = getCornerPosition(x + 1, y + 1);
+
+					// Use the same diagonal as Chunk::getTriangles()
+					btVector3 tri[3];
+					int tri_i = (x + y * width) * 2;
+					if (abs(h_sw - h_ne) < abs(h_se - h_nw)) {
+						tri[0] = pos_sw;
+						tri[1] = pos_ne;
+						tri[2] = pos_se;
+						callback->processTriangle(tri, 0, tri_i);
+						tri[0] = pos_sw;
+						tri[1] = pos_nw;
+						tri[2] = pos_ne;
+						callback->processTriangle(tri, 0, tri_i + 1);
+					} else {
+						tri[0] = pos_sw;
+						tri[1] = pos_nw;
+						tri[2] = pos_se;
+						callback->processTriangle(tri, 0, tri_i);
+						tri[0] = pos_nw;
+						tri[1] = pos_ne;
+						tri[2] = pos_se;
+						callback->processTriangle(tri, 0, tri_i + 1);
+					}
+				}
+			}
+		}
+	}
+}
+
+void HeightfieldShape::calculateLocalInertia(btScalar mass, btVector3& inertia) const
+{
+	(void)mass;
+	// Terrain is always static
+	inertia.setValue(0, 0, 0);
+}
+
+void HeightfieldShape::setLocalScaling(btVector3 const& scaling)
+{
+	this->scaling = scaling;
+}
+
+btVector3 const& HeightfieldShape::getLocalScaling() const
+{
+	return scaling;
+}
+
+char const* HeightfieldShape::getName() const
+{
+	return "BigWorldHeightfield";
+}
+
+btVector3 HeightfieldShape::getCornerPosition(unsigned x, unsigned y) const
+{
+	float const WIDTH_F_HALF = width * sqr_width / 2;
+	btVector3 pos(
+		x * sqr_width - WIDTH_F_HALF,
+		(int(getHeight(x, y)) - int(baseheight)) * heightstep,
+		y * sqr_width - WIDTH_F_HALF
+	);
+	return pos * scaling;
+}
+
+void buildHeightfieldShape(Urho3D::WorkItem const* item, unsigned threadIndex)
+{
+	(void)threadIndex;
+
+	HeightfieldShapeTaskData* data = (HeightfieldShapeTaskData*)item->aux_;
+	TraceScope trace("BuildHeightfieldShape");
+	data->shape = new HeightfieldShape(data->snapshots, data->chunk_width, data->sqr_width, data->heightstep, data->baseheight);
+}
+
+HeightfieldCollider::HeightfieldCollider(
+	Urho3D::WorkQueue* workqueue,
+	Urho3D::PhysicsWorld* physics_world,
+	CornersSnapshots& snapshots,
+	unsigned baseheight,
+	unsigned chunk_width,
+	float sqr_width,
+	float heightstep,
+	unsigned collision_layer,
+	unsigned collision_mask
+) :
+workqueue(workqueue),
+physics_world(physics_world),
+baseheight(baseheight),
+collision_layer(collision_layer),
+collision_mask(collision_mask),
+shape(NULL),
+object_added(false)
+{
+	object = new btCollisionObject();
+	object->setCollisionFlags(object->getCollisionFlags() | btCollisionObject::CF_STATIC_OBJECT);
+
+	task_data = new HeightfieldShapeTaskData;
+	this->snapshots.Swap(snapshots);
+	task_data->snapshots = this->snapshots;
+	task_data->baseheight = baseheight;
+	task_data->chunk_width = chunk_width;
+	task_data->sqr_width = sqr_width;
+	task_data->heightstep = heightstep;
+	task_workitem = new Urho3D::WorkItem();
+	task_workitem->workFunction_ = buildHeightfieldShape;
+	task_workitem->aux_ = task_data;
+	workqueue->AddWorkItem(task_workitem);
+}
+
+HeightfieldCollider::~HeightfieldCollider()
+{
+	// If there is a building task, make sure it is completed.
+	if (task_workitem.NotNull() && !task_workitem->completed_) {
+		if (!workqueue->RemoveWorkItem(task_workitem)) {
+			while (!task_workitem->completed_) {
+				// Wait, wait...
+			}
+		}
+	}
+
+	if (object_added && physics_world.NotNull()) {
+		physics_world->GetWorld()->removeCollisionObject(object);
+	}
+	delete object;
+	delete shape;
+}
+
+void HeightfieldCollider::update()
+{
+	if (object_added || !task_workitem->completed_) {
+		return;
+	}
+	if (physics_world.Null()) {
+		return;
+	}
+
+	// Take shape from the task
+	shape = task_data->shape;
+	task_data->shape = NULL;
+	task_workitem = NULL;
+	task_data = NULL;
+
+	object->setCollisionShape(shape);
+	physics_world->GetWorld()->addCollisionObject(object, collision_layer, collision_mask);
+	object_added = true;
+}
+
+void HeightfieldCollider::setPosition(Urho3D::Vector3 const& pos)
+{
+	btTransform transf;
+	transf.setIdentity();
+	transf.setOrigin(btVector3(pos.x_, pos.y_, pos.z_));
+	object->setWorldTransform(transf);
+	if (object_added && physics_world.NotNull()) {
+		physics_world->GetWorld()->updateSingleAabb(object);
+	}
+}
+
+}
+
+#endif
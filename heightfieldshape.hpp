@@ -0,0 +1,156 @@
+#ifndef BIGWORLD_HEIGHTFIELDSHAPE_HPP
+#define BIGWORLD_HEIGHTFIELDSHAPE_HPP
+
+#ifdef URHO3D_PHYSICS
+
+#include "cornerssnapshot.hpp"
+
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Math/Vector3.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+
+#include <Bullet/BulletCollision/CollisionDispatch/btCollisionObject.h>
+#include <Bullet/BulletCollision/CollisionShapes/btConcaveShape.h>
+
+#include <cstdint>
+
+namespace BigWorld
+{
+
+// Collision shape of one Chunk. Triangles are generated from the heights
+// only when Bullet asks for them, and they are split using the same
+// diagonal as the rendered terrain and Chunk::getTriangles(). Heights are
+// read straight from the CornersSnapshots of the Chunk and its neighbors,
+// so they are not copied. Shape is centered like the Nodes of Chunks, and
+// heights are relative to baseheight.
+class HeightfieldShape : public btConcaveShape
+{
+
+public:
+
+	// "snapshots" must have the Chunk and its eastern, northeastern and northern
+	// neighbors at NGB_* indices. They are not referenced, so they must be kept
+	// alive as long as the shape exists.
+	HeightfieldShape(CornersSnapshots const& snapshots, unsigned width, float sqr_width, float heightstep, unsigned baseheight);
+
+	virtual void getAabb(btTransform const& t, btVector3& aabb_min, btVector3& aabb_max) const;
+	virtual void processAllTriangles(btTriangleCallback* callback, btVector3 const& aabb_min, btVector3 const& aabb_max) const;
+
+	virtual void calculateLocalInertia(btScalar mass, btVector3& inertia) const;
+
+	virtual void setLocalScaling(btVector3 const& scaling);
+	virtual btVector3 const& getLocalScaling() const;
+
+	virtual char const* getName() const;
+
+private:
+
+	// Size of blocks, that are used to skip squares quickly
+	static unsigned const BLOCK_SIZE = 8;
+
+	CornersSnapshot const* snapshot;
+	CornersSnapshot const* snapshot_e;
+	CornersSnapshot const* snapshot_ne;
+	CornersSnapshot const* snapshot_n;
+	unsigned width;
+	float sqr_width;
+	float heightstep;
+	unsigned baseheight;
+
+	btVector3 scaling;
+
+	// Lowest and highest heights of blocks
+	unsigned blocks_width;
+	Urho3D::PODVector<uint16_t> blocks_lowest;
+	Urho3D::PODVector<uint16_t> blocks_highest;
+
+	btVector3 local_aabb_min;
+	btVector3 local_aabb_max;
+
+	// Corners at the eastern and northern edges are read from the neighbors
+	inline uint16_t getHeight(unsigned x, unsigned y) const
+	{
+		if (x < width) {
+			return y < width ? snapshot->getHeight(x, y) : snapshot_n->getHeight(x, 0);
+		}
+		return y < width ? snapshot_e->getHeight(0, y) : snapshot_ne->getHeight(0, 0);
+	}
+
+	btVector3 getCornerPosition(unsigned x, unsigned y) const;
+};
+
+struct HeightfieldShapeTaskData : public Urho3D::RefCounted
+{
+	// Input
+	CornersSnapshots snapshots;
+	unsigned baseheight;
+	// World options
+	unsigned chunk_width;
+	float sqr_width;
+	float heightstep;
+	// Output
+	HeightfieldShape* shape;
+
+	inline HeightfieldShapeTaskData() : shape(NULL) {}
+	inline ~HeightfieldShapeTaskData() { delete shape; }
+};
+
+void buildHeightfieldShape(Urho3D::WorkItem const* item, unsigned threadIndex);
+
+// Static collision object of one Chunk. Shape is built at background,
+// and the object is added to PhysicsWorld once the shape is ready.
+class HeightfieldCollider : public Urho3D::RefCounted
+{
+
+public:
+
+	// Content of "snapshots" is taken. See HeightfieldShape for what it must contain.
+	HeightfieldCollider(
+		Urho3D::WorkQueue* workqueue,
+		Urho3D::PhysicsWorld* physics_world,
+		CornersSnapshots& snapshots,
+		unsigned baseheight,
+		unsigned chunk_width,
+		float sqr_width,
+		float heightstep,
+		unsigned collision_layer,
+		unsigned collision_mask
+	);
+	virtual ~HeightfieldCollider();
+
+	// Adds collision object to PhysicsWorld if the shape is ready.
+	void update();
+	inline bool isAdded() const { return object_added; }
+
+	inline unsigned getBaseHeight() const { return baseheight; }
+
+	// Position of the center of Chunk, relative to the origin of Scene.
+	void setPosition(Urho3D::Vector3 const& pos);
+
+private:
+
+	Urho3D::WorkQueue* workqueue;
+	Urho3D::WeakPtr<Urho3D::PhysicsWorld> physics_world;
+
+	unsigned baseheight;
+	unsigned collision_layer;
+	unsigned collision_mask;
+
+	Urho3D::SharedPtr<Urho3D::WorkItem> task_workitem;
+	Urho3D::SharedPtr<HeightfieldShapeTaskData> task_data;
+
+	// Heights of the shape. These are released after the shape is deleted.
+	CornersSnapshots snapshots;
+	HeightfieldShape* shape;
+	btCollisionObject* object;
+	bool object_added;
+};
+
+}
+
+#endif
+
+#endif
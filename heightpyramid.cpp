@@ -0,0 +1,410 @@
+#include "heightpyramid.hpp"
+
+#include "compactcorners.hpp"
+
+#include <Urho3D/IO/VectorBuffer.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+unsigned const FILE_VERSION = 1;
+
+// Protects from allocating huge buffers because of invalid data
+unsigned const MAX_TILE_WIDTH = 1024;
+unsigned const MAX_LEVELS = 32;
+unsigned const MAX_TILES_PER_LEVEL = 16 * 1024 * 1024;
+
+// Samples of one level, that cover a rectangle of sample coordinates
+struct SampleGrid
+{
+	Urho3D::IntVector2 origin;
+	int width;
+	int height;
+	Urho3D::PODVector<uint16_t> heights;
+	Urho3D::PODVector<uint8_t> ttypes;
+
+	inline bool contains(int x, int y) const
+	{
+		return x >= origin.x_ && y >= origin.y_ && x < origin.x_ + width && y < origin.y_ + height;
+	}
+
+	inline unsigned getIndex(int x, int y) const
+	{
+		return (x - origin.x_) + (y - origin.y_) * width;
+	}
+};
+
+inline int ceilDiv(int a, int b)
+{
+	return -floorDiv(-a, b);
+}
+
+uint8_t getDominantTType(TTypesByWeight const& ttypes)
+{
+	uint8_t result = PYRAMID_NO_DATA;
+	uint8_t result_weight = 0;
+	for (unsigned i = 0; i < ttypes.size(); ++ i) {
+		if (ttypes.getValueByte(i) > result_weight) {
+			result = ttypes.getKey(i);
+			result_weight = ttypes.getValueByte(i);
+		}
+	}
+	// Corner without any weights still has data
+	return result == PYRAMID_NO_DATA ? 0 : result;
+}
+
+// Samples of the next level are at every other sample. Heights are averaged
+// with a tent filter, and terraintype is the one that has most weight there.
+void downsample(SampleGrid& result, SampleGrid const& src)
+{
+	result.origin = Urho3D::IntVector2(ceilDiv(src.origin.x_, 2), ceilDiv(src.origin.y_, 2));
+	result.width = Urho3D::Max(floorDiv(src.origin.x_ + src.width - 1, 2) - result.origin.x_ + 1, 0);
+	result.height = Urho3D::Max(floorDiv(src.origin.y_ + src.height - 1, 2) - result.origin.y_ + 1, 0);
+	result.heights.Resize(result.width * result.height);
+	result.ttypes.Resize(result.width * result.height);
+
+	unsigned ttype_weights[PYRAMID_NO_DATA];
+	for (int y = result.origin.y_; y < result.origin.y_ + result.height; ++ y) {
+		for (int x = result.origin.x_; x < result.origin.x_ + result.width; ++ x) {
+			unsigned result_i = result.getIndex(x, y);
+			if (src.ttypes[src.getIndex(x * 2, y * 2)] == PYRAMID_NO_DATA) {
+				result.heights[result_i] = 0;
+				result.ttypes[result_i] = PYRAMID_NO_DATA;
+				continue;
+			}
+
+			memset(ttype_weights, 0, sizeof(ttype_weights));
+			unsigned total_height = 0;
+			unsigned total_weight = 0;
+			for (int dy = -1; dy <= 1; ++ dy) {
+				for (int dx = -1; dx <= 1; ++ dx) {
+					int src_x = x * 2 + dx;
+					int src_y = y * 2 + dy;
+					if (!src.contains(src_x, src_y)) {
+						continue;
+					}
+					unsigned src_i = src.getIndex(src_x, src_y);
+					uint8_t ttype = src.ttypes[src_i];
+					if (ttype == PYRAMID_NO_DATA) {
+						continue;
+					}
+					unsigned weight = (2 - Urho3D::Abs(dx)) * (2 - Urho3D::Abs(dy));
+					total_height += src.heights[src_i] * weight;
+					total_weight += weight;
+					ttype_weights[ttype] += weight;
+				}
+			}
+
+			uint8_t dominant = 0;
+			for (unsigned ttype = 1; ttype < PYRAMID_NO_DATA; ++ ttype) {
+				if (ttype_weights[ttype] > ttype_weights[dominant]) {
+					dominant = ttype;
+				}
+			}
+			result.heights[result_i] = (total_height + total_weight / 2) / total_weight;
+			result.ttypes[result_i] = dominant;
+		}
+	}
+}
+
+// Like in ChunkDelta, exact for planes
+inline int predictHeight(uint16_t const* heights, unsigned x, unsigned y, unsigned width)
+{
+	unsigned i = x + y * width;
+	if (x > 0 && y > 0) {
+		return int(heights[i - 1]) + int(heights[i - width]) - int(heights[i - 1 - width]);
+	}
+	if (x > 0) {
+		return heights[i - 1];
+	}
+	if (y > 0) {
+		return heights[i - width];
+	}
+	return 0;
+}
+
+// Heights are stored as prediction errors, and samples without data get the
+// predicted height, so they cost one byte. Terraintypes are run length coded.
+// Returns false if tile has no data, and then nothing is written.
+bool writeTile(Urho3D::VectorBuffer& dest, SampleGrid const& grid, Urho3D::IntVector2 const& tile_pos, unsigned tile_width)
+{
+	unsigned const W1 = tile_width + 1;
+
+	HeightPyramid::Tile tile;
+	tile.heights.Resize(W1 * W1);
+	tile.ttypes.Resize(W1 * W1);
+	bool has_data = false;
+	for (unsigned y = 0; y < W1; ++ y) {
+		for (unsigned x = 0; x < W1; ++ x) {
+			int grid_x = tile_pos.x_ * tile_width + x;
+			int grid_y = tile_pos.y_ * tile_width + y;
+			unsigned i = x + y * W1;
+			if (grid.contains(grid_x, grid_y) && grid.ttypes[grid.getIndex(grid_x, grid_y)] != PYRAMID_NO_DATA) {
+				tile.heights[i] = grid.heights[grid.getIndex(grid_x, grid_y)];
+				tile.ttypes[i] = grid.ttypes[grid.getIndex(grid_x, grid_y)];
+				has_data = true;
+			} else {
+				tile.heights[i] = Urho3D::Clamp(predictHeight(tile.heights.Buffer(), x, y, W1), 0, 0xffff);
+				tile.ttypes[i] = PYRAMID_NO_DATA;
+			}
+		}
+	}
+	if (!has_data) {
+		return false;
+	}
+
+	for (unsigned y = 0; y < W1; ++ y) {
+		for (unsigned x = 0; x < W1; ++ x) {
+			int error = int(tile.heights[x + y * W1]) - predictHeight(tile.heights.Buffer(), x, y, W1);
+			dest.WriteVLE(zigzagEncode(error));
+		}
+	}
+
+	unsigned run_start = 0;
+	for (unsigned i = 1; i <= tile.ttypes.Size(); ++ i) {
+		if (i == tile.ttypes.Size() || tile.ttypes[i] != tile.ttypes[run_start]) {
+			dest.WriteVLE(i - run_start - 1);
+			dest.WriteUByte(tile.ttypes[run_start]);
+			run_start = i;
+		}
+	}
+
+	return true;
+}
+
+// Reading past the end gives undefined values, so check it first
+inline bool readVLE(unsigned& result, Urho3D::Deserializer& src)
+{
+	if (src.IsEof()) {
+		return false;
+	}
+	result = src.ReadVLE();
+	return true;
+}
+
+}
+
+bool HeightPyramid::build(
+	Urho3D::Serializer& dest,
+	ChunkLoader const& loader,
+	Urho3D::IntRect const& chunks_area,
+	unsigned chunk_width,
+	unsigned sample_spacing,
+	unsigned tile_width,
+	unsigned levels
+)
+{
+	if (sample_spacing == 0 || chunk_width % sample_spacing != 0) {
+		throw std::runtime_error("Sample spacing of height pyramid must divide the width of Chunk!");
+	}
+	if (tile_width == 0 || tile_width > MAX_TILE_WIDTH || levels == 0 || levels > MAX_LEVELS) {
+		throw std::runtime_error("Invalid tile width or number of levels for height pyramid!");
+	}
+
+	int const SAMPLES_PER_CHUNK = chunk_width / sample_spacing;
+
+	// Sample level zero from Chunks
+	SampleGrid grid;
+	grid.origin = Urho3D::IntVector2(chunks_area.left_, chunks_area.top_) * SAMPLES_PER_CHUNK;
+	grid.width = (chunks_area.right_ - chunks_area.left_ + 1) * SAMPLES_PER_CHUNK;
+	grid.height = (chunks_area.bottom_ - chunks_area.top_ + 1) * SAMPLES_PER_CHUNK;
+	grid.heights.Resize(grid.width * grid.height);
+	grid.ttypes.Resize(grid.width * grid.height);
+	memset(grid.heights.Buffer(), 0, grid.heights.Size() * sizeof(uint16_t));
+	memset(grid.ttypes.Buffer(), PYRAMID_NO_DATA, grid.ttypes.Size());
+
+	Urho3D::IntVector2 chunk_pos;
+	for (chunk_pos.y_ = chunks_area.top_; chunk_pos.y_ <= chunks_area.bottom_; ++ chunk_pos.y_) {
+		for (chunk_pos.x_ = chunks_area.left_; chunk_pos.x_ <= chunks_area.right_; ++ chunk_pos.x_) {
+			Corners corners;
+			if (!loader(corners, chunk_pos)) {
+				continue;
+			}
+			if (corners.Size() != chunk_width * chunk_width) {
+				throw std::runtime_error("Array of corners has invalid size!");
+			}
+			for (int y = 0; y < SAMPLES_PER_CHUNK; ++ y) {
+				for (int x = 0; x < SAMPLES_PER_CHUNK; ++ x) {
+					Corner const& corner = corners[(x + y * chunk_width) * sample_spacing];
+					unsigned i = grid.getIndex(chunk_pos.x_ * SAMPLES_PER_CHUNK + x, chunk_pos.y_ * SAMPLES_PER_CHUNK + y);
+					grid.heights[i] = corner.height;
+					grid.ttypes[i] = getDominantTType(corner.ttypes);
+				}
+			}
+		}
+	}
+
+	// Encode tiles of all levels. Index is written before the data,
+	// so the offsets must be known before writing anything.
+	Urho3D::VectorBuffer data;
+	Levels result_levels;
+	for (unsigned level = 0; level < levels; ++ level) {
+		if (level > 0) {
+			SampleGrid next;
+			downsample(next, grid);
+			grid = next;
+		}
+
+		Level result_level;
+		result_level.tiles.left_ = floorDiv(grid.origin.x_, tile_width);
+		result_level.tiles.top_ = floorDiv(grid.origin.y_, tile_width);
+		result_level.tiles.right_ = floorDiv(grid.origin.x_ + Urho3D::Max(grid.width, 1) - 1, tile_width);
+		result_level.tiles.bottom_ = floorDiv(grid.origin.y_ + Urho3D::Max(grid.height, 1) - 1, tile_width);
+		Urho3D::IntVector2 tile_pos;
+		for (tile_pos.y_ = result_level.tiles.top_; tile_pos.y_ <= result_level.tiles.bottom_; ++ tile_pos.y_) {
+			for (tile_pos.x_ = result_level.tiles.left_; tile_pos.x_ <= result_level.tiles.right_; ++ tile_pos.x_) {
+				unsigned offset = data.GetSize();
+				result_level.offsets.Push(writeTile(data, grid, tile_pos, tile_width) ? offset + 1 : 0);
+			}
+		}
+		result_levels.Push(result_level);
+	}
+
+	// Header and index
+	if (!dest.WriteFileID("BWHP")) return false;
+	if (!dest.WriteVLE(FILE_VERSION)) return false;
+	if (!dest.WriteVLE(chunk_width)) return false;
+	if (!dest.WriteVLE(sample_spacing)) return false;
+	if (!dest.WriteVLE(tile_width)) return false;
+	if (!dest.WriteVLE(levels)) return false;
+	for (unsigned level = 0; level < levels; ++ level) {
+		Level const& result_level = result_levels[level];
+		if (!dest.WriteVLE(zigzagEncode(result_level.tiles.left_))) return false;
+		if (!dest.WriteVLE(zigzagEncode(result_level.tiles.top_))) return false;
+		if (!dest.WriteVLE(result_level.tiles.right_ - result_level.tiles.left_)) return false;
+		if (!dest.WriteVLE(result_level.tiles.bottom_ - result_level.tiles.top_)) return false;
+		for (unsigned i = 0; i < result_level.offsets.Size(); ++ i) {
+			if (!dest.WriteUInt(result_level.offsets[i])) return false;
+		}
+	}
+
+	return dest.Write(data.GetData(), data.GetSize()) == data.GetSize();
+}
+
+HeightPyramid::HeightPyramid() :
+src(NULL),
+data_start(0),
+chunk_width(0),
+sample_spacing(0),
+tile_width(0)
+{
+}
+
+bool HeightPyramid::open(Urho3D::Deserializer* src)
+{
+	this->src = NULL;
+	levels.Clear();
+
+	if (src->ReadFileID() != "BWHP") {
+		return false;
+	}
+	unsigned version;
+	unsigned levels_size;
+	if (!readVLE(version, *src) || version != FILE_VERSION) return false;
+	if (!readVLE(chunk_width, *src)) return false;
+	if (!readVLE(sample_spacing, *src)) return false;
+	if (!readVLE(tile_width, *src)) return false;
+	if (!readVLE(levels_size, *src)) return false;
+	if (sample_spacing == 0 || tile_width == 0 || tile_width > MAX_TILE_WIDTH || levels_size > MAX_LEVELS) {
+		return false;
+	}
+
+	for (unsigned level_i = 0; level_i < levels_size; ++ level_i) {
+		unsigned left;
+		unsigned top;
+		unsigned width_minus_one;
+		unsigned height_minus_one;
+		if (!readVLE(left, *src)) return false;
+		if (!readVLE(top, *src)) return false;
+		if (!readVLE(width_minus_one, *src)) return false;
+		if (!readVLE(height_minus_one, *src)) return false;
+		if (width_minus_one >= MAX_TILES_PER_LEVEL || height_minus_one >= MAX_TILES_PER_LEVEL / (width_minus_one + 1)) {
+			return false;
+		}
+
+		Level level;
+		level.tiles.left_ = zigzagDecode(left);
+		level.tiles.top_ = zigzagDecode(top);
+		level.tiles.right_ = level.tiles.left_ + width_minus_one;
+		level.tiles.bottom_ = level.tiles.top_ + height_minus_one;
+		level.offsets.Resize((width_minus_one + 1) * (height_minus_one + 1));
+		if (src->Read(level.offsets.Buffer(), level.offsets.Size() * sizeof(unsigned)) != level.offsets.Size() * sizeof(unsigned)) {
+			return false;
+		}
+		levels.Push(level);
+	}
+
+	this->src = src;
+	data_start = src->GetPosition();
+	return true;
+}
+
+bool HeightPyramid::hasTile(unsigned level, Urho3D::IntVector2 const& tile_pos) const
+{
+	int index = getTileIndex(level, tile_pos);
+	return index >= 0 && levels[level].offsets[index] > 0;
+}
+
+bool HeightPyramid::readTile(Tile& result, unsigned level, Urho3D::IntVector2 const& tile_pos)
+{
+	int index = getTileIndex(level, tile_pos);
+	if (index < 0 || levels[level].offsets[index] == 0) {
+		return false;
+	}
+	unsigned pos = data_start + levels[level].offsets[index] - 1;
+	if (src->Seek(pos) != pos) {
+		return false;
+	}
+
+	unsigned const W1 = tile_width + 1;
+	result.heights.Resize(W1 * W1);
+	result.ttypes.Resize(W1 * W1);
+
+	for (unsigned y = 0; y < W1; ++ y) {
+		for (unsigned x = 0; x < W1; ++ x) {
+			unsigned error;
+			if (!readVLE(error, *src)) {
+				return false;
+			}
+			int height = predictHeight(result.heights.Buffer(), x, y, W1) + zigzagDecode(error);
+			if (height < 0 || height > 0xffff) {
+				return false;
+			}
+			result.heights[x + y * W1] = height;
+		}
+	}
+
+	unsigned i = 0;
+	while (i < result.ttypes.Size()) {
+		unsigned run_minus_one;
+		if (!readVLE(run_minus_one, *src) || run_minus_one >= result.ttypes.Size() - i || src->IsEof()) {
+			return false;
+		}
+		uint8_t ttype = src->ReadUByte();
+		for (unsigned run_end = i + run_minus_one + 1; i < run_end; ++ i) {
+			result.ttypes[i] = ttype;
+		}
+	}
+
+	return true;
+}
+
+int HeightPyramid::getTileIndex(unsigned level, Urho3D::IntVector2 const& tile_pos) const
+{
+	if (level >= levels.Size()) {
+		return -1;
+	}
+	Urho3D::IntRect const& tiles = levels[level].tiles;
+	if (tile_pos.x_ < tiles.left_ || tile_pos.x_ > tiles.right_ || tile_pos.y_ < tiles.top_ || tile_pos.y_ > tiles.bottom_) {
+		return -1;
+	}
+	return (tile_pos.x_ - tiles.left_) + (tile_pos.y_ - tiles.top_) * (tiles.right_ - tiles.left_ + 1);
+}
+
+}
@@ -0,0 +1,102 @@
+#ifndef BIGWORLD_HEIGHTPYRAMID_HPP
+#define BIGWORLD_HEIGHTPYRAMID_HPP
+
+#include "types.hpp"
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/IO/Deserializer.h>
+#include <Urho3D/IO/Serializer.h>
+#include <Urho3D/Math/Rect.h>
+#include <Urho3D/Math/Vector2.h>
+
+#include <functional>
+
+namespace BigWorld
+{
+
+// Terraintype of samples that have no data
+uint8_t const PYRAMID_NO_DATA = 0xff;
+
+// Low resolution heights and dominant terraintypes of the whole world, built
+// offline and stored as a file that is read one tile at a time. Level zero
+// has one sample per "sample_spacing" corners, and every next level halves
+// the resolution. Samples are at the same corners as the Chunks have them,
+// and tiles share their edge samples, so neighbor tiles match exactly.
+class HeightPyramid : public Urho3D::RefCounted
+{
+
+public:
+
+	// Gives the corners of a Chunk. Returns false if there is no Chunk.
+	typedef std::function<bool(Corners& result, Urho3D::IntVector2 const& chunk_pos)> ChunkLoader;
+
+	// Samples of one tile, (tile_width + 1) x (tile_width + 1), row by row
+	struct Tile
+	{
+		Urho3D::PODVector<uint16_t> heights;
+		Urho3D::PODVector<uint8_t> ttypes;
+	};
+
+	// Builds pyramid from Chunks of "chunks_area" (inclusive) and writes
+	// it to "dest". Chunks are loaded one at a time, but all samples of
+	// level zero are kept in memory. "sample_spacing" must divide the
+	// width of Chunk. Returns false if writing fails. Throws if loader gives
+	// wrong amount of corners.
+	static bool build(
+		Urho3D::Serializer& dest,
+		ChunkLoader const& loader,
+		Urho3D::IntRect const& chunks_area,
+		unsigned chunk_width,
+		unsigned sample_spacing = 8,
+		unsigned tile_width = 32,
+		unsigned levels = 4
+	);
+
+	HeightPyramid();
+
+	// Reads the header and tile index. Tiles are read later
+	// from "src", so it must exist as long as the pyramid.
+	bool open(Urho3D::Deserializer* src);
+
+	inline unsigned getChunkWidth() const { return chunk_width; }
+	inline unsigned getSampleSpacing() const { return sample_spacing; }
+	inline unsigned getTileWidth() const { return tile_width; }
+	inline unsigned getNumOfLevels() const { return levels.Size(); }
+
+	// Distance between samples, and width of tile, in corners
+	inline unsigned getSampleStep(unsigned level) const { return sample_spacing << level; }
+	inline unsigned getTileWidthInCorners(unsigned level) const { return tile_width * getSampleStep(level); }
+
+	bool hasTile(unsigned level, Urho3D::IntVector2 const& tile_pos) const;
+
+	// Returns false if there is no such tile, or if its data is invalid
+	bool readTile(Tile& result, unsigned level, Urho3D::IntVector2 const& tile_pos);
+
+private:
+
+	struct Level
+	{
+		// Inclusive range of tiles
+		Urho3D::IntRect tiles;
+		// Offsets of tiles from the start of their data, plus one.
+		// Zero means that the tile does not exist.
+		Urho3D::PODVector<unsigned> offsets;
+	};
+	typedef Urho3D::Vector<Level> Levels;
+
+	Urho3D::Deserializer* src;
+	unsigned data_start;
+
+	unsigned chunk_width;
+	unsigned sample_spacing;
+	unsigned tile_width;
+	Levels levels;
+
+	int getTileIndex(unsigned level, Urho3D::IntVector2 const& tile_pos) const;
+};
+
+}
+
+#endif
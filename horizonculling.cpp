@@ -0,0 +1,159 @@
+#include "horizonculling.hpp"
+
+#include <Urho3D/Math/MathDefs.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+// Number of angular bins around the eye
+unsigned const BINS = 512;
+float const BIN_WIDTH = 2 * Urho3D::M_PI / BINS;
+
+struct Extent
+{
+	unsigned chunk_i;
+	float min_dist;
+	float max_dist;
+	// Angular range, in radians
+	float angle_begin;
+	float angle_end;
+	// Slopes from the eye
+	float occluder_slope;
+	float target_slope;
+};
+
+inline float wrapAngle(float angle)
+{
+	while (angle > Urho3D::M_PI) angle -= 2 * Urho3D::M_PI;
+	while (angle <= -Urho3D::M_PI) angle += 2 * Urho3D::M_PI;
+	return angle;
+}
+
+inline unsigned binIndex(int bin)
+{
+	int const BINS_I = BINS;
+	return ((bin % BINS_I) + BINS_I) % BINS_I;
+}
+
+bool sortByMinDist(Extent const& e1, Extent const& e2)
+{
+	return e1.min_dist < e2.min_dist;
+}
+
+bool sortByMaxDist(Extent const& e1, Extent const& e2)
+{
+	return e1.max_dist < e2.max_dist;
+}
+
+}
+
+void findHiddenChunks(Urho3D::PODVector<Urho3D::IntVector2>& result, HorizonCullingChunks const& chunks, float chunk_width, float eye_margin)
+{
+	float const CHUNK_W_HALF = chunk_width / 2;
+
+	// Calculate distances, angles and slopes of all Chunks. Eye margin is
+	// applied by making Chunks to seem a little bit nearer and further
+	// away, and by raising the eye, which makes occluders less effective.
+	Urho3D::PODVector<Extent> extents;
+	extents.Reserve(chunks.Size());
+	for (unsigned chunk_i = 0; chunk_i < chunks.Size(); ++ chunk_i) {
+		HorizonCullingChunk const& chunk = chunks[chunk_i];
+		Urho3D::Vector2 rect_min = chunk.center - Urho3D::Vector2::ONE * CHUNK_W_HALF;
+		Urho3D::Vector2 rect_max = chunk.center + Urho3D::Vector2::ONE * CHUNK_W_HALF;
+
+		Extent extent;
+		extent.chunk_i = chunk_i;
+
+		// Nearest and furthest distance
+		Urho3D::Vector2 nearest(Urho3D::Clamp(0.0f, rect_min.x_, rect_max.x_), Urho3D::Clamp(0.0f, rect_min.y_, rect_max.y_));
+		Urho3D::Vector2 furthest(Urho3D::Max(-rect_min.x_, rect_max.x_), Urho3D::Max(-rect_min.y_, rect_max.y_));
+		extent.min_dist = nearest.Length() - eye_margin;
+		extent.max_dist = furthest.Length() + eye_margin;
+
+		// Chunks that are too near can never be culled or used as occluders
+		if (extent.min_dist <= 0) {
+			continue;
+		}
+
+		// Angular range. Eye is not inside the Chunk,
+		// so the range is always less than half circle.
+		float center_angle = atan2(chunk.center.y_, chunk.center.x_);
+		float delta_min = 0;
+		float delta_max = 0;
+		for (unsigned corner_i = 0; corner_i < 4; ++ corner_i) {
+			Urho3D::Vector2 corner(corner_i & 1 ? rect_max.x_ : rect_min.x_, corner_i & 2 ? rect_max.y_ : rect_min.y_);
+			float delta = wrapAngle(atan2(corner.y_, corner.x_) - center_angle);
+			delta_min = Urho3D::Min(delta_min, delta);
+			delta_max = Urho3D::Max(delta_max, delta);
+		}
+		// Eye margin also widens the angular range
+		float angle_margin = asin(Urho3D::Min(1.0f, eye_margin / extent.min_dist));
+		extent.angle_begin = center_angle + delta_min - angle_margin;
+		extent.angle_end = center_angle + delta_max + angle_margin;
+		if (extent.angle_end - extent.angle_begin >= Urho3D::M_PI) {
+			continue;
+		}
+
+		// Smallest possible slope of terrain that is
+		// somewhere on any ray going through this Chunk
+		float lowest = chunk.lowest - eye_margin;
+		extent.occluder_slope = lowest / (lowest >= 0 ? extent.max_dist : extent.min_dist);
+		// Biggest possible slope of any point in this Chunk
+		float highest = chunk.highest - eye_margin;
+		extent.target_slope = highest / (highest >= 0 ? extent.min_dist : extent.max_dist);
+
+		extents.Push(extent);
+	}
+
+	// Targets are tested in the order of their nearest distances, and
+	// occluders are used once they are completely nearer than target.
+	Urho3D::PODVector<Extent> occluders = extents;
+	std::sort(extents.Begin(), extents.End(), sortByMinDist);
+	std::sort(occluders.Begin(), occluders.End(), sortByMaxDist);
+
+	// Biggest occluder slope of every angular bin
+	float horizon[BINS];
+	for (unsigned bin = 0; bin < BINS; ++ bin) {
+		horizon[bin] = -Urho3D::M_INFINITY;
+	}
+
+	unsigned occluders_i = 0;
+	for (unsigned extents_i = 0; extents_i < extents.Size(); ++ extents_i) {
+		Extent const& target = extents[extents_i];
+
+		// Add new occluders to horizon. Only bins that
+		// are completely covered by occluder are updated.
+		while (occluders_i < occluders.Size() && occluders[occluders_i].max_dist <= target.min_dist) {
+			Extent const& occluder = occluders[occluders_i ++];
+			int bin_begin = int(ceil(occluder.angle_begin / BIN_WIDTH));
+			int bin_end = int(floor(occluder.angle_end / BIN_WIDTH));
+			for (int bin = bin_begin; bin < bin_end; ++ bin) {
+				float& horizon_slope = horizon[binIndex(bin)];
+				horizon_slope = Urho3D::Max(horizon_slope, occluder.occluder_slope);
+			}
+		}
+
+		// Target is hidden if it is below horizon at every bin it touches
+		int bin_begin = int(floor(target.angle_begin / BIN_WIDTH));
+		int bin_end = int(floor(target.angle_end / BIN_WIDTH));
+		bool hidden = true;
+		for (int bin = bin_begin; bin <= bin_end; ++ bin) {
+			if (horizon[binIndex(bin)] <= target.target_slope) {
+				hidden = false;
+				break;
+			}
+		}
+		if (hidden) {
+			result.Push(chunks[target.chunk_i].pos);
+		}
+	}
+}
+
+}
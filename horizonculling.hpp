@@ -0,0 +1,28 @@
+#ifndef BIGWORLD_HORIZONCULLING_HPP
+#define BIGWORLD_HORIZONCULLING_HPP
+
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector2.h>
+
+namespace BigWorld
+{
+
+struct HorizonCullingChunk
+{
+	Urho3D::IntVector2 pos;
+	// Center of Chunk at XZ plane, relative to the eye
+	Urho3D::Vector2 center;
+	// Height range of the whole area of Chunk, relative to the eye
+	float lowest;
+	float highest;
+};
+typedef Urho3D::PODVector<HorizonCullingChunk> HorizonCullingChunks;
+
+// Finds Chunks that are completely hidden behind the terrain of nearer Chunks.
+// Result is conservative, so a Chunk is never reported as hidden if any part of
+// it could be visible from any position within "eye_margin" from the eye.
+void findHiddenChunks(Urho3D::PODVector<Urho3D::IntVector2>& result, HorizonCullingChunks const& chunks, float chunk_width, float eye_margin);
+
+}
+
+#endif
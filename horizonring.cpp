@@ -0,0 +1,335 @@
+#include "horizonring.hpp"
+
+#include "chunkworld.hpp"
+#include "lodbuilder.hpp"
+#include "tracer.hpp"
+
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/IndexBuffer.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/StaticModel.h>
+#include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/Scene/Scene.h>
+
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+HorizonRing::HorizonRing(ChunkWorld* world, HeightPyramid* pyramid, unsigned level, float radius, float sink) :
+Urho3D::Object(world->GetContext()),
+world(world),
+pyramid(pyramid),
+level(level),
+radius(radius),
+sink(sink),
+viewmask(Urho3D::DEFAULT_VIEWMASK),
+origin_height(0)
+{
+	if (pyramid->getChunkWidth() != world->getChunkWidth()) {
+		throw std::runtime_error("Height pyramid has different Chunk width!");
+	}
+	if (level >= pyramid->getNumOfLevels()) {
+		throw std::runtime_error("Height pyramid does not have that level!");
+	}
+}
+
+HorizonRing::~HorizonRing()
+{
+	for (Tiles::Iterator i = tiles.Begin(); i != tiles.End(); ++ i) {
+		i->second_.node->Remove();
+	}
+}
+
+void HorizonRing::setCoveredChunks(Urho3D::HashSet<Urho3D::IntVector2> const& covered)
+{
+	// Only tiles that overlap Chunks whose coverage changed need new meshes
+	Urho3D::PODVector<Urho3D::IntVector2> changed;
+	for (Urho3D::HashSet<Urho3D::IntVector2>::ConstIterator i = covered.Begin(); i != covered.End(); ++ i) {
+		if (!this->covered.Contains(*i)) {
+			changed.Push(*i);
+		}
+	}
+	for (Urho3D::HashSet<Urho3D::IntVector2>::ConstIterator i = this->covered.Begin(); i != this->covered.End(); ++ i) {
+		if (!covered.Contains(*i)) {
+			changed.Push(*i);
+		}
+	}
+	this->covered = covered;
+
+	for (Tiles::Iterator i = tiles.Begin(); i != tiles.End() && !changed.Empty(); ++ i) {
+		Urho3D::IntRect tile_chunks = getTileChunks(i->first_);
+		for (unsigned changed_i = 0; changed_i < changed.Size(); ++ changed_i) {
+			Urho3D::IntVector2 const& pos = changed[changed_i];
+			if (pos.x_ >= tile_chunks.left_ && pos.x_ <= tile_chunks.right_ && pos.y_ >= tile_chunks.top_ && pos.y_ <= tile_chunks.bottom_) {
+				i->second_.mesh_outdated = true;
+				break;
+			}
+		}
+	}
+}
+
+void HorizonRing::update(Urho3D::IntVector2 const& center, Urho3D::IntVector2 const& origin, unsigned origin_height, unsigned viewmask)
+{
+	URHO3D_PROFILE(UpdateHorizonRing);
+
+	int const CHUNK_W = world->getChunkWidth();
+	int const TILE_W = pyramid->getTileWidthInCorners(level);
+	float const RADIUS = radius * CHUNK_W;
+	Urho3D::Vector2 const CENTER((center.x_ + 0.5f) * CHUNK_W, (center.y_ + 0.5f) * CHUNK_W);
+
+	// Find tiles that are inside the radius, and the nearest of them that is not loaded
+	Urho3D::HashSet<Urho3D::IntVector2> needed;
+	Urho3D::IntVector2 load_pos;
+	float load_distance = Urho3D::M_INFINITY;
+	Urho3D::IntRect const TILES(
+		floorDiv(Urho3D::FloorToInt(CENTER.x_ - RADIUS), TILE_W),
+		floorDiv(Urho3D::FloorToInt(CENTER.y_ - RADIUS), TILE_W),
+		floorDiv(Urho3D::CeilToInt(CENTER.x_ + RADIUS), TILE_W),
+		floorDiv(Urho3D::CeilToInt(CENTER.y_ + RADIUS), TILE_W)
+	);
+	Urho3D::IntVector2 tile_pos;
+	for (tile_pos.y_ = TILES.top_; tile_pos.y_ <= TILES.bottom_; ++ tile_pos.y_) {
+		for (tile_pos.x_ = TILES.left_; tile_pos.x_ <= TILES.right_; ++ tile_pos.x_) {
+			Urho3D::Vector2 nearest(
+				Urho3D::Clamp<float>(CENTER.x_, tile_pos.x_ * TILE_W, (tile_pos.x_ + 1) * TILE_W),
+				Urho3D::Clamp<float>(CENTER.y_, tile_pos.y_ * TILE_W, (tile_pos.y_ + 1) * TILE_W)
+			);
+			float distance = (nearest - CENTER).Length();
+			if (distance > RADIUS || !pyramid->hasTile(level, tile_pos)) {
+				continue;
+			}
+			needed.Insert(tile_pos);
+			if (!tiles.Contains(tile_pos) && distance < load_distance) {
+				load_pos = tile_pos;
+				load_distance = distance;
+			}
+		}
+	}
+
+	// Forget tiles that are too far away
+	for (Tiles::Iterator i = tiles.Begin(); i != tiles.End(); ) {
+		if (needed.Contains(i->first_)) {
+			++ i;
+		} else {
+			i->second_.node->Remove();
+			i = tiles.Erase(i);
+		}
+	}
+
+	bool origin_changed = origin != this->origin || origin_height != this->origin_height;
+	this->origin = origin;
+	this->origin_height = origin_height;
+
+	// Load one tile per update
+	if (load_distance < Urho3D::M_INFINITY) {
+		TraceScope trace("LoadHorizonTile", load_pos, level);
+		Tile tile;
+		if (!pyramid->readTile(tile.data, level, load_pos)) {
+			throw std::runtime_error("Unable to read tile of height pyramid!");
+		}
+		tile.baseheight = 0xffff;
+		for (unsigned i = 0; i < tile.data.heights.Size(); ++ i) {
+			tile.baseheight = Urho3D::Min<unsigned>(tile.baseheight, tile.data.heights[i]);
+		}
+		tile.node = world->getScene()->CreateChild();
+		tile.mesh_outdated = true;
+		updateTilePosition(load_pos, tile);
+		tiles[load_pos] = tile;
+		++ world->getPipelineCounters().horizon_tiles_loaded;
+	}
+
+	bool viewmask_changed = viewmask != this->viewmask;
+	this->viewmask = viewmask;
+
+	for (Tiles::Iterator i = tiles.Begin(); i != tiles.End(); ++ i) {
+		Tile& tile = i->second_;
+		if (tile.mesh_outdated && buildMesh(i->first_, tile)) {
+			tile.mesh_outdated = false;
+		}
+		if (origin_changed) {
+			updateTilePosition(i->first_, tile);
+		}
+		if (viewmask_changed) {
+			Urho3D::StaticModel* smodel = tile.node->GetComponent<Urho3D::StaticModel>();
+			if (smodel) {
+				smodel->SetViewMask(viewmask);
+			}
+		}
+	}
+}
+
+bool HorizonRing::buildMesh(Urho3D::IntVector2 const& tile_pos, Tile& tile)
+{
+	TraceScope trace("BuildHorizonTile", tile_pos, level);
+
+	unsigned const TILE_W = pyramid->getTileWidth();
+	unsigned const TILE_W1 = TILE_W + 1;
+	int const CHUNK_W = world->getChunkWidth();
+	int const STEP = pyramid->getSampleStep(level);
+	float const SAMPLE_W = STEP * world->getSquareWidth();
+	float const HEIGHTSTEP = world->getHeightstep();
+	float const UV_SCALE = float(STEP) * world->getTerrainTextureRepeats() / CHUNK_W;
+	Urho3D::PODVector<uint16_t> const& heights = tile.data.heights;
+	Urho3D::PODVector<uint8_t> const& ttypes = tile.data.ttypes;
+
+	// Squares are grouped by the terraintype of their southwestern sample
+	Urho3D::HashMap<uint8_t, Urho3D::PODVector<uint32_t> > idxs_by_ttype;
+	for (unsigned y = 0; y < TILE_W; ++ y) {
+		for (unsigned x = 0; x < TILE_W; ++ x) {
+			unsigned i_sw = x + y * TILE_W1;
+			uint8_t ttype = ttypes[i_sw];
+			if (ttype >= world->getNumOfTerrainTextures() ||
+			    ttypes[i_sw + 1] == PYRAMID_NO_DATA ||
+			    ttypes[i_sw + TILE_W1] == PYRAMID_NO_DATA ||
+			    ttypes[i_sw + TILE_W1 + 1] == PYRAMID_NO_DATA) {
+				continue;
+			}
+
+			// Leave out squares that real Chunks cover completely
+			int corner_x = (tile_pos.x_ * int(TILE_W) + int(x)) * STEP;
+			int corner_y = (tile_pos.y_ * int(TILE_W) + int(y)) * STEP;
+			bool covered_completely = true;
+			Urho3D::IntVector2 chunk_pos;
+			for (chunk_pos.y_ = floorDiv(corner_y, CHUNK_W); chunk_pos.y_ <= floorDiv(corner_y + STEP - 1, CHUNK_W) && covered_completely; ++ chunk_pos.y_) {
+				for (chunk_pos.x_ = floorDiv(corner_x, CHUNK_W); chunk_pos.x_ <= floorDiv(corner_x + STEP - 1, CHUNK_W) && covered_completely; ++ chunk_pos.x_) {
+					covered_completely = covered.Contains(chunk_pos);
+				}
+			}
+			if (covered_completely) {
+				continue;
+			}
+
+			uint32_t sqr_idxs[6];
+			getSquareIndices(sqr_idxs, i_sw, TILE_W1, heights[i_sw], heights[i_sw + TILE_W1], heights[i_sw + TILE_W1 + 1], heights[i_sw + 1]);
+			Urho3D::PODVector<uint32_t>& idxs = idxs_by_ttype[ttype];
+			idxs.Insert(idxs.End(), sqr_idxs, sqr_idxs + 6);
+		}
+	}
+
+	// Check Materials before doing anything else
+	Urho3D::Vector<Urho3D::Material*> mats;
+	for (Urho3D::HashMap<uint8_t, Urho3D::PODVector<uint32_t> >::Iterator i = idxs_by_ttype.Begin(); i != idxs_by_ttype.End(); ++ i) {
+		Urho3D::Material* mat = world->getSingleLayerTerrainMaterial(i->first_);
+		if (!mat) {
+			return false;
+		}
+		mats.Push(mat);
+	}
+
+	tile.node->RemoveAllComponents();
+	if (idxs_by_ttype.Empty()) {
+		return true;
+	}
+
+	// Vertices, with normals from the differences of neighbor heights
+	Urho3D::PODVector<Urho3D::VertexElement> vrts_elems;
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
+	vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR2, Urho3D::SEM_TEXCOORD));
+	Urho3D::PODVector<float> vrts_data;
+	vrts_data.Reserve(TILE_W1 * TILE_W1 * 8);
+	Urho3D::BoundingBox boundingbox;
+	for (unsigned y = 0; y < TILE_W1; ++ y) {
+		for (unsigned x = 0; x < TILE_W1; ++ x) {
+			Urho3D::Vector3 pos(x * SAMPLE_W, (int(heights[x + y * TILE_W1]) - int(tile.baseheight)) * HEIGHTSTEP, y * SAMPLE_W);
+			unsigned x_w = x > 0 ? x - 1 : x;
+			unsigned x_e = x < TILE_W ? x + 1 : x;
+			unsigned y_s = y > 0 ? y - 1 : y;
+			unsigned y_n = y < TILE_W ? y + 1 : y;
+			float slope_x = (int(heights[x_e + y * TILE_W1]) - int(heights[x_w + y * TILE_W1])) * HEIGHTSTEP / ((x_e - x_w) * SAMPLE_W);
+			float slope_z = (int(heights[x + y_n * TILE_W1]) - int(heights[x + y_s * TILE_W1])) * HEIGHTSTEP / ((y_n - y_s) * SAMPLE_W);
+			Urho3D::Vector3 nrm = Urho3D::Vector3(-slope_x, 1, -slope_z).Normalized();
+
+			vrts_data.Push(pos.x_);
+			vrts_data.Push(pos.y_);
+			vrts_data.Push(pos.z_);
+			vrts_data.Push(nrm.x_);
+			vrts_data.Push(nrm.y_);
+			vrts_data.Push(nrm.z_);
+			vrts_data.Push(x * UV_SCALE);
+			vrts_data.Push(y * UV_SCALE);
+			boundingbox.Merge(pos);
+		}
+	}
+
+	// Indices of all terraintypes are in the same buffer
+	Urho3D::PODVector<uint32_t> idxs_data;
+	for (Urho3D::HashMap<uint8_t, Urho3D::PODVector<uint32_t> >::Iterator i = idxs_by_ttype.Begin(); i != idxs_by_ttype.End(); ++ i) {
+		idxs_data.Insert(idxs_data.End(), i->second_.Begin(), i->second_.End());
+	}
+
+	Urho3D::SharedPtr<Urho3D::VertexBuffer> vb(new Urho3D::VertexBuffer(context_));
+	if (!vb->SetSize(TILE_W1 * TILE_W1, vrts_elems)) {
+		throw std::runtime_error("Unable to set VertexBuffer size!");
+	}
+	if (!vb->SetData((void*)vrts_data.Buffer())) {
+		throw std::runtime_error("Unable to set VertexBuffer data!");
+	}
+	Urho3D::SharedPtr<Urho3D::IndexBuffer> ib(new Urho3D::IndexBuffer(context_));
+	if (!ib->SetSize(idxs_data.Size(), true)) {
+		throw std::runtime_error("Unable to set IndexBuffer size!");
+	}
+	if (!ib->SetData((void*)idxs_data.Buffer())) {
+		throw std::runtime_error("Unable to set IndexBuffer data!");
+	}
+
+	Urho3D::SharedPtr<Urho3D::Model> model(new Urho3D::Model(context_));
+	model->SetNumGeometries(idxs_by_ttype.Size());
+	unsigned geom_i = 0;
+	unsigned idxs_start = 0;
+	for (Urho3D::HashMap<uint8_t, Urho3D::PODVector<uint32_t> >::Iterator i = idxs_by_ttype.Begin(); i != idxs_by_ttype.End(); ++ i) {
+		Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context_));
+		if (!geom->SetVertexBuffer(0, vb)) {
+			throw std::runtime_error("Unable to set Geometry VertexBuffer!");
+		}
+		geom->SetIndexBuffer(ib);
+		if (!geom->SetDrawRange(Urho3D::TRIANGLE_LIST, idxs_start, i->second_.Size(), false)) {
+			throw std::runtime_error("Unable to set Geometry draw range!");
+		}
+		if (!model->SetGeometry(geom_i, 0, geom)) {
+			throw std::runtime_error("Unable to set Model Geometry!");
+		}
+		idxs_start += i->second_.Size();
+		++ geom_i;
+	}
+	model->SetBoundingBox(boundingbox);
+
+	Urho3D::StaticModel* smodel = tile.node->CreateComponent<Urho3D::StaticModel>();
+	smodel->SetModel(model);
+	for (unsigned i = 0; i < mats.Size(); ++ i) {
+		smodel->SetMaterial(i, mats[i]);
+	}
+	smodel->SetViewMask(viewmask);
+
+	return true;
+}
+
+void HorizonRing::updateTilePosition(Urho3D::IntVector2 const& tile_pos, Tile& tile)
+{
+	// Position of southwestern sample, relative to the corner
+	// at the southwestern edge of the Chunk at origin.
+	int const CHUNK_W = world->getChunkWidth();
+	int const TILE_W = pyramid->getTileWidthInCorners(level);
+	float const SQR_W = world->getSquareWidth();
+	tile.node->SetPosition(Urho3D::Vector3(
+		(tile_pos.x_ * TILE_W - origin.x_ * CHUNK_W) * SQR_W - world->getChunkWidthFloat() / 2,
+		(int(tile.baseheight) - int(origin_height)) * world->getHeightstep() - sink,
+		(tile_pos.y_ * TILE_W - origin.y_ * CHUNK_W) * SQR_W - world->getChunkWidthFloat() / 2
+	));
+}
+
+Urho3D::IntRect HorizonRing::getTileChunks(Urho3D::IntVector2 const& tile_pos) const
+{
+	int const CHUNK_W = world->getChunkWidth();
+	int const TILE_W = pyramid->getTileWidthInCorners(level);
+	return Urho3D::IntRect(
+		floorDiv(tile_pos.x_ * TILE_W, CHUNK_W),
+		floorDiv(tile_pos.y_ * TILE_W, CHUNK_W),
+		floorDiv((tile_pos.x_ + 1) * TILE_W, CHUNK_W),
+		floorDiv((tile_pos.y_ + 1) * TILE_W, CHUNK_W)
+	);
+}
+
+}
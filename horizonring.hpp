@@ -0,0 +1,79 @@
+#ifndef BIGWORLD_HORIZONRING_HPP
+#define BIGWORLD_HORIZONRING_HPP
+
+#include "heightpyramid.hpp"
+#include "types.hpp"
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/Math/Vector2.h>
+#include <Urho3D/Scene/Node.h>
+
+namespace BigWorld
+{
+
+class ChunkWorld;
+
+// Cheap terrain from one level of HeightPyramid, rendered around the Chunks
+// of viewarea up to a radius. Tiles are streamed from the pyramid one per
+// update as camera moves, and every tile is one Model that has a Geometry
+// for each dominant terraintype. Squares that are completely covered by
+// real Chunks are left out, and the ring is sunk a little below them, so
+// where they overlap the real terrain wins.
+class HorizonRing : public Urho3D::Object
+{
+	URHO3D_OBJECT(HorizonRing, Urho3D::Object)
+
+public:
+
+	HorizonRing(ChunkWorld* world, HeightPyramid* pyramid, unsigned level, float radius, float sink);
+	virtual ~HorizonRing();
+
+	// Sets the Chunks that are rendered for real
+	void setCoveredChunks(Urho3D::HashSet<Urho3D::IntVector2> const& covered);
+
+	// Loads and unloads tiles around "center" and moves them relative to the origin
+	void update(Urho3D::IntVector2 const& center, Urho3D::IntVector2 const& origin, unsigned origin_height, unsigned viewmask);
+
+	inline unsigned getNumOfTiles() const { return tiles.Size(); }
+
+private:
+
+	struct Tile
+	{
+		HeightPyramid::Tile data;
+		Urho3D::Node* node;
+		// Lowest height of tile, that vertices are relative to
+		unsigned baseheight;
+		bool mesh_outdated;
+	};
+	typedef Urho3D::HashMap<Urho3D::IntVector2, Tile> Tiles;
+
+	ChunkWorld* world;
+	Urho3D::SharedPtr<HeightPyramid> pyramid;
+	unsigned level;
+	float radius;
+	float sink;
+
+	unsigned viewmask;
+	Urho3D::IntVector2 origin;
+	unsigned origin_height;
+
+	Tiles tiles;
+
+	Urho3D::HashSet<Urho3D::IntVector2> covered;
+
+	// Builds Model of tile. Returns false if some Material is not yet ready.
+	bool buildMesh(Urho3D::IntVector2 const& tile_pos, Tile& tile);
+
+	void updateTilePosition(Urho3D::IntVector2 const& tile_pos, Tile& tile);
+
+	// Inclusive range of Chunks that tile overlaps
+	Urho3D::IntRect getTileChunks(Urho3D::IntVector2 const& tile_pos) const;
+};
+
+}
+
+#endif
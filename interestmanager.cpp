@@ -0,0 +1,232 @@
+#include "interestmanager.hpp"
+
+#include "types.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+InterestManager::InterestManager(unsigned cell_size) :
+cell_size(Urho3D::Max(cell_size, 1u)),
+next_observer_id(0)
+{
+}
+
+InterestManager::ObserverId InterestManager::addObserver(Urho3D::IntVector2 const& chunk_pos, unsigned radius)
+{
+	ObserverId id = next_observer_id ++;
+
+	Observer& observer = observers[id];
+	observer.pos = chunk_pos;
+	observer.radius = radius;
+	observer.cells = getCells(chunk_pos, radius);
+	addToGrid(id, observer.cells);
+
+	addEvents(id, true, chunk_pos, radius, false, chunk_pos, 0);
+
+	return id;
+}
+
+void InterestManager::removeObserver(ObserverId observer)
+{
+	Observer const& obs = getObserver(observer);
+	addEvents(observer, false, obs.pos, obs.radius, false, obs.pos, 0);
+	removeFromGrid(observer, obs.cells);
+	observers.Erase(observer);
+}
+
+void InterestManager::moveObserver(ObserverId observer, Urho3D::IntVector2 const& chunk_pos)
+{
+	Observer& obs = getObserver(observer);
+	if (obs.pos == chunk_pos) {
+		return;
+	}
+
+	addEvents(observer, false, obs.pos, obs.radius, true, chunk_pos, obs.radius);
+	addEvents(observer, true, chunk_pos, obs.radius, true, obs.pos, obs.radius);
+
+	// Grid needs updating only when the circle crosses cell borders
+	Urho3D::IntRect new_cells = getCells(chunk_pos, obs.radius);
+	if (new_cells != obs.cells) {
+		removeFromGrid(observer, obs.cells);
+		addToGrid(observer, new_cells);
+		obs.cells = new_cells;
+	}
+	obs.pos = chunk_pos;
+}
+
+void InterestManager::setObserverRadius(ObserverId observer, unsigned radius)
+{
+	Observer& obs = getObserver(observer);
+	if (obs.radius == radius) {
+		return;
+	}
+
+	addEvents(observer, false, obs.pos, obs.radius, true, obs.pos, radius);
+	addEvents(observer, true, obs.pos, radius, true, obs.pos, obs.radius);
+
+	Urho3D::IntRect new_cells = getCells(obs.pos, radius);
+	if (new_cells != obs.cells) {
+		removeFromGrid(observer, obs.cells);
+		addToGrid(observer, new_cells);
+		obs.cells = new_cells;
+	}
+	obs.radius = radius;
+}
+
+Urho3D::IntVector2 InterestManager::getObserverPosition(ObserverId observer) const
+{
+	return getObserver(observer).pos;
+}
+
+bool InterestManager::isInterested(ObserverId observer, Urho3D::IntVector2 const& chunk_pos) const
+{
+	Observer const& obs = getObserver(observer);
+	Urho3D::IntVector2 diff = chunk_pos - obs.pos;
+	return diff.x_ * diff.x_ + diff.y_ * diff.y_ <= int(obs.radius * obs.radius);
+}
+
+void InterestManager::getChunks(Urho3D::PODVector<Urho3D::IntVector2>& result, ObserverId observer) const
+{
+	Observer const& obs = getObserver(observer);
+	int const RADIUS = obs.radius;
+	for (int dy = -RADIUS; dy <= RADIUS; ++ dy) {
+		int half_width = getHalfWidth(obs.radius, dy);
+		for (int dx = -half_width; dx <= half_width; ++ dx) {
+			result.Push(obs.pos + Urho3D::IntVector2(dx, dy));
+		}
+	}
+}
+
+void InterestManager::getObservers(Urho3D::PODVector<ObserverId>& result, Urho3D::IntVector2 const& chunk_pos) const
+{
+	Urho3D::IntVector2 cell(floorDiv(chunk_pos.x_, cell_size), floorDiv(chunk_pos.y_, cell_size));
+	Grid::ConstIterator grid_find = grid.Find(cell);
+	if (grid_find == grid.End()) {
+		return;
+	}
+	Urho3D::PODVector<ObserverId> const& cell_observers = grid_find->second_;
+	for (unsigned i = 0; i < cell_observers.Size(); ++ i) {
+		if (isInterested(cell_observers[i], chunk_pos)) {
+			result.Push(cell_observers[i]);
+		}
+	}
+}
+
+void InterestManager::takeEvents(Events& result)
+{
+	result.Clear();
+	result.Swap(events);
+}
+
+InterestManager::Observer& InterestManager::getObserver(ObserverId observer)
+{
+	Observers::Iterator observers_find = observers.Find(observer);
+	if (observers_find == observers.End()) {
+		throw std::runtime_error("Observer does not exist!");
+	}
+	return observers_find->second_;
+}
+
+InterestManager::Observer const& InterestManager::getObserver(ObserverId observer) const
+{
+	Observers::ConstIterator observers_find = observers.Find(observer);
+	if (observers_find == observers.End()) {
+		throw std::runtime_error("Observer does not exist!");
+	}
+	return observers_find->second_;
+}
+
+Urho3D::IntRect InterestManager::getCells(Urho3D::IntVector2 const& pos, unsigned radius) const
+{
+	int const RADIUS = radius;
+	return Urho3D::IntRect(
+		floorDiv(pos.x_ - RADIUS, cell_size),
+		floorDiv(pos.y_ - RADIUS, cell_size),
+		floorDiv(pos.x_ + RADIUS, cell_size),
+		floorDiv(pos.y_ + RADIUS, cell_size)
+	);
+}
+
+void InterestManager::addToGrid(ObserverId observer, Urho3D::IntRect const& cells)
+{
+	Urho3D::IntVector2 cell;
+	for (cell.y_ = cells.top_; cell.y_ <= cells.bottom_; ++ cell.y_) {
+		for (cell.x_ = cells.left_; cell.x_ <= cells.right_; ++ cell.x_) {
+			grid[cell].Push(observer);
+		}
+	}
+}
+
+void InterestManager::removeFromGrid(ObserverId observer, Urho3D::IntRect const& cells)
+{
+	Urho3D::IntVector2 cell;
+	for (cell.y_ = cells.top_; cell.y_ <= cells.bottom_; ++ cell.y_) {
+		for (cell.x_ = cells.left_; cell.x_ <= cells.right_; ++ cell.x_) {
+			Grid::Iterator grid_find = grid.Find(cell);
+			assert(grid_find != grid.End());
+			grid_find->second_.RemoveSwap(observer);
+			if (grid_find->second_.Empty()) {
+				grid.Erase(grid_find);
+			}
+		}
+	}
+}
+
+void InterestManager::addEvents(ObserverId observer, bool entered, Urho3D::IntVector2 const& to_pos, unsigned to_radius, bool from_exists, Urho3D::IntVector2 const& from_pos, unsigned from_radius)
+{
+	Event event;
+	event.observer = observer;
+	event.entered = entered;
+
+	int const TO_RADIUS = to_radius;
+	for (int dy = -TO_RADIUS; dy <= TO_RADIUS; ++ dy) {
+		int const Y = to_pos.y_ + dy;
+		int to_half_width = getHalfWidth(to_radius, dy);
+		int to_begin = to_pos.x_ - to_half_width;
+		int to_end = to_pos.x_ + to_half_width;
+
+		// Range of the row that is also in circle "from". If it is
+		// empty, then begin is after end, and nothing is skipped.
+		int from_begin = to_end + 1;
+		int from_end = to_end;
+		if (from_exists) {
+			int from_half_width = getHalfWidth(from_radius, Y - from_pos.y_);
+			if (from_half_width >= 0) {
+				from_begin = Urho3D::Max(from_pos.x_ - from_half_width, to_begin);
+				from_end = Urho3D::Min(from_pos.x_ + from_half_width, to_end);
+			}
+		}
+
+		event.chunk_pos.y_ = Y;
+		for (event.chunk_pos.x_ = to_begin; event.chunk_pos.x_ <= to_end; ++ event.chunk_pos.x_) {
+			if (event.chunk_pos.x_ == from_begin && from_begin <= from_end) {
+				event.chunk_pos.x_ = from_end;
+				continue;
+			}
+			events.Push(event);
+		}
+	}
+}
+
+int InterestManager::getHalfWidth(unsigned radius, int dy)
+{
+	int const RADIUS_SQR = radius * radius;
+	int const DY_SQR = dy * dy;
+	if (DY_SQR > RADIUS_SQR) {
+		return -1;
+	}
+	// Fix possible rounding errors of square root
+	int result = sqrt(float(RADIUS_SQR - DY_SQR));
+	while ((result + 1) * (result + 1) + DY_SQR <= RADIUS_SQR) {
+		++ result;
+	}
+	while (result * result + DY_SQR > RADIUS_SQR) {
+		-- result;
+	}
+	return result;
+}
+
+}
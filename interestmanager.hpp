@@ -0,0 +1,99 @@
+#ifndef BIGWORLD_INTERESTMANAGER_HPP
+#define BIGWORLD_INTERESTMANAGER_HPP
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Rect.h>
+#include <Urho3D/Math/Vector2.h>
+
+namespace BigWorld
+{
+
+// Tracks which Chunks are interesting to which observers, for example to
+// clients of a game server. Observer is interested in the Chunks within its
+// radius, using the same circle as the viewarea of ChunkWorld. When observers
+// are added, moved or removed, only the Chunks that enter or leave their
+// circles are reported. Observers are stored to a grid of cells, so finding
+// the observers of a Chunk does not need to go through all of them.
+class InterestManager : public Urho3D::RefCounted
+{
+
+public:
+
+	typedef unsigned ObserverId;
+
+	struct Event
+	{
+		ObserverId observer;
+		Urho3D::IntVector2 chunk_pos;
+		// True if Chunk became interesting, false if not anymore
+		bool entered;
+	};
+	typedef Urho3D::PODVector<Event> Events;
+
+	// "cell_size" is the width of grid cells in Chunks. It
+	// should be about the same as the radiuses of observers.
+	InterestManager(unsigned cell_size = 16);
+
+	ObserverId addObserver(Urho3D::IntVector2 const& chunk_pos, unsigned radius);
+	void removeObserver(ObserverId observer);
+	// Does nothing if observer stays in the same Chunk and keeps its radius
+	void moveObserver(ObserverId observer, Urho3D::IntVector2 const& chunk_pos);
+	void setObserverRadius(ObserverId observer, unsigned radius);
+
+	inline unsigned getNumOfObservers() const { return observers.Size(); }
+	Urho3D::IntVector2 getObserverPosition(ObserverId observer) const;
+
+	bool isInterested(ObserverId observer, Urho3D::IntVector2 const& chunk_pos) const;
+
+	// Adds all Chunks that "observer" is interested in to "result"
+	void getChunks(Urho3D::PODVector<Urho3D::IntVector2>& result, ObserverId observer) const;
+
+	// Adds all observers that are interested in Chunk to "result"
+	void getObservers(Urho3D::PODVector<ObserverId>& result, Urho3D::IntVector2 const& chunk_pos) const;
+
+	// Moves events that have happened since the previous call to "result",
+	// in the order they happened. Leave events of a move come before enters.
+	void takeEvents(Events& result);
+
+private:
+
+	struct Observer
+	{
+		Urho3D::IntVector2 pos;
+		unsigned radius;
+		// Inclusive range of grid cells that the circle touches
+		Urho3D::IntRect cells;
+	};
+	typedef Urho3D::HashMap<ObserverId, Observer> Observers;
+	typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::PODVector<ObserverId> > Grid;
+
+	int const cell_size;
+
+	Observers observers;
+	ObserverId next_observer_id;
+
+	Grid grid;
+
+	Events events;
+
+	Observer& getObserver(ObserverId observer);
+	Observer const& getObserver(ObserverId observer) const;
+
+	Urho3D::IntRect getCells(Urho3D::IntVector2 const& pos, unsigned radius) const;
+	void addToGrid(ObserverId observer, Urho3D::IntRect const& cells);
+	void removeFromGrid(ObserverId observer, Urho3D::IntRect const& cells);
+
+	// Adds events of Chunks that are in circle "to" but not in circle "from".
+	// Circle "from" is ignored if "from_exists" is false. Goes row by row, so
+	// only the Chunks that actually change are visited.
+	void addEvents(ObserverId observer, bool entered, Urho3D::IntVector2 const& to_pos, unsigned to_radius, bool from_exists, Urho3D::IntVector2 const& from_pos, unsigned from_radius);
+
+	// Half width of circle at row "dy" from the center, or -1 if the row is outside
+	static int getHalfWidth(unsigned radius, int dy);
+};
+
+}
+
+#endif
@@ -2,8 +2,13 @@
 
 #include <Urho3D/Container/HashSet.h>
 
+#include "cornerssnapshot.hpp"
+#include "tracer.hpp"
 #include "types.hpp"
 
+#include <algorithm>
+#include <climits>
+
 namespace BigWorld
 {
 
@@ -17,7 +22,7 @@ inline void pushV3(Urho3D::PODVector<char>& buf, Urho3D::Vector3 const& v)
 	buf.Insert(buf.End(), (char*)v.Data(), (char*)v.Data() + sizeof(float) * 3);
 }
 
-Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width)
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width, bool rgba)
 {
 	// Precalculate some stuff
 	unsigned const CHUNK_W1 = chunk_width + 1;
@@ -26,19 +31,15 @@ Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_t
 	// Calculate what terrains are used and how much. If there are
 	// too many of them, then the rarest ones will be ignored.
 	unsigned const MAX_TERRAINTYPES_IN_MATERIAL = 4;
-	Urho3D::HashMap<uint8_t, float> used_ttypes;
+	Urho3D::HashMap<uint8_t, unsigned> used_ttypes;
 	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
 		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
 		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
 			Corner const& corner = corners[ofs];
 			for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
-				uint8_t ttype = corner.ttypes.getKey(ttypes_i);
-				float weight = corner.ttypes.getValue(ttypes_i);
+				uint8_t weight = corner.ttypes.getValueByte(ttypes_i);
 				if (weight > 0) {
-					if (!used_ttypes.Contains(ttype)) {
-						used_ttypes[ttype] = 0;
-					}
-					used_ttypes[ttype] += weight;
+					used_ttypes[corner.ttypes.getKey(ttypes_i)] += weight;
 				}
 			}
 			++ ofs;
@@ -46,9 +47,9 @@ Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_t
 	}
 	// Do the possible ignoring of rarest terraintypes
 	while (used_ttypes.Size() > MAX_TERRAINTYPES_IN_MATERIAL) {
-		float lowest_usage = 9999999;
+		unsigned lowest_usage = UINT_MAX;
 		unsigned lowest_usage_ttype = 0;
-		for (Urho3D::HashMap<uint8_t, float>::Iterator it = used_ttypes.Begin(); it != used_ttypes.End(); ++ it) {
+		for (Urho3D::HashMap<uint8_t, unsigned>::Iterator it = used_ttypes.Begin(); it != used_ttypes.End(); ++ it) {
 			if (it->second_ < lowest_usage) {
 				lowest_usage = it->second_;
 				lowest_usage_ttype = it->first_;
@@ -58,26 +59,34 @@ Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_t
 	}
 	assert(result_used_ttypes.Empty());
 	result_used_ttypes.Reserve(used_ttypes.Size());
-	for (Urho3D::HashMap<uint8_t, float>::Iterator i = used_ttypes.Begin(); i != used_ttypes.End(); ++ i) {
+	for (Urho3D::HashMap<uint8_t, unsigned>::Iterator i = used_ttypes.Begin(); i != used_ttypes.End(); ++ i) {
 		result_used_ttypes.Push(i->first_);
 	}
 	assert(!result_used_ttypes.Empty());
+	// Keep terraintypes in order, so Chunks with same
+	// terraintypes can end up using the same Material.
+	std::sort(result_used_ttypes.Buffer(), result_used_ttypes.Buffer() + result_used_ttypes.Size());
 
 	// If there is only one terraintype, then image is not needed
 	if (result_used_ttypes.Size() == 1) {
 		return NULL;
 	}
 
+	// Lookup table from terraintype to color channel of image
+	uint8_t const NO_CHANNEL = 0xff;
+	uint8_t channels[256];
+	memset(channels, NO_CHANNEL, sizeof(channels));
+	for (unsigned i = 0; i < result_used_ttypes.Size(); ++ i) {
+		channels[result_used_ttypes[i]] = i;
+	}
+
 	Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context));
 // TODO: Consider using POT(Power Of Two) image size!
-// TODO: Use variable amount of components!
-	if (result_used_ttypes.Size() == 4) {
-		img->SetSize(CHUNK_W1, CHUNK_W1, 4);
-	} else {
-		img->SetSize(CHUNK_W1, CHUNK_W1, 3);
-	}
+	unsigned const COMPONENTS = (rgba || result_used_ttypes.Size() == 4) ? 4 : 3;
+	img->SetSize(CHUNK_W1, CHUNK_W1, COMPONENTS);
 
-	// Render terrain types to image
+	// Render terrain types straight to the pixel data of image
+	unsigned char* pixel = img->GetData();
 	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
 		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
 		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
@@ -85,22 +94,80 @@ Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_t
 			assert(result_used_ttypes.Size() >= 2);
 			assert(result_used_ttypes.Size() <= 4);
 
-			float w0 = ttypes[result_used_ttypes[0]];
-			float w1 = ttypes[result_used_ttypes[1]];
-			float w2 = 0;
-			float w3 = 0;
-			if (result_used_ttypes.Size() >= 3) {
-				w2 = ttypes[result_used_ttypes[2]];
+			unsigned weights[4] = { 0, 0, 0, 0 };
+			unsigned total = 0;
+			for (unsigned ttypes_i = 0; ttypes_i < ttypes.size(); ++ ttypes_i) {
+				uint8_t channel = channels[ttypes.getKey(ttypes_i)];
+				if (channel != NO_CHANNEL) {
+					uint8_t weight = ttypes.getValueByte(ttypes_i);
+					weights[channel] += weight;
+					total += weight;
+				}
 			}
-			if (result_used_ttypes.Size() >= 4) {
-				w3 = ttypes[result_used_ttypes[3]];
+			if (total == 0) {
+				weights[0] = 1;
+				total = 1;
 			}
-			float total = w0 + w1 + w2 + w3;
+			for (unsigned c = 0; c < COMPONENTS; ++ c) {
+				pixel[c] = (weights[c] * 255 + total / 2) / total;
+			}
+			pixel += COMPONENTS;
+
+			++ ofs;
+		}
+	}
+
+	return img;
+}
+
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeIndexImage(Urho3D::Context* context, Corners const& corners, unsigned chunk_width)
+{
+	// Precalculate some stuff
+	unsigned const CHUNK_W1 = chunk_width + 1;
+	unsigned const CHUNK_W3 = chunk_width + 3;
+
+	Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context));
+	img->SetSize(CHUNK_W1, CHUNK_W1, 4);
+
+	// Store two strongest terraintypes of every corner. Red and blue
+	// are the terraintypes, and green and alpha are their weights.
+	unsigned char* pixel = img->GetData();
+	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
+		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
+		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
+			TTypesByWeight const& ttypes = corners[ofs].ttypes;
+			assert(!ttypes.empty());
+
+			uint8_t ttype0 = ttypes.getKey(0);
+			unsigned weight0 = ttypes.getValueByte(0);
+			uint8_t ttype1 = ttype0;
+			unsigned weight1 = 0;
+			for (unsigned ttypes_i = 1; ttypes_i < ttypes.size(); ++ ttypes_i) {
+				unsigned weight = ttypes.getValueByte(ttypes_i);
+				if (weight > weight0) {
+					ttype1 = ttype0;
+					weight1 = weight0;
+					ttype0 = ttypes.getKey(ttypes_i);
+					weight0 = weight;
+				} else if (weight > weight1) {
+					ttype1 = ttypes.getKey(ttypes_i);
+					weight1 = weight;
+				}
+			}
+
+			// Normalize weights, so they sum up to 255
+			unsigned total = weight0 + weight1;
 			if (total == 0) {
-				w0 = 1;
+				weight0 = 1;
 				total = 1;
 			}
-			img->SetPixel(x, y, Urho3D::Color(w0 / total, w1 / total, w2 / total, w3 / total));
+			uint8_t byte_weight0 = (weight0 * 255 + total / 2) / total;
+
+			pixel[0] = ttype0;
+			pixel[1] = byte_weight0;
+			pixel[2] = ttype1;
+			pixel[3] = 255 - byte_weight0;
+			pixel += 4;
 
 			++ ofs;
 		}
@@ -109,15 +176,402 @@ Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_t
 	return img;
 }
 
+Urho3D::Vector3 calculateCornerNormal(Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned ofs, unsigned row_w)
+{
+	Urho3D::Vector3 const& pos = poss[ofs];
+	Urho3D::Vector3 const& pos_n = poss[ofs + row_w];
+	Urho3D::Vector3 const& pos_s = poss[ofs - row_w];
+	Urho3D::Vector3 const& pos_e = poss[ofs + 1];
+	Urho3D::Vector3 const& pos_w = poss[ofs - 1];
+	Urho3D::Vector3 diff_n = (pos_n - pos).Normalized();
+	Urho3D::Vector3 diff_s = (pos_s - pos).Normalized();
+	Urho3D::Vector3 diff_e = (pos_e - pos).Normalized();
+	Urho3D::Vector3 diff_w = (pos_w - pos).Normalized();
+	Urho3D::Vector3 nrm = (diff_w.CrossProduct(diff_n) + diff_e.CrossProduct(diff_s)).Normalized();
+	assert(nrm.y_ > 0);
+	return nrm;
+}
+
+void getSquareIndices(uint32_t* result, unsigned i_sw, unsigned row_w, int h_sw, int h_nw, int h_ne, int h_se)
+{
+	unsigned i_nw = i_sw + row_w;
+	unsigned i_ne = i_sw + row_w + 1;
+	unsigned i_se = i_sw + 1;
+
+	// Use diagonal that has smaller height difference
+	if (abs(h_sw - h_ne) < abs(h_se - h_nw)) {
+		result[0] = i_sw;
+		result[1] = i_ne;
+		result[2] = i_se;
+		result[3] = i_sw;
+		result[4] = i_nw;
+		result[5] = i_ne;
+	} else {
+		result[0] = i_sw;
+		result[1] = i_nw;
+		result[2] = i_se;
+		result[3] = i_nw;
+		result[4] = i_ne;
+		result[5] = i_se;
+	}
+}
+
+void buildOccluder(Urho3D::PODVector<char>& occ_vrts_data, Urho3D::PODVector<uint32_t>& occ_idxs_data, Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned chunk_width, float sqr_width)
+{
+	unsigned const CHUNK_W3 = chunk_width + 3;
+	float const CHUNK_WF_HALF = chunk_width * sqr_width / 2;
+	float const SQR_W = sqr_width;
+
+	unsigned occ_step = getOccluderStep(chunk_width);
+	unsigned occ_width = chunk_width / occ_step + 1;
+
+	// Occluder must never cover anything that is visible, so it must stay
+	// below the terrain. First find the lowest height of every occluder
+	// cell, and then use the lowest height of surrounding cells at every
+	// occluder vertex. This way every occluder triangle stays below its cell.
+	unsigned const OCC_CELLS = occ_width - 1;
+	Urho3D::PODVector<float> occ_cell_lowest;
+	occ_cell_lowest.Reserve(OCC_CELLS * OCC_CELLS);
+	for (unsigned cell_y = 0; cell_y < OCC_CELLS; ++ cell_y) {
+		for (unsigned cell_x = 0; cell_x < OCC_CELLS; ++ cell_x) {
+			float lowest = poss[1 + cell_x * occ_step + (1 + cell_y * occ_step) * CHUNK_W3].y_;
+			for (unsigned y = cell_y * occ_step; y <= (cell_y + 1) * occ_step; ++ y) {
+				unsigned ofs = 1 + cell_x * occ_step + (y + 1) * CHUNK_W3;
+				for (unsigned x = 0; x <= occ_step; ++ x) {
+					lowest = Urho3D::Min(lowest, poss[ofs].y_);
+					++ ofs;
+				}
+			}
+			occ_cell_lowest.Push(lowest);
+		}
+	}
+
+	// Construct the vector of heights
+	Urho3D::PODVector<float> occ_heights;
+	occ_heights.Reserve(occ_width * occ_width);
+	for (unsigned y = 0; y < occ_width; ++ y) {
+		for (unsigned x = 0; x < occ_width; ++ x) {
+			float lowest = Urho3D::M_INFINITY;
+			for (unsigned cell_y = Urho3D::Max<int>(y, 1) - 1; cell_y <= Urho3D::Min(y, OCC_CELLS - 1); ++ cell_y) {
+				for (unsigned cell_x = Urho3D::Max<int>(x, 1) - 1; cell_x <= Urho3D::Min(x, OCC_CELLS - 1); ++ cell_x) {
+					lowest = Urho3D::Min(lowest, occ_cell_lowest[cell_x + cell_y * OCC_CELLS]);
+				}
+			}
+			occ_heights.Push(lowest);
+		}
+	}
+
+	// Convert vector of positions into occluder shape
+	unsigned ofs = 0;
+	for (unsigned y = 0; y < occ_width; ++ y) {
+		for (unsigned x = 0; x < occ_width; ++ x) {
+			Urho3D::Vector3 pos(
+				x * occ_step * SQR_W - CHUNK_WF_HALF,
+				occ_heights[ofs],
+				y * occ_step * SQR_W - CHUNK_WF_HALF
+			);
+			pushV3(occ_vrts_data, pos);
+			++ ofs;
+		}
+	}
+
+	ofs = 0;
+	for (unsigned y = 0; y < occ_width - 1; ++ y) {
+		for (unsigned x = 0; x < occ_width - 1; ++ x) {
+			unsigned i_sw = ofs;
+			unsigned i_nw = ofs + occ_width;
+			unsigned i_ne = ofs + occ_width + 1;
+			unsigned i_se = ofs + 1;
+
+			float h_sw = occ_heights[i_sw];
+			float h_nw = occ_heights[i_nw];
+			float h_ne = occ_heights[i_ne];
+			float h_se = occ_heights[i_se];
+
+			if (fabs(h_sw - h_ne) < fabs(h_se - h_nw)) {
+				occ_idxs_data.Push(i_sw);
+				occ_idxs_data.Push(i_nw);
+				occ_idxs_data.Push(i_ne);
+				occ_idxs_data.Push(i_sw);
+				occ_idxs_data.Push(i_ne);
+				occ_idxs_data.Push(i_se);
+			} else {
+				occ_idxs_data.Push(i_nw);
+				occ_idxs_data.Push(i_ne);
+				occ_idxs_data.Push(i_se);
+				occ_idxs_data.Push(i_nw);
+				occ_idxs_data.Push(i_se);
+				occ_idxs_data.Push(i_sw);
+			}
+
+			++ ofs;
+		}
+		++ ofs;
+	}
+}
+
+void buildWaterPatch(Urho3D::PODVector<char>& vrts_data, Urho3D::PODVector<uint32_t>& idxs_data, Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned chunk_width, float sqr_width, float water_y)
+{
+	unsigned const CHUNK_W3 = chunk_width + 3;
+	float const CHUNK_WF_HALF = chunk_width * sqr_width / 2;
+	float const SQR_W = sqr_width;
+	// Position, normal and UV
+	unsigned const VRT_SIZE = sizeof(float) * 8;
+
+	// Water is flat, so covered squares of each row are merged to one quad
+	for (unsigned y = 0; y < chunk_width; ++ y) {
+		unsigned x = 0;
+		while (x < chunk_width) {
+			unsigned run_end = x;
+			while (run_end < chunk_width) {
+				unsigned ofs = run_end + 1 + (y + 1) * CHUNK_W3;
+				float lowest = Urho3D::Min(Urho3D::Min(poss[ofs].y_, poss[ofs + 1].y_), Urho3D::Min(poss[ofs + CHUNK_W3].y_, poss[ofs + CHUNK_W3 + 1].y_));
+				if (lowest >= water_y) {
+					break;
+				}
+				++ run_end;
+			}
+			if (run_end == x) {
+				++ x;
+				continue;
+			}
+
+			// Southwest, southeast, northwest and northeast corners
+			unsigned i_sw = vrts_data.Size() / VRT_SIZE;
+			for (unsigned corner_y = y; corner_y <= y + 1; ++ corner_y) {
+				for (unsigned corner_x = x; corner_x <= run_end; corner_x += run_end - x) {
+					pushV3(vrts_data, Urho3D::Vector3(corner_x * SQR_W - CHUNK_WF_HALF, water_y, corner_y * SQR_W - CHUNK_WF_HALF));
+					pushV3(vrts_data, Urho3D::Vector3::UP);
+					pushV2(vrts_data, Urho3D::Vector2(float(corner_x) / chunk_width, float(corner_y) / chunk_width));
+				}
+			}
+			uint32_t sqr_idxs[6];
+			getSquareIndices(sqr_idxs, i_sw, 2, 0, 0, 0, 0);
+			idxs_data.Insert(idxs_data.End(), sqr_idxs, sqr_idxs + 6);
+
+			x = run_end;
+		}
+	}
+}
+
+namespace
+{
+
+// Gives the corners of triangle of right-triangulated irregular network.
+// Triangles are numbered like nodes of binary tree, ids 2 and 3 being the
+// halves of Chunk. "a" and "b" are the ends of hypotenuse. "parent_m" is
+// set to the middle of the hypotenuse of parent, or to -1 if it is a root.
+void getRtinTriangle(int& ax, int& ay, int& bx, int& by, int& cx, int& cy, int& parent_mx, int& parent_my, unsigned id, int size)
+{
+	ax = ay = bx = by = cx = cy = 0;
+	if (id & 1) {
+		bx = by = cx = size;
+	} else {
+		ax = ay = cy = size;
+	}
+	parent_mx = parent_my = -1;
+	while ((id >>= 1) > 1) {
+		int mx = (ax + bx) / 2;
+		int my = (ay + by) / 2;
+		if (id & 1) {
+			bx = ax;
+			by = ay;
+			ax = cx;
+			ay = cy;
+		} else {
+			ax = bx;
+			ay = by;
+			bx = cx;
+			by = cy;
+		}
+		cx = mx;
+		cy = my;
+		parent_mx = mx;
+		parent_my = my;
+	}
+}
+
+// Builds the triangles of right-triangulated irregular network. Triangles
+// are split at the midpoint of their hypotenuse, if its error is too big.
+struct RtinBuilder
+{
+	Urho3D::PODVector<char>& vrts_data;
+	Urho3D::PODVector<uint32_t>& idxs_data;
+	Urho3D::PODVector<Urho3D::Vector3> const& poss;
+	Urho3D::PODVector<Urho3D::Vector3> const& nrms;
+	Urho3D::PODVector<Urho3D::Vector2> const& uvs;
+	Urho3D::PODVector<float> const& errors;
+	int size;
+	float max_error;
+	// Indices of the used corners
+	Urho3D::PODVector<int> vrt_idxs;
+
+	inline RtinBuilder(
+		Urho3D::PODVector<char>& vrts_data,
+		Urho3D::PODVector<uint32_t>& idxs_data,
+		Urho3D::PODVector<Urho3D::Vector3> const& poss,
+		Urho3D::PODVector<Urho3D::Vector3> const& nrms,
+		Urho3D::PODVector<Urho3D::Vector2> const& uvs,
+		Urho3D::PODVector<float> const& errors,
+		int size,
+		float max_error
+	) :
+	vrts_data(vrts_data),
+	idxs_data(idxs_data),
+	poss(poss),
+	nrms(nrms),
+	uvs(uvs),
+	errors(errors),
+	size(size),
+	max_error(max_error),
+	vrt_idxs((size + 1) * (size + 1), -1)
+	{
+	}
+
+	void addTriangle(int ax, int ay, int bx, int by, int cx, int cy)
+	{
+		int mx = (ax + bx) / 2;
+		int my = (ay + by) / 2;
+		if (Urho3D::Abs(ax - cx) + Urho3D::Abs(ay - cy) > 1 && errors[mx + my * (size + 1)] > max_error) {
+			addTriangle(cx, cy, ax, ay, mx, my);
+			addTriangle(bx, by, cx, cy, mx, my);
+			return;
+		}
+
+		idxs_data.Push(getVertex(ax, ay));
+		idxs_data.Push(getVertex(bx, by));
+		idxs_data.Push(getVertex(cx, cy));
+	}
+
+	uint32_t getVertex(int x, int y)
+	{
+		int& idx = vrt_idxs[x + y * (size + 1)];
+		if (idx < 0) {
+			unsigned const VRT_SIZE = sizeof(float) * 8;
+			unsigned ofs = 1 + x + (y + 1) * (size + 3);
+			idx = vrts_data.Size() / VRT_SIZE;
+			pushV3(vrts_data, poss[ofs]);
+			pushV3(vrts_data, nrms[ofs]);
+			pushV2(vrts_data, uvs[ofs]);
+		}
+		return idx;
+	}
+};
+
+}
+
+void buildAdaptiveLod(LodBuildingTaskData* data, Urho3D::PODVector<Urho3D::Vector3> const& poss, Urho3D::PODVector<Urho3D::Vector3> const& nrms, Urho3D::PODVector<Urho3D::Vector2> const& uvs)
+{
+	int const SIZE = data->chunk_width;
+	int const GRID_W = SIZE + 1;
+	unsigned const CHUNK_W3 = SIZE + 3;
+	assert((SIZE & (SIZE - 1)) == 0);
+
+	// The finest triangles are the last ones
+	unsigned const TRIANGLES = SIZE * SIZE * 2 - 2;
+	unsigned const PARENT_TRIANGLES = TRIANGLES - SIZE * SIZE;
+
+	float const MAX_ERROR = data->max_error * (1 << data->lod) / data->heightstep;
+	float const BORDER_MAX_ERROR = data->max_error / data->heightstep;
+
+	// Error of corner is the difference between its height and the
+	// middle of the hypotenuse it splits. Errors of children are
+	// added to their parents, so splitting a triangle always splits
+	// its neighbors too, and there will be no T-junctions.
+	//
+	// Neighbor Chunks are built separately, maybe with different LODs,
+	// so corners at borders must not depend on anything else than the
+	// border. They are selected by their own error using the error of
+	// the most detailed LOD, and by their distance from the end of the
+	// border, because some corners near the ends are needed by corners
+	// of other borders. Those are forced, as are all their parents,
+	// and all other corners at borders are never used.
+	Urho3D::PODVector<float> errors(GRID_W * GRID_W, 0.0f);
+	for (unsigned i = TRIANGLES; i > 0; -- i) {
+		int ax, ay, bx, by, cx, cy, parent_mx, parent_my;
+		getRtinTriangle(ax, ay, bx, by, cx, cy, parent_mx, parent_my, i + 1, SIZE);
+
+		int mx = (ax + bx) / 2;
+		int my = (ay + by) / 2;
+		int h_a = data->corners[1 + ax + (ay + 1) * CHUNK_W3].height;
+		int h_b = data->corners[1 + bx + (by + 1) * CHUNK_W3].height;
+		int h_m = data->corners[1 + mx + (my + 1) * CHUNK_W3].height;
+		float local_error = Urho3D::Abs(h_m - (h_a + h_b) / 2.0f);
+		float children_error = 0;
+		if (i - 1 < PARENT_TRIANGLES) {
+			children_error = Urho3D::Max(
+				errors[(ax + cx) / 2 + (ay + cy) / 2 * GRID_W],
+				errors[(bx + cx) / 2 + (by + cy) / 2 * GRID_W]
+			);
+		}
+		float& error = errors[mx + my * GRID_W];
+		if (mx == 0 || mx == SIZE || my == 0 || my == SIZE) {
+			int border_pos = (mx == 0 || mx == SIZE) ? my : mx;
+			int end_dist = Urho3D::Min(border_pos, SIZE - border_pos);
+			if (local_error > BORDER_MAX_ERROR || (end_dist & (end_dist - 1)) == 0 || children_error == Urho3D::M_INFINITY) {
+				error = Urho3D::M_INFINITY;
+			}
+		} else {
+			error = Urho3D::Max(error, Urho3D::Max(local_error, children_error));
+		}
+	}
+
+	// Corners whose parent can not be split can not be split either
+	for (unsigned i = 3; i <= TRIANGLES; ++ i) {
+		int ax, ay, bx, by, cx, cy, parent_mx, parent_my;
+		getRtinTriangle(ax, ay, bx, by, cx, cy, parent_mx, parent_my, i + 1, SIZE);
+		float& error = errors[(ax + bx) / 2 + (ay + by) / 2 * GRID_W];
+		error = Urho3D::Min(error, errors[parent_mx + parent_my * GRID_W]);
+	}
+
+	RtinBuilder builder(data->vrts_data, data->idxs_data, poss, nrms, uvs, errors, SIZE, MAX_ERROR);
+	builder.addTriangle(0, 0, SIZE, SIZE, SIZE, 0);
+	builder.addTriangle(SIZE, SIZE, 0, 0, 0, SIZE);
+}
+
+LodBuildingTaskData::LodBuildingTaskData() :
+context(NULL),
+lod(0),
+baseheight(0),
+calculate_ttype_image(false),
+ttype_image_mode(TTYPE_IMAGE_WEIGHTS),
+data_version(0),
+chunk_width(0),
+sqr_width(0),
+heightstep(0),
+terrain_texture_repeats(0),
+max_error(0),
+build_water_patch(false),
+water_y(0),
+water_version(0),
+occ_shape_available(false)
+{
+}
+
+LodBuildingTaskData::~LodBuildingTaskData()
+{
+}
+
 void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 {
 	(void)threadIndex;
 
 	LodBuildingTaskData* data = (LodBuildingTaskData*)item->aux_;
+	TraceScope trace("BuildLod", data->chunk_pos, data->lod);
+
+	// Copying corners here keeps it away from the main thread
+	if (data->corners.Empty()) {
+		extractCornersData(data->corners, data->snapshots, data->chunk_width);
+	}
 
 	// Check if terraintype image calculation is also needed
 	if (data->calculate_ttype_image) {
-		data->ttype_image = calculateTerraintypeImage(data->used_ttypes, data->context, data->corners, data->chunk_width);
+		if (data->ttype_image_mode == TTYPE_IMAGE_INDICES) {
+			data->ttype_image = calculateTerraintypeIndexImage(data->context, data->corners, data->chunk_width);
+		} else {
+			bool rgba = data->ttype_image_mode == TTYPE_IMAGE_WEIGHTS_RGBA;
+			data->ttype_image = calculateTerraintypeImage(data->used_ttypes, data->context, data->corners, data->chunk_width, rgba);
+		}
 	}
 
 	// Precalculate some stuff
@@ -129,15 +583,6 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 	float const CHUNK_WF_HALF = CHUNK_WF / 2;
 	float const HEIGHTSTEP = data->heightstep;
 
-	// Prepare corners of occluder geometry. Occluder is a very simple shape,
-	// that is based only on heights of corners. It will be lowered according
-	// to vertices, so it doesn't cover visible areas.
-	float occ_h_sw = (int(data->corners[CHUNK_W3 + 1].height) - int(data->baseheight)) * HEIGHTSTEP;
-	float occ_h_se = (int(data->corners[CHUNK_W3 + 1 + CHUNK_W].height) - int(data->baseheight)) * HEIGHTSTEP;
-	float occ_h_nw = (int(data->corners[CHUNK_W3 * (1 + CHUNK_W) + 1].height) - int(data->baseheight)) * HEIGHTSTEP;
-	float occ_h_ne = (int(data->corners[CHUNK_W3 * (1 + CHUNK_W) + 1 + CHUNK_W].height) - int(data->baseheight)) * HEIGHTSTEP;
-	float occluder_lowering = 0;
-
 	// Set up elements
 	data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
 	data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
@@ -167,26 +612,30 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 		}
 	}
 
-	// Check if there is more than one terraintype used
-	Urho3D::HashSet<uint8_t> ttype_check;
-	for (unsigned y = 0; y < CHUNK_W1 && ttype_check.Size() <= 1; ++ y) {
-		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
-		for (unsigned x = 0; x < CHUNK_W1 && ttype_check.Size() <= 1; ++ x) {
-			Corner const& corner = data->corners[ofs];
-			for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
-				uint8_t ttype = corner.ttypes.getKey(ttypes_i);
-				float weight = corner.ttypes.getValue(ttypes_i);
-				if (weight > 0) {
-					ttype_check.Insert(ttype);
-					if (ttype_check.Size() > 1) {
-						break;
+	// Check if there is more than one terraintype used. With index images
+	// the same Material is used always, so then this does not matter.
+	bool multiple_terraintypes = true;
+	if (data->ttype_image_mode != TTYPE_IMAGE_INDICES) {
+		Urho3D::HashSet<uint8_t> ttype_check;
+		for (unsigned y = 0; y < CHUNK_W1 && ttype_check.Size() <= 1; ++ y) {
+			unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
+			for (unsigned x = 0; x < CHUNK_W1 && ttype_check.Size() <= 1; ++ x) {
+				Corner const& corner = data->corners[ofs];
+				for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
+					uint8_t ttype = corner.ttypes.getKey(ttypes_i);
+					float weight = corner.ttypes.getValue(ttypes_i);
+					if (weight > 0) {
+						ttype_check.Insert(ttype);
+						if (ttype_check.Size() > 1) {
+							break;
+						}
 					}
 				}
+				++ ofs;
 			}
-			++ ofs;
 		}
+		multiple_terraintypes = ttype_check.Size() > 1;
 	}
-	bool multiple_terraintypes = ttype_check.Size() > 1;
 
 	// Create array of normals and UV coordinates
 	Urho3D::PODVector<Urho3D::Vector3> nrms;
@@ -199,17 +648,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 
 			if (x >= 1 && y >= 1 && x <= CHUNK_W1 && y <= CHUNK_W1) {
 				// Normal
-				Urho3D::Vector3 const& pos = poss[ofs];
-				Urho3D::Vector3 const& pos_n = poss[ofs + CHUNK_W3];
-				Urho3D::Vector3 const& pos_s = poss[ofs - CHUNK_W3];
-				Urho3D::Vector3 const& pos_e = poss[ofs + 1];
-				Urho3D::Vector3 const& pos_w = poss[ofs - 1];
-				Urho3D::Vector3 diff_n = (pos_n - pos).Normalized();
-				Urho3D::Vector3 diff_s = (pos_s - pos).Normalized();
-				Urho3D::Vector3 diff_e = (pos_e - pos).Normalized();
-				Urho3D::Vector3 diff_w = (pos_w - pos).Normalized();
-				nrm = (diff_w.CrossProduct(diff_n) + diff_e.CrossProduct(diff_s)).Normalized();
-				assert(nrm.y_ > 0);
+				nrm = calculateCornerNormal(poss, ofs, CHUNK_W3);
 
 				// Texture coordinates. If there are no multiple terraintypes,
 				// then apply the repeating straight to UV coordinates.
@@ -230,241 +669,165 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 	// LOD details determines the width of drawn elements, measured in world squares.
 	unsigned step = Urho3D::Min<unsigned>(CHUNK_W, 1 << data->lod);
 
-	// Create vertex data
-	for (unsigned y = 0; y < CHUNK_W1; y += step) {
-		ofs = 1 + (y + 1) * CHUNK_W3;
-		for (unsigned x = 0; x < CHUNK_W1; x += step) {
-			Urho3D::Vector3 const& pos = poss[ofs];
-			Urho3D::Vector3 const& normal = nrms[ofs];
-			Urho3D::Vector2 const& uv = uvs[ofs];
-			pushV3(data->vrts_data, pos);
-			pushV3(data->vrts_data, normal);
-			pushV2(data->vrts_data, uv);
-			ofs += step;
-
-			// Use position to check if occluder should be lowered
-			float xm = float(x) / CHUNK_W;
-			float ym = float(y) / CHUNK_W;
-			float h;
-			if (x < y) {
-				h = Urho3D::Lerp(Urho3D::Lerp(occ_h_sw, occ_h_se, xm), occ_h_ne, ym);
-			} else {
-				h = Urho3D::Lerp(occ_h_sw, Urho3D::Lerp(occ_h_nw, occ_h_ne, xm), ym);
+	// Adaptive meshes have their own vertices and indices
+	if (data->max_error > 0) {
+		buildAdaptiveLod(data, poss, nrms, uvs);
+	} else {
+		// Create vertex data
+		for (unsigned y = 0; y < CHUNK_W1; y += step) {
+			ofs = 1 + (y + 1) * CHUNK_W3;
+			for (unsigned x = 0; x < CHUNK_W1; x += step) {
+				Urho3D::Vector3 const& pos = poss[ofs];
+				Urho3D::Vector3 const& normal = nrms[ofs];
+				Urho3D::Vector2 const& uv = uvs[ofs];
+				pushV3(data->vrts_data, pos);
+				pushV3(data->vrts_data, normal);
+				pushV2(data->vrts_data, uv);
+				ofs += step;
 			}
-			occluder_lowering = Urho3D::Max(occluder_lowering, h - pos.y_);
 		}
-	}
 
-	// Create index data
-	for (unsigned y = 0; y < CHUNK_W / step; ++ y) {
-		ofs = y * (CHUNK_W / step + 1);
-		unsigned ofs2 = 1 + (y * step + 1) * CHUNK_W3;
-		for (unsigned x = 0; x < CHUNK_W / step; ++ x) {
-
-			// Get heights of corners to decide how
-			// square should be splitted to triangles.
-			int h_sw = data->corners[ofs2].height;
-			int h_se = data->corners[ofs2 + step].height;
-			int h_ne = data->corners[ofs2 + step + CHUNK_W3 * step].height;
-			int h_nw = data->corners[ofs2 + CHUNK_W3 * step].height;
-
-			// Use diagonal that has smaller height difference
-			if (abs(h_sw - h_ne) < abs(h_se - h_nw)) {
-				data->idxs_data.Push(ofs);
-				data->idxs_data.Push(ofs + 1 + CHUNK_W / step + 1);
-				data->idxs_data.Push(ofs + 1);
-				data->idxs_data.Push(ofs);
-				data->idxs_data.Push(ofs + CHUNK_W / step + 1);
-				data->idxs_data.Push(ofs + 1 + CHUNK_W / step + 1);
-			} else {
-				data->idxs_data.Push(ofs);
-				data->idxs_data.Push(ofs + CHUNK_W / step + 1);
-				data->idxs_data.Push(ofs + 1);
-				data->idxs_data.Push(ofs + CHUNK_W / step + 1);
-				data->idxs_data.Push(ofs + 1 + CHUNK_W / step + 1);
-				data->idxs_data.Push(ofs + 1);
+		// Create index data
+		for (unsigned y = 0; y < CHUNK_W / step; ++ y) {
+			ofs = y * (CHUNK_W / step + 1);
+			unsigned ofs2 = 1 + (y * step + 1) * CHUNK_W3;
+			for (unsigned x = 0; x < CHUNK_W / step; ++ x) {
+
+				// Get heights of corners to decide how
+				// square should be splitted to triangles.
+				int h_sw = data->corners[ofs2].height;
+				int h_se = data->corners[ofs2 + step].height;
+				int h_ne = data->corners[ofs2 + step + CHUNK_W3 * step].height;
+				int h_nw = data->corners[ofs2 + CHUNK_W3 * step].height;
+
+				uint32_t sqr_idxs[6];
+				getSquareIndices(sqr_idxs, ofs, CHUNK_W / step + 1, h_sw, h_nw, h_ne, h_se);
+				data->idxs_data.Insert(data->idxs_data.End(), sqr_idxs, sqr_idxs + 6);
+
+				++ ofs;
+				ofs2 += step;
 			}
-
-			++ ofs;
-			ofs2 += step;
 		}
-	}
 
-	// If not full detail LOD, then add some vertical triangles to
-	// close some holes that appear between different detail chunks.
-	if (data->lod > 0) {
-		// South edge
-		ofs = 1 + CHUNK_W3;
-		for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
-			unsigned h_begin = data->corners[ofs].height;
-			unsigned h_center = data->corners[ofs + step / 2].height;
-			unsigned h_end = data->corners[ofs + step].height;
-			if (h_center * 2 < h_begin + h_end) {
-				unsigned i_begin = i;
-				unsigned i_end = i + 1;
-				unsigned i_center_ofs = 1 + CHUNK_W3 + i * step + step / 2;
-				// Create new vertex
-				unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
-				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
-				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
-				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
-				// Create new triangle
-				data->idxs_data.Push(i_begin);
-				data->idxs_data.Push(i_end);
-				data->idxs_data.Push(i_center);
+		// If not full detail LOD, then add some vertical triangles to
+		// close some holes that appear between different detail chunks.
+		if (data->lod > 0) {
+			// South edge
+			ofs = 1 + CHUNK_W3;
+			for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
+				unsigned h_begin = data->corners[ofs].height;
+				unsigned h_center = data->corners[ofs + step / 2].height;
+				unsigned h_end = data->corners[ofs + step].height;
+				if (h_center * 2 < h_begin + h_end) {
+					unsigned i_begin = i;
+					unsigned i_end = i + 1;
+					unsigned i_center_ofs = 1 + CHUNK_W3 + i * step + step / 2;
+					// Create new vertex
+					unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
+					Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
+					Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
+					Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
+					pushV3(data->vrts_data, center_pos);
+					pushV3(data->vrts_data, center_nrm);
+					pushV2(data->vrts_data, center_uv);
+					// Create new triangle
+					data->idxs_data.Push(i_begin);
+					data->idxs_data.Push(i_end);
+					data->idxs_data.Push(i_center);
+				}
+				ofs += step;
 			}
-			ofs += step;
-		}
-		// East edge
-		ofs = 1 + CHUNK_W3 + CHUNK_W;
-		for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
-			unsigned h_begin = data->corners[ofs].height;
-			unsigned h_center = data->corners[ofs + CHUNK_W3 * step / 2].height;
-			unsigned h_end = data->corners[ofs + CHUNK_W3 * step].height;
-			if (h_center * 2 < h_begin + h_end) {
-				unsigned i_begin = CHUNK_W / step + i * (CHUNK_W / step + 1);
-				unsigned i_end = i_begin + CHUNK_W / step + 1;
-				unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W + i * CHUNK_W3 * step + CHUNK_W3 * step / 2;
-				// Create new vertex
-				unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
-				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
-				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
-				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
-				// Create new triangle
-				data->idxs_data.Push(i_begin);
-				data->idxs_data.Push(i_end);
-				data->idxs_data.Push(i_center);
+			// East edge
+			ofs = 1 + CHUNK_W3 + CHUNK_W;
+			for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
+				unsigned h_begin = data->corners[ofs].height;
+				unsigned h_center = data->corners[ofs + CHUNK_W3 * step / 2].height;
+				unsigned h_end = data->corners[ofs + CHUNK_W3 * step].height;
+				if (h_center * 2 < h_begin + h_end) {
+					unsigned i_begin = CHUNK_W / step + i * (CHUNK_W / step + 1);
+					unsigned i_end = i_begin + CHUNK_W / step + 1;
+					unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W + i * CHUNK_W3 * step + CHUNK_W3 * step / 2;
+					// Create new vertex
+					unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
+					Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
+					Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
+					Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
+					pushV3(data->vrts_data, center_pos);
+					pushV3(data->vrts_data, center_nrm);
+					pushV2(data->vrts_data, center_uv);
+					// Create new triangle
+					data->idxs_data.Push(i_begin);
+					data->idxs_data.Push(i_end);
+					data->idxs_data.Push(i_center);
+				}
+				ofs += step * CHUNK_W3;
 			}
-			ofs += step * CHUNK_W3;
-		}
-		// North edge
-		ofs = 1 + CHUNK_W3 + CHUNK_W + CHUNK_W * CHUNK_W3;
-		for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
-			unsigned h_begin = data->corners[ofs].height;
-			unsigned h_center = data->corners[ofs - step / 2].height;
-			unsigned h_end = data->corners[ofs - step].height;
-			if (h_center * 2 < h_begin + h_end) {
-				unsigned i_begin = CHUNK_W / step + CHUNK_W / step * (CHUNK_W / step + 1) - i;
-				unsigned i_end = i_begin - 1;
-				unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W + CHUNK_W * CHUNK_W3 - i * step - step / 2;
-				// Create new vertex
-				unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
-				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
-				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
-				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
-				// Create new triangle
-				data->idxs_data.Push(i_begin);
-				data->idxs_data.Push(i_end);
-				data->idxs_data.Push(i_center);
+			// North edge
+			ofs = 1 + CHUNK_W3 + CHUNK_W + CHUNK_W * CHUNK_W3;
+			for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
+				unsigned h_begin = data->corners[ofs].height;
+				unsigned h_center = data->corners[ofs - step / 2].height;
+				unsigned h_end = data->corners[ofs - step].height;
+				if (h_center * 2 < h_begin + h_end) {
+					unsigned i_begin = CHUNK_W / step + CHUNK_W / step * (CHUNK_W / step + 1) - i;
+					unsigned i_end = i_begin - 1;
+					unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W + CHUNK_W * CHUNK_W3 - i * step - step / 2;
+					// Create new vertex
+					unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
+					Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
+					Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
+					Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
+					pushV3(data->vrts_data, center_pos);
+					pushV3(data->vrts_data, center_nrm);
+					pushV2(data->vrts_data, center_uv);
+					// Create new triangle
+					data->idxs_data.Push(i_begin);
+					data->idxs_data.Push(i_end);
+					data->idxs_data.Push(i_center);
+				}
+				ofs -= step;
 			}
-			ofs -= step;
-		}
-		// West edge
-		ofs = 1 + CHUNK_W3 + CHUNK_W * CHUNK_W3;
-		for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
-			unsigned h_begin = data->corners[ofs].height;
-			unsigned h_center = data->corners[ofs - CHUNK_W3 * step / 2].height;
-			unsigned h_end = data->corners[ofs - CHUNK_W3 * step].height;
-			if (h_center * 2 < h_begin + h_end) {
-				unsigned i_begin = CHUNK_W / step * (CHUNK_W / step + 1) - i * (CHUNK_W / step + 1);
-				unsigned i_end = i_begin - CHUNK_W / step - 1;
-				unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W * CHUNK_W3 - i * CHUNK_W3 * step - CHUNK_W3 * step / 2;
-				// Create new vertex
-				unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
-				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
-				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
-				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
-				// Create new triangle
-				data->idxs_data.Push(i_begin);
-				data->idxs_data.Push(i_end);
-				data->idxs_data.Push(i_center);
+			// West edge
+			ofs = 1 + CHUNK_W3 + CHUNK_W * CHUNK_W3;
+			for (unsigned i = 0; i < CHUNK_W / step; ++ i) {
+				unsigned h_begin = data->corners[ofs].height;
+				unsigned h_center = data->corners[ofs - CHUNK_W3 * step / 2].height;
+				unsigned h_end = data->corners[ofs - CHUNK_W3 * step].height;
+				if (h_center * 2 < h_begin + h_end) {
+					unsigned i_begin = CHUNK_W / step * (CHUNK_W / step + 1) - i * (CHUNK_W / step + 1);
+					unsigned i_end = i_begin - CHUNK_W / step - 1;
+					unsigned i_center_ofs = 1 + CHUNK_W3 + CHUNK_W * CHUNK_W3 - i * CHUNK_W3 * step - CHUNK_W3 * step / 2;
+					// Create new vertex
+					unsigned i_center = data->vrts_data.Size() / VRT_SIZE;
+					Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
+					Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
+					Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
+					pushV3(data->vrts_data, center_pos);
+					pushV3(data->vrts_data, center_nrm);
+					pushV2(data->vrts_data, center_uv);
+					// Create new triangle
+					data->idxs_data.Push(i_begin);
+					data->idxs_data.Push(i_end);
+					data->idxs_data.Push(i_center);
+				}
+				ofs -= step * CHUNK_W3;
 			}
-			ofs -= step * CHUNK_W3;
 		}
 	}
 
-	// Construct occluder shape. It will be a lower detail version of the terrain.
-	unsigned occ_step = CHUNK_W / 4;
-	unsigned occ_width = CHUNK_W / occ_step + 1;
+	if (data->build_water_patch) {
+		buildWaterPatch(data->water_vrts_data, data->water_idxs_data, poss, CHUNK_W, SQR_W, data->water_y);
+	}
 
+	// Construct occluder shape. It will be a lower detail version of the terrain.
 	// If detail is same or higher that the visible shape, then use visible shape.
-	if (occ_step <= step) {
+	if (getOccluderStep(CHUNK_W) <= step) {
 		data->occ_shape_available = false;
 		return;
 	}
 
 	data->occ_shape_available = true;
-
-	// Construct the vector of heights
-	Urho3D::PODVector<float> occ_heights;
-	occ_heights.Clear();
-	for (unsigned y = 0; y <= CHUNK_W; y += occ_step) {
-		unsigned ofs = 1 + (y + 1) * CHUNK_W3;
-		for (unsigned x = 0; x <= CHUNK_W; x += occ_step) {
-			occ_heights.Push(poss[ofs].y_);
-			ofs += occ_step;
-		}
-	}
-
-	// Convert vector of positions into occluder shape
-	ofs = 0;
-	for (unsigned y = 0; y < occ_width; ++ y) {
-		for (unsigned x = 0; x < occ_width; ++ x) {
-			Urho3D::Vector3 pos(
-				x * occ_step * SQR_W - CHUNK_WF_HALF,
-				occ_heights[ofs],
-				y * occ_step * SQR_W - CHUNK_WF_HALF
-			);
-			pushV3(data->occ_vrts_data, pos);
-			++ ofs;
-		}
-	}
-
-	ofs = 0;
-	for (unsigned y = 0; y < occ_width - 1; ++ y) {
-		for (unsigned x = 0; x < occ_width - 1; ++ x) {
-			unsigned i_sw = ofs;
-			unsigned i_nw = ofs + occ_width;
-			unsigned i_ne = ofs + occ_width + 1;
-			unsigned i_se = ofs + 1;
-
-			float h_sw = occ_heights[i_sw];
-			float h_nw = occ_heights[i_nw];
-			float h_ne = occ_heights[i_ne];
-			float h_se = occ_heights[i_se];
-
-			if (fabs(h_sw - h_ne) < fabs(h_se - h_nw)) {
-				data->occ_idxs_data.Push(i_sw);
-				data->occ_idxs_data.Push(i_nw);
-				data->occ_idxs_data.Push(i_ne);
-				data->occ_idxs_data.Push(i_sw);
-				data->occ_idxs_data.Push(i_ne);
-				data->occ_idxs_data.Push(i_se);
-			} else {
-				data->occ_idxs_data.Push(i_nw);
-				data->occ_idxs_data.Push(i_ne);
-				data->occ_idxs_data.Push(i_se);
-				data->occ_idxs_data.Push(i_nw);
-				data->occ_idxs_data.Push(i_se);
-				data->occ_idxs_data.Push(i_sw);
-			}
-
-			++ ofs;
-		}
-		++ ofs;
-	}
+	buildOccluder(data->occ_vrts_data, data->occ_idxs_data, poss, CHUNK_W, SQR_W);
 }
 
 }
@@ -1,14 +1,51 @@
 #ifndef BIGWORLD_LODBUILDER_HPP
 #define BIGWORLD_LODBUILDER_HPP
 
+#include "types.hpp"
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
 #include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Math/Vector3.h>
+#include <Urho3D/Resource/Image.h>
+
+#include <cstdint>
 
 namespace BigWorld
 {
 
 void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex);
 
+// Images of terraintypes. "corners" are in the same format as in LodBuildingTaskData.
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width, bool rgba);
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeIndexImage(Urho3D::Context* context, Corners const& corners, unsigned chunk_width);
+
+// These are also used when full detail LODs are updated in place. Positions
+// are in the same (chunk_width + 3) x (chunk_width + 3) layout as the corners
+// that are given to buildLod().
+
+// Calculates normal of the corner at "ofs" from its four neighbors
+Urho3D::Vector3 calculateCornerNormal(Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned ofs, unsigned row_w);
+
+// Writes six indices of the two triangles of square. The
+// diagonal with the smaller height difference is used.
+void getSquareIndices(uint32_t* result, unsigned i_sw, unsigned row_w, int h_sw, int h_nw, int h_ne, int h_se);
+
+// Occluder is used only if it has less detail than the visible shape
+inline unsigned getOccluderStep(unsigned chunk_width) { return chunk_width / 4; }
+
+void buildOccluder(Urho3D::PODVector<char>& occ_vrts_data, Urho3D::PODVector<uint32_t>& occ_idxs_data, Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned chunk_width, float sqr_width);
+
+// Builds vertices and indices of adaptive LOD from the corners, positions,
+// normals and UVs. Borders use the same corners in every LOD, so they match
+// with any LOD of neighbors. Width of Chunk must be a power of two.
+void buildAdaptiveLod(LodBuildingTaskData* data, Urho3D::PODVector<Urho3D::Vector3> const& poss, Urho3D::PODVector<Urho3D::Vector3> const& nrms, Urho3D::PODVector<Urho3D::Vector2> const& uvs);
+
+// Builds flat water surface at "water_y" over the squares that have any corner
+// below it. Vertices have the same elements as LODs. Result is empty if there
+// is no water.
+void buildWaterPatch(Urho3D::PODVector<char>& vrts_data, Urho3D::PODVector<uint32_t>& idxs_data, Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned chunk_width, float sqr_width, float water_y);
+
 }
 
 #endif
-
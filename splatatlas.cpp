@@ -0,0 +1,106 @@
+#include "splatatlas.hpp"
+
+#include <Urho3D/Graphics/Graphics.h>
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+SplatAtlas::SplatAtlas(Urho3D::Context* context, unsigned chunk_width, unsigned terrain_texture_repeats, unsigned slots_per_side) :
+chunk_width(chunk_width),
+slots_per_side(slots_per_side)
+{
+	if (slots_per_side == 0) {
+		throw std::runtime_error("Splat atlas must have at least one slot!");
+	}
+
+	// Terrain textures are repeated using the atlas coordinates. To make
+	// them continue seamlessly between Chunks, the start of every slot
+	// must be at a position where terrain textures start a new repeat.
+	unsigned gcd_a = chunk_width;
+	unsigned gcd_b = terrain_texture_repeats;
+	while (gcd_b) {
+		unsigned temp = gcd_a % gcd_b;
+		gcd_a = gcd_b;
+		gcd_b = temp;
+	}
+	unsigned pitch_unit = chunk_width / gcd_a;
+	slot_pitch = (chunk_width + pitch_unit) / pitch_unit * pitch_unit;
+	assert(slot_pitch >= chunk_width + 1);
+
+	width = slot_pitch * slots_per_side;
+	detail_tiling = float(terrain_texture_repeats) * width / chunk_width;
+
+	free_slots.Reserve(slots_per_side * slots_per_side);
+	for (unsigned i = slots_per_side * slots_per_side; i > 0; -- i) {
+		free_slots.Push(i - 1);
+	}
+
+	texture = new Urho3D::Texture2D(context);
+	// No mipmaps, so slots will not bleed to each others
+	texture->SetNumLevels(1);
+	texture->SetFilterMode(Urho3D::FILTER_BILINEAR);
+	texture->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+	texture->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+	if (!texture->SetSize(width, width, Urho3D::Graphics::GetRGBAFormat(), Urho3D::TEXTURE_STATIC)) {
+		throw std::runtime_error("Unable to set size of splat atlas!");
+	}
+}
+
+unsigned SplatAtlas::reserveSlot()
+{
+	if (free_slots.Empty()) {
+		throw std::runtime_error("Splat atlas is full!");
+	}
+	unsigned slot = free_slots.Back();
+	free_slots.Pop();
+	return slot;
+}
+
+void SplatAtlas::releaseSlot(unsigned slot)
+{
+	assert(slot < slots_per_side * slots_per_side);
+	assert(!free_slots.Contains(slot));
+	free_slots.Push(slot);
+}
+
+void SplatAtlas::setSlotData(unsigned slot, Urho3D::Image* image)
+{
+	unsigned const SLOT_SIZE = chunk_width + 1;
+	assert(image);
+	assert(image->GetWidth() == int(SLOT_SIZE));
+	assert(image->GetHeight() == int(SLOT_SIZE));
+	assert(image->GetComponents() == 4);
+
+	int x = (slot % slots_per_side) * slot_pitch;
+	int y = (slot / slots_per_side) * slot_pitch;
+	if (!texture->SetData(0, x, y, SLOT_SIZE, SLOT_SIZE, image->GetData())) {
+		throw std::runtime_error("Unable to set splat atlas slot data!");
+	}
+}
+
+void SplatAtlas::convertUvsToSlot(Urho3D::PODVector<char>& vrts_data, unsigned vrt_size, unsigned uv_ofs, unsigned slot) const
+{
+	assert(vrts_data.Size() % vrt_size == 0);
+
+	// LOD builder uses (x + 1) / chunk_width as the UV of corner x. Convert
+	// these to point to the centers of the texels in the atlas slot.
+	float const SLOT_X = (slot % slots_per_side) * slot_pitch + 0.5 - 1.0;
+	float const SLOT_Y = (slot / slots_per_side) * slot_pitch + 0.5 - 1.0;
+	float const SCALE = float(chunk_width) / width;
+	float const OFFSET_X = SLOT_X / width;
+	float const OFFSET_Y = SLOT_Y / width;
+
+	for (unsigned ofs = uv_ofs; ofs < vrts_data.Size(); ofs += vrt_size) {
+		float uv[2];
+		memcpy(uv, vrts_data.Buffer() + ofs, sizeof(uv));
+		uv[0] = uv[0] * SCALE + OFFSET_X;
+		uv[1] = uv[1] * SCALE + OFFSET_Y;
+		memcpy(vrts_data.Buffer() + ofs, uv, sizeof(uv));
+	}
+}
+
+}
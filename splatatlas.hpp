@@ -0,0 +1,83 @@
+#ifndef BIGWORLD_SPLATATLAS_HPP
+#define BIGWORLD_SPLATATLAS_HPP
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Math/Vector2.h>
+#include <Urho3D/Resource/Image.h>
+
+namespace BigWorld
+{
+
+// Texture that contains terraintype blend maps of multiple Chunks. Every
+// Chunk gets its own square slot from the atlas, and all Chunks that are
+// using the same atlas can also share the same Material.
+class SplatAtlas : public Urho3D::RefCounted
+{
+
+public:
+
+	SplatAtlas(Urho3D::Context* context, unsigned chunk_width, unsigned terrain_texture_repeats, unsigned slots_per_side);
+
+	inline bool isFull() const { return free_slots.Empty(); }
+
+	unsigned reserveSlot();
+	void releaseSlot(unsigned slot);
+
+	// Image must have size of (chunk_width + 1) x (chunk_width + 1) and four components.
+	void setSlotData(unsigned slot, Urho3D::Image* image);
+
+	// Converts UV coordinates, that are generated by LOD builder, to the
+	// coordinates of specific slot. UVs are in "vrts_data" of VRT_SIZE
+	// sized vertices, and they are located at "uv_ofs" bytes offset.
+	void convertUvsToSlot(Urho3D::PODVector<char>& vrts_data, unsigned vrt_size, unsigned uv_ofs, unsigned slot) const;
+
+	// How many times terrain textures should repeat over the whole atlas.
+	inline float getDetailTiling() const { return detail_tiling; }
+
+	inline unsigned getWidth() const { return width; }
+
+	inline Urho3D::Texture2D* getTexture() const { return texture; }
+
+	inline Urho3D::Material* getMaterial() const { return material; }
+	inline void setMaterial(Urho3D::Material* material) { this->material = material; }
+
+private:
+
+	unsigned chunk_width;
+	unsigned slots_per_side;
+	// Distance of slots in texels. This might be bigger than the size of blend
+	// map, so terrain textures will continue seamlessly between the slots.
+	unsigned slot_pitch;
+	unsigned width;
+	float detail_tiling;
+
+	Urho3D::PODVector<unsigned> free_slots;
+
+	Urho3D::SharedPtr<Urho3D::Texture2D> texture;
+	Urho3D::SharedPtr<Urho3D::Material> material;
+};
+
+// Reservation of one slot from SplatAtlas
+struct SplatSlot
+{
+	Urho3D::SharedPtr<SplatAtlas> atlas;
+	unsigned index;
+
+	inline SplatSlot() : index(0) {}
+
+	inline void release()
+	{
+		if (atlas.NotNull()) {
+			atlas->releaseSlot(index);
+			atlas = NULL;
+		}
+	}
+};
+
+}
+
+#endif
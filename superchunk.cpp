@@ -0,0 +1,373 @@
+#include "superchunk.hpp"
+
+#include "chunk.hpp"
+#include "chunkworld.hpp"
+#include "cornerssnapshot.hpp"
+#include "lodbuilder.hpp"
+#include "tracer.hpp"
+
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/IndexBuffer.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/Scene/Scene.h>
+
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+// Adds skirts below the borders of block. Neighbors are closer to Camera,
+// and their borders can use any real corners between the corners of block.
+// Skirt of a square reaches the lowest real corner of the neighbor Chunks
+// it touches, so it hides the gaps where neighbor is lower. Where neighbor
+// is higher, the block is seen from above, and there is no visible gap.
+void addSkirts(SuperChunkTaskData* data)
+{
+	int const CHUNK_W = data->chunk_width;
+	int const CHUNK_W3 = CHUNK_W + 3;
+	int const SIZE = data->size;
+	int const AREA_W = SIZE + 2;
+	unsigned const VRT_SIZE = sizeof(float) * 8;
+
+	// Start and direction of borders, in squares of block. They go
+	// counterclockwise, so skirts face the neighbors.
+	int const BORDERS[4][4] = {
+		{ 0, 0, 1, 0 },
+		{ CHUNK_W, 0, 0, 1 },
+		{ CHUNK_W, CHUNK_W, -1, 0 },
+		{ 0, CHUNK_W, 0, -1 }
+	};
+
+	for (unsigned border_i = 0; border_i < 4; ++ border_i) {
+		int const X = BORDERS[border_i][0];
+		int const Y = BORDERS[border_i][1];
+		int const DX = BORDERS[border_i][2];
+		int const DY = BORDERS[border_i][3];
+
+		// Lowest real corner of each neighbor Chunk
+		Urho3D::PODVector<int> chunk_lowests;
+		for (int chunk_i = 0; chunk_i < SIZE; ++ chunk_i) {
+			int lowest = INT_MAX;
+			for (int i = chunk_i * CHUNK_W; i <= (chunk_i + 1) * CHUNK_W; ++ i) {
+				int corner_x = X * SIZE + i * DX;
+				int corner_y = Y * SIZE + i * DY;
+				int chunk_x = floorDiv(corner_x, CHUNK_W);
+				int chunk_y = floorDiv(corner_y, CHUNK_W);
+				CornersSnapshot const* snapshot = data->area_snapshots[chunk_x + 1 + (chunk_y + 1) * AREA_W];
+				lowest = Urho3D::Min<int>(lowest, snapshot->getHeight(corner_x - chunk_x * CHUNK_W, corner_y - chunk_y * CHUNK_W));
+			}
+			chunk_lowests.Push(lowest);
+		}
+
+		// Depths of the skirts of squares, in heightsteps
+		Urho3D::PODVector<int> depths;
+		for (int sqr_i = 0; sqr_i < CHUNK_W; ++ sqr_i) {
+			int h_begin = data->corners[1 + X + sqr_i * DX + (Y + sqr_i * DY + 1) * CHUNK_W3].height;
+			int h_end = data->corners[1 + X + (sqr_i + 1) * DX + (Y + (sqr_i + 1) * DY + 1) * CHUNK_W3].height;
+			int lowest = INT_MAX;
+			for (int chunk_i = sqr_i * SIZE / CHUNK_W; chunk_i <= ((sqr_i + 1) * SIZE - 1) / CHUNK_W; ++ chunk_i) {
+				lowest = Urho3D::Min(lowest, chunk_lowests[chunk_i]);
+			}
+			depths.Push(Urho3D::Max(Urho3D::Max(h_begin, h_end) - lowest, 1));
+		}
+
+		// Lowered copies of the vertices at border
+		unsigned first_low = data->vrts_data.Size() / VRT_SIZE;
+		for (int i = 0; i <= CHUNK_W; ++ i) {
+			unsigned vrt_i = X + i * DX + (Y + i * DY) * (CHUNK_W + 1);
+			float vrt[8];
+			std::memcpy(vrt, data->vrts_data.Buffer() + vrt_i * VRT_SIZE, VRT_SIZE);
+			int depth = Urho3D::Max(depths[Urho3D::Max(i - 1, 0)], depths[Urho3D::Min(i, CHUNK_W - 1)]);
+			vrt[1] -= depth * data->heightstep;
+			data->boundingbox.Merge(Urho3D::Vector3(vrt[0], vrt[1], vrt[2]));
+			data->vrts_data.Insert(data->vrts_data.End(), (char const*)vrt, (char const*)vrt + VRT_SIZE);
+		}
+
+		for (int sqr_i = 0; sqr_i < CHUNK_W; ++ sqr_i) {
+			uint32_t i_p = X + sqr_i * DX + (Y + sqr_i * DY) * (CHUNK_W + 1);
+			uint32_t i_q = X + (sqr_i + 1) * DX + (Y + (sqr_i + 1) * DY) * (CHUNK_W + 1);
+			uint32_t i_p_low = first_low + sqr_i;
+			uint32_t i_q_low = first_low + sqr_i + 1;
+			data->idxs_data.Push(i_p);
+			data->idxs_data.Push(i_q);
+			data->idxs_data.Push(i_q_low);
+			data->idxs_data.Push(i_p);
+			data->idxs_data.Push(i_q_low);
+			data->idxs_data.Push(i_p_low);
+		}
+	}
+}
+
+}
+
+SuperChunkTaskData::~SuperChunkTaskData()
+{
+}
+
+void buildSuperChunk(Urho3D::WorkItem const* item, unsigned threadIndex)
+{
+	SuperChunkTaskData* data = static_cast<SuperChunkTaskData*>((LodBuildingTaskData*)item->aux_);
+
+	{
+		TraceScope trace("SampleSuperChunk", data->chunk_pos, data->size);
+
+		int const CHUNK_W = data->chunk_width;
+		int const SIZE = data->size;
+		int const AREA_W = SIZE + 2;
+
+		// Every SIZE:th corner of the block, in the same layout as LOD
+		// builder uses, so one row more at south and west and two at
+		// north and east. They come from the neighbors of the block.
+		data->corners.Reserve((CHUNK_W + 3) * (CHUNK_W + 3));
+		for (int y = -1; y <= CHUNK_W + 1; ++ y) {
+			for (int x = -1; x <= CHUNK_W + 1; ++ x) {
+				int corner_x = x * SIZE;
+				int corner_y = y * SIZE;
+				int chunk_x = floorDiv(corner_x, CHUNK_W);
+				int chunk_y = floorDiv(corner_y, CHUNK_W);
+				CornersSnapshot const* snapshot = data->area_snapshots[chunk_x + 1 + (chunk_y + 1) * AREA_W];
+				snapshot->copyRow(data->corners, corner_x - chunk_x * CHUNK_W, corner_y - chunk_y * CHUNK_W, 1);
+			}
+		}
+	}
+
+	// Rest is like building full detail LOD of a big Chunk, except that
+	// there is no edge filling, so skirts are needed to hide the gaps.
+	buildLod(item, threadIndex);
+	TraceScope trace("AddSuperChunkSkirts", data->chunk_pos, data->size);
+	addSkirts(data);
+}
+
+SuperChunk::SuperChunk(ChunkWorld* world, Urho3D::IntVector2 const& pos, unsigned level) :
+Urho3D::Object(world->GetContext()),
+world(world),
+pos(pos),
+level(level),
+data_version(0),
+model_version(0),
+model_baseheight(0),
+last_shown(0)
+{
+	node = world->getScene()->CreateChild();
+	node->SetEnabled(false);
+}
+
+SuperChunk::~SuperChunk()
+{
+	stopTask();
+	node->Remove();
+	splat_slot.release();
+}
+
+bool SuperChunk::prepare()
+{
+	if (model.NotNull() && model_version == data_version) {
+		return true;
+	}
+
+	// If there is an existing task
+	if (task_workitem.NotNull()) {
+		if (!task_workitem->completed_) {
+			return false;
+		}
+		// If data has changed after the task was started, then
+		// the results are useless. Start a new task instead.
+		if (task_data->data_version != data_version) {
+			task_workitem = NULL;
+			task_data = NULL;
+		} else if (!storeTaskResults()) {
+			return false;
+		} else {
+			++ world->getPipelineCounters().super_chunks_built;
+			task_workitem = NULL;
+			task_data = NULL;
+			return true;
+		}
+	}
+
+	// Corners are sampled from the snapshots of
+	// block and its neighbors at worker thread.
+	int const SIZE = getSize();
+	CornersSnapshots snapshots;
+	snapshots.Reserve((SIZE + 2) * (SIZE + 2));
+	Urho3D::IntVector2 it;
+	for (it.y_ = -1; it.y_ <= SIZE; ++ it.y_) {
+		for (it.x_ = -1; it.x_ <= SIZE; ++ it.x_) {
+			Chunk const* chunk = world->getChunk(pos + it);
+			if (!chunk) {
+				return false;
+			}
+			snapshots.Push(Urho3D::SharedPtr<CornersSnapshot>(chunk->getCornersSnapshot()));
+		}
+	}
+
+	// Block is built like one Chunk with wider squares
+	task_data = new SuperChunkTaskData;
+	task_data->context = context_;
+	task_data->lod = 0;
+	task_data->baseheight = world->getChunk(pos)->getBaseHeight();
+	task_data->calculate_ttype_image = true;
+	task_data->ttype_image_mode = world->getTerraintypeImageMode();
+	task_data->data_version = data_version;
+	task_data->chunk_pos = pos;
+	task_data->chunk_width = world->getChunkWidth();
+	task_data->sqr_width = world->getSquareWidth() * SIZE;
+	task_data->heightstep = world->getHeightstep();
+	task_data->terrain_texture_repeats = world->getTerrainTextureRepeats() * SIZE;
+	task_data->max_error = 0;
+	task_data->size = SIZE;
+	task_data->area_snapshots.Swap(snapshots);
+
+	task_workitem = new Urho3D::WorkItem();
+	task_workitem->workFunction_ = buildSuperChunk;
+	task_workitem->aux_ = static_cast<LodBuildingTaskData*>(task_data.Get());
+	task_workitem->priority_ = 1;
+	GetSubsystem<Urho3D::WorkQueue>()->AddWorkItem(task_workitem);
+
+	return false;
+}
+
+void SuperChunk::show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, unsigned viewmask)
+{
+	assert(model.NotNull());
+
+	// Mesh is centered at the middle of block
+	float const CHUNK_W_F = world->getChunkWidthFloat();
+	float const CENTER_OFS = (getSize() - 1) / 2.0f;
+	node->SetPosition(Urho3D::Vector3(
+		(rel_pos.x_ + CENTER_OFS) * CHUNK_W_F,
+		(int(model_baseheight) - int(origin_height)) * world->getHeightstep(),
+		(rel_pos.y_ + CENTER_OFS) * CHUNK_W_F
+	));
+
+	Urho3D::SharedPtr<Urho3D::StaticModel>& active_model = active_models[viewmask];
+	if (!active_model) {
+		active_model = node->CreateComponent<Urho3D::StaticModel>();
+		active_model->SetViewMask(viewmask);
+		active_model->SetOccludee(true);
+	}
+	if (active_model->GetModel() != model || active_model->GetMaterial() != mat) {
+		active_model->SetModel(model);
+		active_model->SetMaterial(mat);
+	}
+
+	node->SetEnabled(true);
+}
+
+void SuperChunk::hide(unsigned viewmask)
+{
+	ActiveModels::Iterator active_models_find = active_models.Find(viewmask);
+	if (active_models_find != active_models.End()) {
+		node->RemoveComponent(active_models_find->second_);
+		active_models.Erase(active_models_find);
+	}
+	if (active_models.Empty()) {
+		node->SetEnabled(false);
+	}
+}
+
+bool SuperChunk::storeTaskResults()
+{
+	TraceScope trace("StoreSuperChunk", pos, level);
+
+	unsigned const SIZE = getSize();
+
+	// Material is chosen the same way as with Chunks
+	Urho3D::SharedPtr<Urho3D::Material> new_mat;
+	SplatSlot new_splat_slot;
+	if (task_data->used_ttypes.Size() == 1) {
+		new_mat = world->getSingleLayerTerrainMaterial(task_data->used_ttypes[0]);
+		if (new_mat.Null()) {
+			return false;
+		}
+	} else if (world->usesSplatAtlas()) {
+		if (!world->reserveSplatSlot(new_splat_slot, task_data->used_ttypes)) {
+			return false;
+		}
+		assert(task_data->ttype_image.NotNull());
+		new_splat_slot.atlas->setSlotData(new_splat_slot.index, task_data->ttype_image);
+		new_mat = new_splat_slot.atlas->getMaterial();
+
+		unsigned uv_ofs = 0;
+		for (unsigned i = 0; i < task_data->vrts_elems.Size() && task_data->vrts_elems[i].semantic_ != Urho3D::SEM_TEXCOORD; ++ i) {
+			uv_ofs += Urho3D::ELEMENT_TYPESIZES[task_data->vrts_elems[i].type_];
+		}
+		unsigned vrt_size = Urho3D::VertexBuffer::GetVertexSize(task_data->vrts_elems);
+		new_splat_slot.atlas->convertUvsToSlot(task_data->vrts_data, vrt_size, uv_ofs, new_splat_slot.index);
+	} else {
+		new_mat = world->createTerrainBlendMaterial(task_data->used_ttypes, NULL, world->getTerrainTextureRepeats() * SIZE, world->getChunkWidth() + 1);
+		if (new_mat.Null()) {
+			return false;
+		}
+		Urho3D::SharedPtr<Urho3D::Texture2D> blend_tex(new Urho3D::Texture2D(context_));
+		blend_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+		blend_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+		assert(task_data->ttype_image.NotNull());
+		blend_tex->SetData(task_data->ttype_image);
+		new_mat->SetTexture(Urho3D::TU_DIFFUSE, blend_tex);
+	}
+
+	// Far away meshes are never patched, so they need no shadow data
+	Urho3D::SharedPtr<Urho3D::VertexBuffer> new_vb(new Urho3D::VertexBuffer(context_));
+	if (!new_vb->SetSize(task_data->vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(task_data->vrts_elems), task_data->vrts_elems)) {
+		throw std::runtime_error("Unable to set VertexBuffer size!");
+	}
+	if (!new_vb->SetData((void*)task_data->vrts_data.Buffer())) {
+		throw std::runtime_error("Unable to set VertexBuffer data!");
+	}
+	Urho3D::SharedPtr<Urho3D::IndexBuffer> new_ib(new Urho3D::IndexBuffer(context_));
+	if (!new_ib->SetSize(task_data->idxs_data.Size(), true)) {
+		throw std::runtime_error("Unable to set IndexBuffer size!");
+	}
+	if (!new_ib->SetData((void*)task_data->idxs_data.Buffer())) {
+		throw std::runtime_error("Unable to set IndexBuffer data!");
+	}
+	Urho3D::SharedPtr<Urho3D::Geometry> new_geom(new Urho3D::Geometry(context_));
+	if (!new_geom->SetVertexBuffer(0, new_vb)) {
+		throw std::runtime_error("Unable to set Geometry VertexBuffer!");
+	}
+	new_geom->SetIndexBuffer(new_ib);
+	if (!new_geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, task_data->idxs_data.Size(), false)) {
+		throw std::runtime_error("Unable to set Geometry draw range!");
+	}
+	Urho3D::SharedPtr<Urho3D::Model> new_model(new Urho3D::Model(context_));
+	new_model->SetNumGeometries(1);
+	if (!new_model->SetGeometry(0, 0, new_geom)) {
+		throw std::runtime_error("Unable to set Model Geometry!");
+	}
+	new_model->SetBoundingBox(task_data->boundingbox);
+
+	// Visible StaticModels keep the old Model until shown again
+	model = new_model;
+	mat = new_mat;
+	model_version = task_data->data_version;
+	model_baseheight = task_data->baseheight;
+	splat_slot.release();
+	splat_slot = new_splat_slot;
+
+	return true;
+}
+
+void SuperChunk::stopTask()
+{
+	if (task_workitem.NotNull()) {
+		if (!task_workitem->completed_) {
+			Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+			if (!workqueue->RemoveWorkItem(task_workitem)) {
+				while (!task_workitem->completed_) {
+					// Wait, wait...
+				}
+			}
+		}
+		task_workitem = NULL;
+		task_data = NULL;
+	}
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef BIGWORLD_SUPERCHUNK_HPP
+#define BIGWORLD_SUPERCHUNK_HPP
+
+#include "splatatlas.hpp"
+#include "types.hpp"
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/StaticModel.h>
+#include <Urho3D/Math/Vector2.h>
+
+namespace BigWorld
+{
+
+class ChunkWorld;
+
+// Task of building the merged mesh of a block of Chunks. Corners are sampled
+// from snapshots at worker thread, and then the mesh is built like a LOD.
+struct SuperChunkTaskData : public LodBuildingTaskData
+{
+	// Width of block in Chunks
+	unsigned size;
+	// Snapshots of (size + 2) x (size + 2) Chunks, row by row, starting
+	// from the southwestern neighbor of the block.
+	CornersSnapshots area_snapshots;
+
+	virtual ~SuperChunkTaskData();
+};
+
+void buildSuperChunk(Urho3D::WorkItem const* item, unsigned threadIndex);
+
+// Merged mesh of 2^level x 2^level Chunks, that has the same amount of squares
+// and one Material like a single Chunk. It is used instead of its Chunks when
+// they are far away, so distant terrain needs much less draw calls.
+class SuperChunk : public Urho3D::Object
+{
+	URHO3D_OBJECT(SuperChunk, Urho3D::Object)
+
+public:
+
+	// "pos" is the southwestern Chunk of the block
+	SuperChunk(ChunkWorld* world, Urho3D::IntVector2 const& pos, unsigned level);
+	virtual ~SuperChunk();
+
+	inline Urho3D::IntVector2 getPosition() const { return pos; }
+	inline unsigned getLevel() const { return level; }
+	inline unsigned getSize() const { return 1 << level; }
+
+	// Starts building the mesh at background. Should be called multiple
+	// times until returns true to indicate that the mesh is ready.
+	bool prepare();
+
+	// Shows/hides SuperChunk. Like with Chunks, every viewer has its own StaticModel.
+	void show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, unsigned viewmask);
+	void hide(unsigned viewmask);
+	inline bool isShown() const { return !active_models.Empty(); }
+
+	// Number of the viewarea when SuperChunk was shown for the last time
+	inline void setLastShown(unsigned viewarea_num) { last_shown = viewarea_num; }
+	inline unsigned getLastShown() const { return last_shown; }
+
+	// Called when the Chunks of block or their neighbors have changed.
+	// Old mesh is still shown until the new one is ready.
+	inline void invalidate() { ++ data_version; }
+
+private:
+
+	typedef Urho3D::HashMap<unsigned, Urho3D::SharedPtr<Urho3D::StaticModel> > ActiveModels;
+
+	ChunkWorld* world;
+	Urho3D::IntVector2 pos;
+	unsigned level;
+
+	unsigned data_version;
+
+	// Mesh and the version of data it was built from
+	Urho3D::SharedPtr<Urho3D::Model> model;
+	Urho3D::SharedPtr<Urho3D::Material> mat;
+	SplatSlot splat_slot;
+	unsigned model_version;
+	unsigned model_baseheight;
+
+	unsigned last_shown;
+
+	Urho3D::Node* node;
+	ActiveModels active_models;
+
+	Urho3D::SharedPtr<Urho3D::WorkItem> task_workitem;
+	Urho3D::SharedPtr<SuperChunkTaskData> task_data;
+
+	// Returns false if Material is not yet ready
+	bool storeTaskResults();
+
+	// Removes or waits the task, if there is one
+	void stopTask();
+};
+
+}
+
+#endif
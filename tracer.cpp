@@ -0,0 +1,177 @@
+#include "tracer.hpp"
+
+#include <Urho3D/Container/Str.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Core/Mutex.h>
+#include <Urho3D/Core/Thread.h>
+#include <Urho3D/Core/Timer.h>
+
+#include <atomic>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+struct TraceEvent
+{
+	char const* name;
+	int chunk_x;
+	int chunk_y;
+	bool has_chunk_pos;
+	int lod;
+	uint64_t begin_usec;
+	uint64_t end_usec;
+};
+
+// Only the owner thread writes to the buffer. "written" tells how many
+// events have been written in total, and it is increased only after
+// the event is complete, so readers know which events are ready.
+struct ThreadBuffer
+{
+	unsigned tid;
+	bool main_thread;
+	Urho3D::PODVector<TraceEvent> events;
+	std::atomic<unsigned> written;
+};
+
+// Buffers are kept after their threads have finished, so
+// their events can be written. They are freed at exit.
+struct ThreadBuffers : public Urho3D::PODVector<ThreadBuffer*>
+{
+	~ThreadBuffers()
+	{
+		for (unsigned i = 0; i < Size(); ++ i) {
+			delete At(i);
+		}
+	}
+};
+
+Urho3D::Mutex buffers_mutex;
+ThreadBuffers buffers;
+unsigned buffer_size = 0;
+
+thread_local ThreadBuffer* thread_buffer = NULL;
+
+ThreadBuffer* getThreadBuffer()
+{
+	if (!thread_buffer) {
+		Urho3D::MutexLock lock(buffers_mutex);
+		ThreadBuffer* buf = new ThreadBuffer;
+		buf->tid = buffers.Size() + 1;
+		buf->main_thread = Urho3D::Thread::IsMainThread();
+		buf->events.Resize(buffer_size);
+		buf->written.store(0);
+		buffers.Push(buf);
+		thread_buffer = buf;
+	}
+	return thread_buffer;
+}
+
+void writeText(Urho3D::Serializer& dest, Urho3D::String const& text, bool& success)
+{
+	if (dest.Write(text.CString(), text.Length()) != text.Length()) {
+		success = false;
+	}
+}
+
+}
+
+std::atomic<bool> Tracer::enabled(false);
+
+void Tracer::enable(unsigned events_per_thread)
+{
+	// Starts the clock, if this is the first enabling
+	getTimestamp();
+
+	Urho3D::MutexLock lock(buffers_mutex);
+	buffer_size = Urho3D::Max(events_per_thread, 1u);
+	enabled.store(true);
+}
+
+void Tracer::disable()
+{
+	enabled.store(false);
+}
+
+bool Tracer::writeChromeTrace(Urho3D::Serializer& dest)
+{
+	Urho3D::MutexLock lock(buffers_mutex);
+
+	bool success = true;
+	bool first = true;
+	writeText(dest, "{\"traceEvents\":[\n", success);
+	for (unsigned buf_i = 0; buf_i < buffers.Size(); ++ buf_i) {
+		ThreadBuffer const* buf = buffers[buf_i];
+		unsigned const SIZE = buf->events.Size();
+
+		// Name of thread
+		Urho3D::String thread_name = buf->main_thread ? "Main thread" : "Worker thread " + Urho3D::String(buf->tid);
+		writeText(dest, Urho3D::String(first ? "" : ",\n") + "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + Urho3D::String(buf->tid) + ",\"args\":{\"name\":\"" + thread_name + "\"}}", success);
+		first = false;
+
+		// Copy the events that are ready, and then leave out the
+		// ones that the owner thread started to overwrite meanwhile.
+		unsigned written_before = buf->written.load(std::memory_order_acquire);
+		unsigned begin = written_before > SIZE ? written_before - SIZE : 0;
+		Urho3D::PODVector<TraceEvent> events;
+		events.Reserve(written_before - begin);
+		for (unsigned i = begin; i < written_before; ++ i) {
+			events.Push(buf->events[i % SIZE]);
+		}
+		// Makes sure the events were copied before "written" is read
+		// again, so overwriting of them is always noticed.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		unsigned written_after = buf->written.load(std::memory_order_acquire);
+		unsigned first_valid = written_after + 1 > SIZE ? written_after + 1 - SIZE : 0;
+
+		for (unsigned i = Urho3D::Max(begin, first_valid); i < written_before; ++ i) {
+			TraceEvent const& event = events[i - begin];
+			Urho3D::String line = ",\n{\"name\":\"" + Urho3D::String(event.name) + "\",\"cat\":\"bigworld\",\"ph\":\"X\",\"pid\":1,\"tid\":" + Urho3D::String(buf->tid);
+			line += ",\"ts\":" + Urho3D::String((unsigned long long)event.begin_usec);
+			line += ",\"dur\":" + Urho3D::String((unsigned long long)(event.end_usec - event.begin_usec));
+			line += ",\"args\":{";
+			if (event.has_chunk_pos) {
+				line += "\"x\":" + Urho3D::String(event.chunk_x) + ",\"y\":" + Urho3D::String(event.chunk_y);
+				if (event.lod >= 0) {
+					line += ",\"lod\":" + Urho3D::String(event.lod);
+				}
+			}
+			line += "}}";
+			writeText(dest, line, success);
+		}
+	}
+	writeText(dest, "\n]}\n", success);
+
+	return success;
+}
+
+void Tracer::record(char const* name, Urho3D::IntVector2 const& chunk_pos, bool has_chunk_pos, int lod, uint64_t begin_usec, uint64_t end_usec)
+{
+	ThreadBuffer* buf = getThreadBuffer();
+	unsigned index = buf->written.load(std::memory_order_relaxed);
+	// Pairs with the fence in writeChromeTrace(). If a reader sees
+	// some of the new event, then it also sees the "written" of the
+	// previous event, and knows that this slot is being overwritten.
+	std::atomic_thread_fence(std::memory_order_release);
+	TraceEvent& event = buf->events[index % buf->events.Size()];
+	event.name = name;
+	event.chunk_x = chunk_pos.x_;
+	event.chunk_y = chunk_pos.y_;
+	event.has_chunk_pos = has_chunk_pos;
+	event.lod = lod;
+	event.begin_usec = begin_usec;
+	event.end_usec = end_usec;
+	buf->written.store(index + 1, std::memory_order_release);
+}
+
+uint64_t Tracer::getTimestamp()
+{
+	// Initialization of local static is thread safe
+	static Urho3D::HiresTimer epoch;
+	// Zero means "not recorded" in TraceScope
+	return epoch.GetUSec(false) + 1;
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef BIGWORLD_TRACER_HPP
+#define BIGWORLD_TRACER_HPP
+
+#include <Urho3D/IO/Serializer.h>
+#include <Urho3D/Math/Vector2.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace BigWorld
+{
+
+// Opt-in tracer of the stages of Chunk pipeline. Every thread records its
+// events to its own ring buffer without locking, so worker threads can be
+// traced too. Events can be written as Chrome/Perfetto trace JSON.
+class Tracer
+{
+
+public:
+
+	// Starts recording. "events_per_thread" is the size of the ring buffers
+	// of threads that record their first event after this call. When a
+	// buffer is full, the oldest events are overwritten.
+	static void enable(unsigned events_per_thread = 65536);
+	static void disable();
+	static inline bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+	// Writes recorded events of all threads as Chrome trace JSON. This can
+	// be called while threads are recording, but then the events that are
+	// being overwritten at the same time are left out.
+	static bool writeChromeTrace(Urho3D::Serializer& dest);
+
+	// "name" must be a string literal, or otherwise stay alive. If "lod"
+	// is negative, then event has no LOD. Use TraceScope instead of this.
+	static void record(char const* name, Urho3D::IntVector2 const& chunk_pos, bool has_chunk_pos, int lod, uint64_t begin_usec, uint64_t end_usec);
+
+	// Microseconds since the first enabling of Tracer
+	static uint64_t getTimestamp();
+
+private:
+
+	static std::atomic<bool> enabled;
+};
+
+// Records one event of its lifetime, if Tracer is enabled when this is created.
+class TraceScope
+{
+
+public:
+
+	inline TraceScope(char const* name) :
+	name(name),
+	has_chunk_pos(false),
+	lod(-1),
+	begin_usec(Tracer::isEnabled() ? Tracer::getTimestamp() : 0)
+	{
+	}
+
+	inline TraceScope(char const* name, Urho3D::IntVector2 const& chunk_pos, int lod = -1) :
+	name(name),
+	chunk_pos(chunk_pos),
+	has_chunk_pos(true),
+	lod(lod),
+	begin_usec(Tracer::isEnabled() ? Tracer::getTimestamp() : 0)
+	{
+	}
+
+	inline ~TraceScope()
+	{
+		if (begin_usec > 0 && Tracer::isEnabled()) {
+			Tracer::record(name, chunk_pos, has_chunk_pos, lod, begin_usec, Tracer::getTimestamp());
+		}
+	}
+
+private:
+
+	char const* name;
+	Urho3D::IntVector2 chunk_pos;
+	bool has_chunk_pos;
+	int lod;
+	uint64_t begin_usec;
+};
+
+}
+
+#endif
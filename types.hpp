@@ -2,6 +2,7 @@
 #define BIGWORLD_TYPES_HPP
 
 #include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
 #include <Urho3D/Container/Str.h>
 #include <Urho3D/Container/Vector.h>
 #include <Urho3D/Graphics/VertexBuffer.h>
@@ -17,6 +18,15 @@
 namespace BigWorld
 {
 
+class ChunkWorld;
+class CornersSnapshot;
+
+// Floor division, so negative corners go to previous Chunks
+inline int floorDiv(int a, int b)
+{
+	return a >= 0 ? a / b : (a + 1) / b - 1;
+}
+
 struct ChunkPosAndLod
 {
 	Urho3D::IntVector2 pos;
@@ -80,6 +90,16 @@ public:
 		return *this;
 	}
 
+	inline bool operator==(TTypesByWeight const& other) const
+	{
+		return buf_size == other.buf_size && (buf_size == 0 || memcmp(buf, other.buf, buf_size) == 0);
+	}
+
+	inline bool operator!=(TTypesByWeight const& other) const
+	{
+		return !(*this == other);
+	}
+
 	inline ~TTypesByWeight()
 	{
 		if (buf_size > 0) {
@@ -238,6 +258,144 @@ private:
 	uint8_t buf_size;
 };
 
+// Different ways to store terraintypes of Chunk to an image
+// Weights of up to four terraintypes, as RGB or RGBA image
+uint8_t const TTYPE_IMAGE_WEIGHTS = 0;
+// Weights of up to four terraintypes, always as RGBA image
+uint8_t const TTYPE_IMAGE_WEIGHTS_RGBA = 1;
+// Two strongest terraintypes of every corner, as (index, weight) pairs in RGBA image
+uint8_t const TTYPE_IMAGE_INDICES = 2;
+
+// Counters of what streaming and rendering have done. They only grow,
+// so the difference of two snapshots tells what happened between them.
+struct PipelineCounters
+{
+	// Frames and time spent in the per frame update of ChunkWorld
+	unsigned frames;
+	unsigned long long frame_update_usec;
+	// Frames that ended with new viewarea still being prepared, and
+	// how many of them were waiting for a viewarea of different origin.
+	unsigned frames_waiting_viewarea;
+	unsigned frames_waiting_origin_shift;
+	unsigned viewareas_applied;
+	unsigned viewarea_recalculations;
+	// Recalculations that only culled the previous viewarea again
+	unsigned viewarea_reculls;
+	// Time spent in preparing Chunks for their LODs
+	unsigned long long lod_prepare_usec;
+	// When new viewarea is formed, these tell how many
+	// of its Chunks already had their LODs prepared.
+	unsigned lod_cache_hits;
+	unsigned lod_cache_misses;
+	// Background tasks of LOD building
+	unsigned lod_builds_started;
+	unsigned lod_builds_finished;
+	unsigned lod_builds_discarded;
+	// Time from starting LOD building to having it in cache. Bucket
+	// "i" counts builds that took less than 2^i milliseconds, except
+	// the last bucket, that counts all the slower ones.
+	static unsigned const LOD_BUILD_LATENCY_BUCKETS = 12;
+	unsigned lod_build_latency_histogram[LOD_BUILD_LATENCY_BUCKETS];
+	// Chunks whose rendering resources, or whole Chunks, were evicted
+	unsigned chunks_render_evicted;
+	unsigned chunks_data_evicted;
+	// Chunks that were compressed and decompressed by hibernation
+	unsigned chunks_hibernated;
+	unsigned chunks_woken;
+	// Undergrowth creation and total time from start to ready
+	unsigned undergrowths_started;
+	unsigned undergrowths_finished;
+	unsigned long long undergrowth_latency_usec;
+	// Frames when rendering of throttled water reflection was queued. Without
+	// throttling, Urho3D decides itself when to render, and this is not counted.
+	unsigned water_reflections_queued;
+	// Chunks left out from viewareas of water reflection, because they are below water
+	unsigned water_refl_chunks_culled;
+	// Merged meshes of distant blocks of Chunks
+	unsigned super_chunks_built;
+	// Tiles of horizon ring read from height pyramid
+	unsigned horizon_tiles_loaded;
+
+	inline PipelineCounters() :
+	frames(0),
+	frame_update_usec(0),
+	frames_waiting_viewarea(0),
+	frames_waiting_origin_shift(0),
+	viewareas_applied(0),
+	viewarea_recalculations(0),
+	viewarea_reculls(0),
+	lod_prepare_usec(0),
+	lod_cache_hits(0),
+	lod_cache_misses(0),
+	lod_builds_started(0),
+	lod_builds_finished(0),
+	lod_builds_discarded(0),
+	chunks_render_evicted(0),
+	chunks_data_evicted(0),
+	chunks_hibernated(0),
+	chunks_woken(0),
+	undergrowths_started(0),
+	undergrowths_finished(0),
+	undergrowth_latency_usec(0),
+	water_reflections_queued(0),
+	water_refl_chunks_culled(0),
+	super_chunks_built(0),
+	horizon_tiles_loaded(0)
+	{
+		for (unsigned i = 0; i < LOD_BUILD_LATENCY_BUCKETS; ++ i) {
+			lod_build_latency_histogram[i] = 0;
+		}
+	}
+
+	inline void addLodBuildLatency(unsigned long long usec)
+	{
+		unsigned bucket = 0;
+		while (bucket + 1 < LOD_BUILD_LATENCY_BUCKETS && usec >= (1000ull << bucket)) {
+			++ bucket;
+		}
+		++ lod_build_latency_histogram[bucket];
+	}
+};
+
+// Current state of ChunkWorld. See ChunkWorld::getStats().
+struct ChunkWorldStats
+{
+	unsigned chunks_loaded;
+	unsigned chunks_visible;
+	unsigned chunks_hibernating;
+	// LOD Models in the caches of Chunks, and the size of their buffers
+	unsigned lods_cached;
+	unsigned long long lod_bytes_cached;
+	// Pending tasks are in work queue, either waiting or being executed.
+	// In flight tasks also include the complete ones, whose results are
+	// not used yet, for example because textures are still loading.
+	unsigned lod_tasks_pending;
+	unsigned lod_tasks_in_flight;
+	unsigned undergrowth_tasks_pending;
+	unsigned undergrowth_tasks_in_flight;
+	// Different Materials used by Chunks and single terraintype Materials
+	unsigned materials_cached;
+	// Time spent in preparing Chunks for their LODs during the latest frame
+	unsigned long long lod_prepare_usec_last_frame;
+	// Counters since ChunkWorld was created
+	PipelineCounters counters;
+
+	inline ChunkWorldStats() :
+	chunks_loaded(0),
+	chunks_visible(0),
+	chunks_hibernating(0),
+	lods_cached(0),
+	lod_bytes_cached(0),
+	lod_tasks_pending(0),
+	lod_tasks_in_flight(0),
+	undergrowth_tasks_pending(0),
+	undergrowth_tasks_in_flight(0),
+	materials_cached(0),
+	lod_prepare_usec_last_frame(0)
+	{
+	}
+};
+
 typedef Urho3D::HashMap<Urho3D::IntVector2, uint8_t> ViewArea;
 typedef Urho3D::PODVector<uint8_t> TTypes;
 
@@ -268,19 +426,38 @@ struct Corner
 };
 typedef Urho3D::Vector<Corner> Corners;
 
+// Snapshots of a Chunk and its neighbors. See ChunkWorld::getCornersSnapshots().
+typedef Urho3D::Vector<Urho3D::SharedPtr<CornersSnapshot> > CornersSnapshots;
+
 struct LodBuildingTaskData : public Urho3D::RefCounted
 {
 	// Input
 	Urho3D::Context* context;
 	uint8_t lod;
+	// If "corners" is empty, then they are extracted from "snapshots" at worker thread
 	Corners corners;
+	CornersSnapshots snapshots;
 	unsigned baseheight;
 	bool calculate_ttype_image;
+	uint8_t ttype_image_mode;
+	// Version of Chunk data that the corners are from. If Chunk
+	// has newer version when the task is ready, results are useless.
+	unsigned data_version;
+	// Only used for tracing
+	Urho3D::IntVector2 chunk_pos;
 	// World options
 	unsigned chunk_width;
 	float sqr_width;
 	float heightstep;
 	unsigned terrain_texture_repeats;
+	// If positive, LOD is adaptive, and its height error
+	// is at most this, multiplied by two for each LOD.
+	float max_error;
+	// Water surface is built at "water_y", relative to "baseheight". Version
+	// tells which water levels of ChunkWorld the patch was built from.
+	bool build_water_patch;
+	float water_y;
+	unsigned water_version;
 	// Output
 	Urho3D::PODVector<char> vrts_data;
 	Urho3D::PODVector<Urho3D::VertexElement> vrts_elems;
@@ -293,6 +470,14 @@ struct LodBuildingTaskData : public Urho3D::RefCounted
 	bool occ_shape_available;
 	Urho3D::PODVector<char> occ_vrts_data;
 	Urho3D::PODVector<uint32_t> occ_idxs_data;
+	// Output if water patch is built. Empty if there is no water.
+	Urho3D::PODVector<char> water_vrts_data;
+	Urho3D::PODVector<uint32_t> water_idxs_data;
+
+	// Defined where CornersSnapshot is known. Constructor
+	// gives defaults that build LOD zero without extras.
+	LodBuildingTaskData();
+	virtual ~LodBuildingTaskData();
 };
 
 typedef Urho3D::Pair<Urho3D::String, Urho3D::String> StrNStr;
@@ -312,6 +497,27 @@ typedef Urho3D::Vector<UndergrowthModel> UndergrowthModels;
 typedef Urho3D::HashMap<unsigned, UndergrowthModels> UndergrowthModelsByTerraintype;
 typedef Urho3D::HashMap<StrNStr, Transforms> UndergrowthPlacements;
 
+struct UndergrowthPlacingTaskData : public Urho3D::RefCounted
+{
+	// Input
+	ChunkWorld const* world;
+	// Only used for tracing
+	Urho3D::IntVector2 chunk_pos;
+	// If "corners" is empty, then they are extracted from "snapshots" at worker thread
+	Corners corners;
+	CornersSnapshots snapshots;
+	unsigned baseheight;
+	UndergrowthModelsByTerraintype ugmodels;
+	// If this is set, then placing is stopped as soon as possible
+	volatile bool stop;
+	// Output
+	UndergrowthPlacements places;
+
+	inline UndergrowthPlacingTaskData() : stop(false) {}
+	// Defined where CornersSnapshot is known
+	virtual ~UndergrowthPlacingTaskData();
+};
+
 }
 
 #endif
@@ -0,0 +1,120 @@
+#include "undergrowthplacer.hpp"
+
+#include "chunkworld.hpp"
+#include "cornerssnapshot.hpp"
+#include "tracer.hpp"
+#include "../urhoextras/random.hpp"
+#include "../urhoextras/utils.hpp"
+
+namespace BigWorld
+{
+
+UndergrowthPlacingTaskData::~UndergrowthPlacingTaskData()
+{
+}
+
+void placeUndergrowth(Urho3D::WorkItem const* item, unsigned threadIndex)
+{
+	(void)threadIndex;
+
+	UndergrowthPlacingTaskData* data = (UndergrowthPlacingTaskData*)item->aux_;
+	TraceScope trace("PlaceUndergrowth", data->chunk_pos);
+	UndergrowthModelsByTerraintype const& ugmodels = data->ugmodels;
+
+	unsigned const CHUNK_WIDTH = data->world->getChunkWidth();
+	float const HEIGHTSTEP = data->world->getHeightstep();
+	float const SQUARE_WIDTH = data->world->getSquareWidth();
+	float const CHUNK_WIDTH_F_HALF = CHUNK_WIDTH * SQUARE_WIDTH / 2.0;
+
+	if (data->corners.Empty()) {
+		extractCornersData(data->corners, data->snapshots, CHUNK_WIDTH);
+	}
+
+	// To generate the same results every time, seed random from the position
+	// of Chunk. Squares are always visited in the same order.
+	UrhoExtras::Random rnd(data->chunk_pos.x_);
+	rnd.seedMore(data->chunk_pos.y_);
+
+	for (unsigned y = 0; y < CHUNK_WIDTH; ++ y) {
+		unsigned ofs_sw = (y + 1) * (CHUNK_WIDTH + 3) + 1;
+		for (unsigned x = 0; x < CHUNK_WIDTH; ++ x) {
+			unsigned ofs_nw = ofs_sw + CHUNK_WIDTH + 3;
+			unsigned ofs_ne = ofs_nw + 1;
+			unsigned ofs_se = ofs_sw + 1;
+
+			// If cancel has been requested
+			if (data->stop) {
+				data->places.Clear();
+				return;
+			}
+
+			// Randomize rotation and position on square
+			float yaw_angle = 360 * rnd.randomFloat();
+			Urho3D::Vector2 sqr_pos(rnd.randomFloat(), rnd.randomFloat());
+
+			// Get average terraintypes in this square
+			BigWorld::TTypesByWeight const& ttypes_sw = data->corners[ofs_sw].ttypes;
+			BigWorld::TTypesByWeight const& ttypes_nw = data->corners[ofs_nw].ttypes;
+			BigWorld::TTypesByWeight const& ttypes_ne = data->corners[ofs_ne].ttypes;
+			BigWorld::TTypesByWeight const& ttypes_se = data->corners[ofs_se].ttypes;
+			BigWorld::TTypesByWeight ttypes = ttypes_sw.averageOfTwo(ttypes_se).averageOfTwo(ttypes_nw.averageOfTwo(ttypes_ne));
+
+			// Select one of the terrain types randomly
+			unsigned ttypes_total_weight = ttypes.getTotalWeight();
+			unsigned ttype_selection_weight = rnd.randomUnsigned() % ttypes_total_weight;
+			unsigned ttype_selection_idx = 0;
+			while (ttype_selection_weight >= ttypes.getValueByte(ttype_selection_idx)) {
+				ttype_selection_weight -= ttypes.getValueByte(ttype_selection_idx);
+				++ ttype_selection_idx;
+				assert(ttype_selection_idx < ttypes.size());
+			}
+			uint8_t ttype_selection = ttypes.getKey(ttype_selection_idx);
+
+			// Select one of the undergrowth models, based on terraintypes
+			UndergrowthModelsByTerraintype::ConstIterator ugs_find = ugmodels.Find(ttype_selection);
+			if (ugs_find != ugmodels.End()) {
+
+				UndergrowthModels const& ttype_ugs = ugs_find->second_;
+				UndergrowthModel const& ttype_ug = ttype_ugs[rnd.randomUnsigned() % ttype_ugs.Size()];
+
+				// Decide position and rotation
+				float c_sw = (int(data->corners[ofs_sw].height) - int(data->baseheight)) * HEIGHTSTEP;
+				float c_nw = (int(data->corners[ofs_nw].height) - int(data->baseheight)) * HEIGHTSTEP;
+				float c_ne = (int(data->corners[ofs_ne].height) - int(data->baseheight)) * HEIGHTSTEP;
+				float c_se = (int(data->corners[ofs_se].height) - int(data->baseheight)) * HEIGHTSTEP;
+
+				float height = data->world->getHeightFromCorners(c_sw, c_nw, c_ne, c_se, sqr_pos);
+
+				Urho3D::Vector3 ug_pos = Urho3D::Vector3(
+					(x + sqr_pos.x_) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF,
+					height,
+					(y + sqr_pos.y_) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF
+				);
+				Urho3D::Quaternion ug_rot = Urho3D::Quaternion(yaw_angle, Urho3D::Vector3::UP);
+				if (ttype_ug.follow_ground_angle) {
+					Urho3D::Vector3 normal = data->world->getNormalFromCorners(c_sw, c_nw, c_ne, c_se, sqr_pos);
+					Urho3D::Vector2 normal_xz(normal.x_, normal.z_);
+					float follow_yaw = UrhoExtras::getAngle(normal_xz);
+					float follow_pitch = UrhoExtras::getAngle(normal_xz.Length(), normal.y_);
+					ug_rot = Urho3D::Quaternion(follow_yaw, Urho3D::Vector3::UP) * Urho3D::Quaternion(follow_pitch, Urho3D::Vector3::RIGHT) * ug_rot;
+				}
+				float ug_scale = rnd.randomFloatRange(ttype_ug.min_scale, ttype_ug.max_scale);
+
+				// Combine position, rotation and scaling
+				Urho3D::Matrix4 ug_transf_scale;
+				ug_transf_scale.SetScale(ug_scale);
+				Urho3D::Matrix4 ug_transf;
+				ug_transf.SetRotation(ug_rot.RotationMatrix());
+				ug_transf.SetTranslation(ug_pos);
+				ug_transf = ug_transf * ug_transf_scale;
+
+				data->places[StrNStr(ttype_ug.model, ttype_ug.material)].Push(ug_transf);
+			}
+			++ ofs_sw;
+		}
+	}
+
+}
+
+
+}
@@ -0,0 +1,15 @@
+#ifndef BIGWORLD_UNDERGROWTHPLACER_HPP
+#define BIGWORLD_UNDERGROWTHPLACER_HPP
+
+#include <Urho3D/Core/WorkQueue.h>
+
+namespace BigWorld
+{
+
+// Decides models, positions and rotations of undergrowth in one Chunk. Work
+// item must have UndergrowthPlacingTaskData as its auxiliary data.
+void placeUndergrowth(Urho3D::WorkItem const* item, unsigned threadIndex);
+
+}
+
+#endif